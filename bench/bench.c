@@ -0,0 +1,335 @@
+/*
+ * bench.c - End-to-end benchmark runner
+ *
+ * Runs each scenario against a corpus from gen-corpus, several times per
+ * engine, and prints one JSON object per (engine, scenario) on stdout:
+ *
+ *   {"scenario":"literal","engine":"native","runs":5,"input_bytes":...,
+ *    "output_bytes":...,"throughput_mib_s":...,"latency_ms":{"min":...,
+ *    "p50":...,"p90":...,"p99":...,"max":...},"peak_rss_kb":...,"exit_code":0}
+ *
+ * Engines:
+ *   native - Select-String --native
+ *   stub   - the PowerShell code path, with SELECT_STRING_POWERSHELL pointing
+ *            at stub-powershell so it runs where PowerShell does not
+ *
+ * Throughput is input bytes over the median latency. Peak RSS is the
+ * largest maximum resident set size seen across the runs (including the
+ * backend process for the stub engine). Linux/POSIX only.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_ARGS 32
+#define MAX_RUNS 1000
+
+typedef struct {
+    const char *name;
+    const char *args[12];
+    int use_stdin;      // feed the first corpus file on stdin instead of -Path
+} scenario;
+
+static const scenario SCENARIOS[] = {
+    {"literal", {"ERROR", "-SimpleMatch", "-CaseSensitive"}, 0},
+    {"case-insensitive", {"error", "-SimpleMatch"}, 0},
+    {"multi-pattern", {"-Pattern", "ERROR,timeout,refused", "-CaseSensitive"}, 0},
+    {"regex", {"ERROR.*req=[0-9a-f]{4}", "-CaseSensitive"}, 0},
+    {"context", {"ERROR", "-SimpleMatch", "-CaseSensitive", "-Context", "2,2"}, 0},
+    {"notmatch", {"INFO", "-SimpleMatch", "-CaseSensitive", "-NotMatch"}, 0},
+    {"stdin", {"ERROR", "-SimpleMatch", "-CaseSensitive"}, 1},
+};
+
+#define SCENARIO_COUNT (sizeof(SCENARIOS) / sizeof(SCENARIOS[0]))
+
+typedef struct {
+    const char *binary;
+    const char *stub;
+    const char *corpus;
+    const char *engines;
+    const char *scenarios;
+    int runs;
+} options;
+
+typedef struct {
+    double latency_ms;
+    long output_bytes;
+    long max_rss_kb;
+    int exit_code;
+} run_result;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+// Comma-separated list membership; NULL or "all" selects everything
+static int selected(const char *list, const char *name) {
+    if (list == NULL || strcmp(list, "all") == 0) {
+        return 1;
+    }
+    size_t len = strlen(name);
+    for (const char *p = list; p != NULL; p = strchr(p, ',')) {
+        if (*p == ',') {
+            p++;
+        }
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Total size of the corpus files, and the first one for stdin scenarios
+static long long corpus_bytes(const char *dir, char *first, size_t first_size) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+    long long total = 0;
+    first[0] = '\0';
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".log") != 0) {
+            continue;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        struct stat info;
+        if (stat(path, &info) == 0 && S_ISREG(info.st_mode)) {
+            total += info.st_size;
+            if (first[0] == '\0' || strcmp(path, first) < 0) {
+                snprintf(first, first_size, "%s", path);
+            }
+        }
+    }
+    closedir(d);
+    return total;
+}
+
+static int run_once(const options *opts, const scenario *sc, const char *engine,
+                    const char *first_file, run_result *result) {
+    char path_glob[4096];
+    snprintf(path_glob, sizeof(path_glob), "%s/*.log", opts->corpus);
+
+    const char *argv[MAX_ARGS];
+    int argc = 0;
+    argv[argc++] = opts->binary;
+    if (strcmp(engine, "native") == 0) {
+        argv[argc++] = "--native";
+    }
+    for (int i = 0; sc->args[i] != NULL; i++) {
+        argv[argc++] = sc->args[i];
+    }
+    if (!sc->use_stdin) {
+        argv[argc++] = "-Path";
+        argv[argc++] = path_glob;
+    }
+    argv[argc] = NULL;
+
+    int out_pipe[2];
+    if (pipe(out_pipe) != 0) {
+        perror("pipe");
+        return 0;
+    }
+
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        int in = open(sc->use_stdin ? first_file : "/dev/null", O_RDONLY);
+        if (in < 0 || dup2(in, 0) < 0 || dup2(out_pipe[1], 1) < 0) {
+            _exit(127);
+        }
+        close(in);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        if (strcmp(engine, "stub") == 0) {
+            setenv("SELECT_STRING_POWERSHELL", opts->stub, 1);
+        }
+        execv(opts->binary, (char *const *)argv);
+        _exit(127);
+    }
+
+    close(out_pipe[1]);
+    char buf[65536];
+    long total = 0;
+    for (;;) {
+        ssize_t n = read(out_pipe[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    close(out_pipe[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return 0;
+    }
+    result->latency_ms = now_ms() - start;
+    result->output_bytes = total;
+    result->max_rss_kb = usage.ru_maxrss;
+    result->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 1;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+static double percentile(const double *sorted, int count, double p) {
+    int rank = (int)(p / 100.0 * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return sorted[rank - 1];
+}
+
+static int run_scenario(const options *opts, const scenario *sc, const char *engine,
+                        long long input_bytes, const char *first_file) {
+    static double latencies[MAX_RUNS];
+    run_result result;
+    long peak_rss = 0;
+    long output_bytes = 0;
+    int exit_code = 0;
+
+    // One warm-up run to fill the page cache
+    if (!run_once(opts, sc, engine, first_file, &result)) {
+        return 0;
+    }
+    for (int i = 0; i < opts->runs; i++) {
+        if (!run_once(opts, sc, engine, first_file, &result)) {
+            return 0;
+        }
+        latencies[i] = result.latency_ms;
+        if (result.max_rss_kb > peak_rss) {
+            peak_rss = result.max_rss_kb;
+        }
+        output_bytes = result.output_bytes;
+        if (result.exit_code != 0) {
+            exit_code = result.exit_code;
+        }
+    }
+    qsort(latencies, (size_t)opts->runs, sizeof(double), compare_double);
+
+    if (sc->use_stdin) {
+        struct stat info;
+        input_bytes = stat(first_file, &info) == 0 ? info.st_size : 0;
+    }
+    double p50 = percentile(latencies, opts->runs, 50);
+    double throughput = p50 > 0 ? (double)input_bytes / (1024.0 * 1024.0) / (p50 / 1e3) : 0;
+
+    printf("{\"scenario\":\"%s\",\"engine\":\"%s\",\"corpus\":\"%s\",\"runs\":%d,"
+           "\"input_bytes\":%lld,\"output_bytes\":%ld,\"throughput_mib_s\":%.1f,"
+           "\"latency_ms\":{\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+           "\"peak_rss_kb\":%ld,\"exit_code\":%d}\n",
+           sc->name, engine, opts->corpus, opts->runs, input_bytes, output_bytes, throughput,
+           latencies[0], p50, percentile(latencies, opts->runs, 90),
+           percentile(latencies, opts->runs, 99), latencies[opts->runs - 1], peak_rss, exit_code);
+    fflush(stdout);
+    return 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: bench --binary PATH --corpus DIR [options]\n");
+    fprintf(stderr, "  --stub PATH        stub-powershell binary (enables the stub engine)\n");
+    fprintf(stderr, "  --engines LIST     native,stub (default: all available)\n");
+    fprintf(stderr, "  --scenarios LIST   Comma-separated scenario names (default: all)\n");
+    fprintf(stderr, "  --runs N           Timed runs per scenario (default 5)\n");
+    fprintf(stderr, "\nScenarios:");
+    for (size_t i = 0; i < SCENARIO_COUNT; i++) {
+        fprintf(stderr, " %s", SCENARIOS[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.runs = 5;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            usage();
+            return EXIT_FAILURE;
+        }
+        if (strcmp(argv[i], "--binary") == 0) {
+            opts.binary = value;
+        } else if (strcmp(argv[i], "--stub") == 0) {
+            opts.stub = value;
+        } else if (strcmp(argv[i], "--corpus") == 0) {
+            opts.corpus = value;
+        } else if (strcmp(argv[i], "--engines") == 0) {
+            opts.engines = value;
+        } else if (strcmp(argv[i], "--scenarios") == 0) {
+            opts.scenarios = value;
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            opts.runs = atoi(value);
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+    if (opts.binary == NULL || opts.corpus == NULL || opts.runs < 1 || opts.runs > MAX_RUNS) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    char first_file[4096];
+    long long input_bytes = corpus_bytes(opts.corpus, first_file, sizeof(first_file));
+    if (input_bytes < 0 || first_file[0] == '\0') {
+        fprintf(stderr, "Error: No .log files in corpus '%s'\n", opts.corpus);
+        return EXIT_FAILURE;
+    }
+
+    const char *engines[] = {"native", "stub"};
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        if (!selected(opts.engines, engines[e])) {
+            continue;
+        }
+        if (strcmp(engines[e], "stub") == 0 && opts.stub == NULL) {
+            if (opts.engines != NULL) {
+                fprintf(stderr, "Error: The stub engine needs --stub\n");
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        for (size_t s = 0; s < SCENARIO_COUNT; s++) {
+            if (selected(opts.scenarios, SCENARIOS[s].name) &&
+                !run_scenario(&opts, &SCENARIOS[s], engines[e], input_bytes, first_file)) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,704 @@
+/*
+ * compare.c - Differential test of the native engine against the backend
+ *
+ * Runs every query twice, once with --native and once through the
+ * PowerShell code path, and compares stdout and the exit code after
+ * normalizing what PowerShell's host adds on its own (CRLF, ANSI emphasis,
+ * the blank lines around formatted output, backslashes and absolute
+ * paths). The queries are a curated list plus --random N generated ones
+ * built from the corpus vocabulary.
+ *
+ * The backend is whatever SELECT_STRING_POWERSHELL names (--powershell),
+ * so it can be real PowerShell, the .NET stand-in in bench/dotnet_backend
+ * or stub-powershell. --record DIR saves each backend output, normalized,
+ * with its timing, and the backend's name in DIR/BACKEND; --replay DIR
+ * uses those instead of running the backend, so hosts without PowerShell
+ * can still check against its output. --native-flag adds a wrapper option
+ * to the native runs (e.g. --workers 3), so other execution modes are held
+ * to the same output.
+ *
+ * Mismatches are described on stderr and make the exit code 1. stdout
+ * gets one JSON object per query class:
+ *
+ *   {"class":"regex","queries":40,"mismatches":0,"native_ms":81.2,
+ *    "backend_ms":9120.5,"speedup":112.3}
+ *
+ * Linux/POSIX only.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_QUERY_ARGS 16
+#define MAX_ARGS 32
+#define MAX_CLASSES 16
+#define MAX_NATIVE_FLAGS 4
+
+typedef struct {
+    const char *cls;
+    const char *args[MAX_QUERY_ARGS];
+    int use_stdin;      // feed the first corpus file on stdin instead of -Path
+} curated_query;
+
+static const curated_query CURATED[] = {
+    {"literal", {"ERROR", "-SimpleMatch", "-CaseSensitive"}, 0},
+    {"literal", {"req=", "-SimpleMatch", "-CaseSensitive"}, 0},
+    {"literal", {"timeout", "-CaseSensitive"}, 0},
+    {"nocase", {"error"}, 0},
+    {"nocase", {"WARN", "-SimpleMatch"}, 0},
+    {"multi", {"-Pattern", "ERROR,timeout,refused", "-CaseSensitive"}, 0},
+    {"multi", {"-Pattern", "warn,debug"}, 0},
+    {"regex", {"ERROR.*req=[0-9a-f]{4}"}, 0},
+    {"regex", {"\\bINFO\\b", "-CaseSensitive"}, 0},
+    {"regex", {"(timeout|refused) \\w+"}, 0},
+    {"regex", {"^2024-05-01 00:00:00\\.0[0-4]"}, 0},
+    {"regex", {"handler$"}, 0},
+    {"context", {"ERROR", "-SimpleMatch", "-Context", "2,2"}, 0},
+    {"context", {"refused", "-Context", "0,3"}, 0},
+    {"notmatch", {"INFO", "-NotMatch"}, 0},
+    {"modes", {"ERROR", "-Quiet"}, 0},
+    {"modes", {"ERROR", "-List"}, 0},
+    {"modes", {"timeout", "-Raw"}, 0},
+    {"stdin", {"ERROR"}, 1},
+    {"stdin", {"refused", "-Context", "1,1"}, 1},
+};
+
+#define CURATED_COUNT (sizeof(CURATED) / sizeof(CURATED[0]))
+
+static const char *WORDS[] = {
+    "request", "handler", "session", "cache", "worker", "queue", "client", "server",
+    "payload", "upstream", "backend", "metrics", "shard", "commit", "replica", "router",
+    "accepted", "completed", "scheduled", "flushed", "tenant", "snapshot", "batch", "window",
+    "ERROR", "WARN", "INFO", "DEBUG", "timeout", "refused",
+};
+
+#define WORD_COUNT (sizeof(WORDS) / sizeof(WORDS[0]))
+
+typedef struct {
+    char cls[16];
+    char *args[MAX_QUERY_ARGS];
+    int argc;
+    int use_stdin;
+} query;
+
+typedef struct {
+    const char *binary;
+    const char *corpus;
+    const char *powershell;
+    const char *record;
+    const char *replay;
+    const char *native_flags[MAX_NATIVE_FLAGS];
+    int native_flag_count;
+    int random;
+    unsigned long long seed;
+    int runs;
+} options;
+
+typedef struct {
+    char *data;
+    size_t len;
+    double ms;
+    int exit_code;
+} result;
+
+typedef struct {
+    char name[16];
+    int queries;
+    int mismatches;
+    double native_ms;
+    double backend_ms;
+} class_totals;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static unsigned long long next_random(unsigned long long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static char *copy_string(const char *s) {
+    char *copy = malloc(strlen(s) + 1);
+    if (copy == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(copy, s);
+    return copy;
+}
+
+static void add_arg(query *q, const char *arg) {
+    if (q->argc < MAX_QUERY_ARGS) {
+        q->args[q->argc++] = copy_string(arg);
+    }
+}
+
+// A word with its case shuffled now and then, so case folding is exercised
+static const char *random_word(unsigned long long *state, char *buf, size_t size) {
+    const char *word = WORDS[next_random(state) % WORD_COUNT];
+    snprintf(buf, size, "%s", word);
+    if (next_random(state) % 4 == 0) {
+        for (char *c = buf; *c != '\0'; c++) {
+            if (next_random(state) % 2 == 0) {
+                *c = (char)(*c >= 'a' && *c <= 'z' ? *c - 32 : (*c >= 'A' && *c <= 'Z' ? *c + 32 : *c));
+            }
+        }
+    }
+    return buf;
+}
+
+// Builds one random query and files it under the most specific class it
+// exercises
+static void random_query(unsigned long long *state, query *q) {
+    char a[32], b[32], pattern[128];
+    memset(q, 0, sizeof(*q));
+    int shape = (int)(next_random(state) % 8);
+    int literal = 0;
+    int multi = 0;
+
+    switch (shape) {
+    case 0:
+        snprintf(pattern, sizeof(pattern), "%s", random_word(state, a, sizeof(a)));
+        literal = 1;
+        break;
+    case 1:
+        snprintf(pattern, sizeof(pattern), "%s,%s", random_word(state, a, sizeof(a)),
+                 random_word(state, b, sizeof(b)));
+        literal = 1;
+        multi = 1;
+        break;
+    case 2:
+        snprintf(pattern, sizeof(pattern), "%s|%s", random_word(state, a, sizeof(a)),
+                 random_word(state, b, sizeof(b)));
+        break;
+    case 3:
+        snprintf(pattern, sizeof(pattern), "%s \\w+ %s", random_word(state, a, sizeof(a)),
+                 random_word(state, b, sizeof(b)));
+        break;
+    case 4:
+        snprintf(pattern, sizeof(pattern), "\\b%s\\b", random_word(state, a, sizeof(a)));
+        break;
+    case 5:
+        snprintf(pattern, sizeof(pattern), "req=[0-9a-f]{%d}", (int)(next_random(state) % 8) + 1);
+        break;
+    case 6:
+        snprintf(pattern, sizeof(pattern), "%s$", random_word(state, a, sizeof(a)));
+        break;
+    default:
+        snprintf(pattern, sizeof(pattern), "^\\S+ 00:00:0%d\\.\\d+ \\[(%s|INFO)\\]",
+                 (int)(next_random(state) % 10), random_word(state, a, sizeof(a)));
+        break;
+    }
+
+    add_arg(q, "-Pattern");
+    add_arg(q, pattern);
+    snprintf(q->cls, sizeof(q->cls), "%s", multi ? "multi" : literal ? "literal" : "regex");
+    if (literal && next_random(state) % 2 == 0) {
+        add_arg(q, "-SimpleMatch");
+    }
+    if (next_random(state) % 2 == 0) {
+        add_arg(q, "-CaseSensitive");
+    } else if (literal) {
+        snprintf(q->cls, sizeof(q->cls), "%s", multi ? "multi" : "nocase");
+    }
+    if (next_random(state) % 10 == 0) {
+        add_arg(q, "-NotMatch");
+        snprintf(q->cls, sizeof(q->cls), "notmatch");
+    } else if (next_random(state) % 7 == 0) {
+        char context[16];
+        snprintf(context, sizeof(context), "%d,%d", (int)(next_random(state) % 4),
+                 (int)(next_random(state) % 4));
+        add_arg(q, "-Context");
+        add_arg(q, context);
+        snprintf(q->cls, sizeof(q->cls), "context");
+    }
+    if (next_random(state) % 10 == 0) {
+        q->use_stdin = 1;
+        snprintf(q->cls, sizeof(q->cls), "stdin");
+    }
+}
+
+// Runs the binary and captures its stdout
+static int capture(const char *const argv[], const char *stdin_path, const char *powershell,
+                   result *r) {
+    int out_pipe[2];
+    if (pipe(out_pipe) != 0) {
+        perror("pipe");
+        return 0;
+    }
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        int in = open(stdin_path != NULL ? stdin_path : "/dev/null", O_RDONLY);
+        int err = open("/dev/null", O_WRONLY);
+        if (in < 0 || err < 0 || dup2(in, 0) < 0 || dup2(out_pipe[1], 1) < 0 || dup2(err, 2) < 0) {
+            _exit(127);
+        }
+        close(in);
+        close(err);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        if (powershell != NULL) {
+            setenv("SELECT_STRING_POWERSHELL", powershell, 1);
+        }
+        execv(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+
+    close(out_pipe[1]);
+    size_t cap = 65536;
+    r->data = malloc(cap);
+    r->len = 0;
+    for (;;) {
+        if (r->data == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        if (r->len == cap) {
+            cap *= 2;
+            r->data = realloc(r->data, cap);
+            continue;
+        }
+        ssize_t n = read(out_pipe[0], r->data + r->len, cap - r->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        r->len += (size_t)n;
+    }
+    close(out_pipe[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return 0;
+    }
+    r->ms = now_ms() - start;
+    r->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 1;
+}
+
+// Best of `runs`; the output of the last run is kept
+static int run_query(const options *opts, const query *q, int native, const char *path_glob,
+                     const char *first_file, result *r) {
+    const char *argv[MAX_ARGS];
+    int argc = 0;
+    argv[argc++] = opts->binary;
+    if (native) {
+        argv[argc++] = "--native";
+        for (int i = 0; i < opts->native_flag_count; i++) {
+            argv[argc++] = opts->native_flags[i];
+        }
+    }
+    for (int i = 0; i < q->argc; i++) {
+        argv[argc++] = q->args[i];
+    }
+    if (!q->use_stdin) {
+        argv[argc++] = "-Path";
+        argv[argc++] = path_glob;
+    }
+    argv[argc] = NULL;
+
+    double best = 0;
+    for (int i = 0; i < opts->runs; i++) {
+        if (i > 0) {
+            free(r->data);
+        }
+        if (!capture(argv, q->use_stdin ? first_file : NULL, native ? NULL : opts->powershell, r)) {
+            return 0;
+        }
+        if (i == 0 || r->ms < best) {
+            best = r->ms;
+        }
+    }
+    r->ms = best;
+    return 1;
+}
+
+// Strips what PowerShell's host adds around the text Select-String wrote
+static char *normalize(const char *data, size_t len, const char *cwd, size_t *out_len) {
+    char *out = malloc(len + 1);
+    if (out == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (c == '\r') {
+            continue;
+        }
+        if (c == '\x1b' && i + 1 < len && data[i + 1] == '[') {
+            // ANSI CSI sequence (emphasis in PowerShell 7)
+            i += 2;
+            while (i < len && !(data[i] >= '@' && data[i] <= '~')) {
+                i++;
+            }
+            continue;
+        }
+        out[n++] = c == '\\' ? '/' : c;
+    }
+    out[n] = '\0';
+
+    // Absolute paths under the working directory become relative
+    size_t cwd_len = strlen(cwd);
+    if (cwd_len > 1) {
+        size_t w = 0;
+        for (size_t r = 0; r < n;) {
+            if (n - r > cwd_len && memcmp(out + r, cwd, cwd_len) == 0 && out[r + cwd_len] == '/') {
+                r += cwd_len + 1;
+                continue;
+            }
+            out[w++] = out[r++];
+        }
+        n = w;
+    }
+
+    // Leading and trailing blank lines
+    size_t start = 0;
+    while (start < n && out[start] == '\n') {
+        start++;
+    }
+    while (n > start && out[n - 1] == '\n' && (n - 1 == start || out[n - 2] == '\n')) {
+        n--;
+    }
+    memmove(out, out + start, n - start);
+    *out_len = n - start;
+    out[*out_len] = '\0';
+    return out;
+}
+
+static unsigned long long query_key(const query *q, const char *corpus) {
+    unsigned long long h = 1469598103934665603ULL;
+    const char *parts[MAX_QUERY_ARGS + 2];
+    int count = 0;
+    parts[count++] = corpus;
+    parts[count++] = q->use_stdin ? "stdin" : "path";
+    for (int i = 0; i < q->argc; i++) {
+        parts[count++] = q->args[i];
+    }
+    for (int i = 0; i < count; i++) {
+        for (const char *p = parts[i]; *p != '\0'; p++) {
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        }
+        h = (h ^ 0xFF) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Names the backend in DIR/BACKEND, so replays can say what they check against
+static int save_backend_name(const char *dir, const char *powershell) {
+    if (powershell == NULL) {
+        powershell = getenv("SELECT_STRING_POWERSHELL");
+    }
+    const char *name = powershell != NULL ? strrchr(powershell, '/') : NULL;
+    name = name != NULL ? name + 1 : powershell != NULL ? powershell : "powershell.exe";
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/BACKEND", dir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL || fprintf(f, "%s\n", name) < 0 || fclose(f) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+static void print_backend_name(const char *dir) {
+    char path[4096], name[256] = "an unnamed backend";
+    snprintf(path, sizeof(path), "%s/BACKEND", dir);
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        if (fgets(name, sizeof(name), f) != NULL) {
+            name[strcspn(name, "\n")] = '\0';
+        }
+        fclose(f);
+    }
+    fprintf(stderr, "Replaying %s, recorded from %s\n", dir, name);
+}
+
+// Saves the normalized output, so recordings do not depend on the host or
+// directory they were made on
+static int save_recording(const char *dir, unsigned long long key, const result *r,
+                          const char *text, size_t len) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%016llx.out", dir, key);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(text, 1, len, f) != len || fclose(f) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", path);
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%016llx.meta", dir, key);
+    f = fopen(path, "w");
+    if (f == NULL || fprintf(f, "%.3f %d\n", r->ms, r->exit_code) < 0 || fclose(f) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+static int load_recording(const char *dir, unsigned long long key, result *r) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%016llx.meta", dir, key);
+    FILE *f = fopen(path, "r");
+    if (f == NULL || fscanf(f, "%lf %d", &r->ms, &r->exit_code) != 2) {
+        fprintf(stderr, "Error: No recording %s\n", path);
+        if (f != NULL) {
+            fclose(f);
+        }
+        return 0;
+    }
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s/%016llx.out", dir, key);
+    f = fopen(path, "rb");
+    struct stat info;
+    if (f == NULL || fstat(fileno(f), &info) != 0) {
+        fprintf(stderr, "Error: No recording %s\n", path);
+        if (f != NULL) {
+            fclose(f);
+        }
+        return 0;
+    }
+    r->len = (size_t)info.st_size;
+    r->data = malloc(r->len + 1);
+    if (r->data == NULL || fread(r->data, 1, r->len, f) != r->len) {
+        fprintf(stderr, "Error: Failed to read %s\n", path);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    return 1;
+}
+
+static void describe_mismatch(const query *q, const char *native, const char *backend,
+                              const result *nr, const result *br) {
+    fprintf(stderr, "MISMATCH [%s]%s", q->cls, q->use_stdin ? " (stdin)" : "");
+    for (int i = 0; i < q->argc; i++) {
+        fprintf(stderr, " '%s'", q->args[i]);
+    }
+    fprintf(stderr, "\n");
+    if (nr->exit_code != br->exit_code) {
+        fprintf(stderr, "  exit code: native %d, backend %d\n", nr->exit_code, br->exit_code);
+    }
+
+    // First differing line
+    int line = 1;
+    const char *a = native, *b = backend;
+    while (*a != '\0' || *b != '\0') {
+        const char *ae = strchr(a, '\n');
+        const char *be = strchr(b, '\n');
+        size_t al = ae ? (size_t)(ae - a) : strlen(a);
+        size_t bl = be ? (size_t)(be - b) : strlen(b);
+        if (al != bl || memcmp(a, b, al) != 0 || (ae == NULL) != (be == NULL)) {
+            fprintf(stderr, "  line %d:\n    native:  %.*s\n    backend: %.*s\n", line,
+                    (int)(al > 200 ? 200 : al), a, (int)(bl > 200 ? 200 : bl), b);
+            return;
+        }
+        a = ae ? ae + 1 : a + al;
+        b = be ? be + 1 : b + bl;
+        line++;
+    }
+}
+
+static class_totals *find_class(class_totals *classes, int *count, const char *name) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(classes[i].name, name) == 0) {
+            return &classes[i];
+        }
+    }
+    if (*count == MAX_CLASSES) {
+        return &classes[MAX_CLASSES - 1];
+    }
+    class_totals *c = &classes[(*count)++];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    return c;
+}
+
+// First .log file in the corpus, for the stdin queries
+static int first_corpus_file(const char *dir, char *first, size_t size) {
+    char path[4096];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(path, sizeof(path), "%s/log-%04d.log", dir, i);
+        if (access(path, R_OK) == 0) {
+            snprintf(first, size, "%s", path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: compare --binary PATH --corpus DIR [options]\n");
+    fprintf(stderr, "  --powershell PATH  Backend executable (sets SELECT_STRING_POWERSHELL)\n");
+    fprintf(stderr, "  --record DIR       Save backend outputs and timings to DIR\n");
+    fprintf(stderr, "  --replay DIR       Use outputs saved by --record instead of the backend\n");
+    fprintf(stderr, "  --native-flag ARG  Pass ARG to the native runs too (repeatable)\n");
+    fprintf(stderr, "  --random N         Random queries in addition to the curated ones (default 100)\n");
+    fprintf(stderr, "  --seed N           Seed for the random queries (default 1)\n");
+    fprintf(stderr, "  --runs N           Timed runs per query and engine, best kept (default 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.random = 100;
+    opts.seed = 1;
+    opts.runs = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            usage();
+            return EXIT_FAILURE;
+        }
+        if (strcmp(argv[i], "--binary") == 0) {
+            opts.binary = value;
+        } else if (strcmp(argv[i], "--corpus") == 0) {
+            opts.corpus = value;
+        } else if (strcmp(argv[i], "--powershell") == 0) {
+            opts.powershell = value;
+        } else if (strcmp(argv[i], "--record") == 0) {
+            opts.record = value;
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            opts.replay = value;
+        } else if (strcmp(argv[i], "--native-flag") == 0 && opts.native_flag_count < MAX_NATIVE_FLAGS) {
+            opts.native_flags[opts.native_flag_count++] = value;
+        } else if (strcmp(argv[i], "--random") == 0) {
+            opts.random = atoi(value);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            opts.seed = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            opts.runs = atoi(value);
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+    if (opts.binary == NULL || opts.corpus == NULL || opts.random < 0 || opts.runs < 1 ||
+        (opts.record != NULL && opts.replay != NULL)) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (opts.record != NULL && mkdir(opts.record, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", opts.record, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (opts.record != NULL && !save_backend_name(opts.record, opts.powershell)) {
+        return EXIT_FAILURE;
+    }
+    if (opts.replay != NULL) {
+        print_backend_name(opts.replay);
+    }
+
+    char first_file[4096];
+    if (!first_corpus_file(opts.corpus, first_file, sizeof(first_file))) {
+        fprintf(stderr, "Error: No .log files in corpus '%s'\n", opts.corpus);
+        return EXIT_FAILURE;
+    }
+    char path_glob[4096];
+    snprintf(path_glob, sizeof(path_glob), "%s/*.log", opts.corpus);
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        snprintf(cwd, sizeof(cwd), "/");
+    }
+
+    int total = (int)CURATED_COUNT + opts.random;
+    query *queries = calloc((size_t)total, sizeof(*queries));
+    if (queries == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < CURATED_COUNT; i++) {
+        snprintf(queries[i].cls, sizeof(queries[i].cls), "%s", CURATED[i].cls);
+        for (int j = 0; CURATED[i].args[j] != NULL; j++) {
+            add_arg(&queries[i], CURATED[i].args[j]);
+        }
+        queries[i].use_stdin = CURATED[i].use_stdin;
+    }
+    unsigned long long state = opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (int i = (int)CURATED_COUNT; i < total; i++) {
+        random_query(&state, &queries[i]);
+    }
+
+    class_totals classes[MAX_CLASSES];
+    int class_count = 0;
+    int mismatches = 0;
+    for (int i = 0; i < total; i++) {
+        const query *q = &queries[i];
+        result native, backend;
+        unsigned long long key = query_key(q, opts.corpus);
+        if (!run_query(&opts, q, 1, path_glob, first_file, &native)) {
+            return EXIT_FAILURE;
+        }
+        if (opts.replay != NULL) {
+            if (!load_recording(opts.replay, key, &backend)) {
+                return EXIT_FAILURE;
+            }
+        } else if (!run_query(&opts, q, 0, path_glob, first_file, &backend)) {
+            return EXIT_FAILURE;
+        }
+
+        size_t native_len, backend_len;
+        char *a = normalize(native.data, native.len, cwd, &native_len);
+        char *b = normalize(backend.data, backend.len, cwd, &backend_len);
+        if (opts.record != NULL && !save_recording(opts.record, key, &backend, b, backend_len)) {
+            return EXIT_FAILURE;
+        }
+        int same = native_len == backend_len && memcmp(a, b, native_len) == 0 &&
+                   native.exit_code == backend.exit_code;
+        if (!same) {
+            describe_mismatch(q, a, b, &native, &backend);
+            mismatches++;
+        }
+
+        class_totals *c = find_class(classes, &class_count, q->cls);
+        c->queries++;
+        c->mismatches += !same;
+        c->native_ms += native.ms;
+        c->backend_ms += backend.ms;
+        free(a);
+        free(b);
+        free(native.data);
+        free(backend.data);
+    }
+
+    for (int i = 0; i < class_count; i++) {
+        const class_totals *c = &classes[i];
+        printf("{\"class\":\"%s\",\"queries\":%d,\"mismatches\":%d,\"native_ms\":%.1f,"
+               "\"backend_ms\":%.1f,\"speedup\":%.1f}\n",
+               c->name, c->queries, c->mismatches, c->native_ms, c->backend_ms,
+               c->native_ms > 0 ? c->backend_ms / c->native_ms : 0);
+    }
+    fprintf(stderr, "%d queries, %d mismatches\n", total, mismatches);
+
+    for (int i = 0; i < total; i++) {
+        for (int j = 0; j < queries[i].argc; j++) {
+            free(queries[i].args[j]);
+        }
+    }
+    free(queries);
+    return mismatches > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
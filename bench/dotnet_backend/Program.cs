@@ -0,0 +1,368 @@
+/*
+ * Program.cs - Select-String stand-in on .NET's Regex
+ *
+ * Takes the place of powershell.exe the way stub_backend.c does, but
+ * answers the Select-String part itself instead of with the native engine:
+ * patterns go to System.Text.RegularExpressions, the engine PowerShell's
+ * Select-String runs on, and lines, context and MatchInfo formatting are
+ * done here. Answers recorded from it (make compare-record) hold --native
+ * to an implementation that shares none of its code, on hosts where
+ * PowerShell cannot run; answers recorded from real pwsh replace them.
+ *
+ * Only the command shapes the wrapper builds, and the Select-String
+ * parameters make compare uses, are understood:
+ *   -NoProfile -Command "exit 0"
+ *   -NoProfile -Command "...\Select-String <args>"
+ *   -NoProfile -Command "Get-Content -Raw '<file>' | ...\Select-String <args>"
+ * Piped input is matched line by line, as --native does.
+ */
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using System.Text;
+using System.Text.RegularExpressions;
+
+namespace SelectStringBackend;
+
+internal sealed class Token
+{
+    public string Text = "";
+    public bool Quoted;
+}
+
+internal sealed class Query
+{
+    public List<string> Patterns = new();
+    public List<string> Paths = new();
+    public bool SimpleMatch;
+    public bool CaseSensitive;
+    public bool NotMatch;
+    public bool Quiet;
+    public bool List;
+    public bool Raw;
+    public int PreContext;
+    public int PostContext;
+}
+
+internal static class Program
+{
+    private static int Main(string[] args)
+    {
+        string? command = null;
+        for (int i = 0; i + 1 < args.Length; i++)
+        {
+            if (args[i] == "-Command")
+            {
+                command = args[i + 1];
+            }
+        }
+        if (command == null)
+        {
+            Console.Error.WriteLine("dotnet-backend: expected -Command");
+            return 1;
+        }
+        if (command.StartsWith("exit ", StringComparison.Ordinal))
+        {
+            return int.Parse(command.Substring(5));
+        }
+
+        List<Token> tokens = Tokenize(command);
+        int cmdlet = tokens.FindIndex(t => t.Text.EndsWith("Select-String", StringComparison.Ordinal));
+        if (cmdlet < 0)
+        {
+            Console.Error.WriteLine($"dotnet-backend: unsupported command: {command}");
+            return 1;
+        }
+
+        // Get-Content -Raw '<file>' | Select-String ...
+        string? input = null;
+        for (int i = 0; i + 2 < cmdlet; i++)
+        {
+            if (tokens[i].Text == "Get-Content" && tokens[i + 1].Text == "-Raw")
+            {
+                input = tokens[i + 2].Text;
+            }
+        }
+
+        Query? query = Parse(tokens.GetRange(cmdlet + 1, tokens.Count - cmdlet - 1));
+        if (query == null)
+        {
+            return 1;
+        }
+        var output = new StreamWriter(Console.OpenStandardOutput(), new UTF8Encoding(false)) { NewLine = "\n" };
+        int status = Run(query, input, output);
+        output.Flush();
+        return status;
+    }
+
+    // Splits a PowerShell command line on spaces, honouring '...' quoting
+    private static List<Token> Tokenize(string command)
+    {
+        var tokens = new List<Token>();
+        int p = 0;
+        while (p < command.Length)
+        {
+            while (p < command.Length && command[p] == ' ')
+            {
+                p++;
+            }
+            if (p == command.Length)
+            {
+                break;
+            }
+            var token = new Token();
+            var text = new StringBuilder();
+            while (p < command.Length && command[p] != ' ')
+            {
+                if (command[p] != '\'')
+                {
+                    text.Append(command[p++]);
+                    continue;
+                }
+                token.Quoted = true;
+                p++;
+                while (p < command.Length)
+                {
+                    if (command[p] == '\'' && p + 1 < command.Length && command[p + 1] == '\'')
+                    {
+                        text.Append('\'');
+                        p += 2;
+                    }
+                    else if (command[p] == '\'')
+                    {
+                        p++;
+                        break;
+                    }
+                    else
+                    {
+                        text.Append(command[p++]);
+                    }
+                }
+            }
+            token.Text = text.ToString();
+            tokens.Add(token);
+        }
+        return tokens;
+    }
+
+    // An unquoted a,b is an array in PowerShell
+    private static IEnumerable<string> Values(Token token)
+    {
+        return token.Quoted ? new[] { token.Text } : token.Text.Split(',');
+    }
+
+    private static Query? Parse(List<Token> tokens)
+    {
+        var query = new Query();
+        var positional = new List<Token>();
+        for (int i = 0; i < tokens.Count; i++)
+        {
+            Token token = tokens[i];
+            if (token.Quoted || !token.Text.StartsWith('-') || token.Text.Length < 2)
+            {
+                positional.Add(token);
+                continue;
+            }
+            string name = token.Text.Substring(1).ToLowerInvariant();
+            switch (name)
+            {
+            case "simplematch":
+                query.SimpleMatch = true;
+                continue;
+            case "casesensitive":
+                query.CaseSensitive = true;
+                continue;
+            case "notmatch":
+                query.NotMatch = true;
+                continue;
+            case "quiet":
+                query.Quiet = true;
+                continue;
+            case "list":
+                query.List = true;
+                continue;
+            case "raw":
+                query.Raw = true;
+                continue;
+            case "allmatches":
+                // Lines are printed once however often they match
+                continue;
+            }
+            if (i + 1 == tokens.Count)
+            {
+                Console.Error.WriteLine($"dotnet-backend: missing value for {token.Text}");
+                return null;
+            }
+            Token value = tokens[++i];
+            switch (name)
+            {
+            case "pattern":
+                query.Patterns.AddRange(Values(value));
+                break;
+            case "path":
+            case "literalpath":
+                query.Paths.AddRange(Values(value));
+                break;
+            case "context":
+                string[] counts = Values(value).ToArray();
+                query.PreContext = int.Parse(counts[0]);
+                query.PostContext = counts.Length > 1 ? int.Parse(counts[1]) : query.PreContext;
+                break;
+            default:
+                Console.Error.WriteLine($"dotnet-backend: unsupported parameter {token.Text}");
+                return null;
+            }
+        }
+
+        // Select-String [-Pattern] <string[]> [-Path] <string[]>
+        foreach (Token token in positional)
+        {
+            if (query.Patterns.Count == 0)
+            {
+                query.Patterns.AddRange(Values(token));
+            }
+            else
+            {
+                query.Paths.AddRange(Values(token));
+            }
+        }
+        if (query.Patterns.Count == 0)
+        {
+            Console.Error.WriteLine("dotnet-backend: no pattern");
+            return null;
+        }
+        return query;
+    }
+
+    // Resolves wildcards in the last path component, in name order as
+    // Resolve-Path gives them
+    private static List<string> ResolvePaths(List<string> paths)
+    {
+        var files = new List<string>();
+        foreach (string path in paths)
+        {
+            string full = Path.GetFullPath(path);
+            string name = Path.GetFileName(full);
+            if (name.IndexOfAny(new[] { '*', '?' }) < 0)
+            {
+                files.Add(full);
+                continue;
+            }
+            string dir = Path.GetDirectoryName(full) ?? ".";
+            string[] found = Directory.Exists(dir) ? Directory.GetFiles(dir, name) : Array.Empty<string>();
+            Array.Sort(found, StringComparer.OrdinalIgnoreCase);
+            files.AddRange(found);
+        }
+        return files;
+    }
+
+    // MatchInfo.ToString(): the path relative to the current directory
+    private static string DisplayPath(string full)
+    {
+        string cwd = Directory.GetCurrentDirectory().TrimEnd(Path.DirectorySeparatorChar) + Path.DirectorySeparatorChar;
+        return full.StartsWith(cwd, StringComparison.Ordinal) ? full.Substring(cwd.Length) : full;
+    }
+
+    private static int Run(Query query, string? input, TextWriter output)
+    {
+        RegexOptions options = query.CaseSensitive ? RegexOptions.None : RegexOptions.IgnoreCase;
+        StringComparison comparison = query.CaseSensitive ? StringComparison.CurrentCulture
+                                                          : StringComparison.CurrentCultureIgnoreCase;
+        Regex[] regexes = query.SimpleMatch ? Array.Empty<Regex>()
+                                            : query.Patterns.Select(p => new Regex(p, options)).ToArray();
+        Func<string, bool> matches = query.SimpleMatch
+            ? line => query.Patterns.Any(p => line.IndexOf(p, comparison) >= 0)
+            : line => regexes.Any(r => r.IsMatch(line));
+
+        // The wrapper passes any piped stdin, even an empty one, so -Path
+        // wins when both are there, as with the native engine
+        bool any = false;
+        if (input != null && query.Paths.Count == 0)
+        {
+            any = Search(query, File.ReadLines(input), null, matches, output);
+        }
+        else
+        {
+            foreach (string file in ResolvePaths(query.Paths))
+            {
+                any |= Search(query, File.ReadLines(file), DisplayPath(file), matches, output);
+                if (any && query.Quiet)
+                {
+                    break;
+                }
+            }
+        }
+        if (query.Quiet)
+        {
+            output.WriteLine(any ? "True" : "False");
+        }
+        return 0;
+    }
+
+    // Writes the selected lines of one input; returns whether any was
+    // selected. Context lines are shown once, even where the context of
+    // two matches overlaps, and -List stops at the first match.
+    private static bool Search(Query query, IEnumerable<string> lines, string? path, Func<string, bool> matches,
+                               TextWriter output)
+    {
+        bool context = query.PreContext > 0 || query.PostContext > 0;
+        var before = new Queue<(int Number, string Text)>();
+        int postLeft = 0;
+        int number = 0;
+        bool any = false;
+        foreach (string line in lines)
+        {
+            number++;
+            if (matches(line) != query.NotMatch)
+            {
+                any = true;
+                if (query.Quiet)
+                {
+                    return true;
+                }
+                if (query.Raw)
+                {
+                    output.WriteLine(line);
+                }
+                else
+                {
+                    foreach (var held in before)
+                    {
+                        output.WriteLine(Format(path, held.Number, held.Text, context ? "  " : ""));
+                    }
+                    output.WriteLine(Format(path, number, line, context ? "> " : ""));
+                }
+                before.Clear();
+                postLeft = query.PostContext;
+                if (query.List)
+                {
+                    return true;
+                }
+            }
+            else if (postLeft > 0)
+            {
+                if (!query.Raw)
+                {
+                    output.WriteLine(Format(path, number, line, "  "));
+                }
+                postLeft--;
+            }
+            else if (query.PreContext > 0)
+            {
+                before.Enqueue((number, line));
+                if (before.Count > query.PreContext)
+                {
+                    before.Dequeue();
+                }
+            }
+        }
+        return any;
+    }
+
+    private static string Format(string? path, int number, string line, string prefix)
+    {
+        return path == null ? prefix + line : $"{prefix}{path}:{number}:{line}";
+    }
+}
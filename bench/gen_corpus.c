@@ -0,0 +1,262 @@
+/*
+ * gen_corpus.c - Deterministic log corpus for the benchmark suite
+ *
+ * Writes N log files whose match density, line lengths and encoding are
+ * controlled from the command line. The same options and seed always
+ * produce byte-identical files, so numbers stay comparable across versions.
+ *
+ * Matching lines carry the tokens the bench scenarios look for:
+ *   "ERROR"             - level of a `--density` fraction of lines
+ *   "timeout"/"refused" - extra words on half of the ERROR lines
+ *   "req=<hex>"         - request ID on every ERROR line (regex scenario)
+ * Everything else is INFO/WARN/DEBUG lines built from a fixed vocabulary.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+static const char *WORDS[] = {
+    "request", "handler", "session", "cache", "worker", "queue", "client", "server",
+    "socket", "payload", "upstream", "retry", "backend", "config", "metrics", "shard",
+    "index", "stream", "buffer", "commit", "replica", "lease", "token", "router",
+    "accepted", "completed", "scheduled", "flushed", "rotated", "opened", "closed", "synced",
+    "user", "tenant", "region", "node", "pod", "volume", "snapshot", "bucket",
+    "latency", "bytes", "items", "rows", "batch", "epoch", "offset", "window",
+};
+
+// Extra vocabulary for the UTF-8 and UTF-16 corpora
+static const char *WIDE_WORDS[] = {
+    "r\xc3\xa9sum\xc3\xa9", "na\xc3\xafve", "gr\xc3\xbc\xc3\x9f" "e", "\xc3\xa5r",
+    "\xe6\x97\xa5\xe6\x9c\xac", "\xe3\x83\xad\xe3\x82\xb0", "\xd0\xb6\xd1\x83\xd1\x80\xd0\xbd\xd0\xb0\xd0\xbb",
+    "caf\xc3\xa9",
+};
+
+static const char *LEVELS[] = {"INFO", "INFO", "INFO", "INFO", "INFO", "WARN", "DEBUG", "DEBUG"};
+
+#define WORD_COUNT (sizeof(WORDS) / sizeof(WORDS[0]))
+#define WIDE_WORD_COUNT (sizeof(WIDE_WORDS) / sizeof(WIDE_WORDS[0]))
+#define LEVEL_COUNT (sizeof(LEVELS) / sizeof(LEVELS[0]))
+
+enum { ENC_ASCII, ENC_UTF8, ENC_UTF8_BOM, ENC_UTF16LE };
+
+typedef struct {
+    const char *dir;
+    int files;
+    long size;
+    int min_line;
+    int max_line;
+    double density;
+    int encoding;
+    int crlf;
+    uint64_t seed;
+} options;
+
+static uint64_t rng_state;
+
+// xorshift64*: tiny, fast and identical on every platform
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static uint32_t rng_below(uint32_t n) {
+    return (uint32_t)((rng_next() >> 32) % n);
+}
+
+static double rng_unit(void) {
+    return (double)(rng_next() >> 11) / 9007199254740992.0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: gen-corpus [options] DIR\n");
+    fprintf(stderr, "  --files N          Number of files (default 8)\n");
+    fprintf(stderr, "  --size BYTES       Approximate size per file (default 4194304)\n");
+    fprintf(stderr, "  --line-length A:B  Line length range in bytes (default 40:160)\n");
+    fprintf(stderr, "  --density F        Fraction of ERROR lines, 0..1 (default 0.01)\n");
+    fprintf(stderr, "  --encoding E       ascii, utf8, utf8-bom or utf16le (default ascii)\n");
+    fprintf(stderr, "  --crlf             Use CRLF line endings\n");
+    fprintf(stderr, "  --seed N           Random seed (default 1)\n");
+}
+
+static int parse_options(int argc, char *argv[], options *opts) {
+    opts->files = 8;
+    opts->size = 4L * 1024 * 1024;
+    opts->min_line = 40;
+    opts->max_line = 160;
+    opts->density = 0.01;
+    opts->encoding = ENC_ASCII;
+    opts->seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        int takes_value = 1;
+        if (strcmp(arg, "--crlf") == 0) {
+            opts->crlf = 1;
+            takes_value = 0;
+        } else if (arg[0] != '-') {
+            opts->dir = arg;
+            takes_value = 0;
+        } else if (value == NULL) {
+            fprintf(stderr, "Error: Missing value for %s\n", arg);
+            return 0;
+        } else if (strcmp(arg, "--files") == 0) {
+            opts->files = atoi(value);
+        } else if (strcmp(arg, "--size") == 0) {
+            opts->size = atol(value);
+        } else if (strcmp(arg, "--line-length") == 0) {
+            if (sscanf(value, "%d:%d", &opts->min_line, &opts->max_line) != 2) {
+                fprintf(stderr, "Error: --line-length expects MIN:MAX\n");
+                return 0;
+            }
+        } else if (strcmp(arg, "--density") == 0) {
+            opts->density = atof(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            opts->seed = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--encoding") == 0) {
+            if (strcmp(value, "ascii") == 0) {
+                opts->encoding = ENC_ASCII;
+            } else if (strcmp(value, "utf8") == 0) {
+                opts->encoding = ENC_UTF8;
+            } else if (strcmp(value, "utf8-bom") == 0) {
+                opts->encoding = ENC_UTF8_BOM;
+            } else if (strcmp(value, "utf16le") == 0) {
+                opts->encoding = ENC_UTF16LE;
+            } else {
+                fprintf(stderr, "Error: Unknown encoding '%s'\n", value);
+                return 0;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", arg);
+            return 0;
+        }
+        i += takes_value;
+    }
+
+    if (opts->dir == NULL || opts->files < 1 || opts->size < 1 || opts->min_line < 1 ||
+        opts->max_line < opts->min_line || opts->density < 0 || opts->density > 1) {
+        usage();
+        return 0;
+    }
+    return 1;
+}
+
+// Builds one log line (without terminator) into `line`, returns its length
+static size_t build_line(const options *opts, long number, char *line, size_t cap) {
+    int target = opts->min_line + (int)rng_below((uint32_t)(opts->max_line - opts->min_line + 1));
+    int is_error = rng_unit() < opts->density;
+    const char *level = is_error ? "ERROR" : LEVELS[rng_below(LEVEL_COUNT)];
+
+    int len = snprintf(line, cap, "2024-05-%02ld %02ld:%02ld:%02ld.%03ld [%s] ",
+                       1 + number / 86400000 % 28, number / 3600000 % 24, number / 60000 % 60,
+                       number / 1000 % 60, number % 1000, level);
+    if (is_error) {
+        len += snprintf(line + len, cap - (size_t)len, "req=%08x ", (unsigned)(rng_next() >> 32));
+        if (rng_below(2) == 0) {
+            len += snprintf(line + len, cap - (size_t)len, "%s ", rng_below(2) ? "timeout" : "refused");
+        }
+    }
+
+    while (len < target && (size_t)len + 24 < cap) {
+        const char *word;
+        if (opts->encoding != ENC_ASCII && rng_below(8) == 0) {
+            word = WIDE_WORDS[rng_below(WIDE_WORD_COUNT)];
+        } else {
+            word = WORDS[rng_below(WORD_COUNT)];
+        }
+        len += snprintf(line + len, cap - (size_t)len, "%s ", word);
+    }
+    if (len > 0 && line[len - 1] == ' ') {
+        len--;
+    }
+    return (size_t)len;
+}
+
+// Writes UTF-8 text as UTF-16LE (the corpus only uses the BMP)
+static void write_utf16le(FILE *f, const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + len;
+    while (p < end) {
+        unsigned cp = *p++;
+        if (cp >= 0xE0 && p + 1 < end) {
+            cp = ((cp & 0x0F) << 12) | ((unsigned)(p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else if (cp >= 0xC0 && p < end) {
+            cp = ((cp & 0x1F) << 6) | (p[0] & 0x3F);
+            p += 1;
+        }
+        fputc((int)(cp & 0xFF), f);
+        fputc((int)(cp >> 8), f);
+    }
+}
+
+static int write_file(const options *opts, int index) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/log-%04d.log", opts->dir, index);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    if (opts->encoding == ENC_UTF8_BOM) {
+        fputs("\xEF\xBB\xBF", f);
+    } else if (opts->encoding == ENC_UTF16LE) {
+        fputs("\xFF\xFE", f);
+    }
+
+    const char *eol = opts->crlf ? "\r\n" : "\n";
+    char line[8192];
+    long written = 0;
+    long number = (long)index * 1000003L;
+    while (written < opts->size) {
+        size_t len = build_line(opts, number++, line, sizeof(line));
+        if (opts->encoding == ENC_UTF16LE) {
+            write_utf16le(f, line, len);
+            write_utf16le(f, eol, strlen(eol));
+            written += (long)(len + strlen(eol)) * 2;
+        } else {
+            fwrite(line, 1, len, f);
+            fputs(eol, f);
+            written += (long)(len + strlen(eol));
+        }
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    options opts;
+    memset(&opts, 0, sizeof(opts));
+    if (!parse_options(argc, argv, &opts)) {
+        return EXIT_FAILURE;
+    }
+    if (mkdir(opts.dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", opts.dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < opts.files; i++) {
+        // Each file has its own stream so file N does not depend on --files
+        rng_state = (opts.seed + 1) * 0x9E3779B97F4A7C15ULL + (uint64_t)i * 0xBF58476D1CE4E5B9ULL;
+        if (rng_state == 0) {
+            rng_state = 1;
+        }
+        if (!write_file(&opts, i)) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
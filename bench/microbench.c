@@ -0,0 +1,376 @@
+/*
+ * microbench.c - Search kernel microbenchmark
+ *
+ * Times each kernel in src/kernels.c, for every ISA variant this CPU
+ * supports, over a sweep of needle lengths, haystack sizes and start
+ * alignments, and prints one JSON object per point on stdout:
+ *
+ *   {"kernel":"literal","variant":"avx2","needle":8,"haystack":4096,
+ *    "align":1,"cycles_per_byte":0.061,"gib_s":21.4}
+ *
+ * Kernels:
+ *   literal   - case-sensitive single literal
+ *   nocase    - case-insensitive single literal
+ *   multi     - several literals at once ("needle" is the literal count)
+ *   newlines  - newline counting
+ *   dfa       - the automaton: its lazy DFA ("table"), the whole DFA built
+ *               up front ("frozen") and that DFA as machine code ("jit",
+ *               x86-64 only)
+ *   regex     - the same variants, and the C generated for the set by
+ *               --generate-matchers ("custom"), for each pattern set in
+ *               bench/matchers.txt ("needle" is its line among the sets)
+ *
+ * The haystack is lower-case text with a newline every 80 bytes or so.
+ * Needles start and end with a common letter but are never present, so
+ * the SIMD kernels hit candidates and verify them at a realistic rate and
+ * every run scans the whole haystack. Each variant's result is checked
+ * against the scalar one before it is timed.
+ *
+ * cycles_per_byte comes from the time-stamp counter on x86 (reference
+ * cycles, not core cycles) and is null elsewhere. Each point is the best
+ * of five repetitions.
+ */
+
+#include "compat.h"
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "kernels.h"
+#include "automaton.h"
+#include "builtin.h"
+
+#define REPETITIONS 5
+#define MAX_NEEDLE 64
+#define MAX_LITERALS 16
+
+static const size_t NEEDLE_LENGTHS[] = {1, 2, 4, 8, 16, 32};
+static const size_t LITERAL_COUNTS[] = {2, 4, 8, 16};
+static const size_t HAYSTACK_SIZES[] = {64, 1024, 16384, 262144, 4194304};
+static const size_t ALIGNMENTS[] = {0, 1, 15, 31};
+
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *const KERNEL_NAMES[] = {"literal", "nocase", "multi", "newlines", "dfa", "regex"};
+static const char *const DFA_VARIANTS[] = {"table", "frozen", "jit", NULL};
+static const char *const REGEX_VARIANTS[] = {"table", "frozen", "jit", "custom", NULL};
+
+enum { KERNEL_LITERAL, KERNEL_NOCASE, KERNEL_MULTI, KERNEL_NEWLINES, KERNEL_DFA, KERNEL_REGEX };
+
+typedef struct {
+    int kernel;
+    const kernel_set *k;
+    const char *needle;
+    size_t needle_len;
+    const multi_literal *multi;
+    automaton *dfa;
+} job;
+
+static volatile long long sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned long long cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Comma-separated list membership; NULL selects everything
+static int selected(const char *list, const char *name) {
+    if (list == NULL) {
+        return 1;
+    }
+    size_t len = strlen(name);
+    for (const char *p = list; p != NULL; p = strchr(p, ',')) {
+        if (*p == ',') {
+            p++;
+        }
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void fill_haystack(char *buf, size_t size) {
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    size_t column = 0;
+    for (size_t i = 0; i < size; i++) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        unsigned r = (unsigned)((state * 0x2545F4914F6CDD1DULL) >> 32);
+        if (column >= 60 && r % 20 == 0) {
+            buf[i] = '\n';
+            column = 0;
+        } else {
+            buf[i] = r % 6 == 0 ? ' ' : (char)('a' + r % 26);
+            column++;
+        }
+    }
+}
+
+// Common first and last letter, absent filler in between
+static void make_needle(char *needle, size_t len, char edge) {
+    for (size_t i = 0; i < len; i++) {
+        needle[i] = (i == 0 || i == len - 1) ? edge : '#';
+    }
+    if (len == 1) {
+        needle[0] = '#';
+    } else if (len == 2) {
+        needle[1] = '#';
+    }
+    needle[len] = '\0';
+}
+
+// A copy of the lazy DFA that runs as `variant`, or NULL if there is no
+// such variant here. Only a set compiled in by --generate-matchers has a
+// custom one.
+static automaton *dfa_variant(const automaton *lazy, const builtin_matcher *set, const char *variant) {
+    char error[256];
+    int custom = strcmp(variant, "custom") == 0;
+    automaton *a = !custom ? automaton_clone(lazy)
+                 : set != NULL ? automaton_compile(set->patterns, set->pattern_count, set->flags, error, sizeof(error))
+                 : NULL;
+    int ok = a != NULL;
+    if (ok && strcmp(variant, "frozen") == 0) {
+        ok = automaton_prebuild(a);
+    } else if (ok && strcmp(variant, "jit") == 0) {
+        ok = automaton_jit(a) > 0;
+    } else if (ok && custom) {
+        ok = automaton_builtin(a);
+    }
+    if (!ok) {
+        automaton_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+static long long run(const job *j, const char *p, size_t size) {
+    const char *end = p + size;
+    const char *hit = NULL;
+    switch (j->kernel) {
+    case KERNEL_LITERAL:
+        hit = j->k->find_literal(p, end, j->needle, j->needle_len);
+        break;
+    case KERNEL_NOCASE:
+        hit = j->k->find_literal_nocase(p, end, j->needle, j->needle_len);
+        break;
+    case KERNEL_MULTI:
+        hit = j->k->find_multi(j->multi, p, end, NULL);
+        break;
+    case KERNEL_NEWLINES:
+        return j->k->count_newlines(p, end);
+    default:
+        hit = automaton_find_line(j->dfa, p, end);
+        break;
+    }
+    return hit == NULL ? -1 : (long long)(hit - p);
+}
+
+static void measure(const job *reference, const job *j, const char *variant, size_t needle,
+                    const char *p, size_t size, size_t align, double min_time_ns) {
+    long long expected = run(reference, p, size);
+    if (run(j, p, size) != expected) {
+        fprintf(stderr, "Error: %s/%s returned a different result from scalar "
+                "(needle %zu, haystack %zu, align %zu)\n",
+                KERNEL_NAMES[j->kernel], variant, needle, size, align);
+        exit(EXIT_FAILURE);
+    }
+
+    // Calibrate so one repetition takes about min_time / REPETITIONS
+    long iterations = 1;
+    for (;;) {
+        double start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            sink += run(j, p, size);
+        }
+        if (now_ns() - start >= min_time_ns / REPETITIONS || iterations > (1L << 30)) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    double best_ns = 0, best_cycles = 0;
+    for (int r = 0; r < REPETITIONS; r++) {
+        double start = now_ns();
+        unsigned long long c0 = cycles();
+        for (long i = 0; i < iterations; i++) {
+            sink += run(j, p, size);
+        }
+        unsigned long long c1 = cycles();
+        double elapsed = now_ns() - start;
+        if (r == 0 || elapsed < best_ns) {
+            best_ns = elapsed;
+            best_cycles = (double)(c1 - c0);
+        }
+    }
+
+    double bytes = (double)size * (double)iterations;
+    printf("{\"kernel\":\"%s\",\"variant\":\"%s\",\"needle\":%zu,\"haystack\":%zu,\"align\":%zu,",
+           KERNEL_NAMES[j->kernel], variant, needle, size, align);
+#ifdef HAVE_TSC
+    printf("\"cycles_per_byte\":%.4f,", best_cycles / bytes);
+#else
+    (void)best_cycles;
+    printf("\"cycles_per_byte\":null,");
+#endif
+    printf("\"gib_s\":%.2f}\n", bytes / best_ns * 1e9 / (1024.0 * 1024.0 * 1024.0));
+    fflush(stdout);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: microbench [options]\n");
+    fprintf(stderr, "  --kernels LIST     literal,nocase,multi,newlines,dfa,regex (default: all)\n");
+    fprintf(stderr, "  --variants LIST    scalar,sse2,avx2,table,frozen,jit,custom (default: all supported)\n");
+    fprintf(stderr, "  --max-size BYTES   Largest haystack in the sweep (default 4194304)\n");
+    fprintf(stderr, "  --min-time MS      Target time per point (default 10)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *kernels = NULL;
+    const char *variants = NULL;
+    size_t max_size = HAYSTACK_SIZES[COUNT_OF(HAYSTACK_SIZES) - 1];
+    double min_time_ns = 10e6;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            usage();
+            return EXIT_FAILURE;
+        }
+        if (strcmp(argv[i], "--kernels") == 0) {
+            kernels = value;
+        } else if (strcmp(argv[i], "--variants") == 0) {
+            variants = value;
+        } else if (strcmp(argv[i], "--max-size") == 0) {
+            max_size = (size_t)strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--min-time") == 0) {
+            min_time_ns = atof(value) * 1e6;
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+    if (min_time_ns <= 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // 64-byte aligned base, so ALIGNMENTS are offsets from a cache line
+    char *raw = malloc(max_size + 128);
+    if (raw == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    char *base = (char *)(((size_t)raw + 63) & ~(size_t)63);
+    fill_haystack(base, max_size + 64);
+
+    const kernel_set *scalar = kernels_variant("scalar");
+    char needle[MAX_NEEDLE + 1];
+    char literals[MAX_LITERALS][MAX_NEEDLE + 1];
+    const char *literal_ptrs[MAX_LITERALS];
+    size_t literal_lens[MAX_LITERALS];
+    const char *firsts = "etaoinsrhldcumfp";
+
+    for (int kernel = 0; kernel < (int)COUNT_OF(KERNEL_NAMES); kernel++) {
+        if (!selected(kernels, KERNEL_NAMES[kernel])) {
+            continue;
+        }
+        const size_t *needles = kernel == KERNEL_MULTI ? LITERAL_COUNTS : NEEDLE_LENGTHS;
+        size_t needle_count = kernel == KERNEL_MULTI ? COUNT_OF(LITERAL_COUNTS)
+                            : kernel == KERNEL_NEWLINES ? 1
+                            : kernel == KERNEL_REGEX ? builtin_matcher_count : COUNT_OF(NEEDLE_LENGTHS);
+
+        for (size_t n = 0; n < needle_count; n++) {
+            job j;
+            memset(&j, 0, sizeof(j));
+            j.kernel = kernel;
+            j.needle = needle;
+            j.needle_len = kernel == KERNEL_NEWLINES ? 0 : kernel == KERNEL_REGEX ? n : needles[n];
+            if (kernel == KERNEL_LITERAL || kernel == KERNEL_NOCASE || kernel == KERNEL_DFA) {
+                make_needle(needle, j.needle_len, 'e');
+            }
+
+            multi_literal *multi = NULL;
+            if (kernel == KERNEL_MULTI) {
+                for (size_t i = 0; i < needles[n]; i++) {
+                    make_needle(literals[i], 8, firsts[i]);
+                    literal_ptrs[i] = literals[i];
+                    literal_lens[i] = 8;
+                }
+                multi = multi_literal_new(literal_ptrs, literal_lens, needles[n], 0);
+                if (multi == NULL) {
+                    fprintf(stderr, "Error: Out of memory\n");
+                    return EXIT_FAILURE;
+                }
+                j.multi = multi;
+            }
+            if (kernel == KERNEL_DFA) {
+                char error[256];
+                const char *patterns[1] = {needle};
+                j.dfa = automaton_compile(patterns, 1, 0, error, sizeof(error));
+                if (j.dfa == NULL) {
+                    fprintf(stderr, "Error: %s\n", error);
+                    return EXIT_FAILURE;
+                }
+            }
+            const builtin_matcher *set = kernel == KERNEL_REGEX ? &builtin_matchers[n] : NULL;
+            if (set != NULL) {
+                char error[256];
+                j.dfa = automaton_compile(set->patterns, set->pattern_count, set->flags, error, sizeof(error));
+                if (j.dfa == NULL) {
+                    fprintf(stderr, "Error: %s\n", error);
+                    return EXIT_FAILURE;
+                }
+                // The reference, and the copies made from it, run the DFA
+                automaton_skip_builtin(j.dfa);
+            }
+
+            job reference = j;
+            reference.k = scalar;
+            int automaton_kernel = kernel == KERNEL_DFA || kernel == KERNEL_REGEX;
+            const char *const *variant_names = kernel == KERNEL_DFA ? DFA_VARIANTS
+                                             : kernel == KERNEL_REGEX ? REGEX_VARIANTS : KERNEL_VARIANTS;
+            for (int v = 0; variant_names[v] != NULL; v++) {
+                const char *variant = variant_names[v];
+                j.k = automaton_kernel ? scalar : kernels_variant(variant);
+                j.dfa = reference.dfa;
+                if (automaton_kernel && v > 0 && selected(variants, variant)) {
+                    // Each variant runs its own copy, checked against the lazy DFA
+                    j.dfa = dfa_variant(reference.dfa, set, variant);
+                    if (j.dfa == NULL) {
+                        fprintf(stderr, "Note: no %s variant of the %s kernel here\n", variant, KERNEL_NAMES[kernel]);
+                        continue;
+                    }
+                }
+                if (j.k != NULL && selected(variants, variant)) {
+                    for (size_t s = 0; s < COUNT_OF(HAYSTACK_SIZES) && HAYSTACK_SIZES[s] <= max_size; s++) {
+                        for (size_t a = 0; a < COUNT_OF(ALIGNMENTS); a++) {
+                            measure(&reference, &j, variant, j.needle_len, base + ALIGNMENTS[a],
+                                    HAYSTACK_SIZES[s], ALIGNMENTS[a], min_time_ns);
+                        }
+                    }
+                }
+                if (j.dfa != reference.dfa) {
+                    automaton_free(j.dfa);
+                }
+            }
+            multi_literal_free(multi);
+            automaton_free(reference.dfa);
+        }
+    }
+    free(raw);
+    return EXIT_SUCCESS;
+}
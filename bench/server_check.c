@@ -0,0 +1,232 @@
+/*
+ * server_check.c - Protocol checks for --server
+ *
+ * Starts `Select-String --server` on a socket in a scratch directory and
+ * sends it requests the way a client would, checking what comes back
+ * frame by frame rather than as the bytes --connect writes out:
+ *
+ *   - an "interactive" request gets one output frame per match, and the
+ *     same request without it gets its matches batched
+ *   - a file truncated in place after the server has mapped it is searched
+ *     as it is now, without taking the server down
+ *
+ * Prints one line per check and exits 1 if any fails. Linux/POSIX only.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Frame kinds, as in src/engine.h
+#define FRAME_OUTPUT 1
+#define FRAME_END 3
+
+typedef struct {
+    int output_frames;  // output frames received
+    int lines;          // newline-terminated output lines in them
+    int exit_code;      // from the end frame, or -1 if there was none
+} answer;
+
+static int receive(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Sends one request line and reads frames until the end frame
+static int ask(const char *socket_path, const char *request, answer *a) {
+    memset(a, 0, sizeof(*a));
+    a->exit_code = -1;
+    int fd = connect_to(socket_path);
+    if (fd < 0 || write(fd, request, strlen(request)) != (ssize_t)strlen(request)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    for (;;) {
+        unsigned char header[5];
+        if (!receive(fd, header, sizeof(header))) {
+            break;
+        }
+        size_t size = (size_t)header[0] | (size_t)header[1] << 8 | (size_t)header[2] << 16 |
+                      (size_t)header[3] << 24;
+        char *payload = size > 1 ? malloc(size - 1) : NULL;
+        if (size == 0 || (size > 1 && (payload == NULL || !receive(fd, payload, size - 1)))) {
+            free(payload);
+            break;
+        }
+        if (header[4] == FRAME_OUTPUT) {
+            a->output_frames++;
+            for (size_t i = 0; i + 1 < size; i++) {
+                a->lines += payload[i] == '\n';
+            }
+        }
+        if (header[4] == FRAME_END && size == 5) {
+            a->exit_code = (unsigned char)payload[0];
+        }
+        free(payload);
+        if (header[4] == FRAME_END) {
+            break;
+        }
+    }
+    close(fd);
+    return a->exit_code >= 0;
+}
+
+static int failures;
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    failures += !ok;
+}
+
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    char buffer[65536];
+    size_t n;
+    int ok = in != NULL && out != NULL;
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        ok = fwrite(buffer, 1, n, out) == n;
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL && fclose(out) != 0) {
+        ok = 0;
+    }
+    return ok;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: server-check --binary PATH --file PATH\n");
+    fprintf(stderr, "  --binary PATH  Select-String to run as the server\n");
+    fprintf(stderr, "  --file PATH    A log file with at least two ERROR lines\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *binary = NULL, *file = NULL;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            binary = argv[i + 1];
+        } else if (strcmp(argv[i], "--file") == 0) {
+            file = argv[i + 1];
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (binary == NULL || file == NULL || argc % 2 == 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    char dir[] = "/tmp/server-check-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    char socket_path[256], log_path[256];
+    snprintf(socket_path, sizeof(socket_path), "%s/socket", dir);
+    snprintf(log_path, sizeof(log_path), "%s/copy.log", dir);
+    if (!copy_file(file, log_path)) {
+        fprintf(stderr, "Error: Cannot copy %s to %s\n", file, log_path);
+        unlink(log_path);
+        rmdir(dir);
+        return EXIT_FAILURE;
+    }
+
+    pid_t server = fork();
+    if (server < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (server == 0) {
+        execl(binary, binary, "--server", socket_path, (char *)NULL);
+        _exit(127);
+    }
+    // Wait for the socket to take connections
+    int fd = -1;
+    for (int i = 0; i < 500 && fd < 0; i++) {
+        fd = connect_to(socket_path);
+        if (fd < 0) {
+            struct timespec pause = {0, 10 * 1000 * 1000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: The server did not start on %s\n", socket_path);
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        unlink(log_path);
+        rmdir(dir);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    char request[1024];
+    answer batched, streamed;
+    snprintf(request, sizeof(request),
+             "{\"args\":[\"ERROR\",\"-CaseSensitive\",\"-Path\",\"%s\"],\"format\":\"ndjson\"}\n", log_path);
+    int ok = ask(socket_path, request, &batched);
+    snprintf(request, sizeof(request),
+             "{\"args\":[\"ERROR\",\"-CaseSensitive\",\"-Path\",\"%s\"],\"format\":\"ndjson\","
+             "\"interactive\":true}\n", log_path);
+    ok = ok && ask(socket_path, request, &streamed);
+    check(ok && batched.lines >= 2 && streamed.lines == batched.lines,
+          "interactive and batched requests find the same matches");
+    check(ok && streamed.output_frames == streamed.lines, "interactive: one output frame per match");
+    check(ok && batched.output_frames < batched.lines, "batched: matches share output frames");
+
+    // The first request left the file mapped in the server's cache
+    struct stat info;
+    answer truncated;
+    ok = stat(log_path, &info) == 0 && truncate(log_path, info.st_size / 2) == 0;
+    snprintf(request, sizeof(request),
+             "{\"args\":[\"ERROR\",\"-CaseSensitive\",\"-Path\",\"%s\"],\"format\":\"ndjson\"}\n", log_path);
+    ok = ok && ask(socket_path, request, &truncated);
+    check(ok && truncated.lines < batched.lines && kill(server, 0) == 0,
+          "a mapped file truncated in place is searched as it is now");
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(log_path);
+    unlink(socket_path);
+    rmdir(dir);
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+ * stub_backend.c - Stand-in for powershell.exe in benchmarks
+ *
+ * Point SELECT_STRING_POWERSHELL at this binary and the wrapper's backend
+ * path runs end to end on hosts without PowerShell: the availability probe,
+ * the stdin spool, the spawn and the output loop are all real, and the
+ * Select-String part of the command line is answered by the native engine.
+ *
+ * Only the command shapes the wrapper itself builds are understood:
+ *   -NoProfile -Command "exit 0"
+ *   -NoProfile -Command "[$input |] ...\Select-String <args>"
+ *   -NoProfile -Command "Get-Content -Raw '<file>' | ...\Select-String <args>"
+ */
+
+#include "compat.h"
+
+#include "engine.h"
+
+#define MAX_TOKENS 1024
+
+// Splits a PowerShell command line on spaces, honouring '...' quoting
+static int tokenize(char *command, char *tokens[], int max_tokens) {
+    int count = 0;
+    char *p = command;
+    while (*p != '\0') {
+        while (*p == ' ') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (count == max_tokens) {
+            return -1;
+        }
+
+        char *out = p;
+        tokens[count++] = out;
+        while (*p != '\0' && *p != ' ') {
+            if (*p == '\'') {
+                p++;
+                while (*p != '\0') {
+                    if (p[0] == '\'' && p[1] == '\'') {
+                        *out++ = '\'';
+                        p += 2;
+                    } else if (*p == '\'') {
+                        p++;
+                        break;
+                    } else {
+                        *out++ = *p++;
+                    }
+                }
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (*p != '\0') {
+            p++;
+        }
+        *out = '\0';
+    }
+    return count;
+}
+
+static int ends_with(const char *s, const char *suffix) {
+    size_t len = strlen(s);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *command = NULL;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-Command") == 0) {
+            command = argv[i + 1];
+        }
+    }
+    if (command == NULL) {
+        fprintf(stderr, "stub-powershell: expected -Command\n");
+        return EXIT_FAILURE;
+    }
+    if (strncmp(command, "exit ", 5) == 0) {
+        return atoi(command + 5);
+    }
+
+    char *copy = malloc(strlen(command) + 1);
+    char **tokens = malloc(MAX_TOKENS * sizeof(*tokens));
+    if (copy == NULL || tokens == NULL) {
+        fprintf(stderr, "stub-powershell: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(copy, command);
+    int count = tokenize(copy, tokens, MAX_TOKENS);
+
+    int cmdlet = -1;
+    for (int i = 0; i < count && cmdlet < 0; i++) {
+        if (ends_with(tokens[i], "Select-String")) {
+            cmdlet = i;
+        }
+    }
+    if (cmdlet < 0) {
+        fprintf(stderr, "stub-powershell: unsupported command: %s\n", command);
+        return EXIT_FAILURE;
+    }
+
+    // Get-Content -Raw '<file>' | Select-String ...
+    for (int i = 0; i + 2 < cmdlet; i++) {
+        if (strcmp(tokens[i], "Get-Content") == 0 && strcmp(tokens[i + 1], "-Raw") == 0) {
+            if (freopen(tokens[i + 2], "rb", stdin) == NULL) {
+                fprintf(stderr, "stub-powershell: cannot open %s\n", tokens[i + 2]);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    int status = engine_run(count - cmdlet - 1, tokens + cmdlet + 1, NULL);
+    free(tokens);
+    free(copy);
+    return status;
+}
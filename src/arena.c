@@ -0,0 +1,79 @@
+/*
+ * arena.c - bump allocator for per-scan state
+ *
+ * The native engine needs a little memory per file (the held -Context
+ * lines, UTF-16 input converted to UTF-8) and per printed line (match
+ * spans). Taking it from an arena that is reset rather than freed means
+ * that once a thread has seen its largest file and line, scanning more
+ * of them allocates nothing. Every block allocated is counted in
+ * --stats, so that is something that can be checked.
+ */
+
+#include "compat.h"
+
+#include "arena.h"
+#include "stats.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK 16384
+#define ARENA_MAX_KEEP (16u << 20)
+
+struct arena_block {
+    arena_block *prev;
+    size_t size;                // usable bytes after the header
+};
+
+#define ARENA_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_block *new_block(size_t size, arena_block *prev) {
+    arena_block *b = malloc(ARENA_HEADER + size);
+    if (b != NULL) {
+        b->prev = prev;
+        b->size = size;
+        stats_add(&stats.scan_allocs, 1);
+    }
+    return b;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (a->head == NULL || a->head->size - a->used < size) {
+        size_t block = a->head != NULL ? a->head->size * 2 : ARENA_MIN_BLOCK;
+        if (block < size) {
+            block = size;
+        }
+        arena_block *b = new_block(block, a->head);
+        if (b == NULL) {
+            return NULL;
+        }
+        a->head = b;
+        a->used = 0;
+    }
+    void *p = (char *)a->head + ARENA_HEADER + a->used;
+    a->used += size;
+    return p;
+}
+
+void arena_reset(arena *a) {
+    a->used = 0;
+    if (a->head == NULL || (a->head->prev == NULL && a->head->size <= ARENA_MAX_KEEP)) {
+        return;
+    }
+    size_t total = 0;
+    for (arena_block *b = a->head; b != NULL; b = b->prev) {
+        total += b->size;
+    }
+    arena_free(a);
+    if (total <= ARENA_MAX_KEEP) {
+        a->head = new_block(total, NULL);
+    }
+}
+
+void arena_free(arena *a) {
+    while (a->head != NULL) {
+        arena_block *prev = a->head->prev;
+        free(a->head);
+        a->head = prev;
+    }
+    a->used = 0;
+}
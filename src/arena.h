@@ -0,0 +1,31 @@
+/*
+ * arena.h - bump allocator for per-scan state
+ */
+
+#ifndef SS_ARENA_H
+#define SS_ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block arena_block;
+
+// Allocations are carved off the newest block and never freed one by
+// one; arena_reset() takes them all back at once. Zero-initialized is an
+// empty arena. Not shared between threads.
+typedef struct {
+    arena_block *head;
+    size_t used;                // bytes of the head block handed out
+} arena;
+
+// 16-byte aligned; NULL if out of memory
+void *arena_alloc(arena *a, size_t size);
+
+// Takes back everything allocated so far. An arena that had to chain
+// blocks keeps one block as large as all of them, so the same work
+// again needs no allocation; one that grew past ARENA_MAX_KEEP keeps
+// nothing.
+void arena_reset(arena *a);
+
+void arena_free(arena *a);
+
+#endif
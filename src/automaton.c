@@ -0,0 +1,2304 @@
+/*
+ * automaton.c - Regular expression compiler for the native engine
+ *
+ * Patterns use the .NET syntax Select-String accepts. They are parsed into a
+ * small AST, compiled to a Thompson NFA over bytes, and run through a lazily
+ * built DFA. The DFA works on whole buffers: a newline resets it to the
+ * line-start state, so one pass over a chunk finds the next matching line.
+ * Where a line matches is worked out separately, by a Pike VM over the same
+ * NFA, and only when a caller asks for it.
+ *
+ * The DFA cache has a fixed size and is flushed when full. A pattern that
+ * keeps filling it (`.{0,100}ERROR` builds a state for every combination
+ * of pending positions) is switched to a bit-parallel NFA simulation,
+ * which is slower per byte than a warm DFA but never builds states.
+ *
+ * Constructs that need backtracking (backreferences, lookaround, atomic
+ * groups) are rejected with an error rather than approximated.
+ */
+
+#include "compat.h"
+#include <errno.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "automaton.h"
+#include "builtin.h"
+#include "codegen.h"
+#include "jit.h"
+#include "stats.h"
+
+#define MAX_NFA_STATES 200000
+#define MAX_REPEAT 1000
+
+// ---------------------------------------------------------------------------
+// Byte sets
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint32_t bits[8];
+} byte_set;
+
+static void set_add(byte_set *s, int b) {
+    s->bits[b >> 5] |= 1u << (b & 31);
+}
+
+static void set_add_range(byte_set *s, int lo, int hi) {
+    for (int b = lo; b <= hi; b++) {
+        set_add(s, b);
+    }
+}
+
+static int set_has(const byte_set *s, int b) {
+    return (s->bits[b >> 5] >> (b & 31)) & 1u;
+}
+
+static void set_add_char(byte_set *s, int b, int icase) {
+    set_add(s, b);
+    if (icase && b < 0x80 && isalpha(b)) {
+        set_add(s, (unsigned char)tolower(b));
+        set_add(s, (unsigned char)toupper(b));
+    }
+}
+
+static int is_word_byte(int b) {
+    return b >= 0x80 || isalnum(b) || b == '_';
+}
+
+// ---------------------------------------------------------------------------
+// AST
+// ---------------------------------------------------------------------------
+
+enum {
+    AST_EMPTY,
+    AST_SET,
+    AST_CONCAT,
+    AST_ALT,
+    AST_REPEAT,
+    AST_BOL,
+    AST_EOL,
+    AST_WORDB,
+    AST_NWORDB
+};
+
+typedef struct ast {
+    int type;
+    int set;            // AST_SET: index into the set table
+    int min, max;       // AST_REPEAT: max < 0 means unbounded
+    int greedy;
+    struct ast **kids;  // AST_CONCAT, AST_ALT, AST_REPEAT
+    int kid_count;
+    int kid_cap;
+} ast;
+
+// ---------------------------------------------------------------------------
+// NFA
+// ---------------------------------------------------------------------------
+
+enum {
+    NFA_SET,
+    NFA_SPLIT,
+    NFA_EPSILON,
+    NFA_BOL,
+    NFA_EOL,
+    NFA_WORDB,
+    NFA_NWORDB,
+    NFA_MATCH
+};
+
+typedef struct {
+    uint8_t op;
+    int out;
+    int out1;
+    int arg;            // NFA_SET: set index, NFA_MATCH: pattern index
+} nfa_state;
+
+// ---------------------------------------------------------------------------
+// Lazy DFA
+// ---------------------------------------------------------------------------
+
+#define DFA_MATCH 0
+#define DFA_UNKNOWN (-1)
+
+#define DFA_BOL       0x1
+#define DFA_PREV_WORD 0x2
+
+#define DFA_CACHE_SIZE (8 << 20)    // bytes, unless automaton_set_cache_limit() says otherwise
+// A flush is wasted when the states it drops were used for fewer bytes
+// than this each; after FLUSH_STRIKES in a row, the NFA takes over
+#define FLUSH_MIN_BYTES_PER_STATE 10
+#define FLUSH_STRIKES 3
+#define SIM_MAX_BYTES (4 << 20)     // follow tables; a larger NFA keeps flushing instead
+
+// The NFA simulation resolves assertions with the whole context at once
+#define CTX_BOL       0x1
+#define CTX_PREV_WORD 0x2
+#define CTX_NEXT_WORD 0x4
+#define CTX_EOL       0x8
+#define CTX_COUNT     16
+
+// A frozen DFA (automaton_freeze()) is this header, the byte class map,
+// then a row of int32 per state. Rows are padded to a power of two up to
+// 16 entries and to a multiple of 16 above, so none straddles a cache
+// line once the table sits at a 64-byte boundary.
+#define FROZEN_MAGIC "SSDFA\0\0\1"
+#define FROZEN_BYTE_ORDER 0x01020304u
+#define FROZEN_TABLE_OFFSET (sizeof(frozen_header) + 256)
+#define FROZEN_MAX_SIZE ((size_t)64 << 20)
+// automaton_prebuild() is for DFAs small enough to build in passing
+#define PREBUILD_MAX_SIZE ((size_t)1 << 20)
+// States automaton_codegen() writes C for; each is a switch of up to 256 cases
+#define CODEGEN_MAX_STATES 4096
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;    // as written; a table is not portable across byte orders
+    uint32_t state_count;
+    uint32_t class_count;
+    uint32_t stride;        // entries per row
+    int32_t start;          // row offsets, like the entries
+    int32_t dead;
+    uint32_t newline_class;
+    uint32_t reserved[7];   // to 64 bytes
+} frozen_header;
+
+typedef struct {
+    size_t offset;      // first NFA state in the set pool
+    int count;
+    unsigned flags;
+    uint32_t hash;
+} dfa_state;
+
+struct automaton {
+    nfa_state *nfa;
+    int nfa_count;
+    int nfa_cap;
+    int start;
+    int *entries;       // each pattern's own start state
+    int pattern_count;
+
+    byte_set *sets;
+    int set_count;
+    int set_cap;
+
+    uint8_t classmap[256];
+    uint8_t class_rep[256];
+    int class_count;
+    int newline_class;
+    int uses_word;
+
+    dfa_state *states;
+    int state_count;
+    int state_cap;
+    int32_t *trans;
+    int *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    int *table;
+    size_t table_size;
+    int line_start;
+    int dead;
+    size_t cache_limit;     // bytes the DFA may grow to
+    int base_states;        // made by dfa_init(), kept when the cache is flushed
+    size_t base_pool;
+    unsigned long long scanned;     // bytes handed to automaton_find_line()
+    unsigned long long flushed_at;  // ...when the cache was last flushed
+    int flushed_states;     // states it held then
+    int strikes;            // wasted flushes in a row
+
+    // Bit-parallel NFA simulation over the states that consume a byte
+    // (the "consumers"), once the DFA is given up on
+    int use_sim;
+    int consumer_count;
+    int words;              // uint64_t per consumer set
+    int contexts;           // CTX_COUNT, or 1 for a pattern without assertions
+    int *consumer_state;    // consumer -> NFA state
+    uint64_t *class_mask;   // per byte class: consumers whose set holds it
+    uint64_t *follow;       // per root (each consumer, then the start) and context:
+    unsigned char *follow_state;    // ...consumers in its closure; 0 not built, 1 built, 2 built and matches
+    uint64_t *group_follow; // per context, group of 8 consumers and subset of the group:
+    unsigned char *group_state;     // ...the union of their follow sets, built like `follow`
+    int groups;
+    uint64_t *active;
+    uint64_t *reached;
+
+    // A whole, minimized DFA from automaton_freeze(), attached read-only
+    // and shared between clones. Entries are row offsets, not state numbers.
+    const int32_t *frozen;
+    int32_t frozen_start;
+    int32_t frozen_dead;
+    uint32_t frozen_stride;
+    uint32_t frozen_states;
+    void *frozen_image;     // automaton_prebuild()'s, freed with the automaton...
+    jit_code *jit;          // machine code for `frozen` (automaton_jit())...
+    int owns_jit;           // ...also freed with it, but shared with clones
+    builtin_find_line builtin;  // generated for these patterns at build time
+
+    // Scratch space for subset construction
+    int *stack;
+    int *list;
+    int *list2;
+    unsigned *mark;
+    unsigned generation;
+    size_t *thread_start;   // Pike VM: where each thread's match began
+};
+
+// ---------------------------------------------------------------------------
+// Parser
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    automaton *a;
+    const char *p;
+    const char *end;
+    int icase;
+    int literal;
+    int failed;
+    char *error;
+    size_t error_size;
+    ast **nodes;        // every node allocated, for cleanup
+    size_t node_count;
+    size_t node_cap;
+} parser;
+
+static void parse_error(parser *ps, const char *message) {
+    if (!ps->failed) {
+        snprintf(ps->error, ps->error_size, "%s", message);
+        ps->failed = 1;
+    }
+}
+
+static ast *ast_new(parser *ps, int type) {
+    if (ps->failed) {
+        return NULL;
+    }
+    if (ps->node_count == ps->node_cap) {
+        size_t cap = ps->node_cap ? ps->node_cap * 2 : 64;
+        ast **nodes = realloc(ps->nodes, cap * sizeof(*nodes));
+        if (nodes == NULL) {
+            parse_error(ps, "out of memory");
+            return NULL;
+        }
+        ps->nodes = nodes;
+        ps->node_cap = cap;
+    }
+    ast *n = calloc(1, sizeof(*n));
+    if (n == NULL) {
+        parse_error(ps, "out of memory");
+        return NULL;
+    }
+    n->type = type;
+    ps->nodes[ps->node_count++] = n;
+    return n;
+}
+
+static void ast_add_kid(parser *ps, ast *n, ast *kid) {
+    if (n == NULL || kid == NULL) {
+        return;
+    }
+    if (n->kid_count == n->kid_cap) {
+        int cap = n->kid_cap ? n->kid_cap * 2 : 4;
+        ast **kids = realloc(n->kids, (size_t)cap * sizeof(*kids));
+        if (kids == NULL) {
+            parse_error(ps, "out of memory");
+            return;
+        }
+        n->kids = kids;
+        n->kid_cap = cap;
+    }
+    n->kids[n->kid_count++] = kid;
+}
+
+static ast *ast_set(parser *ps, const byte_set *set) {
+    automaton *a = ps->a;
+    ast *n = ast_new(ps, AST_SET);
+    if (n == NULL) {
+        return NULL;
+    }
+    if (a->set_count == a->set_cap) {
+        int cap = a->set_cap ? a->set_cap * 2 : 32;
+        byte_set *sets = realloc(a->sets, (size_t)cap * sizeof(*sets));
+        if (sets == NULL) {
+            parse_error(ps, "out of memory");
+            return NULL;
+        }
+        a->sets = sets;
+        a->set_cap = cap;
+    }
+    a->sets[a->set_count] = *set;
+    n->set = a->set_count++;
+    return n;
+}
+
+static ast *ast_byte(parser *ps, int b) {
+    byte_set set;
+    memset(&set, 0, sizeof(set));
+    set_add_char(&set, b, ps->icase);
+    return ast_set(ps, &set);
+}
+
+static ast *ast_repeat(parser *ps, ast *kid, int min, int max) {
+    ast *n = ast_new(ps, AST_REPEAT);
+    if (n != NULL) {
+        n->min = min;
+        n->max = max;
+        n->greedy = 1;
+        ast_add_kid(ps, n, kid);
+    }
+    return n;
+}
+
+// Encodes a code point as a concatenation of its UTF-8 bytes
+static ast *ast_codepoint(parser *ps, unsigned long cp) {
+    if (cp < 0x80) {
+        return ast_byte(ps, (int)cp);
+    }
+
+    unsigned char bytes[4];
+    int len;
+    if (cp < 0x800) {
+        bytes[0] = (unsigned char)(0xC0 | (cp >> 6));
+        bytes[1] = (unsigned char)(0x80 | (cp & 0x3F));
+        len = 2;
+    } else if (cp < 0x10000) {
+        bytes[0] = (unsigned char)(0xE0 | (cp >> 12));
+        bytes[1] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+        bytes[2] = (unsigned char)(0x80 | (cp & 0x3F));
+        len = 3;
+    } else {
+        bytes[0] = (unsigned char)(0xF0 | (cp >> 18));
+        bytes[1] = (unsigned char)(0x80 | ((cp >> 12) & 0x3F));
+        bytes[2] = (unsigned char)(0x80 | ((cp >> 6) & 0x3F));
+        bytes[3] = (unsigned char)(0x80 | (cp & 0x3F));
+        len = 4;
+    }
+
+    ast *n = ast_new(ps, AST_CONCAT);
+    for (int i = 0; i < len; i++) {
+        byte_set set;
+        memset(&set, 0, sizeof(set));
+        set_add(&set, bytes[i]);
+        ast_add_kid(ps, n, ast_set(ps, &set));
+    }
+    return n;
+}
+
+// Any single non-ASCII character: a lead byte plus up to three continuation
+// bytes. Lenient enough that Latin-1 bytes still count as one character each.
+static ast *ast_nonascii(parser *ps) {
+    byte_set lead, cont;
+    memset(&lead, 0, sizeof(lead));
+    memset(&cont, 0, sizeof(cont));
+    set_add_range(&lead, 0x80, 0xFF);
+    set_add_range(&cont, 0x80, 0xBF);
+
+    ast *n = ast_new(ps, AST_CONCAT);
+    ast_add_kid(ps, n, ast_set(ps, &lead));
+    ast_add_kid(ps, n, ast_repeat(ps, ast_set(ps, &cont), 0, 3));
+    return n;
+}
+
+// ASCII members plus, optionally, every non-ASCII character
+static ast *ast_class(parser *ps, const byte_set *ascii, int nonascii) {
+    ast *set = ast_set(ps, ascii);
+    if (!nonascii) {
+        return set;
+    }
+    ast *n = ast_new(ps, AST_ALT);
+    ast_add_kid(ps, n, set);
+    ast_add_kid(ps, n, ast_nonascii(ps));
+    return n;
+}
+
+// Shorthand classes: fills the ASCII part, returns whether non-ASCII
+// characters belong to the class as well
+static int shorthand_class(int c, byte_set *set) {
+    byte_set tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    int nonascii = 0;
+    switch (tolower(c)) {
+    case 'd':
+        set_add_range(&tmp, '0', '9');
+        break;
+    case 'w':
+        set_add_range(&tmp, 'a', 'z');
+        set_add_range(&tmp, 'A', 'Z');
+        set_add_range(&tmp, '0', '9');
+        set_add(&tmp, '_');
+        nonascii = 1;
+        break;
+    case 's':
+        set_add(&tmp, ' ');
+        set_add_range(&tmp, '\t', '\r');
+        break;
+    }
+    if (isupper(c)) {
+        for (int b = 0; b < 0x80; b++) {
+            if (!set_has(&tmp, b)) {
+                set_add(set, b);
+            }
+        }
+        return !nonascii;
+    }
+    for (int i = 0; i < 8; i++) {
+        set->bits[i] |= tmp.bits[i];
+    }
+    return nonascii;
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static long parse_hex(parser *ps, int digits) {
+    long value = 0;
+    for (int i = 0; i < digits; i++) {
+        int v = ps->p < ps->end ? hex_value((unsigned char)*ps->p) : -1;
+        if (v < 0) {
+            parse_error(ps, "insufficient hexadecimal digits in escape");
+            return -1;
+        }
+        value = value * 16 + v;
+        ps->p++;
+    }
+    return value;
+}
+
+// Decodes one UTF-8 character from the pattern text
+static unsigned long next_codepoint(parser *ps) {
+    const unsigned char *s = (const unsigned char *)ps->p;
+    unsigned long cp = *s++;
+    int extra = 0;
+    if (cp >= 0xF0) {
+        cp &= 0x07;
+        extra = 3;
+    } else if (cp >= 0xE0) {
+        cp &= 0x0F;
+        extra = 2;
+    } else if (cp >= 0xC0) {
+        cp &= 0x1F;
+        extra = 1;
+    }
+    while (extra-- > 0 && (const char *)s < ps->end && (*s & 0xC0) == 0x80) {
+        cp = (cp << 6) | (*s++ & 0x3F);
+    }
+    ps->p = (const char *)s;
+    return cp;
+}
+
+// Character escapes shared by atoms and classes. Returns the code point, or
+// -1 if the escape is not a single character.
+static long parse_char_escape(parser *ps, int c, int in_class) {
+    switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case 'e': return 0x1B;
+    case 'a': return 0x07;
+    case 'b': return in_class ? 0x08 : -1;
+    case 'x': return parse_hex(ps, 2);
+    case 'u': return parse_hex(ps, 4);
+    case 'c':
+        if (ps->p < ps->end && isalpha((unsigned char)*ps->p)) {
+            return toupper((unsigned char)*ps->p++) - '@';
+        }
+        parse_error(ps, "missing control character");
+        return -1;
+    case '0': {
+        long value = 0;
+        for (int i = 0; i < 2 && ps->p < ps->end && *ps->p >= '0' && *ps->p <= '7'; i++) {
+            value = value * 8 + (*ps->p++ - '0');
+        }
+        return value;
+    }
+    default:
+        if (c < 0x80 && !isalnum(c)) {
+            return c;
+        }
+        return -1;
+    }
+}
+
+static ast *parse_alternation(parser *ps);
+
+static ast *parse_class(parser *ps) {
+    byte_set ascii;
+    memset(&ascii, 0, sizeof(ascii));
+    int nonascii = 0;
+    int negated = 0;
+    ast *extra = NULL;  // non-ASCII literal members
+
+    if (ps->p < ps->end && *ps->p == '^') {
+        negated = 1;
+        ps->p++;
+    }
+
+    int first = 1;
+    while (!ps->failed) {
+        if (ps->p >= ps->end) {
+            parse_error(ps, "unterminated [] set");
+            return NULL;
+        }
+        if (*ps->p == ']' && !first) {
+            ps->p++;
+            break;
+        }
+        first = 0;
+        if (*ps->p == '-' && ps->p + 1 < ps->end && ps->p[1] == '[') {
+            parse_error(ps, "character class subtraction is not supported by the native engine");
+            return NULL;
+        }
+
+        long lo;
+        if (*ps->p == '\\') {
+            ps->p++;
+            if (ps->p >= ps->end) {
+                parse_error(ps, "illegal \\ at end of pattern");
+                return NULL;
+            }
+            int c = (unsigned char)*ps->p++;
+            if (strchr("dDwWsS", c)) {
+                nonascii |= shorthand_class(c, &ascii);
+                continue;
+            }
+            if (c == 'p' || c == 'P') {
+                parse_error(ps, "Unicode categories are not supported by the native engine");
+                return NULL;
+            }
+            lo = parse_char_escape(ps, c, 1);
+            if (lo < 0) {
+                parse_error(ps, "unrecognized escape sequence in [] set");
+                return NULL;
+            }
+        } else {
+            lo = (long)next_codepoint(ps);
+        }
+
+        long hi = lo;
+        if (ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']') {
+            ps->p++;
+            if (*ps->p == '\\') {
+                ps->p++;
+                if (ps->p >= ps->end) {
+                    parse_error(ps, "illegal \\ at end of pattern");
+                    return NULL;
+                }
+                hi = parse_char_escape(ps, (unsigned char)*ps->p++, 1);
+                if (hi < 0) {
+                    parse_error(ps, "invalid range in [] set");
+                    return NULL;
+                }
+            } else {
+                hi = (long)next_codepoint(ps);
+            }
+            if (hi < lo) {
+                parse_error(ps, "[x-y] range in reverse order");
+                return NULL;
+            }
+        }
+
+        if (hi < 0x80) {
+            for (long b = lo; b <= hi; b++) {
+                set_add_char(&ascii, (int)b, ps->icase);
+            }
+        } else if (lo == hi && !negated) {
+            if (extra == NULL) {
+                extra = ast_new(ps, AST_ALT);
+            }
+            ast_add_kid(ps, extra, ast_codepoint(ps, (unsigned long)lo));
+        } else {
+            parse_error(ps, "non-ASCII ranges and negated non-ASCII sets are not supported by the native engine");
+            return NULL;
+        }
+    }
+    if (ps->failed) {
+        return NULL;
+    }
+
+    if (negated) {
+        byte_set inverted;
+        memset(&inverted, 0, sizeof(inverted));
+        for (int b = 0; b < 0x80; b++) {
+            if (!set_has(&ascii, b)) {
+                set_add(&inverted, b);
+            }
+        }
+        return ast_class(ps, &inverted, !nonascii);
+    }
+
+    ast *n = ast_class(ps, &ascii, nonascii);
+    if (extra == NULL) {
+        return n;
+    }
+    ast_add_kid(ps, extra, n);
+    return extra;
+}
+
+// Parses (?imnsx-imnsx) and (?imnsx-imnsx:...). Returns 1 for a scoped group.
+static int parse_inline_options(parser *ps, int *icase) {
+    int on = 1;
+    while (ps->p < ps->end) {
+        int c = (unsigned char)*ps->p++;
+        switch (c) {
+        case '-':
+            on = 0;
+            break;
+        case 'i':
+            *icase = on;
+            break;
+        case 'm':
+        case 's':
+        case 'n':
+            // Lines are matched one at a time and captures are not
+            // reported, so these options do not change the result
+            break;
+        case 'x':
+            parse_error(ps, "the x option is not supported by the native engine");
+            return 0;
+        case ')':
+            return 0;
+        case ':':
+            return 1;
+        default:
+            parse_error(ps, "unrecognized grouping construct");
+            return 0;
+        }
+    }
+    parse_error(ps, "not enough )'s");
+    return 0;
+}
+
+static ast *parse_group(parser *ps) {
+    int saved_icase = ps->icase;
+
+    if (ps->p < ps->end && *ps->p == '?') {
+        ps->p++;
+        if (ps->p >= ps->end) {
+            parse_error(ps, "unrecognized grouping construct");
+            return NULL;
+        }
+        char c = *ps->p;
+        if (c == ':') {
+            ps->p++;
+        } else if (c == '#') {
+            const char *close = memchr(ps->p, ')', (size_t)(ps->end - ps->p));
+            if (close == NULL) {
+                parse_error(ps, "unterminated (?#...) comment");
+                return NULL;
+            }
+            ps->p = close + 1;
+            return ast_new(ps, AST_EMPTY);
+        } else if ((c == '<' || c == '\'') && ps->p + 1 < ps->end &&
+                   ps->p[1] != '=' && ps->p[1] != '!') {
+            char terminator = c == '<' ? '>' : '\'';
+            const char *close = memchr(ps->p + 1, terminator, (size_t)(ps->end - ps->p - 1));
+            if (close == NULL) {
+                parse_error(ps, "invalid group name");
+                return NULL;
+            }
+            ps->p = close + 1;
+        } else if (c == '=' || c == '!' || c == '<') {
+            parse_error(ps, "lookaround assertions are not supported by the native engine");
+            return NULL;
+        } else if (c == '>') {
+            parse_error(ps, "atomic groups are not supported by the native engine");
+            return NULL;
+        } else if (c == '(') {
+            parse_error(ps, "conditional groups are not supported by the native engine");
+            return NULL;
+        } else {
+            int icase = ps->icase;
+            int scoped = parse_inline_options(ps, &icase);
+            if (ps->failed) {
+                return NULL;
+            }
+            if (!scoped) {
+                // (?i) changes the options for the rest of the enclosing group
+                ps->icase = icase;
+                return ast_new(ps, AST_EMPTY);
+            }
+            ps->icase = icase;
+        }
+    }
+
+    ast *n = parse_alternation(ps);
+    if (ps->failed) {
+        return NULL;
+    }
+    if (ps->p >= ps->end || *ps->p != ')') {
+        parse_error(ps, "not enough )'s");
+        return NULL;
+    }
+    ps->p++;
+    ps->icase = saved_icase;
+    return n;
+}
+
+static ast *parse_escape(parser *ps) {
+    if (ps->p >= ps->end) {
+        parse_error(ps, "illegal \\ at end of pattern");
+        return NULL;
+    }
+    int c = (unsigned char)*ps->p++;
+    byte_set set;
+    memset(&set, 0, sizeof(set));
+
+    switch (c) {
+    case 'd': case 'D': case 'w': case 'W': case 's': case 'S': {
+        int nonascii = shorthand_class(c, &set);
+        return ast_class(ps, &set, nonascii);
+    }
+    case 'b':
+        return ast_new(ps, AST_WORDB);
+    case 'B':
+        return ast_new(ps, AST_NWORDB);
+    case 'A':
+        return ast_new(ps, AST_BOL);
+    case 'z':
+    case 'Z':
+        return ast_new(ps, AST_EOL);
+    case 'G':
+        parse_error(ps, "\\G is not supported by the native engine");
+        return NULL;
+    case 'k':
+        parse_error(ps, "backreferences are not supported by the native engine");
+        return NULL;
+    case 'p':
+    case 'P':
+        parse_error(ps, "Unicode categories are not supported by the native engine");
+        return NULL;
+    default:
+        break;
+    }
+    if (c >= '1' && c <= '9') {
+        parse_error(ps, "backreferences are not supported by the native engine");
+        return NULL;
+    }
+
+    long cp = parse_char_escape(ps, c, 0);
+    if (ps->failed) {
+        return NULL;
+    }
+    if (cp < 0) {
+        parse_error(ps, "unrecognized escape sequence");
+        return NULL;
+    }
+    return ast_codepoint(ps, (unsigned long)cp);
+}
+
+static ast *parse_atom(parser *ps) {
+    int c = (unsigned char)*ps->p;
+
+    if (ps->literal) {
+        return ast_codepoint(ps, next_codepoint(ps));
+    }
+
+    ps->p++;
+    switch (c) {
+    case '(':
+        return parse_group(ps);
+    case '[':
+        return parse_class(ps);
+    case '\\':
+        return parse_escape(ps);
+    case '^':
+        return ast_new(ps, AST_BOL);
+    case '$':
+        return ast_new(ps, AST_EOL);
+    case '.': {
+        byte_set set;
+        memset(&set, 0, sizeof(set));
+        set_add_range(&set, 0, 0x7F);
+        return ast_class(ps, &set, 1);
+    }
+    case '*':
+    case '+':
+    case '?':
+        parse_error(ps, "quantifier following nothing");
+        return NULL;
+    default:
+        ps->p--;
+        return ast_codepoint(ps, next_codepoint(ps));
+    }
+}
+
+// Parses {n}, {n,} or {n,m}. Leaves the position untouched and returns 0 when
+// the brace does not start a quantifier, in which case it is a literal.
+static int parse_braces(parser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    long lo = 0, hi;
+    if (p >= ps->end || !isdigit((unsigned char)*p)) {
+        return 0;
+    }
+    while (p < ps->end && isdigit((unsigned char)*p)) {
+        lo = lo * 10 + (*p++ - '0');
+        if (lo > MAX_REPEAT) lo = MAX_REPEAT + 1;
+    }
+    hi = lo;
+    if (p < ps->end && *p == ',') {
+        p++;
+        if (p < ps->end && isdigit((unsigned char)*p)) {
+            hi = 0;
+            while (p < ps->end && isdigit((unsigned char)*p)) {
+                hi = hi * 10 + (*p++ - '0');
+                if (hi > MAX_REPEAT) hi = MAX_REPEAT + 1;
+            }
+        } else {
+            hi = -1;
+        }
+    }
+    if (p >= ps->end || *p != '}') {
+        return 0;
+    }
+    if (lo > MAX_REPEAT || hi > MAX_REPEAT) {
+        parse_error(ps, "repetition count too large for the native engine");
+        return 0;
+    }
+    if (hi >= 0 && hi < lo) {
+        parse_error(ps, "illegal {x,y} with x > y");
+        return 0;
+    }
+    ps->p = p + 1;
+    *min = (int)lo;
+    *max = (int)hi;
+    return 1;
+}
+
+static ast *parse_repetition(parser *ps) {
+    ast *atom = parse_atom(ps);
+    int quantified = 0;
+
+    while (!ps->failed && !ps->literal && ps->p < ps->end) {
+        int min, max;
+        char c = *ps->p;
+        if (c == '*') {
+            min = 0, max = -1;
+            ps->p++;
+        } else if (c == '+') {
+            min = 1, max = -1;
+            ps->p++;
+        } else if (c == '?') {
+            min = 0, max = 1;
+            ps->p++;
+        } else if (c == '{' && parse_braces(ps, &min, &max)) {
+            // parsed
+        } else {
+            break;
+        }
+        if (quantified) {
+            parse_error(ps, "nested quantifier");
+            return NULL;
+        }
+        quantified = 1;
+
+        atom = ast_repeat(ps, atom, min, max);
+        if (ps->p < ps->end && *ps->p == '?') {
+            ps->p++;
+            if (atom != NULL) {
+                atom->greedy = 0;
+            }
+        }
+    }
+    return atom;
+}
+
+static ast *parse_concatenation(parser *ps) {
+    ast *n = ast_new(ps, AST_CONCAT);
+    while (!ps->failed && ps->p < ps->end) {
+        if (!ps->literal && (*ps->p == '|' || *ps->p == ')')) {
+            break;
+        }
+        ast_add_kid(ps, n, parse_repetition(ps));
+    }
+    return n;
+}
+
+static ast *parse_alternation(parser *ps) {
+    ast *first = parse_concatenation(ps);
+    if (ps->failed || ps->p >= ps->end || *ps->p != '|') {
+        return first;
+    }
+    ast *n = ast_new(ps, AST_ALT);
+    ast_add_kid(ps, n, first);
+    while (!ps->failed && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        ast_add_kid(ps, n, parse_concatenation(ps));
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// NFA construction
+// ---------------------------------------------------------------------------
+
+static int nfa_add(automaton *a, int op, int out, int out1, int arg) {
+    if (a->nfa_count >= MAX_NFA_STATES) {
+        return -1;
+    }
+    if (a->nfa_count == a->nfa_cap) {
+        int cap = a->nfa_cap ? a->nfa_cap * 2 : 64;
+        nfa_state *nfa = realloc(a->nfa, (size_t)cap * sizeof(*nfa));
+        if (nfa == NULL) {
+            return -1;
+        }
+        a->nfa = nfa;
+        a->nfa_cap = cap;
+    }
+    nfa_state *s = &a->nfa[a->nfa_count];
+    s->op = (uint8_t)op;
+    s->out = out;
+    s->out1 = out1;
+    s->arg = arg;
+    return a->nfa_count++;
+}
+
+// Compiles `n` so that it continues at state `next`. Returns the entry state
+// or -1 when the NFA grows too large.
+static int nfa_compile(automaton *a, const ast *n, int next) {
+    if (next < 0) {
+        return -1;
+    }
+    switch (n->type) {
+    case AST_EMPTY:
+        return next;
+    case AST_SET:
+        return nfa_add(a, NFA_SET, next, -1, n->set);
+    case AST_BOL:
+        return nfa_add(a, NFA_BOL, next, -1, 0);
+    case AST_EOL:
+        return nfa_add(a, NFA_EOL, next, -1, 0);
+    case AST_WORDB:
+        a->uses_word = 1;
+        return nfa_add(a, NFA_WORDB, next, -1, 0);
+    case AST_NWORDB:
+        a->uses_word = 1;
+        return nfa_add(a, NFA_NWORDB, next, -1, 0);
+    case AST_CONCAT:
+        for (int i = n->kid_count - 1; i >= 0 && next >= 0; i--) {
+            next = nfa_compile(a, n->kids[i], next);
+        }
+        return next;
+    case AST_ALT: {
+        int entry = nfa_compile(a, n->kids[n->kid_count - 1], next);
+        for (int i = n->kid_count - 2; i >= 0 && entry >= 0; i--) {
+            int branch = nfa_compile(a, n->kids[i], next);
+            entry = branch < 0 ? -1 : nfa_add(a, NFA_SPLIT, branch, entry, 0);
+        }
+        return entry;
+    }
+    case AST_REPEAT: {
+        const ast *kid = n->kids[0];
+        int cont = next;
+        if (n->max < 0) {
+            int loop = nfa_add(a, NFA_SPLIT, -1, -1, 0);
+            if (loop < 0) {
+                return -1;
+            }
+            int body = nfa_compile(a, kid, loop);
+            if (body < 0) {
+                return -1;
+            }
+            a->nfa[loop].out = n->greedy ? body : next;
+            a->nfa[loop].out1 = n->greedy ? next : body;
+            cont = loop;
+        } else {
+            for (int i = 0; i < n->max - n->min && cont >= 0; i++) {
+                int body = nfa_compile(a, kid, cont);
+                if (body < 0) {
+                    return -1;
+                }
+                cont = n->greedy ? nfa_add(a, NFA_SPLIT, body, next, 0)
+                                 : nfa_add(a, NFA_SPLIT, next, body, 0);
+            }
+        }
+        for (int i = 0; i < n->min && cont >= 0; i++) {
+            cont = nfa_compile(a, kid, cont);
+        }
+        return cont;
+    }
+    }
+    return -1;
+}
+
+// Splits the byte alphabet into classes that no set distinguishes between
+static void build_byte_classes(automaton *a) {
+    uint8_t classmap[256];
+    int class_count = 1;
+    memset(classmap, 0, sizeof(classmap));
+
+    // Line endings always get classes of their own, and word boundaries
+    // need word and non-word bytes to be told apart
+    byte_set newline;
+    memset(&newline, 0, sizeof(newline));
+    set_add(&newline, '\n');
+    byte_set carriage_return;
+    memset(&carriage_return, 0, sizeof(carriage_return));
+    set_add(&carriage_return, '\r');
+    byte_set word;
+    memset(&word, 0, sizeof(word));
+    for (int b = 0; b < 256; b++) {
+        if (is_word_byte(b)) {
+            set_add(&word, b);
+        }
+    }
+
+    for (int i = -3; i < a->set_count; i++) {
+        const byte_set *s = i == -3 ? &newline : i == -2 ? &carriage_return :
+                            i == -1 ? &word : &a->sets[i];
+        if (i == -1 && !a->uses_word) {
+            continue;
+        }
+        int split[256][2];
+        memset(split, -1, sizeof(split));
+        int next_count = 0;
+        for (int b = 0; b < 256; b++) {
+            int in = set_has(s, b);
+            int *slot = &split[classmap[b]][in];
+            if (*slot < 0) {
+                *slot = next_count++;
+            }
+            classmap[b] = (uint8_t)*slot;
+        }
+        class_count = next_count;
+    }
+
+    memcpy(a->classmap, classmap, sizeof(classmap));
+    a->class_count = class_count;
+    for (int b = 255; b >= 0; b--) {
+        a->class_rep[classmap[b]] = (uint8_t)b;
+    }
+    a->newline_class = classmap['\n'];
+}
+
+// ---------------------------------------------------------------------------
+// Subset construction
+// ---------------------------------------------------------------------------
+
+static int int_compare(const void *x, const void *y) {
+    int a = *(const int *)x;
+    int b = *(const int *)y;
+    return (a > b) - (a < b);
+}
+
+static void next_generation(automaton *a) {
+    if (++a->generation == 0) {
+        memset(a->mark, 0, (size_t)a->nfa_count * sizeof(*a->mark));
+        a->generation = 1;
+    }
+}
+
+// Adds the epsilon closure of `s` to list. Assertions that depend on the next
+// byte stay in the list; ^ is resolved with `bol`. Returns 1 on a match.
+static int closure_add(automaton *a, int s, int bol, int *list, int *count) {
+    int top = 0;
+    int matched = 0;
+    a->stack[top++] = s;
+    while (top > 0) {
+        s = a->stack[--top];
+        if (a->mark[s] == a->generation) {
+            continue;
+        }
+        a->mark[s] = a->generation;
+        const nfa_state *st = &a->nfa[s];
+        switch (st->op) {
+        case NFA_SPLIT:
+            a->stack[top++] = st->out1;
+            a->stack[top++] = st->out;
+            break;
+        case NFA_EPSILON:
+            a->stack[top++] = st->out;
+            break;
+        case NFA_BOL:
+            if (bol) {
+                a->stack[top++] = st->out;
+            }
+            break;
+        case NFA_MATCH:
+            matched = 1;
+            break;
+        default:
+            list[(*count)++] = s;
+            break;
+        }
+    }
+    return matched;
+}
+
+static uint32_t hash_state(const int *list, int count, unsigned flags) {
+    uint32_t h = 2166136261u ^ flags;
+    for (int i = 0; i < count; i++) {
+        h = (h ^ (uint32_t)list[i]) * 16777619u;
+    }
+    return h;
+}
+
+// What the DFA would take with these capacities
+static size_t cache_bytes(const automaton *a, size_t states, size_t pool, size_t table) {
+    return states * (sizeof(dfa_state) + (size_t)a->class_count * sizeof(int32_t)) +
+           pool * sizeof(int) + table * sizeof(int);
+}
+
+static int over_limit(const automaton *a, size_t states, size_t pool, size_t table) {
+    return a->cache_limit > 0 && cache_bytes(a, states, pool, table) > a->cache_limit;
+}
+
+// Puts the states of the DFA's table back into it, after it grows or is flushed
+static void fill_table(automaton *a) {
+    memset(a->table, -1, a->table_size * sizeof(*a->table));
+    for (int id = 1; id < a->state_count; id++) {
+        size_t slot = a->states[id].hash & (a->table_size - 1);
+        while (a->table[slot] >= 0) {
+            slot = (slot + 1) & (a->table_size - 1);
+        }
+        a->table[slot] = id;
+    }
+}
+
+static int grow_table(automaton *a, int limited) {
+    size_t size = a->table_size ? a->table_size * 2 : 256;
+    if (limited && over_limit(a, (size_t)a->state_cap, a->pool_cap, size)) {
+        return 0;
+    }
+    int *table = malloc(size * sizeof(*table));
+    if (table == NULL) {
+        return 0;
+    }
+    stats_add(&stats.scan_allocs, a->table_size > 0);
+    free(a->table);
+    a->table = table;
+    a->table_size = size;
+    fill_table(a);
+    return 1;
+}
+
+// Drops every state built while scanning, keeping the ones dfa_init()
+// made. Returns 0 if there was nothing to drop.
+static int flush_cache(automaton *a) {
+    if (a->state_count <= a->base_states) {
+        return 0;
+    }
+    a->flushed_states = a->state_count;
+    a->state_count = a->base_states;
+    a->pool_len = a->base_pool;
+    for (size_t i = 0; i < (size_t)a->state_count * (size_t)a->class_count; i++) {
+        a->trans[i] = DFA_UNKNOWN;
+    }
+    fill_table(a);
+    stats_add(&stats.dfa_flushes, 1);
+    return 1;
+}
+
+// Returns the DFA state for a sorted NFA state list, creating it if needed.
+// A `limited` call fails rather than grow the DFA past its cache limit.
+static int intern_state(automaton *a, int *list, int count, unsigned flags, int limited) {
+    qsort(list, (size_t)count, sizeof(*list), int_compare);
+    if (count == 0) {
+        flags = 0;
+    }
+    uint32_t hash = hash_state(list, count, flags);
+
+    if ((size_t)a->state_count * 2 >= a->table_size && !grow_table(a, limited)) {
+        return DFA_UNKNOWN;
+    }
+    size_t slot = hash & (a->table_size - 1);
+    while (a->table[slot] >= 0) {
+        const dfa_state *st = &a->states[a->table[slot]];
+        if (st->hash == hash && st->count == count && st->flags == flags &&
+            memcmp(a->pool + st->offset, list, (size_t)count * sizeof(*list)) == 0) {
+            return a->table[slot];
+        }
+        slot = (slot + 1) & (a->table_size - 1);
+    }
+
+    if (a->state_count == a->state_cap) {
+        int cap = a->state_cap * 2;
+        if (limited && over_limit(a, (size_t)cap, a->pool_cap, a->table_size)) {
+            return DFA_UNKNOWN;
+        }
+        dfa_state *states = realloc(a->states, (size_t)cap * sizeof(*states));
+        if (states == NULL) {
+            return DFA_UNKNOWN;
+        }
+        a->states = states;
+        int32_t *trans = realloc(a->trans, (size_t)cap * (size_t)a->class_count * sizeof(*trans));
+        if (trans == NULL) {
+            return DFA_UNKNOWN;
+        }
+        a->trans = trans;
+        a->state_cap = cap;
+        stats_add(&stats.scan_allocs, 2);
+    }
+    if (a->pool_len + (size_t)count > a->pool_cap) {
+        size_t cap = a->pool_cap * 2;
+        while (cap < a->pool_len + (size_t)count) {
+            cap *= 2;
+        }
+        if (limited && over_limit(a, (size_t)a->state_cap, cap, a->table_size)) {
+            return DFA_UNKNOWN;
+        }
+        int *pool = realloc(a->pool, cap * sizeof(*pool));
+        if (pool == NULL) {
+            return DFA_UNKNOWN;
+        }
+        a->pool = pool;
+        a->pool_cap = cap;
+        stats_add(&stats.scan_allocs, 1);
+    }
+
+    int id = a->state_count++;
+    dfa_state *st = &a->states[id];
+    st->offset = a->pool_len;
+    st->count = count;
+    st->flags = flags;
+    st->hash = hash;
+    memcpy(a->pool + a->pool_len, list, (size_t)count * sizeof(*list));
+    a->pool_len += (size_t)count;
+    for (int c = 0; c < a->class_count; c++) {
+        a->trans[(size_t)id * (size_t)a->class_count + (size_t)c] = DFA_UNKNOWN;
+    }
+    a->table[slot] = id;
+    return id;
+}
+
+// Computes the transition of DFA state `id` on byte class `cls`
+static int compute_transition(automaton *a, int id, int cls) {
+    const dfa_state *st = &a->states[id];
+    int b = a->class_rep[cls];
+    int eol = (cls == a->newline_class);
+    // Get-Content strips CRLF line endings, so $ also holds before a \r
+    int eol_ahead = eol || b == '\r';
+    int prev_word = (st->flags & DFA_PREV_WORD) != 0;
+    int next_word = eol ? 0 : is_word_byte(b);
+    int bol = (st->flags & DFA_BOL) != 0;
+
+    // Resolve the pending assertions now that the next byte is known
+    int *consumers = a->list2;
+    int consumer_count = 0;
+    int matched = 0;
+    int top = 0;
+    next_generation(a);
+    for (int i = st->count - 1; i >= 0; i--) {
+        a->stack[top++] = a->pool[st->offset + (size_t)i];
+    }
+    while (top > 0) {
+        int s = a->stack[--top];
+        if (a->mark[s] == a->generation) {
+            continue;
+        }
+        a->mark[s] = a->generation;
+        const nfa_state *ns = &a->nfa[s];
+        int follow = 0;
+        switch (ns->op) {
+        case NFA_SET:
+            consumers[consumer_count++] = s;
+            break;
+        case NFA_MATCH:
+            matched = 1;
+            break;
+        case NFA_SPLIT:
+            a->stack[top++] = ns->out1;
+            follow = 1;
+            break;
+        case NFA_EPSILON:
+            follow = 1;
+            break;
+        case NFA_BOL:
+            follow = bol;
+            break;
+        case NFA_EOL:
+            follow = eol_ahead;
+            break;
+        case NFA_WORDB:
+            follow = prev_word != next_word;
+            break;
+        case NFA_NWORDB:
+            follow = prev_word == next_word;
+            break;
+        }
+        if (follow) {
+            a->stack[top++] = ns->out;
+        }
+    }
+
+    int next;
+    if (matched) {
+        next = DFA_MATCH;
+    } else if (eol) {
+        next = a->line_start;
+    } else {
+        // Consume the byte, then restart the search at the next position
+        int count = 0;
+        next_generation(a);
+        for (int i = 0; i < consumer_count && !matched; i++) {
+            const nfa_state *ns = &a->nfa[consumers[i]];
+            if (set_has(&a->sets[ns->arg], b)) {
+                matched = closure_add(a, ns->out, 0, a->list, &count);
+            }
+        }
+        if (!matched) {
+            matched = closure_add(a, a->start, 0, a->list, &count);
+        }
+        if (matched) {
+            next = DFA_MATCH;
+        } else {
+            unsigned flags = (a->uses_word && next_word) ? DFA_PREV_WORD : 0;
+            next = intern_state(a, a->list, count, flags, 1);
+            if (next == DFA_UNKNOWN && flush_cache(a)) {
+                // The cache is full: start it over. State `id` went with
+                // it, so the transition is not recorded, and the one new
+                // state may take the DFA a little past its limit.
+                return intern_state(a, a->list, count, flags, 0);
+            }
+        }
+    }
+
+    if (next != DFA_UNKNOWN) {
+        a->trans[(size_t)id * (size_t)a->class_count + (size_t)cls] = next;
+    }
+    return next;
+}
+
+// Sets up an empty DFA cache over a finished NFA
+static int dfa_init(automaton *a) {
+    a->stack = malloc(((size_t)a->nfa_count * 3 + 1) * sizeof(*a->stack));
+    a->list = malloc((size_t)a->nfa_count * sizeof(*a->list));
+    a->list2 = malloc((size_t)a->nfa_count * sizeof(*a->list2));
+    a->mark = calloc((size_t)a->nfa_count, sizeof(*a->mark));
+    a->state_cap = 16;
+    a->states = malloc((size_t)a->state_cap * sizeof(*a->states));
+    a->trans = malloc((size_t)a->state_cap * (size_t)a->class_count * sizeof(*a->trans));
+    a->pool_cap = 256;
+    a->pool = malloc(a->pool_cap * sizeof(*a->pool));
+    if (a->stack == NULL || a->list == NULL || a->list2 == NULL || a->mark == NULL ||
+        a->states == NULL || a->trans == NULL || a->pool == NULL || !grow_table(a, 0)) {
+        return 0;
+    }
+
+    // State 0 is the match sentinel
+    a->state_count = 1;
+    memset(&a->states[0], 0, sizeof(a->states[0]));
+
+    int list_count = 0;
+    a->generation = 0;
+    next_generation(a);
+    if (closure_add(a, a->start, 1, a->list, &list_count)) {
+        a->line_start = DFA_MATCH;
+    } else {
+        a->line_start = intern_state(a, a->list, list_count, DFA_BOL, 0);
+    }
+    a->dead = intern_state(a, a->list, 0, 0, 0);
+    a->base_states = a->state_count;
+    a->base_pool = a->pool_len;
+    a->cache_limit = DFA_CACHE_SIZE;
+    return a->line_start != DFA_UNKNOWN && a->dead != DFA_UNKNOWN;
+}
+
+// ---------------------------------------------------------------------------
+// NFA simulation
+// ---------------------------------------------------------------------------
+
+// Sets up the simulation, or returns 0 if the NFA is too large for it or
+// memory runs out (the DFA then carries on flushing)
+static int sim_init(automaton *a) {
+    int count = 0;
+    int asserts = 0;
+    for (int s = 0; s < a->nfa_count; s++) {
+        count += a->nfa[s].op == NFA_SET;
+        asserts |= a->nfa[s].op == NFA_BOL || a->nfa[s].op == NFA_EOL || a->nfa[s].op == NFA_WORDB ||
+                   a->nfa[s].op == NFA_NWORDB;
+    }
+    int words = count / 64 + 1;
+    int groups = (count + 7) / 8;
+    int contexts = asserts ? CTX_COUNT : 1;
+    size_t roots = (size_t)count + 1;
+    size_t entries = roots + (size_t)groups * 256;
+    if (entries * (size_t)contexts * (size_t)words * sizeof(uint64_t) > SIM_MAX_BYTES) {
+        return 0;
+    }
+    a->consumer_state = malloc((size_t)count * sizeof(*a->consumer_state) + 1);
+    a->class_mask = calloc((size_t)a->class_count * (size_t)words, sizeof(*a->class_mask));
+    a->follow = malloc(roots * (size_t)contexts * (size_t)words * sizeof(*a->follow));
+    a->follow_state = calloc(roots * (size_t)contexts, 1);
+    a->group_follow = malloc((size_t)contexts * (size_t)groups * 256 * (size_t)words * sizeof(*a->group_follow) + 1);
+    a->group_state = calloc((size_t)contexts * (size_t)groups * 256 + 1, 1);
+    a->active = malloc((size_t)words * sizeof(*a->active));
+    a->reached = malloc((size_t)words * sizeof(*a->reached));
+    if (a->consumer_state == NULL || a->class_mask == NULL || a->follow == NULL || a->follow_state == NULL ||
+        a->group_follow == NULL || a->group_state == NULL || a->active == NULL || a->reached == NULL) {
+        return 0;
+    }
+    // The mark array doubles as the state -> consumer map while the
+    // masks are filled in; closures reset it through next_generation()
+    int n = 0;
+    for (int s = 0; s < a->nfa_count; s++) {
+        if (a->nfa[s].op != NFA_SET) {
+            continue;
+        }
+        for (int c = 0; c < a->class_count; c++) {
+            if (set_has(&a->sets[a->nfa[s].arg], a->class_rep[c])) {
+                a->class_mask[(size_t)c * (size_t)words + (size_t)(n / 64)] |= 1ull << (n % 64);
+            }
+        }
+        a->consumer_state[n++] = s;
+    }
+    a->consumer_count = count;
+    a->words = words;
+    a->groups = groups;
+    a->contexts = contexts;
+    return 1;
+}
+
+// The consumers in the closure of `root` (a consumer, or consumer_count
+// for the start state) in context `ctx`, built on first use. Sets
+// *matched if the closure reaches a match.
+static const uint64_t *sim_follow(automaton *a, int root, int ctx, int *matched) {
+    size_t at = (size_t)root * (size_t)a->contexts + (size_t)ctx;
+    uint64_t *set = a->follow + at * (size_t)a->words;
+    if (a->follow_state[at] == 0) {
+        memset(set, 0, (size_t)a->words * sizeof(*set));
+        int found = 0;
+        int top = 0;
+        next_generation(a);
+        a->stack[top++] = root < a->consumer_count ? a->nfa[a->consumer_state[root]].out : a->start;
+        while (top > 0) {
+            int s = a->stack[--top];
+            if (a->mark[s] == a->generation) {
+                continue;
+            }
+            a->mark[s] = a->generation;
+            const nfa_state *ns = &a->nfa[s];
+            int follow = 0;
+            switch (ns->op) {
+            case NFA_SET: {
+                // Consumers are numbered in NFA order
+                int lo = 0, hi = a->consumer_count;
+                while (lo < hi) {
+                    int mid = (lo + hi) / 2;
+                    if (a->consumer_state[mid] < s) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                set[lo / 64] |= 1ull << (lo % 64);
+                break;
+            }
+            case NFA_MATCH:
+                found = 1;
+                break;
+            case NFA_SPLIT:
+                a->stack[top++] = ns->out1;
+                follow = 1;
+                break;
+            case NFA_EPSILON:
+                follow = 1;
+                break;
+            case NFA_BOL:
+                follow = (ctx & CTX_BOL) != 0;
+                break;
+            case NFA_EOL:
+                follow = (ctx & CTX_EOL) != 0;
+                break;
+            case NFA_WORDB:
+                follow = !(ctx & CTX_PREV_WORD) != !(ctx & CTX_NEXT_WORD);
+                break;
+            case NFA_NWORDB:
+                follow = !(ctx & CTX_PREV_WORD) == !(ctx & CTX_NEXT_WORD);
+                break;
+            }
+            if (follow) {
+                a->stack[top++] = ns->out;
+            }
+        }
+        a->follow_state[at] = (unsigned char)(1 + found);
+    }
+    *matched = a->follow_state[at] == 2;
+    return set;
+}
+
+// The union of the follow sets of the consumers in `subset` of group
+// `group` (bit i for consumer group * 8 + i), so that a step takes one
+// lookup per group of eight active consumers rather than one per consumer
+static const uint64_t *sim_group(automaton *a, int group, unsigned subset, int ctx, int *matched) {
+    size_t at = ((size_t)ctx * (size_t)a->groups + (size_t)group) * 256 + subset;
+    uint64_t *set = a->group_follow + at * (size_t)a->words;
+    if (a->group_state[at] == 0) {
+        memset(set, 0, (size_t)a->words * sizeof(*set));
+        int found = 0;
+        for (int i = 0; i < 8; i++) {
+            if (subset & (1u << i)) {
+                int hit;
+                const uint64_t *one = sim_follow(a, group * 8 + i, ctx, &hit);
+                for (int w = 0; w < a->words; w++) {
+                    set[w] |= one[w];
+                }
+                found |= hit;
+            }
+        }
+        a->group_state[at] = (unsigned char)(1 + found);
+    }
+    *matched = a->group_state[at] == 2;
+    return set;
+}
+
+// automaton_find_line() without the DFA. The active set holds the
+// consumers that took the last byte; the closure of their successors and
+// of the start state, in the context of the next byte, gives the ones
+// that may take it.
+static const char *sim_find_line(automaton *a, const char *p, const char *end) {
+    const unsigned char *q = (const unsigned char *)p;
+    const unsigned char *stop = (const unsigned char *)end;
+    const size_t words = (size_t)a->words;
+    int bol = 1;
+    int prev_word = 0;
+    memset(a->active, 0, words * sizeof(*a->active));
+    for (;;) {
+        if (q == stop && (q == (const unsigned char *)p || q[-1] == '\n')) {
+            return NULL;
+        }
+        // The last line has no terminating newline
+        int b = q < stop ? *q : '\n';
+        int ctx = 0;
+        if (a->contexts > 1) {
+            ctx = (bol ? CTX_BOL : 0) | (prev_word ? CTX_PREV_WORD : 0) |
+                  (b != '\n' && is_word_byte(b) ? CTX_NEXT_WORD : 0) | (b == '\n' || b == '\r' ? CTX_EOL : 0);
+        }
+        int matched;
+        const uint64_t *set = sim_follow(a, a->consumer_count, ctx, &matched);
+        memcpy(a->reached, set, words * sizeof(*set));
+        for (size_t w = 0; w < words && !matched; w++) {
+            for (int shift = 0; shift < 64 && (a->active[w] >> shift) != 0 && !matched; shift += 8) {
+                unsigned subset = (unsigned)(a->active[w] >> shift) & 0xff;
+                if (subset != 0) {
+                    set = sim_group(a, (int)(w * 8) + shift / 8, subset, ctx, &matched);
+                    for (size_t i = 0; i < words; i++) {
+                        a->reached[i] |= set[i];
+                    }
+                }
+            }
+        }
+        if (matched) {
+            return q < stop ? (const char *)q : (const char *)q - 1;
+        }
+        if (q == stop) {
+            return NULL;
+        }
+        if (b == '\n') {
+            memset(a->active, 0, words * sizeof(*a->active));
+            bol = 1;
+            prev_word = 0;
+        } else {
+            const uint64_t *mask = a->class_mask + (size_t)a->classmap[b] * words;
+            for (size_t i = 0; i < words; i++) {
+                a->active[i] = a->reached[i] & mask[i];
+            }
+            bol = 0;
+            prev_word = is_word_byte(b);
+        }
+        q++;
+    }
+}
+
+// Called once the DFA cache has been flushed at `pos` (in bytes scanned
+// so far). Gives up on the DFA when flushes keep coming before the states
+// they drop have earned their keep.
+static void note_flush(automaton *a, unsigned long long pos) {
+    int wasted = pos - a->flushed_at < (unsigned long long)a->flushed_states * FLUSH_MIN_BYTES_PER_STATE;
+    a->flushed_at = pos;
+    a->strikes = wasted ? a->strikes + 1 : 0;
+    if (a->strikes >= FLUSH_STRIKES && a->consumer_state == NULL) {
+        a->use_sim = sim_init(a);
+        if (a->use_sim) {
+            stats_add(&stats.dfa_fallbacks, 1);
+        }
+    }
+}
+
+static void *copy_array(const void *src, size_t size) {
+    void *dst = malloc(size > 0 ? size : 1);
+    if (dst != NULL && size > 0) {
+        memcpy(dst, src, size);
+    }
+    return dst;
+}
+
+// ---------------------------------------------------------------------------
+// Public interface
+// ---------------------------------------------------------------------------
+
+// The matcher generated for exactly these patterns and flags, if the
+// binary was built with one (make custom)
+static builtin_find_line find_builtin(const char *const *patterns, size_t count, int flags) {
+    for (size_t i = 0; i < builtin_matcher_count; i++) {
+        const builtin_matcher *b = &builtin_matchers[i];
+        if (b->flags != flags || b->pattern_count != count) {
+            continue;
+        }
+        size_t same = 0;
+        while (same < count && strcmp(b->patterns[same], patterns[same]) == 0) {
+            same++;
+        }
+        if (same == count) {
+            return b->find_line;
+        }
+    }
+    return NULL;
+}
+
+int automaton_builtin(const automaton *a) {
+    return a->builtin != NULL;
+}
+
+void automaton_skip_builtin(automaton *a) {
+    a->builtin = NULL;
+}
+
+automaton *automaton_compile(const char *const *patterns, size_t count, int flags,
+                             char *error, size_t error_size) {
+    automaton *a = calloc(1, sizeof(*a));
+    if (a == NULL) {
+        snprintf(error, error_size, "out of memory");
+        return NULL;
+    }
+
+    parser ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.a = a;
+    ps.error = error;
+    ps.error_size = error_size;
+
+    a->entries = malloc((count > 0 ? count : 1) * sizeof(*a->entries));
+    if (a->entries == NULL) {
+        snprintf(error, error_size, "out of memory");
+        free(a);
+        return NULL;
+    }
+    a->pattern_count = (int)count;
+
+    // Patterns are chained back to front so the first one has priority
+    int entry = -1;
+    for (size_t i = count; i-- > 0 && !ps.failed;) {
+        ps.p = patterns[i];
+        ps.end = patterns[i] + strlen(patterns[i]);
+        ps.icase = (flags & AUTOMATON_IGNORE_CASE) != 0;
+        ps.literal = (flags & AUTOMATON_LITERAL) != 0;
+
+        ast *root = parse_alternation(&ps);
+        if (!ps.failed && ps.p < ps.end) {
+            parse_error(&ps, "too many )'s");
+        }
+        if (ps.failed) {
+            break;
+        }
+
+        int match = nfa_add(a, NFA_MATCH, -1, -1, (int)i);
+        int start = nfa_compile(a, root, match);
+        a->entries[i] = start;
+        if (start >= 0 && entry >= 0) {
+            start = nfa_add(a, NFA_SPLIT, start, entry, 0);
+        }
+        if (start < 0) {
+            parse_error(&ps, "pattern too large for the native engine");
+            break;
+        }
+        entry = start;
+    }
+
+    for (size_t i = 0; i < ps.node_count; i++) {
+        free(ps.nodes[i]->kids);
+        free(ps.nodes[i]);
+    }
+    free(ps.nodes);
+    if (ps.failed) {
+        automaton_free(a);
+        return NULL;
+    }
+    a->start = entry;
+    a->builtin = find_builtin(patterns, count, flags);
+
+    // Line filtering never sees newlines inside a line
+    for (int i = 0; i < a->set_count; i++) {
+        a->sets[i].bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+    }
+    build_byte_classes(a);
+
+    if (!dfa_init(a)) {
+        snprintf(error, error_size, "out of memory");
+        automaton_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+automaton *automaton_clone(const automaton *a) {
+    automaton *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->nfa_count = c->nfa_cap = a->nfa_count;
+    c->start = a->start;
+    c->pattern_count = a->pattern_count;
+    c->set_count = c->set_cap = a->set_count;
+    memcpy(c->classmap, a->classmap, sizeof(c->classmap));
+    memcpy(c->class_rep, a->class_rep, sizeof(c->class_rep));
+    c->class_count = a->class_count;
+    c->newline_class = a->newline_class;
+    c->uses_word = a->uses_word;
+    c->frozen = a->frozen;
+    c->frozen_start = a->frozen_start;
+    c->frozen_dead = a->frozen_dead;
+    c->frozen_stride = a->frozen_stride;
+    c->frozen_states = a->frozen_states;
+    c->jit = a->jit;
+    c->builtin = a->builtin;
+    c->nfa = copy_array(a->nfa, (size_t)a->nfa_count * sizeof(*a->nfa));
+    c->entries = copy_array(a->entries, (size_t)a->pattern_count * sizeof(*a->entries));
+    c->sets = copy_array(a->sets, (size_t)a->set_count * sizeof(*a->sets));
+    if (c->nfa == NULL || c->entries == NULL || c->sets == NULL || !dfa_init(c)) {
+        automaton_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void automaton_free(automaton *a) {
+    if (a == NULL) {
+        return;
+    }
+    free(a->nfa);
+    free(a->entries);
+    free(a->thread_start);
+    free(a->sets);
+    free(a->states);
+    free(a->trans);
+    free(a->pool);
+    free(a->table);
+    free(a->stack);
+    free(a->list);
+    free(a->list2);
+    free(a->mark);
+    free(a->consumer_state);
+    free(a->class_mask);
+    free(a->follow);
+    free(a->follow_state);
+    free(a->group_follow);
+    free(a->group_state);
+    free(a->active);
+    free(a->reached);
+    free(a->frozen_image);
+    if (a->owns_jit) {
+        jit_free(a->jit);
+    }
+    free(a);
+}
+
+void automaton_set_cache_limit(automaton *a, size_t bytes) {
+    a->cache_limit = bytes > 0 ? bytes : DFA_CACHE_SIZE;
+}
+
+// The start of the line `q` is in; `p` is at a line start
+static const char *start_of_line(const char *p, const char *q) {
+    while (q > p && q[-1] != '\n') {
+        q--;
+    }
+    return q;
+}
+
+// automaton_find_line() in machine code; the last line's end is checked here
+static const char *jit_find_line(const automaton *a, const char *p, const char *end) {
+    int32_t s = a->frozen_start;
+    const unsigned char *q = jit_run(a->jit, (const unsigned char *)p, (const unsigned char *)end, &s);
+    if (q != NULL) {
+        return (const char *)q;
+    }
+    if (end > p && end[-1] != '\n' && a->frozen[s + a->newline_class] == DFA_MATCH) {
+        return end - 1;
+    }
+    return NULL;
+}
+
+// automaton_find_line() over a frozen DFA: every transition is there
+static const char *frozen_find_line(const automaton *a, const char *p, const char *end) {
+    const unsigned char *q = (const unsigned char *)p;
+    const unsigned char *stop = (const unsigned char *)end;
+    const int32_t *t = a->frozen;
+    const int32_t start = a->frozen_start;
+    const int32_t dead = a->frozen_dead;
+    int32_t s = start;
+
+    while (q < stop) {
+        if (s == dead) {
+            q = memchr(q, '\n', (size_t)(stop - q));
+            if (q == NULL) {
+                return NULL;
+            }
+            s = start;
+            q++;
+            continue;
+        }
+        s = t[s + a->classmap[*q]];
+        if (s == DFA_MATCH) {
+            return (const char *)q;
+        }
+        q++;
+    }
+    if (q > (const unsigned char *)p && q[-1] != '\n' && t[s + a->newline_class] == DFA_MATCH) {
+        return (const char *)q - 1;
+    }
+    return NULL;
+}
+
+const char *automaton_find_line(automaton *a, const char *p, const char *end) {
+    const unsigned char *q = (const unsigned char *)p;
+    const unsigned char *stop = (const unsigned char *)end;
+    const size_t classes = (size_t)a->class_count;
+    int s = a->line_start;
+
+    if (s == DFA_MATCH) {
+        return p < end ? p : NULL;
+    }
+    if (a->builtin != NULL) {
+        return a->builtin(p, end);
+    }
+    if (a->jit != NULL) {
+        return jit_find_line(a, p, end);
+    }
+    if (a->frozen != NULL) {
+        return frozen_find_line(a, p, end);
+    }
+    a->scanned += (unsigned long long)(end - p);
+    if (a->use_sim) {
+        return sim_find_line(a, p, end);
+    }
+    while (q < stop) {
+        if (s == a->dead) {
+            // Nothing can match before the next line starts
+            q = memchr(q, '\n', (size_t)(stop - q));
+            if (q == NULL) {
+                return NULL;
+            }
+            s = a->line_start;
+            q++;
+            continue;
+        }
+        int cls = a->classmap[*q];
+        int next = a->trans[(size_t)s * classes + (size_t)cls];
+        if (next <= DFA_MATCH) {
+            if (next == DFA_UNKNOWN) {
+                int states = a->state_count;
+                next = compute_transition(a, s, cls);
+                if (a->state_count < states) {
+                    note_flush(a, a->scanned - (unsigned long long)(stop - q));
+                }
+                if (next == DFA_UNKNOWN && a->consumer_state == NULL) {
+                    // Out of memory even after a flush
+                    a->use_sim = sim_init(a);
+                }
+                if (next == DFA_UNKNOWN || a->use_sim) {
+                    // The rest goes to the simulation, from this line on
+                    return a->use_sim ? sim_find_line(a, start_of_line(p, (const char *)q), end) : NULL;
+                }
+            }
+            if (next == DFA_MATCH) {
+                return (const char *)q;
+            }
+        }
+        s = next;
+        q++;
+    }
+
+    // The last line has no terminating newline
+    if (q > (const unsigned char *)p && q[-1] != '\n') {
+        int next = a->trans[(size_t)s * classes + (size_t)a->newline_class];
+        if (next == DFA_UNKNOWN) {
+            next = compute_transition(a, s, a->newline_class);
+        }
+        if (next == DFA_MATCH) {
+            return (const char *)q - 1;
+        }
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Ahead-of-time DFA
+// ---------------------------------------------------------------------------
+
+static uint32_t hash_row(const automaton *a, const int *block, int s) {
+    uint32_t h = 2166136261u ^ (uint32_t)block[s];
+    const int32_t *row = a->trans + (size_t)s * (size_t)a->class_count;
+    for (int c = 0; c < a->class_count; c++) {
+        h = (h ^ (uint32_t)block[row[c]]) * 16777619u;
+    }
+    return h;
+}
+
+static int same_row(const automaton *a, const int *block, int r, int s) {
+    if (block[r] != block[s]) {
+        return 0;
+    }
+    const int32_t *x = a->trans + (size_t)r * (size_t)a->class_count;
+    const int32_t *y = a->trans + (size_t)s * (size_t)a->class_count;
+    for (int c = 0; c < a->class_count; c++) {
+        if (block[x[c]] != block[y[c]]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Minimizes a complete DFA (Moore's algorithm): states start out split
+// into the match sentinel and the rest, and blocks are split by where
+// their transitions lead until none splits. Returns each state's block,
+// with the sentinel in block 0, or NULL when out of memory.
+static int *minimize(const automaton *a, int *block_count) {
+    size_t n = (size_t)a->state_count;
+    size_t size = 16;
+    while (size < n * 2) {
+        size *= 2;
+    }
+    int *block = malloc(n * sizeof(*block));
+    int *next = malloc(n * sizeof(*next));
+    int *slots = malloc(size * sizeof(*slots));
+    if (block == NULL || next == NULL || slots == NULL) {
+        free(block);
+        free(next);
+        free(slots);
+        return NULL;
+    }
+    for (size_t s = 0; s < n; s++) {
+        block[s] = s > 0;
+    }
+    int blocks = n > 1 ? 2 : 1;
+    for (;;) {
+        memset(slots, -1, size * sizeof(*slots));
+        int made = 1;
+        next[0] = 0;
+        for (int s = 1; s < (int)n; s++) {
+            size_t slot = hash_row(a, block, s) & (size - 1);
+            while (slots[slot] >= 0 && !same_row(a, block, slots[slot], s)) {
+                slot = (slot + 1) & (size - 1);
+            }
+            if (slots[slot] < 0) {
+                slots[slot] = s;
+                next[s] = made++;
+            } else {
+                next[s] = next[slots[slot]];
+            }
+        }
+        int *swap = block;
+        block = next;
+        next = swap;
+        // A block is only ever split, so the same count means no change
+        if (made == blocks) {
+            break;
+        }
+        blocks = made;
+    }
+    free(next);
+    free(slots);
+    *block_count = blocks;
+    return block;
+}
+
+static void *freeze(const automaton *a, size_t *len, size_t max_size, char *error, size_t error_size) {
+    automaton *c = automaton_clone(a);
+    if (c == NULL) {
+        snprintf(error, error_size, "out of memory");
+        return NULL;
+    }
+    // Build every state, with no cache limit to flush at
+    c->cache_limit = 0;
+    size_t classes = (size_t)c->class_count;
+    // The scan skips the rest of a line once in the dead state, so that
+    // is what its row does; left to compute_transition() it would restart
+    // the search, and minimizing could merge it with live states
+    for (size_t cls = 0; cls < classes; cls++) {
+        c->trans[(size_t)c->dead * classes + cls] = (int)cls == c->newline_class ? c->line_start : c->dead;
+    }
+    for (int id = 1; id < c->state_count; id++) {
+        for (size_t cls = 0; cls < classes; cls++) {
+            if (c->trans[(size_t)id * classes + cls] != DFA_UNKNOWN) {
+                continue;
+            }
+            int states = c->state_count;
+            if (compute_transition(c, id, (int)cls) == DFA_UNKNOWN || c->state_count < states) {
+                snprintf(error, error_size, "out of memory");
+                automaton_free(c);
+                return NULL;
+            }
+        }
+        if ((size_t)c->state_count * classes * sizeof(int32_t) > max_size) {
+            snprintf(error, error_size, "the DFA would be over %d MB; split the patterns into several rule files",
+                     (int)(max_size >> 20));
+            automaton_free(c);
+            return NULL;
+        }
+    }
+
+    int count = 0;
+    int *block = minimize(c, &count);
+    size_t stride = 1;
+    while (stride < classes && stride < 16) {
+        stride *= 2;
+    }
+    if (stride < classes) {
+        stride = (classes + 15) & ~(size_t)15;
+    }
+    size_t size = FROZEN_TABLE_OFFSET + (size_t)count * stride * sizeof(int32_t);
+    unsigned char *image = block != NULL ? calloc(1, size) : NULL;
+    if (image == NULL) {
+        snprintf(error, error_size, "out of memory");
+        free(block);
+        automaton_free(c);
+        return NULL;
+    }
+
+    frozen_header *h = (frozen_header *)image;
+    memcpy(h->magic, FROZEN_MAGIC, sizeof(h->magic));
+    h->byte_order = FROZEN_BYTE_ORDER;
+    h->state_count = (uint32_t)count;
+    h->class_count = (uint32_t)classes;
+    h->stride = (uint32_t)stride;
+    h->start = (int32_t)((size_t)block[c->line_start] * stride);
+    h->dead = (int32_t)((size_t)block[c->dead] * stride);
+    h->newline_class = (uint32_t)c->newline_class;
+    memcpy(image + sizeof(*h), c->classmap, 256);
+
+    // The sentinel's row is never read and stays zero; every other block
+    // takes the row of the first state in it
+    int32_t *t = (int32_t *)(image + FROZEN_TABLE_OFFSET);
+    for (int id = c->state_count - 1; id > 0; id--) {
+        int32_t *row = t + (size_t)block[id] * stride;
+        for (size_t cls = 0; cls < classes; cls++) {
+            row[cls] = (int32_t)((size_t)block[c->trans[(size_t)id * classes + cls]] * stride);
+        }
+    }
+    free(block);
+    automaton_free(c);
+    *len = size;
+    return image;
+}
+
+void *automaton_freeze(const automaton *a, size_t *len, char *error, size_t error_size) {
+    return freeze(a, len, FROZEN_MAX_SIZE, error, error_size);
+}
+
+int automaton_attach(automaton *a, const void *image, size_t len) {
+    const frozen_header *h = image;
+    if (((uintptr_t)image & 3) != 0 || len < FROZEN_TABLE_OFFSET ||
+        memcmp(h->magic, FROZEN_MAGIC, sizeof(h->magic)) != 0 || h->byte_order != FROZEN_BYTE_ORDER ||
+        h->class_count != (uint32_t)a->class_count || h->newline_class != (uint32_t)a->newline_class ||
+        h->stride < h->class_count || h->stride > 256 || h->state_count == 0 ||
+        (len - FROZEN_TABLE_OFFSET) / sizeof(int32_t) / h->stride < h->state_count ||
+        memcmp((const unsigned char *)image + sizeof(*h), a->classmap, 256) != 0) {
+        return 0;
+    }
+    // One pass over the entries, so a damaged file cannot send the scan
+    // outside the table
+    const int32_t *t = (const int32_t *)((const unsigned char *)image + FROZEN_TABLE_OFFSET);
+    int64_t limit = (int64_t)h->state_count * h->stride;
+    int ok = h->start >= 0 && h->start < limit && h->start % (int32_t)h->stride == 0 &&
+             h->dead >= 0 && h->dead < limit && h->dead % (int32_t)h->stride == 0;
+    for (int64_t row = h->stride; ok && row < limit; row += h->stride) {
+        for (uint32_t cls = 0; cls < h->class_count; cls++) {
+            int32_t next = t[row + cls];
+            ok &= next >= 0 && next < limit && next % (int32_t)h->stride == 0;
+        }
+    }
+    if (!ok) {
+        return 0;
+    }
+    a->frozen = t;
+    a->frozen_start = h->start;
+    a->frozen_dead = h->dead;
+    a->frozen_stride = h->stride;
+    a->frozen_states = h->state_count;
+    return 1;
+}
+
+int automaton_prebuild(automaton *a) {
+    if (a->frozen != NULL) {
+        return 1;
+    }
+    char error[256];
+    size_t len = 0;
+    void *image = freeze(a, &len, PREBUILD_MAX_SIZE, error, sizeof(error));
+    if (image == NULL || !automaton_attach(a, image, len)) {
+        free(image);
+        return 0;
+    }
+    a->frozen_image = image;
+    return 1;
+}
+
+size_t automaton_jit(automaton *a) {
+    if (a->jit == NULL && a->builtin == NULL && a->line_start != DFA_MATCH && automaton_prebuild(a)) {
+        a->jit = jit_compile(a->frozen, a->frozen_stride, a->frozen_states, a->classmap, a->frozen_start);
+        a->owns_jit = a->jit != NULL;
+    }
+    return a->jit != NULL ? jit_size(a->jit) : 0;
+}
+
+void automaton_codegen_header(FILE *out) {
+    codegen_header(out);
+}
+
+int automaton_codegen(const automaton *a, FILE *out, const char *name, char *error, size_t error_size) {
+    size_t len = 0;
+    unsigned char *image = freeze(a, &len, FROZEN_MAX_SIZE, error, error_size);
+    if (image == NULL) {
+        if (strcmp(error, "out of memory") != 0) {
+            snprintf(error, error_size, "the DFA would be over %d MB, far too large for C", (int)(FROZEN_MAX_SIZE >> 20));
+        }
+        return 0;
+    }
+    const frozen_header *h = (const frozen_header *)image;
+    int ok = h->state_count <= CODEGEN_MAX_STATES;
+    if (!ok) {
+        snprintf(error, error_size, "the DFA has %u states, over the %d C is generated for; use a rule file",
+                 (unsigned)h->state_count, CODEGEN_MAX_STATES);
+    } else if (!codegen_find_line(out, name, (const int32_t *)(image + FROZEN_TABLE_OFFSET), h->stride,
+                                  h->state_count, image + sizeof(*h), h->start, h->dead, (int)h->newline_class)) {
+        snprintf(error, error_size, "%s", ferror(out) ? strerror(errno) : "out of memory");
+        ok = 0;
+    }
+    free(image);
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Match positions (Pike VM)
+// ---------------------------------------------------------------------------
+
+// Adds `s` and its epsilon closure at `pos` to the thread list, in priority
+// order. Assertions are resolved on the spot since the whole line is known.
+static void vm_add(automaton *a, int s, size_t start, const unsigned char *line, size_t len,
+                   size_t pos, int *list, size_t *starts, int *count) {
+    // Mirrors compute_transition(): $ also holds before a \r
+    int eol = pos == len || line[pos] == '\r';
+    int prev_word = pos > 0 && is_word_byte(line[pos - 1]);
+    int next_word = pos < len && !eol && is_word_byte(line[pos]);
+    int top = 0;
+    a->stack[top++] = s;
+    while (top > 0) {
+        s = a->stack[--top];
+        if (a->mark[s] == a->generation) {
+            continue;
+        }
+        a->mark[s] = a->generation;
+        const nfa_state *st = &a->nfa[s];
+        int follow = 0;
+        switch (st->op) {
+        case NFA_SPLIT:
+            a->stack[top++] = st->out1;
+            follow = 1;
+            break;
+        case NFA_EPSILON:
+            follow = 1;
+            break;
+        case NFA_BOL:
+            follow = pos == 0;
+            break;
+        case NFA_EOL:
+            follow = eol;
+            break;
+        case NFA_WORDB:
+            follow = prev_word != next_word;
+            break;
+        case NFA_NWORDB:
+            follow = prev_word == next_word;
+            break;
+        default:
+            list[*count] = s;
+            starts[*count] = start;
+            (*count)++;
+            break;
+        }
+        if (follow) {
+            a->stack[top++] = st->out;
+        }
+    }
+}
+
+int automaton_match(automaton *a, int pattern, const char *line, size_t len, size_t from,
+                    automaton_span *span) {
+    if (pattern < 0 || pattern >= a->pattern_count || from > len) {
+        return 0;
+    }
+    if (a->thread_start == NULL) {
+        a->thread_start = malloc((size_t)a->nfa_count * 2 * sizeof(*a->thread_start));
+        if (a->thread_start == NULL) {
+            return 0;
+        }
+    }
+    const unsigned char *s = (const unsigned char *)line;
+    int entry = a->entries[pattern];
+    int *clist = a->list, *nlist = a->list2;
+    size_t *cstart = a->thread_start, *nstart = a->thread_start + a->nfa_count;
+    int ccount = 0;
+    int found = 0;
+
+    next_generation(a);
+    vm_add(a, entry, from, s, len, from, clist, cstart, &ccount);
+    for (size_t pos = from;; pos++) {
+        int ncount = 0;
+        next_generation(a);
+        for (int i = 0; i < ccount; i++) {
+            const nfa_state *st = &a->nfa[clist[i]];
+            if (st->op == NFA_MATCH) {
+                // Threads after this one have lower priority; only the
+                // ones already carried forward can still win
+                span->start = cstart[i];
+                span->end = pos;
+                found = 1;
+                break;
+            }
+            if (pos < len && set_has(&a->sets[st->arg], s[pos])) {
+                vm_add(a, st->out, cstart[i], s, len, pos + 1, nlist, nstart, &ncount);
+            }
+        }
+        if (!found) {
+            if (pos == len) {
+                break;
+            }
+            vm_add(a, entry, pos + 1, s, len, pos + 1, nlist, nstart, &ncount);
+        } else if (ncount == 0) {
+            break;
+        }
+        int *list = clist;
+        clist = nlist;
+        nlist = list;
+        size_t *starts = cstart;
+        cstart = nstart;
+        nstart = starts;
+        ccount = ncount;
+    }
+    return found;
+}
+
+int automaton_literal(const char *pattern, char *out, size_t *out_len) {
+    size_t len = 0;
+    for (const char *p = pattern; *p; p++) {
+        char c = *p;
+        if (c == '\\') {
+            char next = p[1];
+            if (next == '\0' || isalnum((unsigned char)next) || (unsigned char)next >= 0x80) {
+                return 0;
+            }
+            out[len++] = next;
+            p++;
+        } else if (strchr(".^$|?*+()[{", c) != NULL) {
+            return 0;
+        } else {
+            out[len++] = c;
+        }
+    }
+    *out_len = len;
+    return 1;
+}
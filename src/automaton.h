@@ -0,0 +1,99 @@
+/*
+ * automaton.h - Regular expression compiler for the native engine
+ */
+
+#ifndef SS_AUTOMATON_H
+#define SS_AUTOMATON_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define AUTOMATON_IGNORE_CASE 0x1
+#define AUTOMATON_LITERAL     0x2
+
+typedef struct automaton automaton;
+
+// Compiles one or more patterns into a single automaton that matches a line
+// when any of the patterns match it. Returns NULL and fills `error` on failure.
+automaton *automaton_compile(const char *const *patterns, size_t count, int flags,
+                             char *error, size_t error_size);
+void automaton_free(automaton *a);
+
+// A copy with its own, empty DFA cache. The DFA is built lazily as it
+// runs, so each thread needs its own automaton; cloning skips parsing and
+// NFA construction. Returns NULL when out of memory.
+automaton *automaton_clone(const automaton *a);
+
+// Caps the memory the DFA cache of this automaton may grow to; 0 for the
+// default of 8 MB. A full cache is flushed and rebuilt as the scan goes
+// on, and a pattern that keeps filling it is run as an NFA simulation
+// instead. Either way the same lines are found.
+void automaton_set_cache_limit(automaton *a, size_t bytes);
+
+// Builds the whole DFA ahead of time, minimizes it and returns it as one
+// malloc'd image of `len` bytes, for a rule set compiled once and
+// searched many times. Returns NULL and fills `error` when out of memory
+// or when the DFA would be too large.
+void *automaton_freeze(const automaton *a, size_t *len, char *error, size_t error_size);
+
+// Runs `a` from a frozen DFA instead of its lazy one: no state is built
+// while scanning. The image must have come from automaton_freeze() for
+// the same patterns and flags, sit at a 64-byte boundary (4 at the
+// least) and outlive `a` and its clones, which share it. Returns 0 if it
+// does not fit `a` or is damaged.
+int automaton_attach(automaton *a, const void *image, size_t len);
+
+// Builds the whole DFA now and runs `a` from it, as automaton_attach()
+// would, if it is small (about 1 MB before minimizing). Clones made
+// afterwards share it. Returns 0, leaving the lazy DFA, if it is larger.
+int automaton_prebuild(automaton *a);
+
+// Compiles the frozen DFA (attached, or prebuilt now) to x86-64 machine
+// code, which `a` and clones made afterwards then run instead of the
+// table. Returns the size of the code, or 0 where there is none (not
+// x86-64, no executable memory allowed, or no frozen DFA to compile);
+// the table is used then.
+size_t automaton_jit(automaton *a);
+
+// Whether `a` runs a matcher generated for its patterns (make custom)
+// instead of its DFA
+int automaton_builtin(const automaton *a);
+
+// Runs `a`, and clones made afterwards, from its DFA even when a matcher
+// was generated for its patterns; for timing one against the other
+void automaton_skip_builtin(automaton *a);
+
+// Writes the whole DFA as a C function, `static const char *name(const
+// char *p, const char *end)`, that does what automaton_find_line() does,
+// for compiling into a custom build. Returns 0 and fills `error` when the
+// DFA has more states than is sensible as C, or on a write error.
+int automaton_codegen(const automaton *a, FILE *out, const char *name, char *error, size_t error_size);
+
+// The #includes automaton_codegen()'s functions need, written once at the
+// top of the file
+void automaton_codegen_header(FILE *out);
+
+// Finds the first matching line in [p, end). `p` must be at the start of a
+// line. Returns a pointer into the matching line (possibly at its newline),
+// or NULL if no line in the range matches.
+const char *automaton_find_line(automaton *a, const char *p, const char *end);
+
+typedef struct {
+    size_t start;
+    size_t end;
+} automaton_span;
+
+// Finds the leftmost match of pattern number `pattern` in line[from, len),
+// choosing among matches at that position the way .NET's backtracking
+// engine would. `line` is one line without its newline; ^ and \b look at
+// the whole line, not just from `from`. Returns 1 and fills `span` with
+// offsets into `line`, or 0 if there is no match. Much slower than
+// automaton_find_line(), so only run it on lines already known to match.
+int automaton_match(automaton *a, int pattern, const char *line, size_t len, size_t from,
+                    automaton_span *span);
+
+// If `pattern` is a plain literal once escapes are resolved, copies its bytes
+// to `out` (at least strlen(pattern) bytes), stores the length and returns 1.
+int automaton_literal(const char *pattern, char *out, size_t *out_len);
+
+#endif
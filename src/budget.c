@@ -0,0 +1,215 @@
+/*
+ * budget.c - CPU and memory budget from the cgroup limits
+ *
+ * In a container, sysconf() reports the host's CPUs. The budget takes the
+ * CPU quota and memory limit of our cgroup and of every cgroup above it,
+ * under cgroup v2 and under v1's cpu and memory controllers (a hybrid
+ * host has both), and the CPUs our affinity mask allows, and sizes the
+ * defaults from the tightest of them.
+ */
+
+#define _GNU_SOURCE
+
+#include "compat.h"
+#include <pthread.h>
+
+#include "budget.h"
+
+#ifndef CGROUP_DIR
+#define CGROUP_DIR "/sys/fs/cgroup"
+#endif
+
+#define MAP_CACHE_BYTES (1LL << 30)
+#define QUERY_MEMORY (16LL << 20)   // a generous guess at a query with a warm DFA
+
+static budget current;
+static int computed;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+#ifdef __linux__
+
+#include <sched.h>
+
+static int read_text(const char *path, char *text, int size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    int ok = fgets(text, size, file) != NULL;
+    fclose(file);
+    return ok;
+}
+
+static void limit_cpus(double quota, const char *source) {
+    if (quota > 0 && (current.cpu_quota == 0 || quota < current.cpu_quota)) {
+        current.cpu_quota = quota;
+        current.source = source;
+    }
+}
+
+static void limit_memory(long long limit, const char *source) {
+    // v1 reports "no limit" as a huge page-rounded number
+    if (limit > 0 && limit < (1LL << 60) && (current.memory_limit == 0 || limit < current.memory_limit)) {
+        current.memory_limit = limit;
+        current.source = source;
+    }
+}
+
+// Reads the limits of cgroup `path` under `root` and of its ancestors
+static void read_cgroup(const char *root, const char *path, int v2) {
+    char dir[4096];
+    char file[4200];
+    char text[256];
+    snprintf(dir, sizeof(dir), "%s%s", root, path);
+    size_t root_len = strlen(root);
+    for (;;) {
+        size_t len = strlen(dir);
+        while (len > root_len && dir[len - 1] == '/') {
+            dir[--len] = '\0';
+        }
+        if (v2) {
+            long long quota, period;
+            snprintf(file, sizeof(file), "%s/cpu.max", dir);
+            if (read_text(file, text, sizeof(text)) && sscanf(text, "%lld %lld", &quota, &period) == 2 &&
+                period > 0) {
+                limit_cpus((double)quota / (double)period, "cgroup v2");
+            }
+            // memory.high throttles rather than kills, but it is where
+            // the kernel starts taking memory back
+            snprintf(file, sizeof(file), "%s/memory.max", dir);
+            if (read_text(file, text, sizeof(text))) {
+                limit_memory(atoll(text), "cgroup v2");
+            }
+            snprintf(file, sizeof(file), "%s/memory.high", dir);
+            if (read_text(file, text, sizeof(text))) {
+                limit_memory(atoll(text), "cgroup v2");
+            }
+        } else {
+            long long quota = 0, period = 0;
+            snprintf(file, sizeof(file), "%s/cpu.cfs_quota_us", dir);
+            if (read_text(file, text, sizeof(text))) {
+                quota = atoll(text);
+            }
+            snprintf(file, sizeof(file), "%s/cpu.cfs_period_us", dir);
+            if (read_text(file, text, sizeof(text))) {
+                period = atoll(text);
+            }
+            if (quota > 0 && period > 0) {
+                limit_cpus((double)quota / (double)period, "cgroup v1");
+            }
+            snprintf(file, sizeof(file), "%s/memory.limit_in_bytes", dir);
+            if (read_text(file, text, sizeof(text))) {
+                limit_memory(atoll(text), "cgroup v1");
+            }
+        }
+        char *slash = strrchr(dir + root_len, '/');
+        if (slash == NULL) {
+            break;
+        }
+        *slash = '\0';
+    }
+}
+
+// Whether `controller` is one of the comma-separated `controllers`
+static int has_controller(const char *controllers, const char *controller) {
+    size_t len = strlen(controller);
+    for (const char *p = controllers; *p != '\0';) {
+        const char *comma = strchr(p, ',');
+        size_t n = comma != NULL ? (size_t)(comma - p) : strlen(p);
+        if (n == len && strncmp(p, controller, len) == 0) {
+            return 1;
+        }
+        p += n + (comma != NULL);
+    }
+    return 0;
+}
+
+static void read_limits(void) {
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        // hierarchy-id:controllers:path
+        char *controllers = strchr(line, ':');
+        char *path = controllers != NULL ? strchr(controllers + 1, ':') : NULL;
+        if (path == NULL) {
+            continue;
+        }
+        *controllers++ = '\0';
+        *path++ = '\0';
+        char root[512];
+        if (strcmp(line, "0") == 0 && controllers[0] == '\0') {
+            read_cgroup(CGROUP_DIR, path, 1);
+            read_cgroup(CGROUP_DIR "/unified", path, 1);
+            continue;
+        }
+        // A container sees its own cgroup as the root of the mount, so the
+        // path from /proc may not exist; the walk up still reaches the root
+        if (has_controller(controllers, "cpu") || has_controller(controllers, "memory")) {
+            snprintf(root, sizeof(root), "%s/%s", CGROUP_DIR, controllers);
+            read_cgroup(root, path, 0);
+        }
+    }
+    fclose(file);
+}
+
+static int allowed_cpus(void) {
+    cpu_set_t set;
+    return sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 0;
+}
+
+#else
+
+static void read_limits(void) {
+}
+
+static int allowed_cpus(void) {
+    return 0;
+}
+
+#endif
+
+static void compute(void) {
+    current.source = "none";
+    current.online_cpus = ss_cpu_count();
+    current.allowed_cpus = allowed_cpus();
+    read_limits();
+
+    int cpus = current.online_cpus;
+    if (current.allowed_cpus > 0 && current.allowed_cpus < cpus) {
+        cpus = current.allowed_cpus;
+    }
+    // A quota of 1.5 CPUs still keeps two threads busy part of the time
+    if (current.cpu_quota > 0 && current.cpu_quota < (double)cpus) {
+        cpus = (int)current.cpu_quota;
+        cpus += (double)cpus < current.cpu_quota;
+    }
+    current.cpus = cpus > 0 ? cpus : 1;
+
+    current.map_cache_bytes = MAP_CACHE_BYTES;
+    current.query_cache_size = BUDGET_QUERY_CACHE_MAX;
+    if (current.memory_limit > 0) {
+        // A quarter of the limit for mappings (their pages count against
+        // the cgroup once touched) and another for compiled queries
+        if (current.memory_limit / 4 < current.map_cache_bytes) {
+            current.map_cache_bytes = current.memory_limit / 4;
+        }
+        long long queries = current.memory_limit / 4 / QUERY_MEMORY;
+        if (queries < current.query_cache_size) {
+            current.query_cache_size = queries > 4 ? (int)queries : 4;
+        }
+    }
+    __atomic_store_n(&computed, 1, __ATOMIC_RELEASE);
+}
+
+const budget *budget_get(void) {
+    pthread_once(&once, compute);
+    return &current;
+}
+
+const budget *budget_peek(void) {
+    return __atomic_load_n(&computed, __ATOMIC_ACQUIRE) ? &current : NULL;
+}
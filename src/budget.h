@@ -0,0 +1,29 @@
+/*
+ * budget.h - CPU and memory budget from the cgroup limits
+ */
+
+#ifndef SS_BUDGET_H
+#define SS_BUDGET_H
+
+#define BUDGET_QUERY_CACHE_MAX 32
+
+typedef struct {
+    int cpus;                   // threads to run when not told otherwise
+    int online_cpus;
+    int allowed_cpus;           // in our affinity mask
+    double cpu_quota;           // in CPUs; 0 for no quota
+    long long memory_limit;     // bytes; 0 for no limit
+    const char *source;         // where the limits came from: "cgroup v2", "cgroup v1" or "none"
+
+    // What the limits leave for the server's caches (server.c)
+    long long map_cache_bytes;  // memory-mapped files
+    int query_cache_size;       // compiled queries
+} budget;
+
+// The budget, read on first use
+const budget *budget_get(void);
+
+// The budget if something has used it, else NULL (for --stats)
+const budget *budget_peek(void);
+
+#endif
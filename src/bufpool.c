@@ -0,0 +1,122 @@
+/*
+ * bufpool.c - recycled read buffers
+ *
+ * Every scratch context has a read buffer, sized per file, and the server
+ * makes new scratch contexts for each query's threads. Buffers go back to
+ * a pool instead of being freed, one free list per power-of-two size, so
+ * a buffer's pages are faulted in once and reused from then on. The
+ * pool does not know NUMA nodes; a pinned worker's first buffer is its
+ * own, but a recycled one may sit in another node's memory.
+ */
+
+#define _GNU_SOURCE
+
+#include "compat.h"
+#include <pthread.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "budget.h"
+#include "bufpool.h"
+#include "stats.h"
+
+#define BUFPOOL_CLASSES 48
+#define BUFPOOL_KEEP (64LL << 20)
+
+// A pooled buffer's first bytes link it to the next one of its size
+typedef struct pooled {
+    struct pooled *next;
+} pooled;
+
+static pooled *free_lists[BUFPOOL_CLASSES];
+static long long pooled_bytes;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t bufpool_round(size_t size) {
+    size_t rounded = BUFPOOL_ALIGN;
+    while (rounded < size) {
+        rounded *= 2;
+    }
+    return rounded;
+}
+
+static int size_class(size_t size) {
+    int c = 0;
+    while (c < BUFPOOL_CLASSES - 1 && ((size_t)BUFPOOL_ALIGN << c) < size) {
+        c++;
+    }
+    return c;
+}
+
+static long long pool_limit(void) {
+    long long limit = budget_get()->memory_limit / 8;
+    return limit > 0 && limit < BUFPOOL_KEEP ? limit : BUFPOOL_KEEP;
+}
+
+static char *aligned_new(size_t size) {
+    size_t align = size >= BUFPOOL_HUGE_PAGE ? BUFPOOL_HUGE_PAGE : size >= BUFPOOL_PAGE ? BUFPOOL_PAGE
+                                                                                       : BUFPOOL_ALIGN;
+#ifdef _WIN32
+    return _aligned_malloc(size, align);
+#else
+    void *buf = NULL;
+    if (posix_memalign(&buf, align, size) != 0) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (size >= BUFPOOL_HUGE_PAGE) {
+        madvise(buf, size, MADV_HUGEPAGE);
+    }
+#endif
+    return buf;
+#endif
+}
+
+static void aligned_free(char *buf) {
+#ifdef _WIN32
+    _aligned_free(buf);
+#else
+    free(buf);
+#endif
+}
+
+char *bufpool_get(size_t size) {
+    size = bufpool_round(size);
+    int c = size_class(size);
+    pthread_mutex_lock(&lock);
+    pooled *p = free_lists[c];
+    if (p != NULL) {
+        free_lists[c] = p->next;
+        pooled_bytes -= (long long)size;
+    }
+    pthread_mutex_unlock(&lock);
+    if (p != NULL) {
+        return (char *)p;
+    }
+    stats_add(&stats.scan_allocs, 1);
+    return aligned_new(size);
+}
+
+void bufpool_put(char *buf, size_t size) {
+    if (buf == NULL) {
+        return;
+    }
+    size = bufpool_round(size);
+    long long limit = pool_limit();
+    pthread_mutex_lock(&lock);
+    int keep = pooled_bytes + (long long)size <= limit;
+    if (keep) {
+        pooled *p = (pooled *)(void *)buf;
+        int c = size_class(size);
+        p->next = free_lists[c];
+        free_lists[c] = p;
+        pooled_bytes += (long long)size;
+    }
+    pthread_mutex_unlock(&lock);
+    if (!keep) {
+        aligned_free(buf);
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ * bufpool.h - recycled read buffers
+ */
+
+#ifndef SS_BUFPOOL_H
+#define SS_BUFPOOL_H
+
+#include <stddef.h>
+
+#define BUFPOOL_ALIGN 64
+#define BUFPOOL_PAGE 4096
+#define BUFPOOL_HUGE_PAGE (2u << 20)
+
+// The size bufpool_get() hands out for `size`: the next power of two
+size_t bufpool_round(size_t size);
+
+// A read buffer of bufpool_round(size) bytes, 64-byte aligned, taken
+// from the pool when one of that size is there. From 4KB up it is
+// page-aligned, as O_DIRECT reads need, and from 2MB up it is
+// 2MB-aligned and advised as transparent huge pages, so a large buffer
+// takes a handful of TLB entries instead of hundreds. NULL if out of
+// memory.
+char *bufpool_get(size_t size);
+
+// Hands a buffer back for the next bufpool_get() of its size. The pool
+// keeps up to 64MB, or an eighth of a cgroup memory limit; the rest is
+// freed.
+void bufpool_put(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,11 @@
+/*
+ * builtin.c - No matchers compiled in
+ *
+ * The table a regular build links; `make custom` replaces this file
+ * with one generated from MATCHERS.
+ */
+
+#include "builtin.h"
+
+const builtin_matcher *const builtin_matchers = NULL;
+const size_t builtin_matcher_count = 0;
@@ -0,0 +1,26 @@
+/*
+ * builtin.h - Matchers compiled into the binary
+ *
+ * `make custom` generates C for fixed pattern sets (see
+ * ss_generate_matchers()) and links it in place of builtin.c, whose
+ * table is empty.
+ */
+
+#ifndef SS_BUILTIN_H
+#define SS_BUILTIN_H
+
+#include <stddef.h>
+
+typedef const char *(*builtin_find_line)(const char *p, const char *end);
+
+typedef struct {
+    int flags;                      // AUTOMATON_* the patterns were compiled with
+    size_t pattern_count;
+    const char *const *patterns;
+    builtin_find_line find_line;    // automaton_find_line() for exactly these
+} builtin_matcher;
+
+extern const builtin_matcher *const builtin_matchers;
+extern const size_t builtin_matcher_count;
+
+#endif
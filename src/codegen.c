@@ -0,0 +1,401 @@
+/*
+ * codegen.c - C source for a frozen DFA
+ *
+ * The build-time counterpart of jit.c. A state that loops on itself for
+ * all but a few bytes (the start state of a literal-led pattern) becomes
+ * a label: it skips ahead with memchr() or a tight compare loop, then
+ * switches on the byte that stopped it and jumps to the next state's
+ * label. So does a state that starts a run of states each advancing on
+ * one byte, the way a literal is spelled out; the run is first tried as
+ * a single unrolled comparison, and only when that fails does the switch
+ * step through it byte by byte.
+ *
+ * The other states leave on most bytes, so a switch there would be an
+ * indirect jump per byte that the branch predictor gets wrong whenever
+ * the text does (between the word and non-word states of \b, every few
+ * bytes). Those are stepped through a byte-indexed table instead, like
+ * the frozen DFA but without its byte classes, until a byte leads to a
+ * labelled state or a match.
+ */
+
+#include "compat.h"
+#include <ctype.h>
+
+#include "codegen.h"
+
+#define CODEGEN_SKIP_BYTES 3    // exit bytes a self-looping state skips over with compares
+#define CODEGEN_MAX_CHAIN 32    // bytes in one unrolled literal comparison
+
+typedef struct {
+    FILE *out;
+    const int32_t *table;
+    size_t stride;
+    size_t state_count;
+    const unsigned char *classmap;
+    size_t *fallback;       // per state: where most bytes lead
+    size_t *row;            // per state: 1 + its row in the byte table, 0 if it is a label
+    size_t *exit;           // per state: 1 + the code that leaves the table for it
+    size_t row_count;
+    size_t exit_count;
+    int last_line;          // an unterminated last line can match in a table row
+} generator;
+
+// State numbers here are rows; row 0 is the match sentinel
+static size_t next_state(const generator *g, size_t s, int b) {
+    return (size_t)g->table[s * g->stride + g->classmap[b]] / g->stride;
+}
+
+static void put_byte(FILE *out, int b) {
+    if (b < 0x80 && isalnum(b)) {
+        fprintf(out, "'%c'", b);
+    } else {
+        fprintf(out, "0x%02x", b);
+    }
+}
+
+// A state advances like a literal when every byte but one (or one letter
+// in both cases) leads to its fallback. Returns that byte, lower-cased
+// for a pair, and where it leads; -1 if the state is not like that.
+static int literal_step(const generator *g, size_t s, size_t *next, int *folded) {
+    int found = -1;
+    int count = 0;
+    for (int b = 0; b < 256; b++) {
+        if (next_state(g, s, b) != g->fallback[s]) {
+            found = count++ == 0 ? b : found;
+        }
+    }
+    *next = found >= 0 ? next_state(g, s, found) : 0;
+    *folded = 0;
+    if (count == 2 && found < 0x80 && isupper(found) && next_state(g, s, tolower(found)) == *next) {
+        *folded = 1;
+        return tolower(found);
+    }
+    return count == 1 ? found : -1;
+}
+
+static void emit_target(const generator *g, size_t target, const char *indent) {
+    if (target == 0) {
+        fprintf(g->out, "%sreturn (const char *)q - 1;\n", indent);
+    } else if (g->row[target] != 0) {
+        fprintf(g->out, "%sd = %zu;\n%sgoto table;\n", indent, 256 * (g->row[target] - 1), indent);
+    } else {
+        fprintf(g->out, "%sgoto s%zu;\n", indent, target);
+    }
+}
+
+// The literal spelled out from state `s`: its bytes, which of them match
+// either case, and the state after it. Returns its length.
+static size_t chain(const generator *g, size_t s, int bytes[CODEGEN_MAX_CHAIN], int folded[CODEGEN_MAX_CHAIN],
+                    size_t *end) {
+    size_t seen[CODEGEN_MAX_CHAIN];
+    size_t len = 0;
+    size_t at = s;
+    while (len < CODEGEN_MAX_CHAIN && at != 0) {
+        size_t next = 0;
+        int b = literal_step(g, at, &next, &folded[len]);
+        if (b < 0) {
+            break;
+        }
+        seen[len] = at;
+        bytes[len++] = b;
+        for (size_t i = 0; i < len && next != 0; i++) {
+            if (seen[i] == next) {
+                next = (size_t)-1;
+                break;
+            }
+        }
+        if (next == (size_t)-1) {
+            len--;
+            break;
+        }
+        at = next;
+    }
+    *end = at;
+    return len;
+}
+
+// Bytes that take state `s` somewhere else
+static int exit_bytes(const generator *g, size_t s, int exits[CODEGEN_SKIP_BYTES]) {
+    int count = 0;
+    for (int b = 0; b < 256; b++) {
+        if (next_state(g, s, b) != s && count++ < CODEGEN_SKIP_BYTES) {
+            exits[count - 1] = b;
+        }
+    }
+    return count;
+}
+
+// The unrolled comparison for the literal starting at state `s`, if it
+// spells out at least two bytes
+static void emit_chain(const generator *g, size_t s) {
+    int bytes[CODEGEN_MAX_CHAIN];
+    int folded[CODEGEN_MAX_CHAIN];
+    size_t at = 0;
+    size_t len = chain(g, s, bytes, folded, &at);
+    if (len < 2) {
+        return;
+    }
+    fprintf(g->out, "    if (stop - q >= %zu", len);
+    for (size_t i = 0; i < len; i++) {
+        fprintf(g->out, i % 4 == 3 ? " &&\n        " : " && ");
+        fprintf(g->out, folded[i] ? "(q[%zu] | 0x20) == " : "q[%zu] == ", i);
+        put_byte(g->out, bytes[i]);
+    }
+    fprintf(g->out, ") {\n");
+    if (at == 0) {
+        fprintf(g->out, "        return (const char *)q + %zu;\n", len - 1);
+    } else {
+        fprintf(g->out, "        q += %zu;\n", len);
+        emit_target(g, at, "        ");
+    }
+    fprintf(g->out, "    }\n");
+}
+
+static void emit_state(const generator *g, size_t s, int newline_class) {
+    FILE *out = g->out;
+    fprintf(out, "s%zu:\n", s);
+
+    // Bytes that keep the state where it is can be skipped without a switch
+    int exits[CODEGEN_SKIP_BYTES];
+    int exit_count = exit_bytes(g, s, exits);
+    if (exit_count == 0) {
+        fprintf(out, "    q = stop;\n");
+    } else if (exit_count == 1) {
+        fprintf(out, "    q = memchr(q, ");
+        put_byte(out, exits[0]);
+        fprintf(out, ", (size_t)(stop - q));\n    if (q == NULL) {\n        q = stop;\n    }\n");
+    } else if (exit_count <= CODEGEN_SKIP_BYTES) {
+        fprintf(out, "#ifdef SKIP_SSE2\n");
+        fprintf(out, "    while (stop - q >= 16) {\n");
+        fprintf(out, "        __m128i v = _mm_loadu_si128((const __m128i *)q);\n");
+        fprintf(out, "        __m128i hit = _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0x%02x));\n", exits[0]);
+        for (int i = 1; i < exit_count; i++) {
+            fprintf(out, "        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0x%02x)));\n", exits[i]);
+        }
+        fprintf(out, "        unsigned mask = (unsigned)_mm_movemask_epi8(hit);\n");
+        fprintf(out, "        if (mask != 0) {\n            q += __builtin_ctz(mask);\n            break;\n        }\n");
+        fprintf(out, "        q += 16;\n    }\n#endif\n");
+        fprintf(out, "    while (q < stop");
+        for (int i = 0; i < exit_count; i++) {
+            fprintf(out, " && *q != ");
+            put_byte(out, exits[i]);
+        }
+        fprintf(out, ") {\n        q++;\n    }\n");
+    }
+
+    // The last line has no terminating newline
+    fprintf(out, "    if (q == stop) {\n");
+    if (g->table[s * g->stride + (size_t)newline_class] == 0) {
+        fprintf(out, "        return q > (const unsigned char *)p && q[-1] != '\\n' ? (const char *)q - 1 : NULL;\n");
+    } else {
+        fprintf(out, "        return NULL;\n");
+    }
+    fprintf(out, "    }\n");
+
+    emit_chain(g, s);
+
+    fprintf(out, "    switch (*q++) {\n");
+    unsigned char done[256] = {0};
+    for (int b = 0; b < 256; b++) {
+        size_t target = next_state(g, s, b);
+        if (done[b] || target == g->fallback[s]) {
+            continue;
+        }
+        int on_line = 0;
+        for (int c = b; c < 256; c++) {
+            if (!done[c] && next_state(g, s, c) == target) {
+                done[c] = 1;
+                fprintf(out, on_line == 0 ? "    case " : on_line % 8 == 0 ? ":\n    case " : ": case ");
+                put_byte(out, c);
+                on_line++;
+            }
+        }
+        fprintf(out, ":\n");
+        emit_target(g, target, "        ");
+    }
+    fprintf(out, "    default:\n");
+    emit_target(g, g->fallback[s], "        ");
+    fprintf(out, "    }\n");
+}
+
+// The byte table, declared at the top of the function. Entries are
+// offsets, 256 per row, so a step is one add and one load; an offset past
+// the last row is the code that leaves the table for a label or a match.
+static void emit_table(const generator *g, const size_t *order, size_t count, int newline_class) {
+    FILE *out = g->out;
+    const char *type = g->row_count + g->exit_count <= 256 ? "uint16_t" : "uint32_t";
+    fprintf(out, "    static const %s next[%zu] = {\n", type, g->row_count * 256);
+    for (size_t i = 0; i < count; i++) {
+        size_t s = order[i];
+        if (g->row[s] == 0) {
+            continue;
+        }
+        fprintf(out, "        // s%zu\n", s);
+        for (int b = 0; b < 256; b++) {
+            size_t target = next_state(g, s, b);
+            size_t entry = 256 * (g->row[target] != 0 ? g->row[target] - 1 : g->row_count + g->exit[target] - 1);
+            fprintf(out, b % 16 == 0 ? "        %zu," : b % 16 < 15 ? " %zu," : " %zu,\n", entry);
+        }
+    }
+    fprintf(out, "    };\n");
+    if (g->last_line) {
+        // Rows where an unterminated last line matches
+        fprintf(out, "    static const unsigned char last_line[%zu] = {", g->row_count);
+        for (size_t i = 0, r = 0; i < count; i++) {
+            if (g->row[order[i]] != 0) {
+                fprintf(out, r++ == 0 ? "%d" : ", %d", g->table[order[i] * g->stride + (size_t)newline_class] == 0);
+            }
+        }
+        fprintf(out, "};\n");
+    }
+    fprintf(out, "    unsigned d;\n");
+}
+
+// Steps through the table until the input ends or a byte leaves it
+static void emit_table_loop(const generator *g) {
+    FILE *out = g->out;
+    fprintf(out, "table:\n");
+    fprintf(out, "    while (q < stop) {\n        d = next[d + *q++];\n");
+    if (g->exit_count > 0) {
+        fprintf(out, "        if (d >= %zu) {\n            goto leave;\n        }\n", g->row_count * 256);
+    }
+    fprintf(out, "    }\n");
+    if (g->last_line) {
+        fprintf(out, "    return q > (const unsigned char *)p && q[-1] != '\\n' && last_line[d >> 8] ? (const char *)q - 1 : NULL;\n");
+    } else {
+        fprintf(out, "    return NULL;\n");
+    }
+    if (g->exit_count == 0) {
+        return;
+    }
+    fprintf(out, "leave:\n    switch (d) {\n");
+    for (size_t code = 1; code <= g->exit_count; code++) {
+        size_t target = 0;
+        while (g->exit[target] != code) {
+            target++;
+        }
+        if (code < g->exit_count) {
+            fprintf(out, "    case %zu:\n", 256 * (g->row_count + code - 1));
+        } else {
+            fprintf(out, "    default:\n");
+        }
+        emit_target(g, target, "        ");
+    }
+    fprintf(out, "    }\n");
+}
+
+void codegen_header(FILE *out) {
+    fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n\n");
+    // SSE2 is part of x86-64; elsewhere the skip loops compare byte by byte
+    fprintf(out, "#if defined(__GNUC__) && defined(__SSE2__)\n#define SKIP_SSE2 1\n#include <emmintrin.h>\n#endif\n\n");
+}
+
+int codegen_find_line(FILE *out, const char *name, const int32_t *table, size_t stride, size_t state_count,
+                      const unsigned char classmap[256], int32_t start, int32_t dead, int newline_class) {
+    generator g = {out, table, stride, state_count, classmap, NULL, NULL, NULL, 0, 0, 0};
+    size_t *order = malloc(state_count * sizeof(*order));
+    size_t *counts = calloc(state_count, sizeof(*counts));
+    unsigned char *reached = calloc(state_count, 1);
+    g.fallback = malloc(state_count * sizeof(*g.fallback));
+    g.row = calloc(state_count, sizeof(*g.row));
+    g.exit = calloc(state_count, sizeof(*g.exit));
+    int ok = order != NULL && counts != NULL && reached != NULL && g.fallback != NULL && g.row != NULL &&
+             g.exit != NULL;
+
+    // Every state's most common target, then the states reachable from
+    // the start, in the order they are first reached
+    for (size_t s = 1; ok && s < state_count; s++) {
+        size_t best = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t target = next_state(&g, s, b);
+            if (++counts[target] > counts[best] || (counts[target] == counts[best] && target < best)) {
+                best = target;
+            }
+        }
+        for (int b = 0; b < 256; b++) {
+            counts[next_state(&g, s, b)] = 0;
+        }
+        g.fallback[s] = best;
+    }
+    size_t first = (size_t)start / stride;
+    size_t count = 0;
+    if (ok) {
+        order[count++] = first;
+        reached[first] = 1;
+        reached[0] = 1;
+    }
+    for (size_t i = 0; ok && i < count; i++) {
+        for (int b = 0; b < 256; b++) {
+            size_t target = next_state(&g, order[i], b);
+            if (!reached[target]) {
+                reached[target] = 1;
+                order[count++] = target;
+            }
+        }
+    }
+
+    // States that can neither skip ahead nor try a literal go in the
+    // table, and the states the table leaves for get exit codes
+    for (size_t i = 0; ok && i < count; i++) {
+        size_t s = order[i];
+        int exits[CODEGEN_SKIP_BYTES];
+        int bytes[CODEGEN_MAX_CHAIN];
+        int folded[CODEGEN_MAX_CHAIN];
+        size_t at = 0;
+        if (s != (size_t)dead / stride && exit_bytes(&g, s, exits) > CODEGEN_SKIP_BYTES &&
+            chain(&g, s, bytes, folded, &at) < 2) {
+            g.row[s] = ++g.row_count;
+            g.last_line |= table[s * stride + (size_t)newline_class] == 0;
+        }
+    }
+    for (size_t i = 0; ok && i < count; i++) {
+        for (int b = 0; g.row[order[i]] != 0 && b < 256; b++) {
+            size_t target = next_state(&g, order[i], b);
+            if (g.row[target] == 0 && g.exit[target] == 0) {
+                g.exit[target] = ++g.exit_count;
+            }
+        }
+    }
+
+    if (ok) {
+        fprintf(out, "static const char *%s(const char *p, const char *end) {\n", name);
+    }
+    if (ok && first == 0) {
+        // Every line matches, even an empty one
+        fprintf(out, "    return p < end ? p : NULL;\n");
+        count = 0;
+    } else if (ok) {
+        if (g.row_count > 0) {
+            emit_table(&g, order, count, newline_class);
+        }
+        fprintf(out, "    const unsigned char *q = (const unsigned char *)p;\n");
+        fprintf(out, "    const unsigned char *stop = (const unsigned char *)end;\n\n");
+        emit_target(&g, first, "    ");
+    }
+    for (size_t i = 0; ok && i < count; i++) {
+        size_t s = order[i];
+        if (s == (size_t)dead / stride) {
+            // Nothing can match before the next line starts
+            fprintf(out, "s%zu:\n", s);
+            fprintf(out, "    q = memchr(q, '\\n', (size_t)(stop - q));\n");
+            fprintf(out, "    if (q == NULL) {\n        return NULL;\n    }\n");
+            fprintf(out, "    q++;\n");
+            emit_target(&g, first, "    ");
+        } else if (g.row[s] == 0) {
+            emit_state(&g, s, newline_class);
+        }
+    }
+    if (ok && count > 0 && g.row_count > 0) {
+        emit_table_loop(&g);
+    }
+    if (ok) {
+        fprintf(out, "}\n");
+    }
+    free(order);
+    free(counts);
+    free(reached);
+    free(g.fallback);
+    free(g.row);
+    free(g.exit);
+    return ok && !ferror(out);
+}
@@ -0,0 +1,24 @@
+/*
+ * codegen.h - C source for a frozen DFA
+ */
+
+#ifndef SS_CODEGEN_H
+#define SS_CODEGEN_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes `static const char *name(const char *p, const char *end)`, a C
+// function that does what automaton_find_line() does for one complete
+// DFA. The table is laid out as for jit_compile(); `dead` is the row
+// offset of the state that waits for the next line, and `newline_class`
+// is looked up to decide whether an unterminated last line matches.
+// Returns 0 if writing failed or memory ran out.
+int codegen_find_line(FILE *out, const char *name, const int32_t *table, size_t stride, size_t state_count,
+                      const unsigned char classmap[256], int32_t start, int32_t dead, int newline_class);
+
+// The #includes the functions need, once per file
+void codegen_header(FILE *out);
+
+#endif
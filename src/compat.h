@@ -0,0 +1,258 @@
+/*
+ * compat.h - Platform shims
+ *
+ * The wrapper was written against the MSVC/MinGW runtime (_isatty, _popen,
+ * _tempnam). This header maps those names onto POSIX so the same sources
+ * build on Linux, which is where the benchmark suite runs.
+ *
+ * Must be included before any system header.
+ */
+
+#ifndef SS_COMPAT_H
+#define SS_COMPAT_H
+
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#ifdef _WIN32
+
+#include <io.h>
+
+#define NULL_DEVICE "nul"
+
+#define ss_open _open
+#define ss_read _read
+#define ss_write _write
+#define ss_close _close
+
+#ifndef O_BINARY
+#define O_BINARY _O_BINARY
+#endif
+
+static inline int ss_cpu_count(void) {
+    const char *count = getenv("NUMBER_OF_PROCESSORS");
+    int n = count != NULL ? atoi(count) : 0;
+    return n > 0 ? n : 1;
+}
+
+// The backend with its stdout on a pipe. Windows has no portable way to
+// kill a _popen() child, so it stops when its next write fails instead.
+typedef struct {
+    int out;
+    FILE *pipe;
+} ss_process;
+
+static inline int ss_spawn(const char *command, ss_process *p) {
+    p->pipe = _popen(command, "r");
+    p->out = p->pipe != NULL ? _fileno(p->pipe) : -1;
+    return p->pipe != NULL;
+}
+
+static inline void ss_kill(ss_process *p) {
+    (void)p;
+}
+
+static inline int ss_wait(ss_process *p) {
+    return _pclose(p->pipe);
+}
+
+// No poll() on pipes; closed output shows up as a failed write
+static inline int ss_output_closed(int fd) {
+    (void)fd;
+    return 0;
+}
+
+static inline int ss_wait_readable(int fd, int watch) {
+    (void)fd;
+    (void)watch;
+    return 1;
+}
+
+static inline int ss_input_pending(int fd) {
+    (void)fd;
+    return 0;
+}
+
+#else
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define NULL_DEVICE "/dev/null"
+
+#define ss_open open
+#define ss_read read
+#define ss_write write
+#define ss_close close
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define _isatty isatty
+#define _fileno fileno
+#define _popen popen
+#define _pclose ss_pclose
+#define _tempnam ss_tempnam
+
+static inline int ss_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// The backend with its stdout on a pipe. Unlike popen(), we keep the pid
+// so the backend can be killed when nobody reads our output any more.
+typedef struct {
+    int out;
+    pid_t pid;
+} ss_process;
+
+static inline int ss_spawn(const char *command, ss_process *p) {
+    // "exec" makes the shell replace itself, so the pid is the backend's
+    size_t size = strlen(command) + sizeof("exec ");
+    char *script = malloc(size);
+    int fds[2];
+    if (script == NULL) {
+        return 0;
+    }
+    snprintf(script, size, "exec %s", command);
+    if (pipe(fds) != 0) {
+        free(script);
+        return 0;
+    }
+    p->pid = fork();
+    if (p->pid == 0) {
+        dup2(fds[1], 1);
+        close(fds[0]);
+        close(fds[1]);
+        // main() ignores SIGPIPE and exec keeps it ignored; the backend
+        // and what it pipes to should die quietly when their reader goes,
+        // not get EPIPE write errors
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", script, (char *)NULL);
+        _exit(127);
+    }
+    free(script);
+    close(fds[1]);
+    if (p->pid < 0) {
+        close(fds[0]);
+        return 0;
+    }
+    p->out = fds[0];
+    return 1;
+}
+
+static inline void ss_kill(ss_process *p) {
+    kill(p->pid, SIGTERM);
+}
+
+// Closes the pipe and returns the exit code, like _pclose()
+static inline int ss_wait(ss_process *p) {
+    int status;
+    close(p->out);
+    while (waitpid(p->pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+// True once the reader of a pipe (or terminal) has gone away
+static inline int ss_output_closed(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = 0;
+    p.revents = 0;
+    return poll(&p, 1, 0) > 0 && (p.revents & (POLLERR | POLLHUP)) != 0;
+}
+
+// True if `fd` has input (or EOF) waiting, without blocking
+static inline int ss_input_pending(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    return poll(&p, 1, 0) > 0 && p.revents != 0;
+}
+
+// Waits until `fd` is readable (or at EOF). Returns 0 instead if the
+// reader of `watch` goes away first.
+static inline int ss_wait_readable(int fd, int watch) {
+    struct pollfd p[2];
+    p[0].fd = fd;
+    p[0].events = POLLIN;
+    p[1].fd = watch;
+    p[1].events = 0;
+    for (;;) {
+        p[0].revents = p[1].revents = 0;
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        if (p[1].revents & (POLLERR | POLLHUP)) {
+            return 0;
+        }
+        if (p[0].revents != 0) {
+            return 1;
+        }
+    }
+}
+
+// pclose() returns a wait status; _pclose() returns the exit code
+static inline int ss_pclose(FILE *pipe) {
+    int status = pclose(pipe);
+    if (status == -1) {
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+// tempnam() triggers a linker warning on glibc, so reserve the name with
+// mkstemp() instead. Like _tempnam(), the result is malloc'd by us.
+static inline char *ss_tempnam(const char *dir, const char *prefix) {
+    if (dir == NULL) {
+        dir = getenv("TMPDIR");
+    }
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+
+    size_t size = strlen(dir) + strlen(prefix) + sizeof("/XXXXXX");
+    char *path = malloc(size);
+    if (path == NULL) {
+        return NULL;
+    }
+    snprintf(path, size, "%s/%sXXXXXX", dir, prefix);
+
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        free(path);
+        return NULL;
+    }
+    close(fd);
+    return path;
+}
+
+#endif
+
+#endif
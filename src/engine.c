@@ -0,0 +1,1332 @@
+/*
+ * engine.c - Native Select-String engine, command-line side
+ *
+ * Runs a query through libselectstring (selectstring.c) and prints what it
+ * selects the way MatchInfo.ToString() does: "path:line:text" for files,
+ * the bare line for piped input, and "> "/"  " prefixes when -Context is
+ * used. Also expands -Path wildcards and spreads files over --threads.
+ *
+ * With --format ndjson or binary, each output line becomes a record
+ * written straight into the output buffer: path, line number, offset,
+ * and for matches the pattern index and match spans.
+ */
+
+#include "compat.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <glob.h>
+#include <setjmp.h>
+#include <signal.h>
+#endif
+
+#include "arena.h"
+#include "budget.h"
+#include "engine.h"
+#include "numa.h"
+#include "selectstring.h"
+#include "stats.h"
+#include "trace.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define MAX_READ_CHUNK (1 << 30)
+#define PLACEMENT_MIN_SIZE (1 << 20)
+
+// --max-memory: the smallest share a thread is worth starting for, and
+// the most of it that goes to the read buffer unless --read-buffer asks
+// for more
+#define MIN_THREAD_MEMORY (256 * 1024)
+#define MAX_READ_SHARE (256 * 1024)
+#define MIN_DFA_CACHE (16 * 1024)
+
+// --cache-policy direct: the read size without --read-buffer. O_DIRECT
+// reads get no readahead, so each one should keep the disk busy a while.
+#define DIRECT_READ_BUFFER (4 << 20)
+
+// ---------------------------------------------------------------------------
+// File list
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char **items;
+    size_t count;
+    size_t cap;
+} string_list;
+
+static int list_push(string_list *list, char *item) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 8;
+        char **items = realloc(list->items, cap * sizeof(*items));
+        if (items == NULL) {
+            return 0;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count++] = item;
+    return 1;
+}
+
+static void list_free(string_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// ---------------------------------------------------------------------------
+// Output
+// ---------------------------------------------------------------------------
+
+// Where output goes: stdout, or a server client's socket as frames. Once
+// it fails (or the client cancels) every writer stops.
+typedef struct {
+    int fd;
+    int framed;
+    int cancel_fd;              // readable input cancels; -1 for none
+    int failed;                 // output is gone, or ran out of memory
+    int closed;                 // ...because its reader went away, which is not an error
+    int cancelled;              // ...because a newer request arrived
+    pthread_mutex_t lock;       // frames from different threads must not interleave
+} sink;
+
+// A streaming buffer goes to the sink whenever it fills. A block buffer
+// grows instead and holds one file's results until the file is done, so a
+// worker writes each file with one write and lines never interleave.
+typedef struct {
+    sink *sink;
+    char *data;
+    size_t len;
+    size_t cap;
+    int stream;
+    size_t *marks;              // where each match ends, for --first on ordered blocks
+    size_t mark_count;
+    size_t mark_cap;
+} output;
+
+// Engine flags are shared with the workers
+static int flag_get(const int *flag) {
+    return __atomic_load_n(flag, __ATOMIC_RELAXED);
+}
+
+static void flag_set(int *flag) {
+    if (!flag_get(flag)) {
+        __atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static size_t write_all(sink *k, const char *data, size_t len) {
+    size_t done = 0;
+    while (done < len && !flag_get(&k->failed)) {
+        size_t chunk = len - done;
+        if (chunk > MAX_READ_CHUNK) {
+            chunk = MAX_READ_CHUNK;
+        }
+        long n = (long)ss_write(k->fd, data + done, (unsigned)chunk);
+        stats_add(&stats.write_calls, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+                flag_set(&k->closed);
+            }
+            if (!__atomic_exchange_n(&k->failed, 1, __ATOMIC_RELAXED) && !flag_get(&k->closed)) {
+                fprintf(stderr, "Error: Failed to write output to %s\n", k->framed ? "client" : "stdout");
+            }
+            break;
+        }
+        done += (size_t)n;
+    }
+    stats_add(&stats.bytes_written, (long long)done);
+    return done;
+}
+
+// One frame: u32 length of kind and payload, kind, payload
+static int write_frame(sink *k, int kind, const char *data, size_t len) {
+    unsigned char header[5];
+    unsigned long size = (unsigned long)len + 1;
+    for (int i = 0; i < 4; i++) {
+        header[i] = (unsigned char)(size >> (8 * i));
+    }
+    header[4] = (unsigned char)kind;
+    pthread_mutex_lock(&k->lock);
+    int ok = write_all(k, (const char *)header, sizeof(header)) == sizeof(header) &&
+             write_all(k, data, len) == len;
+    pthread_mutex_unlock(&k->lock);
+    return ok;
+}
+
+static int sink_write(sink *k, const char *data, size_t len) {
+    stats_enter(PHASE_OUTPUT);
+    stats_first_output();
+    unsigned long long span = trace_begin();
+    size_t done = k->framed ? (write_frame(k, ENGINE_FRAME_OUTPUT, data, len) ? len : 0)
+                            : write_all(k, data, len);
+    trace_end("write", span, NULL, (long long)done);
+    stats_leave();
+    return !flag_get(&k->failed);
+}
+
+// "Error: ..." to stderr, or to the client
+static void sink_error(sink *k, const char *format, ...) {
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if (!k->framed) {
+        fprintf(stderr, "Error: %s\n", message);
+        return;
+    }
+    char line[sizeof(message) + 16];
+    n = snprintf(line, sizeof(line), "Error: %s\n", message);
+    write_frame(k, ENGINE_FRAME_ERROR, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+}
+
+// Only the first failure is reported; the rest follow from it
+static void sink_fail(sink *k, const char *message) {
+    if (!__atomic_exchange_n(&k->failed, 1, __ATOMIC_RELAXED)) {
+        sink_error(k, "%s", message);
+    }
+}
+
+// Checked between reads, so a search stops as soon as its output is no
+// longer read (`| head`), even while it has nothing to write. A server
+// query also stops when its client sends the next request.
+static int output_gone(sink *k) {
+    if (!flag_get(&k->failed) && ss_output_closed(k->fd)) {
+        flag_set(&k->closed);
+        flag_set(&k->failed);
+    }
+    if (!flag_get(&k->failed) && k->cancel_fd >= 0 && ss_input_pending(k->cancel_fd)) {
+        flag_set(&k->cancelled);
+        flag_set(&k->closed);
+        flag_set(&k->failed);
+    }
+    return flag_get(&k->failed);
+}
+
+static int out_flush(output *o) {
+    if (o->len == 0) {
+        return !flag_get(&o->sink->failed);
+    }
+    int ok = sink_write(o->sink, o->data, o->len);
+    o->len = 0;
+    return ok;
+}
+
+static int out_grow(output *o) {
+    size_t cap = o->cap == 0 ? OUTPUT_BUFFER_SIZE : o->cap * 2;
+    char *data = realloc(o->data, cap);
+    if (data == NULL) {
+        sink_fail(o->sink, "Out of memory");
+        return 0;
+    }
+    o->data = data;
+    o->cap = cap;
+    stats_add(&stats.scan_allocs, 1);
+    return 1;
+}
+
+static void out_write(output *o, const char *s, size_t len) {
+    while (len > 0 && !flag_get(&o->sink->failed)) {
+        size_t room = o->cap - o->len;
+        if (room == 0) {
+            if (o->stream && o->len > 0) {
+                out_flush(o);
+            } else if (!out_grow(o)) {
+                return;
+            }
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(o->data + o->len, s, n);
+        o->len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+static void out_mark(output *o) {
+    if (o->mark_count == o->mark_cap) {
+        size_t cap = o->mark_cap == 0 ? 16 : o->mark_cap * 2;
+        size_t *marks = realloc(o->marks, cap * sizeof(*marks));
+        if (marks == NULL) {
+            sink_fail(o->sink, "Out of memory");
+            return;
+        }
+        o->marks = marks;
+        o->mark_cap = cap;
+        stats_add(&stats.scan_allocs, 1);
+    }
+    o->marks[o->mark_count++] = o->len;
+}
+
+static void out_number(output *o, long long value) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    char text[24];
+    for (int i = 0; i < n; i++) {
+        text[i] = digits[n - 1 - i];
+    }
+    out_write(o, text, (size_t)n);
+}
+
+// ---------------------------------------------------------------------------
+// Printing
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    ss_query *query;
+    const ss_query_info *info;
+    engine_options opt;
+    sink sink;
+    string_list files;          // -Path and -LiteralPath after expansion, as given
+    int has_context;
+    int flush_each;             // interactive on a terminal, ours or a client's
+    int any_match;
+    int errors;
+    int stop;
+    long long file_limit;       // matches per file, 0 for no limit
+    long long matched;          // matches counted against --first
+
+    // --threads: workers claim files in list order. Unless --unordered,
+    // each finished file's block waits until every earlier one is written.
+    size_t next_file;
+    size_t next_block;
+    output *blocks;
+    unsigned char *ready;
+    output *spares;             // written blocks kept for the next files
+    size_t spare_count;
+    pthread_mutex_t lock;
+
+    // --max-memory and --read-buffer: what each thread's scratch is
+    // sized to, and the bytes parked blocks may hold before workers that
+    // are ahead wait
+    size_t read_size;           // 0 for the default
+    size_t dfa_cache;
+    size_t reorder_limit;
+    size_t block_limit;         // a file still being searched, per thread
+    size_t parked;
+    pthread_cond_t room;
+
+    // NUMA placement: workers are pinned to a node and take the files
+    // whose cached pages are in that node's memory first. The queue holds
+    // file indexes grouped by node, then a group of files with no home.
+    numa_topology *topology;    // NULL when threads are not pinned
+    size_t *queue;
+    size_t *queue_end;          // per group
+    size_t *queue_next;         // per group, claimed with an atomic add
+    int groups;
+} engine;
+
+// One searching thread with its own scratch context
+typedef struct {
+    engine *e;
+    ss_scratch *scratch;
+    ss_handler handler;
+    output out;
+    const char *name;           // the file being searched, as given
+    size_t index;               // ...and its place in the file list
+    long long file_matches;     // in the file being searched
+    int claimed;                // --first slot taken for the match being printed
+    int own_scratch;
+    int node;                   // topology node it is pinned to, -1 for none
+    arena arena;                // reset per file
+    pthread_t thread;
+} worker;
+
+static void count_error(engine *e) {
+    __atomic_fetch_add(&e->errors, 1, __ATOMIC_RELAXED);
+}
+
+static void out_str(output *o, const char *s) {
+    out_write(o, s, strlen(s));
+}
+
+// Little-endian fields for the binary format
+static void out_u32(output *o, unsigned long value) {
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    out_write(o, (const char *)bytes, 4);
+}
+
+static void out_u64(output *o, unsigned long long value) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    out_write(o, (const char *)bytes, 8);
+}
+
+// Copies the text between escapes in one piece. Bytes that are not valid
+// UTF-8 are passed through as they are.
+static void out_json_string(output *o, const char *s, size_t len) {
+    static const char HEX[] = "0123456789abcdef";
+    size_t run = 0;
+    out_write(o, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out_write(o, s + run, i - run);
+        run = i + 1;
+        switch (c) {
+        case '"': out_write(o, "\\\"", 2); break;
+        case '\\': out_write(o, "\\\\", 2); break;
+        case '\t': out_write(o, "\\t", 2); break;
+        case '\r': out_write(o, "\\r", 2); break;
+        case '\n': out_write(o, "\\n", 2); break;
+        default: {
+            char escape[6] = {'\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 15]};
+            out_write(o, escape, 6);
+            break;
+        }
+        }
+    }
+    out_write(o, s + run, len - run);
+    out_write(o, "\"", 1);
+}
+
+// {"type":"match","path":"a.log","line":3,"offset":120,"text":"...",
+//  "pattern":0,"spans":[[4,9]]}; context lines have "type":"context" and
+// no pattern or spans
+static void emit_json(output *o, const ss_line *line, int pattern, const ss_span *spans,
+                      size_t span_count) {
+    int is_match = line->kind == SS_LINE_MATCH;
+    out_str(o, is_match ? "{\"type\":\"match\",\"path\":" : "{\"type\":\"context\",\"path\":");
+    if (line->path != NULL) {
+        out_json_string(o, line->path, strlen(line->path));
+    } else {
+        out_str(o, "null");
+    }
+    out_str(o, ",\"line\":");
+    out_number(o, line->number);
+    out_str(o, ",\"offset\":");
+    out_number(o, line->offset);
+    out_str(o, ",\"text\":");
+    out_json_string(o, line->text, line->len);
+    if (is_match) {
+        out_str(o, ",\"pattern\":");
+        if (pattern >= 0) {
+            out_number(o, pattern);
+        } else {
+            out_str(o, "null");
+        }
+        out_str(o, ",\"spans\":[");
+        for (size_t i = 0; i < span_count; i++) {
+            out_str(o, i > 0 ? ",[" : "[");
+            out_number(o, (long long)spans[i].start);
+            out_str(o, ",");
+            out_number(o, (long long)spans[i].end);
+            out_str(o, "]");
+        }
+        out_str(o, "]");
+    }
+    out_str(o, "}\n");
+}
+
+static void emit_binary(output *o, const ss_line *line, int pattern, const ss_span *spans,
+                        size_t span_count) {
+    size_t name_len = line->path != NULL ? strlen(line->path) : 0;
+    size_t size = 1 + 4 + 8 + 8 + 4 + name_len + 4 + line->len + 4 + span_count * 8;
+    unsigned char kind = line->kind == SS_LINE_MATCH ? 1 : 2;
+    out_u32(o, (unsigned long)size);
+    out_write(o, (const char *)&kind, 1);
+    out_u32(o, (unsigned long)(long)pattern);
+    out_u64(o, (unsigned long long)line->number);
+    out_u64(o, (unsigned long long)line->offset);
+    out_u32(o, (unsigned long)name_len);
+    out_write(o, line->path, name_len);
+    out_u32(o, (unsigned long)line->len);
+    out_write(o, line->text, line->len);
+    out_u32(o, (unsigned long)span_count);
+    for (size_t i = 0; i < span_count; i++) {
+        out_u32(o, (unsigned long)spans[i].start);
+        out_u32(o, (unsigned long)spans[i].end);
+    }
+}
+
+static void emit_line(worker *w, const ss_line *found) {
+    const engine *e = w->e;
+    output *o = &w->out;
+    // Reported under the name it was given, which differs from the path
+    // opened when the server resolves it against the client's directory
+    ss_line shown = *found;
+    const ss_line *line = &shown;
+    shown.path = w->name;
+    int is_match = line->kind == SS_LINE_MATCH;
+    if (e->opt.format != ENGINE_FORMAT_TEXT) {
+        int pattern;
+        const ss_span *spans;
+        size_t span_count = ss_line_spans(w->scratch, found, &pattern, &spans);
+        if (e->opt.format == ENGINE_FORMAT_NDJSON) {
+            emit_json(o, line, pattern, spans, span_count);
+        } else {
+            emit_binary(o, line, pattern, spans, span_count);
+        }
+        if (e->flush_each) {
+            out_flush(o);
+        }
+        return;
+    }
+
+    if (e->info->raw) {
+        if (is_match) {
+            out_write(o, line->text, line->len);
+            out_write(o, "\n", 1);
+        }
+        return;
+    }
+    if (e->has_context) {
+        out_write(o, is_match ? "> " : "  ", 2);
+    }
+    if (line->path != NULL) {
+        out_write(o, line->path, strlen(line->path));
+        out_write(o, ":", 1);
+        out_number(o, line->number);
+        out_write(o, ":", 1);
+    }
+    out_write(o, line->text, line->len);
+    out_write(o, "\n", 1);
+    if (e->flush_each) {
+        out_flush(o);
+    }
+}
+
+// --first: each match takes a slot from the shared count, and the last
+// slot stops every worker. The slot is taken at the first line printed
+// for the match, its leading context included. Ordered blocks are counted
+// as they are written instead, since workers finish files out of order.
+// Returns -1 when the limit is already reached, 1 for the last slot.
+static int claim_slot(worker *w) {
+    engine *e = w->e;
+    if (e->opt.first == 0 || e->blocks != NULL || w->claimed) {
+        return 0;
+    }
+    long long n = __atomic_add_fetch(&e->matched, 1, __ATOMIC_RELAXED);
+    if (n > e->opt.first) {
+        return -1;
+    }
+    w->claimed = n == e->opt.first ? 2 : 1;
+    return 0;
+}
+
+// Line callback: prints the line, and decides when the file is done
+static int on_line(void *user, const ss_line *line) {
+    worker *w = user;
+    engine *e = w->e;
+    if (line->kind != SS_LINE_AFTER && claim_slot(w) < 0) {
+        return 1;
+    }
+    if (line->kind != SS_LINE_MATCH) {
+        if (!e->info->quiet) {
+            emit_line(w, line);
+        }
+        return flag_get(&e->stop) || flag_get(&e->sink.failed);
+    }
+
+    int last = w->claimed == 2;
+    w->claimed = 0;
+    flag_set(&e->any_match);
+    stats_add(&stats.matches, 1);
+    w->file_matches++;
+    if (e->info->quiet) {
+        flag_set(&e->stop);
+        return 1;
+    }
+    emit_line(w, line);
+    if (e->blocks != NULL && e->opt.first > 0) {
+        out_mark(&w->out);
+    }
+    if (last) {
+        flag_set(&e->stop);
+    }
+    return last || (e->file_limit > 0 && w->file_matches >= e->file_limit) ||
+           flag_get(&e->stop) || flag_get(&e->sink.failed);
+}
+
+static int on_progress(void *user, long long bytes) {
+    worker *w = user;
+    engine *e = w->e;
+    (void)bytes;
+    // Under --max-memory a worker that is ahead stops once its block
+    // outgrows its part of the reorder buffer, and the earliest file's
+    // block goes out as it fills: nothing before it is left to write. Not
+    // with --first, which may still cut the block short.
+    if (e->reorder_limit > 0 && !w->out.stream && w->out.len >= OUTPUT_BUFFER_SIZE) {
+        pthread_mutex_lock(&e->lock);
+        if (e->next_block != w->index && w->out.cap > e->block_limit) {
+            stats_add(&stats.reorder_waits, 1);
+            while (e->next_block != w->index && !flag_get(&e->stop) && !flag_get(&e->sink.failed)) {
+                pthread_cond_wait(&e->room, &e->lock);
+            }
+        }
+        if (e->next_block == w->index && e->opt.first == 0) {
+            out_flush(&w->out);
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
+    return flag_get(&e->stop) || output_gone(&e->sink);
+}
+
+// ---------------------------------------------------------------------------
+// Inputs
+// ---------------------------------------------------------------------------
+
+// The path to open for a name as given: the name itself, or for the
+// server a path under the client's directory, in `a` or malloc'd when it
+// is NULL. NULL if out of memory.
+static char *file_path(const engine *e, const char *name, arena *a) {
+    if (e->opt.dir == NULL || name[0] == '/') {
+        return (char *)name;
+    }
+    size_t size = strlen(e->opt.dir) + strlen(name) + 2;
+    char *path = a != NULL ? arena_alloc(a, size) : malloc(size);
+    if (path != NULL) {
+        snprintf(path, size, "%s/%s", e->opt.dir, name);
+    }
+    return path;
+}
+
+#ifndef _WIN32
+// A mapped file that is truncated while it is searched (logrotate's
+// copytruncate, `> file`) raises SIGBUS on the pages past its new end.
+// The thread scanning it jumps back to scan_mapped(); a SIGBUS anywhere
+// else still ends the process.
+static THREAD_LOCAL sigjmp_buf *bus_escape;
+static pthread_once_t bus_once = PTHREAD_ONCE_INIT;
+
+static void on_sigbus(int sig) {
+    if (bus_escape == NULL) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    siglongjmp(*bus_escape, 1);
+}
+
+static void install_sigbus(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigbus;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+// Scans a mapping, or returns 0 if the file shrank under the scan. Lines
+// found before that have been printed; the rest of the file is gone.
+static int scan_mapped(worker *w, const char *data, size_t len, const char *path, int *result) {
+    sigjmp_buf escape;
+    pthread_once(&bus_once, install_sigbus);
+    if (sigsetjmp(escape, 1) != 0) {
+        bus_escape = NULL;
+        return 0;
+    }
+    bus_escape = &escape;
+    *result = ss_scan_buffer(w->scratch, data, len, path, &w->handler);
+    bus_escape = NULL;
+    return 1;
+}
+#else
+static int scan_mapped(worker *w, const char *data, size_t len, const char *path, int *result) {
+    *result = ss_scan_buffer(w->scratch, data, len, path, &w->handler);
+    return 1;
+}
+#endif
+
+static int scan_file(worker *w, const char *path) {
+    engine *e = w->e;
+    const engine_files *files = e->opt.files;
+    // The server's mappings stay in the page cache on purpose; a query
+    // that asks to stay out of it reads the file itself
+    if (files != NULL && e->opt.cache_policy == SS_CACHE_NORMAL && ss_path_selected(e->query, path)) {
+        size_t len;
+        void *handle;
+        const char *data = files->open(files->user, path, &len, &handle);
+        if (data != NULL) {
+            int result;
+            if (!scan_mapped(w, data, len, path, &result)) {
+                sink_error(&e->sink, "Cannot read '%s': The file was truncated while it was searched",
+                           w->name);
+                count_error(e);
+                result = SS_OK;
+            }
+            files->close(files->user, handle);
+            return result;
+        }
+    }
+    return ss_scan_path(w->scratch, path, &w->handler);
+}
+
+// Searches a file from the list, or piped input when `name` is NULL
+static void scan_input(worker *w, int fd, const char *name) {
+    engine *e = w->e;
+    // Small files are read in one go and never reach the progress
+    // callback, so a server query looks for a newer request between files
+    if (e->sink.cancel_fd >= 0 && output_gone(&e->sink)) {
+        return;
+    }
+    w->name = name;
+    w->file_matches = 0;
+    w->claimed = 0;
+    int result;
+    char *path = NULL;
+    if (name == NULL) {
+        result = ss_scan_fd(w->scratch, fd, NULL, &w->handler);
+    } else {
+        arena_reset(&w->arena);
+        path = file_path(e, name, &w->arena);
+        if (path == NULL) {
+            sink_error(&e->sink, "Out of memory");
+            count_error(e);
+            return;
+        }
+        result = scan_file(w, path);
+    }
+    if (result == SS_ERROR) {
+        if (!flag_get(&e->sink.failed)) {
+            // Name the file the way the client did
+            const char *message = ss_error(w->scratch);
+            const char *at = path != name ? strstr(message, path) : NULL;
+            if (at != NULL) {
+                sink_error(&e->sink, "%.*s%s%s", (int)(at - message), message, name, at + strlen(path));
+            } else {
+                sink_error(&e->sink, "%s", message);
+            }
+        }
+        count_error(e);
+    }
+}
+
+static int add_file(engine *e, const char *path) {
+    size_t len = strlen(path);
+    char *copy = malloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, path, len + 1);
+    }
+    if (copy == NULL || !list_push(&e->files, copy)) {
+        free(copy);
+        sink_error(&e->sink, "Out of memory");
+        return 0;
+    }
+    return 1;
+}
+
+static int expand_wildcard(engine *e, const char *pattern) {
+#ifndef _WIN32
+    if (strpbrk(pattern, "*?[") != NULL) {
+        char *path = file_path(e, pattern, NULL);
+        if (path == NULL) {
+            sink_error(&e->sink, "Out of memory");
+            return 0;
+        }
+        // Matches under the client's directory are listed relative to it
+        size_t skip = path != pattern ? strlen(e->opt.dir) + 1 : 0;
+        glob_t matches;
+        int ok = 1;
+        // No match is not an error for a wildcard, just like PowerShell
+        if (glob(path, 0, NULL, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc && ok; i++) {
+                ok = add_file(e, matches.gl_pathv[i] + skip);
+            }
+        }
+        globfree(&matches);
+        if (path != pattern) {
+            free(path);
+        }
+        return ok;
+    }
+#endif
+    return add_file(e, pattern);
+}
+
+typedef struct {
+    char *path;
+    long long size;
+    long long mtime;
+    size_t size_rank;
+    size_t mtime_rank;
+    size_t index;
+} file_rank;
+
+static int by_size(const void *a, const void *b) {
+    const file_rank *x = a, *y = b;
+    return (x->size > y->size) - (x->size < y->size);
+}
+
+static int by_mtime_newest(const void *a, const void *b) {
+    const file_rank *x = a, *y = b;
+    return (x->mtime < y->mtime) - (x->mtime > y->mtime);
+}
+
+static int by_score(const void *a, const void *b) {
+    const file_rank *x = a, *y = b;
+    size_t sx = x->size_rank + x->mtime_rank;
+    size_t sy = y->size_rank + y->mtime_rank;
+    if (sx != sy) {
+        return sx < sy ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Puts the files most likely to answer quickly first: small ones scan
+// fast and recently modified ones are what the user is usually after.
+// Each file is ranked on both and they are searched by the rank sum.
+static int order_for_latency(engine *e) {
+    size_t count = e->files.count;
+    file_rank *ranks = malloc(count * sizeof(*ranks));
+    if (ranks == NULL) {
+        sink_error(&e->sink, "Out of memory");
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct stat info;
+        ranks[i].path = e->files.items[i];
+        ranks[i].index = i;
+        char *path = file_path(e, ranks[i].path, NULL);
+        int found = path != NULL && stat(path, &info) == 0;
+        if (path != ranks[i].path) {
+            free(path);
+        }
+        if (found) {
+            ranks[i].size = (long long)info.st_size;
+            ranks[i].mtime = (long long)info.st_mtime;
+        } else {
+            // Report missing files early rather than last
+            ranks[i].size = -1;
+            ranks[i].mtime = 0;
+        }
+    }
+    qsort(ranks, count, sizeof(*ranks), by_size);
+    for (size_t i = 0; i < count; i++) {
+        ranks[i].size_rank = i;
+    }
+    qsort(ranks, count, sizeof(*ranks), by_mtime_newest);
+    for (size_t i = 0; i < count; i++) {
+        ranks[i].mtime_rank = i;
+    }
+    qsort(ranks, count, sizeof(*ranks), by_score);
+    for (size_t i = 0; i < count; i++) {
+        e->files.items[i] = ranks[i].path;
+    }
+    free(ranks);
+    return 1;
+}
+
+// Ends a file of a fan-out shard: its output, then how many matches it had
+static void end_shard_file(worker *w) {
+    unsigned char payload[8];
+    for (int i = 0; i < 8; i++) {
+        payload[i] = (unsigned char)((unsigned long long)w->file_matches >> (8 * i));
+    }
+    if (out_flush(&w->out)) {
+        write_frame(&w->e->sink, ENGINE_FRAME_FILE, (const char *)payload, sizeof(payload));
+    }
+}
+
+// What this shard's search added to the counters, for the coordinator
+static void send_shard_stats(engine *e) {
+    unsigned char payload[8 * STATS_SEARCH_COUNTERS];
+    for (int i = 0; i < STATS_SEARCH_COUNTERS; i++) {
+        unsigned long long value = (unsigned long long)*stats_search_counters[i];
+        for (int j = 0; j < 8; j++) {
+            payload[8 * i + j] = (unsigned char)(value >> (8 * j));
+        }
+    }
+    write_frame(&e->sink, ENGINE_FRAME_STATS, (const char *)payload, sizeof(payload));
+}
+
+// ---------------------------------------------------------------------------
+// Workers
+// ---------------------------------------------------------------------------
+
+// Sets a scratch context's --cache-policy, and sizes one the engine made
+// for --read-buffer and its --max-memory share. The server's own scratch
+// keeps its size for the queries after this one; each query sets the
+// policy.
+static void tune_scratch(worker *w) {
+    if (w->scratch != NULL) {
+        ss_scratch_cache_policy(w->scratch, w->e->opt.cache_policy);
+    }
+    if (w->own_scratch && w->scratch != NULL && w->e->read_size > 0) {
+        ss_scratch_limit(w->scratch, w->e->read_size, w->e->dfa_cache);
+    }
+}
+
+// `scratch` may be one lent by the caller, or NULL for a new one
+static int worker_init(worker *w, engine *e, ss_scratch *scratch) {
+    memset(w, 0, sizeof(*w));
+    w->e = e;
+    w->out.sink = &e->sink;
+    w->own_scratch = scratch == NULL;
+    w->node = -1;
+    w->handler.line = on_line;
+    w->handler.progress = on_progress;
+    w->handler.user = w;
+    // A pinned worker makes its own once it runs on its node, so that the
+    // buffers it touches first are in that node's memory
+    w->scratch = scratch != NULL || e->topology != NULL ? scratch : ss_scratch_new(e->query);
+    if (w->scratch == NULL && e->topology == NULL) {
+        sink_error(&e->sink, "Out of memory");
+        return 0;
+    }
+    tune_scratch(w);
+    return 1;
+}
+
+static void worker_free(worker *w) {
+    if (w->own_scratch) {
+        ss_scratch_free(w->scratch);
+    }
+    free(w->out.data);
+    free(w->out.marks);
+    arena_free(&w->arena);
+}
+
+// Keeps a written block's buffers for the next file a worker starts,
+// which then needs no allocation. There are never more spares than
+// blocks were parked at once. Under --max-memory only buffers that never
+// grew are kept, so the spares stay within the budget.
+static void recycle_block(engine *e, output *block) {
+    if (e->reorder_limit == 0 || block->cap <= OUTPUT_BUFFER_SIZE) {
+        block->len = 0;
+        block->mark_count = 0;
+        e->spares[e->spare_count++] = *block;
+    } else {
+        free(block->data);
+        free(block->marks);
+    }
+    memset(block, 0, sizeof(*block));
+}
+
+// Writes a finished file's results. Unordered blocks go out at once; in
+// order, the block is parked and whoever completes the earliest missing
+// file writes every block that is now ready.
+static void finish_block(worker *w, size_t index) {
+    engine *e = w->e;
+    if (e->opt.unordered) {
+        if (w->out.len > 0) {
+            pthread_mutex_lock(&e->lock);
+            out_flush(&w->out);
+            pthread_mutex_unlock(&e->lock);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    // Under --max-memory a worker that is ahead holds on to its block
+    // while the parked ones fill the reorder buffer. The earliest file is
+    // never held, and the worker with it writes the rest out.
+    if (e->reorder_limit > 0 && index != e->next_block && e->parked > 0 &&
+        e->parked + w->out.cap > e->reorder_limit) {
+        stats_add(&stats.reorder_waits, 1);
+        while (index != e->next_block && e->parked > 0 && e->parked + w->out.cap > e->reorder_limit &&
+               !flag_get(&e->stop) && !flag_get(&e->sink.failed)) {
+            pthread_cond_wait(&e->room, &e->lock);
+        }
+    }
+    e->blocks[index] = w->out;
+    e->ready[index] = 1;
+    e->parked += w->out.cap;
+    memset(&w->out, 0, sizeof(w->out));
+    w->out.sink = &e->sink;
+    size_t written = e->next_block;
+    while (e->next_block < e->files.count && e->ready[e->next_block]) {
+        output *block = &e->blocks[e->next_block++];
+        e->parked -= block->cap;
+        if (e->opt.first > 0) {
+            // Cut the block right after the last match within the limit,
+            // which is where a single-threaded run would have stopped
+            size_t room = (size_t)(e->opt.first - e->matched);
+            if (block->mark_count >= room) {
+                block->len = room > 0 ? block->marks[room - 1] : 0;
+                block->mark_count = room;
+            }
+            e->matched += (long long)block->mark_count;
+            if (e->matched >= e->opt.first) {
+                flag_set(&e->stop);
+            }
+        }
+        out_flush(block);
+        recycle_block(e, block);
+    }
+    if (e->spare_count > 0) {
+        w->out = e->spares[--e->spare_count];
+        w->out.sink = &e->sink;
+    }
+    if (e->next_block != written && e->reorder_limit > 0) {
+        pthread_cond_broadcast(&e->room);
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+// The next file for `w` to search, in list order or with NUMA placement
+// from its own node first, then one with no home, then any other node's
+static int claim_file(worker *w, size_t *index) {
+    engine *e = w->e;
+    if (e->queue == NULL) {
+        *index = __atomic_fetch_add(&e->next_file, 1, __ATOMIC_RELAXED);
+        return *index < e->files.count;
+    }
+    for (int k = -2; k < e->groups; k++) {
+        int group = k == -2 ? w->node : k == -1 ? e->groups - 1 : k;
+        if (group < 0 || __atomic_load_n(&e->queue_next[group], __ATOMIC_RELAXED) >= e->queue_end[group]) {
+            continue;
+        }
+        size_t at = __atomic_fetch_add(&e->queue_next[group], 1, __ATOMIC_RELAXED);
+        if (at < e->queue_end[group]) {
+            *index = e->queue[at];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    worker *w = arg;
+    engine *e = w->e;
+    size_t i;
+    while (claim_file(w, &i) && !flag_get(&e->stop) && !flag_get(&e->sink.failed)) {
+        w->index = i;
+        scan_input(w, -1, e->files.items[i]);
+        finish_block(w, i);
+    }
+    return NULL;
+}
+
+static void *worker_thread(void *arg) {
+    worker *w = arg;
+    engine *e = w->e;
+    trace_thread_name("worker");
+    if (e->topology != NULL) {
+        numa_bind(e->topology, w->node);
+        w->scratch = ss_scratch_new(e->query);
+        if (w->scratch == NULL) {
+            sink_error(&e->sink, "Out of memory");
+            return NULL;
+        }
+        tune_scratch(w);
+    }
+    return worker_main(w);
+}
+
+// Queues each file for the node holding its cached pages. Small files are
+// not worth the look and go with the ones that have no home.
+static void queue_by_node(engine *e) {
+    const numa_topology *t = e->topology;
+    size_t count = e->files.count;
+    int groups = t->node_count + 1;
+    int *home = malloc(count * sizeof(*home));
+    e->queue = malloc(count * sizeof(*e->queue));
+    e->queue_end = calloc((size_t)groups, sizeof(*e->queue_end));
+    e->queue_next = calloc((size_t)groups, sizeof(*e->queue_next));
+    if (home == NULL || e->queue == NULL || e->queue_end == NULL || e->queue_next == NULL) {
+        // Still pinned, just without preferences
+        free(home);
+        free(e->queue);
+        free(e->queue_end);
+        free(e->queue_next);
+        e->queue = NULL;
+        return;
+    }
+    e->groups = groups;
+    for (size_t i = 0; i < count; i++) {
+        struct stat info;
+        char *path = file_path(e, e->files.items[i], NULL);
+        int id = path != NULL && stat(path, &info) == 0 && info.st_size >= PLACEMENT_MIN_SIZE
+                 ? numa_file_node(path) : -1;
+        if (path != NULL && path != e->files.items[i]) {
+            free(path);
+        }
+        home[i] = groups - 1;
+        for (int node = 0; node < t->node_count && id >= 0; node++) {
+            if (t->node_id[node] == id) {
+                home[i] = node;
+            }
+        }
+        e->queue_next[home[i]]++;
+    }
+    // Groups in node order, each in list order
+    size_t start = 0;
+    for (int group = 0; group < groups; group++) {
+        size_t size = e->queue_next[group];
+        e->queue_next[group] = start;
+        e->queue_end[group] = start;
+        start += size;
+    }
+    for (size_t i = 0; i < count; i++) {
+        e->queue[e->queue_end[home[i]]++] = i;
+    }
+    free(home);
+}
+
+// Pins the worker threads unless --affinity is "none", or there is one
+// node and no CPU list. Returns 0 if the CPU list is not usable.
+static int plan_placement(engine *e) {
+    const char *affinity = e->opt.affinity;
+    if (affinity != NULL && strcmp(affinity, "none") == 0) {
+        return 1;
+    }
+    const char *only = affinity != NULL && strcmp(affinity, "numa") != 0 ? affinity : NULL;
+    numa_topology *t = malloc(sizeof(*t));
+    if (t == NULL || !numa_detect(t, only) || (t->node_count < 2 && only == NULL)) {
+        int usable = t == NULL || only == NULL;
+        free(t);
+        if (!usable) {
+            sink_error(&e->sink, "No usable CPU in --affinity %s", only);
+        }
+        return usable;
+    }
+    e->topology = t;
+    // A held-back worker counts on the earliest file being claimed
+    // already, which only list order promises
+    if (t->node_count > 1 && e->reorder_limit == 0) {
+        queue_by_node(e);
+    }
+    return 1;
+}
+
+// Searches the file list on `count` threads, the calling thread included.
+// Fewer threads are used if some cannot be started.
+static int run_workers(engine *e, worker *self, int count) {
+    if ((size_t)count > e->files.count) {
+        count = (int)e->files.count;
+    }
+    worker *workers = calloc((size_t)count, sizeof(*workers));
+    if (!e->opt.unordered) {
+        e->blocks = calloc(e->files.count, sizeof(*e->blocks));
+        e->ready = calloc(e->files.count, 1);
+        e->spares = calloc(e->files.count, sizeof(*e->spares));
+    }
+    if (workers == NULL || (!e->opt.unordered && (e->blocks == NULL || e->ready == NULL || e->spares == NULL))) {
+        sink_error(&e->sink, "Out of memory");
+        free(workers);
+        free(e->blocks);
+        free(e->ready);
+        free(e->spares);
+        return 0;
+    }
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->room, NULL);
+
+    if (!plan_placement(e)) {
+        free(workers);
+        free(e->blocks);
+        free(e->ready);
+        free(e->spares);
+        pthread_mutex_destroy(&e->lock);
+        pthread_cond_destroy(&e->room);
+        return 0;
+    }
+
+    // Piped input was written first; from here on every file is a block
+    out_flush(&self->out);
+    self->out.stream = 0;
+
+    // The calling thread stays where it is and takes files with no home
+    // first; the others are spread over the nodes
+    int started = 0;
+    for (int i = 1; i < count; i++) {
+        worker *w = &workers[started];
+        if (!worker_init(w, e, NULL)) {
+            break;
+        }
+        if (e->topology != NULL) {
+            w->node = started % e->topology->node_count;
+        }
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+            worker_free(w);
+            break;
+        }
+        started++;
+    }
+    worker_main(self);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        worker_free(&workers[i]);
+    }
+
+    // Blocks left behind when -Quiet or a write error stopped the search
+    for (size_t i = 0; e->blocks != NULL && i < e->files.count; i++) {
+        free(e->blocks[i].data);
+        free(e->blocks[i].marks);
+    }
+    for (size_t i = 0; i < e->spare_count; i++) {
+        free(e->spares[i].data);
+        free(e->spares[i].marks);
+    }
+    free(e->blocks);
+    free(e->ready);
+    free(e->spares);
+    free(workers);
+    free(e->topology);
+    free(e->queue);
+    free(e->queue_end);
+    free(e->queue_next);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->room);
+    self->out.stream = 1;
+    return 1;
+}
+
+// Splits --max-memory between the reorder buffer, a quarter of it when
+// several threads keep the output in order, and the threads, each of
+// which needs a read buffer, a DFA cache and an output buffer. Starts
+// fewer threads rather than give any less than MIN_THREAD_MEMORY; one
+// thread always runs, with its buffers at their floor if need be.
+// Returns the thread count.
+static int plan_memory(engine *e, int threads) {
+    long long total = e->opt.max_memory;
+    long long asked = e->opt.read_buffer > 0 ? e->opt.read_buffer
+                      : e->opt.cache_policy == SS_CACHE_DIRECT ? DIRECT_READ_BUFFER : 0;
+    if (total <= 0) {
+        e->read_size = (size_t)asked;
+        return threads;
+    }
+    long long reorder = threads > 1 && !e->opt.unordered ? total / 4 : 0;
+    if ((total - reorder) / threads < MIN_THREAD_MEMORY) {
+        threads = (int)((total - reorder) / MIN_THREAD_MEMORY);
+        if (threads <= 1) {
+            threads = 1;
+            reorder = 0;
+        }
+    }
+    long long share = (total - reorder) / threads;
+    long long most = asked > 0 ? asked : MAX_READ_SHARE;
+    long long read = share / 4 < most ? share / 4 : most;
+    long long dfa = share - read - OUTPUT_BUFFER_SIZE;
+    e->read_size = (size_t)read;
+    e->dfa_cache = dfa > MIN_DFA_CACHE ? (size_t)dfa : MIN_DFA_CACHE;
+    e->reorder_limit = (size_t)reorder;
+    e->block_limit = (size_t)(reorder / threads);
+    return threads;
+}
+
+int engine_run(int argc, char *argv[], const engine_options *options) {
+    engine e;
+    memset(&e, 0, sizeof(e));
+    if (options != NULL) {
+        e.opt = *options;
+    }
+    e.sink.fd = e.opt.client ? e.opt.client_fd : 1;
+    e.sink.framed = e.opt.client;
+    e.sink.cancel_fd = e.opt.client ? e.opt.client_fd : -1;
+    pthread_mutex_init(&e.sink.lock, NULL);
+    stats_enter(PHASE_MATCH);
+
+    char error[512];
+    e.query = e.opt.query;
+    if (e.query == NULL) {
+        e.query = ss_compile(argc, argv, error, sizeof(error));
+    }
+    worker self;
+    if (e.query == NULL) {
+        sink_error(&e.sink, "%s", error);
+    }
+    if (e.query == NULL || !worker_init(&self, &e, e.opt.scratch)) {
+        if (e.query != e.opt.query) {
+            ss_query_free(e.query);
+        }
+        pthread_mutex_destroy(&e.sink.lock);
+        stats_leave();
+        return EXIT_FAILURE;
+    }
+    e.info = ss_query_describe(e.query);
+    self.out.stream = 1;
+    e.has_context = e.info->context_before > 0 || e.info->context_after > 0;
+    // No file can give more than --first matches either, which bounds the
+    // work done on files an ordered run ends up cutting
+    e.file_limit = e.opt.max_count;
+    if (e.opt.first > 0 && (e.file_limit == 0 || e.opt.first < e.file_limit)) {
+        e.file_limit = e.opt.first;
+    }
+    // --unordered defaults to a thread per CPU the cgroup lets us use
+    int cpus = budget_get()->cpus;
+    int threads = e.opt.threads > 0 ? e.opt.threads : e.opt.unordered ? cpus : 1;
+    if (e.opt.shard_count > 0) {
+        // The coordinator merges file by file; its workers are the parallelism
+        threads = 1;
+    }
+    threads = plan_memory(&e, threads);
+    tune_scratch(&self);
+    // A client asks for interactive only when its own stdout is a terminal
+    e.flush_each = threads == 1 && e.opt.interactive && (e.opt.client || _isatty(1));
+
+    if (e.info->path_count == 0 && e.info->literal_path_count == 0) {
+        // The server's own stdin is not the client's
+        if (e.opt.client || _isatty(_fileno(stdin))) {
+            sink_error(&e.sink, "No input. Pipe text to Select-String or pass -Path");
+            e.errors++;
+        } else {
+            scan_input(&self, _fileno(stdin), NULL);
+        }
+    }
+    int listed = 1;
+    for (size_t i = 0; i < e.info->path_count && listed; i++) {
+        listed = expand_wildcard(&e, e.info->paths[i]);
+    }
+    for (size_t i = 0; i < e.info->literal_path_count && listed; i++) {
+        listed = add_file(&e, e.info->literal_paths[i]);
+    }
+    if (listed && e.opt.interactive && e.opt.shard_count == 0) {
+        listed = order_for_latency(&e);
+    }
+    if (!listed) {
+        e.errors++;
+    } else if (threads > 1 && e.files.count > 1) {
+        if (!run_workers(&e, &self, threads)) {
+            e.errors++;
+        }
+    } else {
+        for (size_t i = 0; i < e.files.count && !e.stop && !e.sink.failed; i++) {
+            if (e.opt.shard_count > 0) {
+                if (i % (size_t)e.opt.shard_count != (size_t)e.opt.shard) {
+                    continue;
+                }
+                scan_input(&self, -1, e.files.items[i]);
+                end_shard_file(&self);
+                continue;
+            }
+            scan_input(&self, -1, e.files.items[i]);
+        }
+    }
+
+    if (e.opt.shard_count > 0) {
+        // The coordinator answers -Quiet from the file frames
+        if (stats.enabled) {
+            send_shard_stats(&e);
+        }
+    } else if (e.info->quiet) {
+        const char *answer = e.any_match ? "True\n" : "False\n";
+        out_write(&self.out, answer, strlen(answer));
+    }
+    out_flush(&self.out);
+
+    stats_leave();
+    int failed = e.errors > 0 || (e.sink.failed && !e.sink.closed);
+    worker_free(&self);
+    list_free(&e.files);
+    if (e.query != e.opt.query) {
+        ss_query_free(e.query);
+    }
+    pthread_mutex_destroy(&e.sink.lock);
+    if (e.sink.cancelled) {
+        return ENGINE_CANCELLED;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
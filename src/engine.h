@@ -0,0 +1,80 @@
+/*
+ * engine.h - Native Select-String engine
+ */
+
+#ifndef SS_ENGINE_H
+#define SS_ENGINE_H
+
+#include <stddef.h>
+
+#include "selectstring.h"
+
+enum {
+    ENGINE_FORMAT_TEXT,     // MatchInfo.ToString(), like the backend
+    ENGINE_FORMAT_NDJSON,   // one JSON object per line
+    ENGINE_FORMAT_BINARY    // length-prefixed records, see README
+};
+
+// Where the server keeps hot files mapped. open() returns a file's
+// contents, or NULL to have the engine read it as usual; each non-NULL
+// result is handed back to close().
+typedef struct {
+    const char *(*open)(void *user, const char *path, size_t *len, void **handle);
+    void (*close)(void *user, void *handle);
+    void *user;
+} engine_files;
+
+// Response frames sent to a server client: u32 length of what follows,
+// little-endian, then a kind byte and the payload
+enum {
+    ENGINE_FRAME_OUTPUT = 1,    // output bytes, in the requested format
+    ENGINE_FRAME_ERROR = 2,     // an error message, as it would go to stderr
+    ENGINE_FRAME_END = 3,       // u32 exit code; the query is done
+    ENGINE_FRAME_CANCELLED = 4, // the query was stopped by a newer request
+    ENGINE_FRAME_FILE = 5,      // u64 matches; a shard's file is done
+    ENGINE_FRAME_STATS = 6      // a shard's stats_search_counters, as u64s
+};
+
+#define ENGINE_CANCELLED (-1)
+
+// --read-buffer: the largest read buffer a thread may be given
+#define ENGINE_MAX_READ_BUFFER (16 << 20)
+
+// Wrapper options that change how the engine works, not what it matches
+typedef struct {
+    int interactive;        // smallest, newest files first; flush each match on a TTY
+    int threads;            // files searched at once; 0 means 1, or one per CPU if unordered
+    int unordered;          // write each file's results as soon as it is done
+    long long first;        // stop after this many matches in all; 0 for no limit
+    long long max_count;    // stop each file after this many matches; 0 for no limit
+    int format;             // ENGINE_FORMAT_*
+    const char *affinity;   // worker threads: NULL or "numa" to pin per node when there
+                            // are several, "none", or a CPU list to pin within
+    long long max_memory;   // bytes for read buffers, DFA caches and output held for
+                            // ordering; fewer threads and smaller buffers to stay
+                            // under it. 0 for no limit.
+    long long read_buffer;  // the most each thread's read buffer grows to for a big
+                            // file; 0 for the library's default
+    int cache_policy;       // SS_CACHE_*: how files read go through the page cache
+
+    // Used by the server (server.c); all optional
+    const char *dir;        // relative paths are taken from here, not the working directory
+    int client;             // output and errors go to this socket as frames...
+    int client_fd;          // ...and a new request arriving on it cancels the query
+    ss_query *query;        // already compiled from argv; not freed
+    ss_scratch *scratch;    // for the calling thread; not freed
+    const engine_files *files;
+
+    // Used by fan-out workers (fanout.c): search only the files whose
+    // index modulo shard_count is shard, and end each with a file frame
+    int shard;
+    int shard_count;
+} engine_options;
+
+// Runs a Select-String query in-process. `argv` holds the Select-String
+// arguments only (no program name), in the same form the wrapper would
+// forward to PowerShell. `options` may be NULL. Returns the process exit
+// code, or ENGINE_CANCELLED when a request on options->client_fd stopped it.
+int engine_run(int argc, char *argv[], const engine_options *options);
+
+#endif
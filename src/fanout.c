@@ -0,0 +1,475 @@
+/*
+ * fanout.c - Search sharded across worker processes
+ *
+ * `--workers N` forks N copies of the engine, each connected to this
+ * process (the coordinator) by a socket pair. Worker k searches files k,
+ * k+N, k+2N, ... of the expanded file list and answers with the server's
+ * frames (see engine.h), ending each file with a file frame. The
+ * coordinator takes file i from worker i % N, so the merged output is in
+ * the same order as a single-process search; with --unordered each file is
+ * written as soon as it is complete instead. A worker that runs ahead is
+ * buffered up to MAX_BUFFERED and then left blocked on its socket.
+ * --max-memory is split evenly between the workers and the coordinator,
+ * whose share caps those buffers.
+ *
+ * Closing a worker's socket cancels its search, which is how an early end
+ * (`| head`, a failed write, -Quiet's first match) reaches the workers.
+ */
+
+#include "compat.h"
+#include <errno.h>
+
+#include "fanout.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifndef _WIN32
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define READ_SIZE 65536
+#define MAX_BUFFERED (16 << 20)
+
+typedef struct {
+    int fd;                     // -1 once closed
+    pid_t pid;
+    char *data;
+    size_t len;                 // bytes buffered
+    size_t pos;                 // start of the first frame not handled yet
+    size_t cap;
+    int eof;                    // nothing more will arrive
+    int ended;                  // the end frame was handled
+    int code;
+} shard;
+
+typedef struct {
+    shard shards[FANOUT_MAX_WORKERS];
+    int count;
+    int unordered;
+    int quiet;
+    size_t max_buffered;        // per worker, before it is left blocked
+    size_t turn;                // the file to write next, in order
+    long long matches;
+    int failed;                 // stdout is gone...
+    int closed;                 // ...because its reader went away, which is not an error
+    int code;
+} fanout;
+
+static int write_stdout(fanout *f, const char *data, size_t len) {
+    stats_enter(PHASE_OUTPUT);
+    stats_first_output();
+    unsigned long long span = trace_begin();
+    size_t done = 0;
+    while (done < len && !f->failed) {
+        long n = (long)ss_write(1, data + done, (unsigned)(len - done));
+        stats_add(&stats.write_calls, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0 && errno == EPIPE) {
+                f->closed = 1;
+            } else {
+                fprintf(stderr, "Error: Failed to write output to stdout\n");
+            }
+            f->failed = 1;
+            break;
+        }
+        done += (size_t)n;
+    }
+    stats_add(&stats.bytes_written, (long long)done);
+    trace_end("write", span, NULL, (long long)done);
+    stats_leave();
+    return !f->failed;
+}
+
+static unsigned long long get_u64(const char *p, size_t len) {
+    unsigned long long value = 0;
+    for (size_t i = 0; i < len && i < 8; i++) {
+        value |= (unsigned long long)(unsigned char)p[i] << (8 * i);
+    }
+    return value;
+}
+
+// The frame at offset `at` of the shard's buffer. Returns its full size,
+// or 0 if it has not arrived yet.
+static size_t peek_frame(const shard *s, size_t at, int *kind, const char **payload, size_t *len) {
+    if (s->len - at < 5) {
+        return 0;
+    }
+    size_t size = (size_t)get_u64(s->data + at, 4);
+    if (size == 0 || s->len - at - 4 < size) {
+        return 0;
+    }
+    *kind = (unsigned char)s->data[at + 4];
+    *payload = s->data + at + 5;
+    *len = size - 1;
+    return size + 4;
+}
+
+static void handle_frame(fanout *f, shard *s, int kind, const char *payload, size_t len) {
+    switch (kind) {
+    case ENGINE_FRAME_OUTPUT:
+        if (!f->failed) {
+            write_stdout(f, payload, len);
+        }
+        break;
+    case ENGINE_FRAME_ERROR:
+        fwrite(payload, 1, len, stderr);
+        break;
+    case ENGINE_FRAME_FILE:
+        f->matches += (long long)get_u64(payload, len);
+        break;
+    case ENGINE_FRAME_STATS:
+        for (int i = 0; i < STATS_SEARCH_COUNTERS && (size_t)(8 * i + 8) <= len; i++) {
+            stats_add(stats_search_counters[i], (long long)get_u64(payload + 8 * i, 8));
+        }
+        break;
+    case ENGINE_FRAME_END:
+        s->ended = 1;
+        s->code = (int)get_u64(payload, len);
+        break;
+    default:
+        s->ended = 1;
+        s->code = EXIT_FAILURE;
+        break;
+    }
+}
+
+// Handles the shard's next frame, if it has arrived
+static int next_frame(fanout *f, shard *s, int *kind) {
+    const char *payload;
+    size_t len;
+    size_t size = s->ended ? 0 : peek_frame(s, s->pos, kind, &payload, &len);
+    if (size == 0) {
+        // A length of 0 leaves no room for the kind byte. Nothing after it
+        // can be framed, so the shard counts as stopped.
+        if (!s->ended && s->len - s->pos >= 5 && get_u64(s->data + s->pos, 4) == 0) {
+            s->pos = s->len;
+            s->eof = 1;
+        }
+        return 0;
+    }
+    s->pos += size;
+    handle_frame(f, s, *kind, payload, len);
+    return 1;
+}
+
+static int all_ended(const fanout *f) {
+    for (int i = 0; i < f->count; i++) {
+        if (!f->shards[i].ended && !f->shards[i].eof) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int any_frame(const fanout *f) {
+    for (int i = 0; i < f->count; i++) {
+        const shard *s = &f->shards[i];
+        int kind;
+        const char *payload;
+        size_t len;
+        if (!s->ended && peek_frame(s, s->pos, &kind, &payload, &len) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Writes what has arrived in file order. A shard with nothing more to
+// send has no more files, so its turns are skipped.
+static void drain_ordered(fanout *f) {
+    int kind;
+    for (;;) {
+        shard *s = &f->shards[f->turn % (size_t)f->count];
+        if (next_frame(f, s, &kind)) {
+            if (kind == ENGINE_FRAME_FILE) {
+                f->turn++;
+            }
+            continue;
+        }
+        if (!s->ended && !s->eof) {
+            return;
+        }
+        if (all_ended(f) && !any_frame(f)) {
+            return;
+        }
+        f->turn++;
+    }
+}
+
+// Writes every file that has fully arrived
+static void drain_unordered(fanout *f) {
+    for (int i = 0; i < f->count; i++) {
+        shard *s = &f->shards[i];
+        for (;;) {
+            // Only once the file (or the shard) is complete
+            size_t at = s->pos;
+            int kind = 0;
+            const char *payload;
+            size_t len;
+            size_t size;
+            while ((size = peek_frame(s, at, &kind, &payload, &len)) > 0 &&
+                   kind != ENGINE_FRAME_FILE && kind != ENGINE_FRAME_END) {
+                at += size;
+            }
+            if (size == 0 || s->ended) {
+                break;
+            }
+            while (next_frame(f, s, &kind) && kind != ENGINE_FRAME_FILE && kind != ENGINE_FRAME_END) {
+            }
+        }
+    }
+}
+
+// Reads what shard `s` has sent. Returns 0 if out of memory.
+static int receive(shard *s) {
+    if (s->pos > 0) {
+        memmove(s->data, s->data + s->pos, s->len - s->pos);
+        s->len -= s->pos;
+        s->pos = 0;
+    }
+    if (s->cap - s->len < READ_SIZE) {
+        size_t cap = s->cap == 0 ? READ_SIZE * 2 : s->cap * 2;
+        char *data = realloc(s->data, cap);
+        if (data == NULL) {
+            return 0;
+        }
+        s->data = data;
+        s->cap = cap;
+    }
+    long n = (long)ss_read(s->fd, s->data + s->len, READ_SIZE);
+    if (n < 0 && errno == EINTR) {
+        return 1;
+    }
+    if (n <= 0) {
+        s->eof = 1;
+        return 1;
+    }
+    s->len += (size_t)n;
+    return 1;
+}
+
+// A worker's last frame, once engine_run() is done
+static void send_end(int fd, int code) {
+    char frame[9] = {5, 0, 0, 0, ENGINE_FRAME_END};
+    for (int i = 0; i < 4; i++) {
+        frame[5 + i] = (char)((unsigned)code >> (8 * i));
+    }
+    size_t done = 0;
+    while (done < sizeof(frame)) {
+        long n = (long)ss_write(fd, frame + done, (unsigned)(sizeof(frame) - done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        done += (size_t)n;
+    }
+}
+
+static void stop_workers(fanout *f) {
+    for (int i = 0; i < f->count; i++) {
+        shard *s = &f->shards[i];
+        if (s->fd >= 0) {
+            ss_close(s->fd);
+            s->fd = -1;
+        }
+        if (s->pid > 0) {
+            int status;
+            while (waitpid(s->pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            s->pid = 0;
+        }
+        free(s->data);
+        s->data = NULL;
+    }
+}
+
+static int start_workers(fanout *f, int argc, char *argv[], const engine_options *options, ss_query *query) {
+    stats_enter(PHASE_SPAWN);
+    fflush(NULL);
+    int started = 1;
+    for (int k = 0; k < f->count && started; k++) {
+        shard *s = &f->shards[k];
+        int pair[2];
+        started = socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0;
+        pid_t pid = started ? fork() : -1;
+        stats_add(&stats.spawn_calls, 1);
+        if (pid == 0) {
+            ss_close(pair[0]);
+            for (int j = 0; j < k; j++) {
+                ss_close(f->shards[j].fd);
+            }
+            // Each worker reports only what it did itself
+            for (int i = 0; i < STATS_SEARCH_COUNTERS; i++) {
+                *stats_search_counters[i] = 0;
+            }
+            engine_options worker = *options;
+            worker.client = 1;
+            worker.client_fd = pair[1];
+            worker.query = query;
+            worker.shard = k;
+            worker.shard_count = f->count;
+            worker.unordered = 0;
+            worker.max_memory = options->max_memory / (f->count + 1);
+            int code = engine_run(argc, argv, &worker);
+            if (code != ENGINE_CANCELLED) {
+                send_end(pair[1], code);
+            }
+            // Skips the coordinator's exit handlers (--stats, --trace)
+            _exit(code == ENGINE_CANCELLED ? EXIT_FAILURE : code);
+        }
+        if (started) {
+            ss_close(pair[1]);
+            if (pid < 0) {
+                ss_close(pair[0]);
+                started = 0;
+            }
+        }
+        s->fd = started ? pair[0] : -1;
+        s->pid = started ? pid : 0;
+    }
+    stats_leave();
+    if (!started) {
+        stop_workers(f);
+    }
+    return started;
+}
+
+static void run_shards(fanout *f) {
+    struct pollfd fds[FANOUT_MAX_WORKERS];
+    shard *polled[FANOUT_MAX_WORKERS];
+    while (!all_ended(f) && !f->failed && !(f->quiet && f->matches > 0)) {
+        shard *turn = &f->shards[f->turn % (size_t)f->count];
+        int n = 0;
+        for (int i = 0; i < f->count; i++) {
+            shard *s = &f->shards[i];
+            // A shard that is far ahead waits until its turn comes
+            if (s->eof || s->ended || (s != turn && !f->unordered && s->len - s->pos >= f->max_buffered)) {
+                continue;
+            }
+            fds[n].fd = s->fd;
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            polled[n++] = s;
+        }
+        if (n == 0) {
+            break;
+        }
+        // Wakes up now and then to notice a closed stdout while the
+        // workers have nothing to say
+        int ready = poll(fds, (nfds_t)n, 100);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < n && ready > 0; i++) {
+            if (fds[i].revents != 0 && !receive(polled[i])) {
+                fprintf(stderr, "Error: Out of memory\n");
+                f->code = EXIT_FAILURE;
+                return;
+            }
+        }
+        if (f->unordered) {
+            drain_unordered(f);
+        } else {
+            drain_ordered(f);
+        }
+        if (ss_output_closed(1)) {
+            f->closed = 1;
+            f->failed = 1;
+        }
+    }
+    if (f->unordered) {
+        drain_unordered(f);
+    } else {
+        drain_ordered(f);
+    }
+}
+
+// The caller's query (--rules) is the caller's to free
+static void release_query(ss_query *query, const engine_options *options) {
+    if (query != options->query) {
+        ss_query_free(query);
+    }
+}
+
+int fanout_run(int argc, char *argv[], const engine_options *options, int workers) {
+    if (options->first > 0 || options->interactive || options->threads > 0) {
+        fprintf(stderr, "Error: --workers cannot be combined with --first, --interactive or --threads\n");
+        return EXIT_FAILURE;
+    }
+    char error[512];
+    ss_query *query = options->query != NULL ? options->query : ss_compile(argc, argv, error, sizeof(error));
+    if (query == NULL) {
+        fprintf(stderr, "Error: %s\n", error);
+        return EXIT_FAILURE;
+    }
+    const ss_query_info *info = ss_query_describe(query);
+    // Piped input cannot be split between processes
+    if (info->path_count == 0 && info->literal_path_count == 0) {
+        release_query(query, options);
+        return engine_run(argc, argv, options);
+    }
+
+    fanout *f = calloc(1, sizeof(*f));
+    if (f == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        release_query(query, options);
+        return EXIT_FAILURE;
+    }
+    f->count = workers;
+    f->unordered = options->unordered;
+    f->max_buffered = MAX_BUFFERED;
+    if (options->max_memory > 0) {
+        long long share = options->max_memory / (workers + 1) / workers;
+        f->max_buffered = share < READ_SIZE ? READ_SIZE : share < MAX_BUFFERED ? (size_t)share : MAX_BUFFERED;
+    }
+    f->quiet = info->quiet;
+    if (!start_workers(f, argc, argv, options, query)) {
+        // Searched in-process instead, like a missing server
+        free(f);
+        release_query(query, options);
+        return engine_run(argc, argv, options);
+    }
+
+    stats_enter(PHASE_MATCH);
+    run_shards(f);
+    stats_leave();
+    int cut = f->failed || (f->quiet && f->matches > 0);
+    int code = f->code;
+    for (int i = 0; i < f->count; i++) {
+        shard *s = &f->shards[i];
+        if (!s->ended && !cut && code == EXIT_SUCCESS) {
+            fprintf(stderr, "Error: Worker %d stopped before finishing its files\n", i);
+            code = EXIT_FAILURE;
+        }
+        if (s->ended && s->code != EXIT_SUCCESS && !f->closed) {
+            code = EXIT_FAILURE;
+        }
+    }
+    stop_workers(f);
+    if (f->quiet && !f->failed) {
+        const char *answer = f->matches > 0 ? "True\n" : "False\n";
+        write_stdout(f, answer, strlen(answer));
+    }
+    if (f->failed && !f->closed) {
+        code = EXIT_FAILURE;
+    }
+    free(f);
+    release_query(query, options);
+    return code;
+}
+
+#else
+
+int fanout_run(int argc, char *argv[], const engine_options *options, int workers) {
+    (void)workers;
+    return engine_run(argc, argv, options);
+}
+
+#endif
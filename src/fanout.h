@@ -0,0 +1,17 @@
+/*
+ * fanout.h - Search sharded across worker processes
+ */
+
+#ifndef SS_FANOUT_H
+#define SS_FANOUT_H
+
+#include "engine.h"
+
+#define FANOUT_MAX_WORKERS 256
+
+// Searches the files of a native query with `workers` processes and
+// writes their merged results to stdout, as engine_run() would. Returns
+// the process exit code.
+int fanout_run(int argc, char *argv[], const engine_options *options, int workers);
+
+#endif
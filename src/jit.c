@@ -0,0 +1,383 @@
+/*
+ * jit.c - x86-64 machine code for a frozen DFA
+ *
+ * Each DFA state becomes a block of code instead of a table row. A state
+ * checks for the end of the input, loads a byte and branches on it: a
+ * chain of compares when few byte ranges leave the state, or an indirect
+ * jump through a per-state table of code addresses when many do. A state
+ * that loops on itself for all but a handful of bytes (the start state of
+ * a literal-led pattern, or the dead state, which waits for a newline)
+ * first skips 16 bytes at a time with SSE2 compares against those bytes.
+ *
+ * The code is written into anonymous memory that is only ever writable
+ * or executable, never both: it is filled in, then flipped to read and
+ * execute. Where that is refused, or off x86-64, jit_compile() returns
+ * NULL and the caller steps the table instead.
+ *
+ * Registers: rdi is the cursor, rsi the end, rdx where the final state
+ * goes; rax, rcx and xmm0-xmm7 are scratch. Nothing is saved, so the
+ * code is a plain System V leaf function.
+ */
+
+#define _GNU_SOURCE
+
+#include "compat.h"
+
+#include "jit.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+#define JIT_MAX_SIZE (4 << 20)      // code and data
+#define JIT_MAX_RANGES 16           // byte ranges leaving a state before it uses a jump table
+#define JIT_PREFILTER_BYTES 5       // exit bytes a self-looping state can skip over with SSE2
+
+typedef const unsigned char *(*scan_fn)(const unsigned char *p, const unsigned char *end, int32_t *state);
+
+struct jit_code {
+    void *mem;
+    size_t size;
+    scan_fn entry;
+};
+
+// Sizes the code on a first pass (buf NULL), then writes it on a second;
+// every instruction has the same length on both
+typedef struct {
+    unsigned char *buf;
+    size_t pos;
+} emitter;
+
+static void emit(emitter *e, const unsigned char *bytes, size_t n) {
+    if (e->buf != NULL) {
+        memcpy(e->buf + e->pos, bytes, n);
+    }
+    e->pos += n;
+}
+
+#define EMIT(e, ...) do { \
+        static const unsigned char bytes_[] = {__VA_ARGS__}; \
+        emit((e), bytes_, sizeof(bytes_)); \
+    } while (0)
+
+static void emit32(emitter *e, uint32_t v) {
+    unsigned char bytes[4] = {(unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16),
+                              (unsigned char)(v >> 24)};
+    emit(e, bytes, 4);
+}
+
+// A rel32 or RIP-relative disp32 that ends its instruction
+static void emit_rel(emitter *e, size_t target) {
+    emit32(e, (uint32_t)(int32_t)((long long)target - (long long)(e->pos + 4)));
+}
+
+typedef struct {
+    const int32_t *table;
+    size_t stride;
+    size_t state_count;
+    const unsigned char *classmap;
+    size_t match;           // code offset of the match exit
+    size_t *label;          // per state: its entry...
+    size_t *loop;           // ...the SSE2 loop, if it has one...
+    size_t *found;          // ...where the loop found an exit byte...
+    size_t *scalar;         // ...and the byte-at-a-time step
+    size_t *constants;      // per state: its SSE2 compare bytes in the data
+    size_t *jumps;          // per state: its jump table in the data, if it has one
+    size_t classmap_at;
+} program;
+
+// The state each byte leads to from state `s`; 0 is a match
+static void targets(const program *pr, size_t s, uint32_t *to) {
+    const int32_t *row = pr->table + s * pr->stride;
+    for (int b = 0; b < 256; b++) {
+        to[b] = (uint32_t)row[pr->classmap[b]] / (uint32_t)pr->stride;
+    }
+}
+
+// `seen` has a zeroed counter per state, and is left that way
+static uint32_t most_common(const uint32_t *to, unsigned *seen) {
+    uint32_t best = to[0];
+    for (int b = 0; b < 256; b++) {
+        if (++seen[to[b]] > seen[best]) {
+            best = to[b];
+        }
+    }
+    for (int b = 0; b < 256; b++) {
+        seen[to[b]] = 0;
+    }
+    return best;
+}
+
+// Where code going to state `t` from state `s` jumps
+static size_t target_code(const program *pr, size_t s, uint32_t t) {
+    if (t == 0) {
+        return pr->match;
+    }
+    if (t == s && pr->loop[s] != 0) {
+        return pr->loop[s];
+    }
+    return pr->label[t];
+}
+
+static int range_count(const uint32_t *to, uint32_t fallback) {
+    int ranges = 0;
+    for (int b = 0; b < 256; b++) {
+        if (to[b] != fallback && (b == 0 || to[b - 1] != to[b])) {
+            ranges++;
+        }
+    }
+    return ranges;
+}
+
+static void emit_state(emitter *e, program *pr, size_t s, unsigned *seen) {
+    uint32_t to[256];
+    targets(pr, s, to);
+    uint32_t fallback = most_common(to, seen);
+    int exits = 0;
+    unsigned char exit_bytes[JIT_PREFILTER_BYTES];
+    for (int b = 0; b < 256 && fallback == s; b++) {
+        if (to[b] != s) {
+            if (exits < JIT_PREFILTER_BYTES) {
+                exit_bytes[exits] = (unsigned char)b;
+            }
+            exits++;
+        }
+    }
+    int prefilter = exits > 0 && exits <= JIT_PREFILTER_BYTES;
+
+    pr->label[s] = e->pos;
+    pr->loop[s] = 0;
+    if (prefilter) {
+        // movdqu xmm2+k, [rip + constant k]
+        for (int k = 0; k < exits; k++) {
+            EMIT(e, 0xF3, 0x0F, 0x6F);
+            unsigned char modrm = (unsigned char)(((2 + k) << 3) | 5);
+            emit(e, &modrm, 1);
+            emit_rel(e, pr->constants[s] + (size_t)k * 16);
+            if (e->buf != NULL) {
+                memset(e->buf + pr->constants[s] + (size_t)k * 16, exit_bytes[k], 16);
+            }
+        }
+        pr->loop[s] = e->pos;
+        EMIT(e, 0x48, 0x8D, 0x47, 0x10);                // lea rax, [rdi + 16]
+        EMIT(e, 0x48, 0x39, 0xF0);                      // cmp rax, rsi
+        EMIT(e, 0x0F, 0x87);                            // ja scalar
+        emit_rel(e, pr->scalar[s]);
+        EMIT(e, 0xF3, 0x0F, 0x6F, 0x07);                // movdqu xmm0, [rdi]
+        EMIT(e, 0x66, 0x0F, 0x6F, 0xC8);                // movdqa xmm1, xmm0
+        EMIT(e, 0x66, 0x0F, 0x74, 0xCA);                // pcmpeqb xmm1, xmm2
+        for (int k = 1; k < exits; k++) {
+            EMIT(e, 0x66, 0x0F, 0x6F, 0xF8);            // movdqa xmm7, xmm0
+            EMIT(e, 0x66, 0x0F, 0x74);                  // pcmpeqb xmm7, xmm2+k
+            unsigned char modrm = (unsigned char)(0xF8 | (2 + k));
+            emit(e, &modrm, 1);
+            EMIT(e, 0x66, 0x0F, 0xEB, 0xCF);            // por xmm1, xmm7
+        }
+        EMIT(e, 0x66, 0x0F, 0xD7, 0xC1);                // pmovmskb eax, xmm1
+        EMIT(e, 0x85, 0xC0);                            // test eax, eax
+        EMIT(e, 0x0F, 0x85);                            // jnz found
+        emit_rel(e, pr->found[s]);
+        EMIT(e, 0x48, 0x83, 0xC7, 0x10);                // add rdi, 16
+        EMIT(e, 0xE9);                                  // jmp loop
+        emit_rel(e, pr->loop[s]);
+        pr->found[s] = e->pos;
+        EMIT(e, 0x0F, 0xBC, 0xC0);                      // bsf eax, eax
+        EMIT(e, 0x48, 0x01, 0xC7);                      // add rdi, rax
+    }
+
+    pr->scalar[s] = e->pos;
+    EMIT(e, 0x48, 0x39, 0xF7);                          // cmp rdi, rsi
+    EMIT(e, 0x72, 0x09);                                // jb +9
+    EMIT(e, 0xC7, 0x02);                                // mov dword [rdx], row offset
+    emit32(e, (uint32_t)(s * pr->stride));
+    EMIT(e, 0x31, 0xC0);                                // xor eax, eax
+    EMIT(e, 0xC3);                                      // ret
+    EMIT(e, 0x0F, 0xB6, 0x07);                          // movzx eax, byte [rdi]
+    EMIT(e, 0x48, 0xFF, 0xC7);                          // inc rdi
+
+    if (range_count(to, fallback) > JIT_MAX_RANGES) {
+        EMIT(e, 0x48, 0x8D, 0x0D);                      // lea rcx, [rip + classmap]
+        emit_rel(e, pr->classmap_at);
+        EMIT(e, 0x0F, 0xB6, 0x04, 0x01);                // movzx eax, byte [rcx + rax]
+        EMIT(e, 0x48, 0x8D, 0x0D);                      // lea rcx, [rip + jump table]
+        emit_rel(e, pr->jumps[s]);
+        EMIT(e, 0xFF, 0x24, 0xC1);                      // jmp [rcx + rax * 8]
+        if (e->buf != NULL) {
+            const int32_t *row = pr->table + s * pr->stride;
+            for (size_t c = 0; c < pr->stride; c++) {
+                uint32_t t = (uint32_t)row[c] / (uint32_t)pr->stride;
+                uint64_t address = (uint64_t)(uintptr_t)(e->buf + target_code(pr, s, t));
+                memcpy(e->buf + pr->jumps[s] + c * 8, &address, 8);
+            }
+        }
+        return;
+    }
+    for (int b = 0; b < 256;) {
+        int hi = b;
+        while (hi < 255 && to[hi + 1] == to[b]) {
+            hi++;
+        }
+        if (to[b] != fallback) {
+            if (hi == b) {
+                EMIT(e, 0x3C);                          // cmp al, b
+                unsigned char imm = (unsigned char)b;
+                emit(e, &imm, 1);
+                EMIT(e, 0x0F, 0x84);                    // je target
+            } else {
+                EMIT(e, 0x8D, 0x88);                    // lea ecx, [rax - b]
+                emit32(e, (uint32_t)-b);
+                EMIT(e, 0x81, 0xF9);                    // cmp ecx, hi - b
+                emit32(e, (uint32_t)(hi - b));
+                EMIT(e, 0x0F, 0x86);                    // jbe target
+            }
+            emit_rel(e, target_code(pr, s, to[b]));
+        }
+        b = hi + 1;
+    }
+    EMIT(e, 0xE9);                                      // jmp fallback
+    emit_rel(e, target_code(pr, s, fallback));
+}
+
+static void emit_program(emitter *e, program *pr, unsigned *seen) {
+    pr->match = e->pos;
+    EMIT(e, 0x48, 0x8D, 0x47, 0xFF);                    // lea rax, [rdi - 1]
+    EMIT(e, 0xC3);                                      // ret
+    for (size_t s = 1; s < pr->state_count; s++) {
+        emit_state(e, pr, s, seen);
+    }
+}
+
+jit_code *jit_compile(const int32_t *table, size_t stride, size_t state_count,
+                      const unsigned char classmap[256], int32_t start) {
+    program pr;
+    memset(&pr, 0, sizeof(pr));
+    pr.table = table;
+    pr.stride = stride;
+    pr.state_count = state_count;
+    pr.classmap = classmap;
+    size_t *arrays = calloc(state_count * 6, sizeof(*arrays));
+    unsigned *seen = calloc(state_count, sizeof(*seen));
+    jit_code *code = calloc(1, sizeof(*code));
+    if (arrays == NULL || seen == NULL || code == NULL || start <= 0) {
+        free(arrays);
+        free(seen);
+        free(code);
+        return NULL;
+    }
+    pr.label = arrays;
+    pr.loop = arrays + state_count;
+    pr.found = arrays + state_count * 2;
+    pr.scalar = arrays + state_count * 3;
+    pr.constants = arrays + state_count * 4;
+    pr.jumps = arrays + state_count * 5;
+
+    // First pass: where everything goes. The code comes first, then the
+    // compare bytes, the class map and the jump tables.
+    emitter e = {NULL, 0};
+    emit_program(&e, &pr, seen);
+    size_t size = (e.pos + 15) & ~(size_t)15;
+    for (size_t s = 1; s < state_count && size <= JIT_MAX_SIZE; s++) {
+        uint32_t to[256];
+        targets(&pr, s, to);
+        uint32_t fallback = most_common(to, seen);
+        if (pr.loop[s] != 0) {
+            int exits = 0;
+            for (int b = 0; b < 256; b++) {
+                exits += to[b] != s;
+            }
+            pr.constants[s] = size;
+            size += (size_t)exits * 16;
+        }
+        if (range_count(to, fallback) > JIT_MAX_RANGES) {
+            if (pr.classmap_at == 0) {
+                pr.classmap_at = size;
+                size += 256;
+            }
+            pr.jumps[s] = size;
+            size += stride * 8;
+        }
+    }
+    if (size > JIT_MAX_SIZE) {
+        free(arrays);
+        free(seen);
+        free(code);
+        return NULL;
+    }
+
+    // Second pass into writable memory, which then becomes executable
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(arrays);
+        free(seen);
+        free(code);
+        return NULL;
+    }
+    e.buf = mem;
+    e.pos = 0;
+    emit_program(&e, &pr, seen);
+    if (pr.classmap_at != 0) {
+        memcpy(e.buf + pr.classmap_at, classmap, 256);
+    }
+    size_t entry = pr.label[(size_t)start / stride];
+    free(arrays);
+    free(seen);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        free(code);
+        return NULL;
+    }
+    code->mem = mem;
+    code->size = size;
+    // ISO C has no cast from data to function pointers
+    void *at = (unsigned char *)mem + entry;
+    memcpy(&code->entry, &at, sizeof(code->entry));
+    return code;
+}
+
+void jit_free(jit_code *code) {
+    if (code != NULL) {
+        munmap(code->mem, code->size);
+        free(code);
+    }
+}
+
+size_t jit_size(const jit_code *code) {
+    return code->size;
+}
+
+const unsigned char *jit_run(const jit_code *code, const unsigned char *p, const unsigned char *end,
+                             int32_t *state) {
+    return code->entry(p, end, state);
+}
+
+#else
+
+jit_code *jit_compile(const int32_t *table, size_t stride, size_t state_count,
+                      const unsigned char classmap[256], int32_t start) {
+    (void)table;
+    (void)stride;
+    (void)state_count;
+    (void)classmap;
+    (void)start;
+    return NULL;
+}
+
+void jit_free(jit_code *code) {
+    (void)code;
+}
+
+size_t jit_size(const jit_code *code) {
+    (void)code;
+    return 0;
+}
+
+const unsigned char *jit_run(const jit_code *code, const unsigned char *p, const unsigned char *end,
+                             int32_t *state) {
+    (void)code;
+    (void)p;
+    (void)end;
+    (void)state;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * jit.h - x86-64 machine code for a frozen DFA
+ */
+
+#ifndef SS_JIT_H
+#define SS_JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct jit_code jit_code;
+
+// Compiles a complete DFA to machine code. `table` has `state_count` rows
+// of `stride` entries, indexed by the byte classes in `classmap`; each
+// entry is the row offset of the next state, and row 0 is the match
+// sentinel. Returns NULL when this is not x86-64, the DFA is too large,
+// or the system will not make memory executable (W^X policies); the
+// caller then runs the table itself.
+jit_code *jit_compile(const int32_t *table, size_t stride, size_t state_count,
+                      const unsigned char classmap[256], int32_t start);
+void jit_free(jit_code *code);
+
+// Bytes of machine code and data
+size_t jit_size(const jit_code *code);
+
+// Runs the DFA over [p, end) from its start state. Returns the byte that
+// completed a match, or NULL with the row offset of the state it ended
+// in stored to *state.
+const unsigned char *jit_run(const jit_code *code, const unsigned char *p, const unsigned char *end,
+                             int32_t *state);
+
+#endif
@@ -0,0 +1,516 @@
+/*
+ * kernels.c - Inner search loops
+ *
+ * The SIMD literal search compares the needle's first and last bytes at
+ * every offset of a block and only runs memcmp where both agree, which
+ * keeps the verify rate low even for common first bytes. Case-insensitive
+ * search does the same on (byte | 0x20): that never misses an ASCII case
+ * variant, and the fold-table verify weeds out the few bytes it conflates.
+ */
+
+#include "compat.h"
+#include <ctype.h>
+
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+unsigned char kernel_fold[256];
+
+static void init_fold(void) {
+    static int done;
+    if (done) {
+        return;
+    }
+    for (int b = 0; b < 256; b++) {
+        kernel_fold[b] = (unsigned char)(b < 0x80 ? tolower(b) : b);
+    }
+    done = 1;
+}
+
+// ---------------------------------------------------------------------------
+// Multi-literal sets
+// ---------------------------------------------------------------------------
+
+struct multi_literal {
+    char **literals;            // folded when ignore_case
+    size_t *lens;
+    size_t count;
+    int ignore_case;
+    int head[256];              // first literal starting with (folded) byte b, or -1
+    int *next;                  // next literal with the same first byte, by index
+    unsigned char is_first[256];
+
+    // Distinct two-byte prefixes for the SIMD filter, with 0x20 or'ed in
+    // when ignoring case. One-byte literals match any second byte.
+    unsigned char pair_first[MULTI_LITERAL_SIMD_MAX];
+    unsigned char pair_second[MULTI_LITERAL_SIMD_MAX];
+    unsigned char pair_any[MULTI_LITERAL_SIMD_MAX];
+    int pair_count;             // > MULTI_LITERAL_SIMD_MAX disables SIMD
+};
+
+multi_literal *multi_literal_new(const char *const *literals, const size_t *lens, size_t count,
+                                 int ignore_case) {
+    init_fold();
+    multi_literal *m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->literals = calloc(count, sizeof(*m->literals));
+    m->lens = malloc(count * sizeof(*m->lens));
+    m->next = malloc(count * sizeof(*m->next));
+    if (m->literals == NULL || m->lens == NULL || m->next == NULL) {
+        multi_literal_free(m);
+        return NULL;
+    }
+    m->count = count;
+    m->ignore_case = ignore_case;
+    for (int b = 0; b < 256; b++) {
+        m->head[b] = -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        m->literals[i] = malloc(lens[i] + 1);
+        if (m->literals[i] == NULL || lens[i] == 0) {
+            multi_literal_free(m);
+            return NULL;
+        }
+        for (size_t j = 0; j < lens[i]; j++) {
+            unsigned char c = (unsigned char)literals[i][j];
+            m->literals[i][j] = (char)(ignore_case ? kernel_fold[c] : c);
+        }
+        m->literals[i][lens[i]] = '\0';
+        m->lens[i] = lens[i];
+    }
+
+    // Chain literals by first byte, lowest index first
+    for (size_t i = count; i-- > 0;) {
+        unsigned char c = (unsigned char)m->literals[i][0];
+        m->next[i] = m->head[c];
+        m->head[c] = (int)i;
+    }
+    for (int b = 0; b < 256; b++) {
+        unsigned char key = (unsigned char)(ignore_case ? kernel_fold[b] : b);
+        m->is_first[b] = m->head[key] >= 0;
+    }
+
+    unsigned char bit = (unsigned char)(ignore_case ? 0x20 : 0);
+    for (size_t i = 0; i < count; i++) {
+        unsigned char first = (unsigned char)(m->literals[i][0] | bit);
+        unsigned char second = (unsigned char)(lens[i] > 1 ? m->literals[i][1] | bit : 0);
+        unsigned char any = lens[i] == 1;
+        int k = 0;
+        while (k < m->pair_count && k < MULTI_LITERAL_SIMD_MAX &&
+               !(m->pair_first[k] == first && m->pair_second[k] == second && m->pair_any[k] == any)) {
+            k++;
+        }
+        if (k < m->pair_count) {
+            continue;
+        }
+        if (k < MULTI_LITERAL_SIMD_MAX) {
+            m->pair_first[k] = first;
+            m->pair_second[k] = second;
+            m->pair_any[k] = any;
+        }
+        m->pair_count++;
+    }
+    return m;
+}
+
+void multi_literal_free(multi_literal *m) {
+    if (m == NULL) {
+        return;
+    }
+    for (size_t i = 0; m->literals != NULL && i < m->count; i++) {
+        free(m->literals[i]);
+    }
+    free(m->literals);
+    free(m->lens);
+    free(m->next);
+    free(m);
+}
+
+// Checks the literals that start with *h; h is known to be a candidate
+static int multi_verify(const multi_literal *m, const char *h, const char *end, size_t *which) {
+    const unsigned char *u = (const unsigned char *)h;
+    int i = m->head[m->ignore_case ? kernel_fold[u[0]] : u[0]];
+    for (; i >= 0; i = m->next[i]) {
+        size_t len = m->lens[i];
+        if ((size_t)(end - h) < len) {
+            continue;
+        }
+        const unsigned char *n = (const unsigned char *)m->literals[i];
+        size_t j = 1;
+        if (m->ignore_case) {
+            while (j < len && kernel_fold[u[j]] == n[j]) {
+                j++;
+            }
+        } else if (memcmp(u + 1, n + 1, len - 1) == 0) {
+            j = len;
+        }
+        if (j == len) {
+            if (which != NULL) {
+                *which = (size_t)i;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Scalar
+// ---------------------------------------------------------------------------
+
+static const char *find_literal_scalar(const char *p, const char *end, const char *needle, size_t len) {
+    const char first = needle[0];
+    while ((size_t)(end - p) >= len) {
+        p = memchr(p, first, (size_t)(end - p) - len + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p + 1, needle + 1, len - 1) == 0) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+static const char *find_literal_nocase_scalar(const char *p, const char *end, const char *needle,
+                                              size_t len) {
+    const unsigned char *h = (const unsigned char *)p;
+    const unsigned char *n = (const unsigned char *)needle;
+    if ((size_t)(end - p) < len) {
+        return NULL;
+    }
+    const unsigned char *last = (const unsigned char *)end - len;
+    for (; h <= last; h++) {
+        if (kernel_fold[*h] != n[0]) {
+            continue;
+        }
+        size_t i = 1;
+        while (i < len && kernel_fold[h[i]] == n[i]) {
+            i++;
+        }
+        if (i == len) {
+            return (const char *)h;
+        }
+    }
+    return NULL;
+}
+
+static const char *find_multi_scalar(const multi_literal *m, const char *p, const char *end,
+                                     size_t *which) {
+    for (; p < end; p++) {
+        if (m->is_first[(unsigned char)*p] && multi_verify(m, p, end, which)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static long long count_newlines_scalar(const char *p, const char *end) {
+    long long count = 0;
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+static const kernel_set SCALAR_KERNELS = {
+    "scalar",
+    find_literal_scalar,
+    find_literal_nocase_scalar,
+    find_multi_scalar,
+    count_newlines_scalar
+};
+
+#ifdef KERNELS_X86
+
+// The SIMD versions below share one shape: a vector body over whole
+// blocks, then the scalar version for the tail.
+
+static int nocase_verify(const char *h, const char *needle, size_t len) {
+    const unsigned char *u = (const unsigned char *)h;
+    const unsigned char *n = (const unsigned char *)needle;
+    for (size_t i = 0; i < len; i++) {
+        if (kernel_fold[u[i]] != n[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// SSE2
+// ---------------------------------------------------------------------------
+
+TARGET_SSE2
+static const char *find_literal_sse2(const char *p, const char *end, const char *needle, size_t len) {
+    if (len == 1) {
+        return find_literal_scalar(p, end, needle, len);
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[len - 1]);
+    while ((size_t)(end - p) >= len + 15) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(p + bit + 1, needle + 1, len - 2) == 0) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    return find_literal_scalar(p, end, needle, len);
+}
+
+TARGET_SSE2
+static const char *find_literal_nocase_sse2(const char *p, const char *end, const char *needle,
+                                            size_t len) {
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i first = _mm_set1_epi8((char)(needle[0] | 0x20));
+    const __m128i last = _mm_set1_epi8((char)(needle[len - 1] | 0x20));
+    while ((size_t)(end - p) >= len + 15) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p), fold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + len - 1)), fold);
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (nocase_verify(p + bit, needle, len)) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    return find_literal_nocase_scalar(p, end, needle, len);
+}
+
+TARGET_SSE2
+static const char *find_multi_sse2(const multi_literal *m, const char *p, const char *end,
+                                   size_t *which) {
+    if (m->pair_count > MULTI_LITERAL_SIMD_MAX) {
+        return find_multi_scalar(m, p, end, which);
+    }
+    __m128i firsts[MULTI_LITERAL_SIMD_MAX], seconds[MULTI_LITERAL_SIMD_MAX];
+    for (int i = 0; i < m->pair_count; i++) {
+        firsts[i] = _mm_set1_epi8((char)m->pair_first[i]);
+        seconds[i] = _mm_set1_epi8((char)m->pair_second[i]);
+    }
+    const __m128i fold = _mm_set1_epi8((char)(m->ignore_case ? 0x20 : 0));
+    // 17 bytes, so the second-byte load stays in bounds
+    while (end - p >= 17) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p), fold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 1)), fold);
+        __m128i hits = _mm_setzero_si128();
+        for (int i = 0; i < m->pair_count; i++) {
+            __m128i hit = _mm_cmpeq_epi8(a, firsts[i]);
+            if (!m->pair_any[i]) {
+                hit = _mm_and_si128(hit, _mm_cmpeq_epi8(b, seconds[i]));
+            }
+            hits = _mm_or_si128(hits, hit);
+        }
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (multi_verify(m, p + bit, end, which)) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    return find_multi_scalar(m, p, end, which);
+}
+
+// Matches are subtracted from per-lane byte counters (cmpeq gives -1),
+// which are widened with SAD before they can overflow at 255
+TARGET_SSE2
+static long long count_newlines_sse2(const char *p, const char *end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    __m128i total = zero;
+    while (end - p >= 16) {
+        __m128i lanes = zero;
+        for (int i = 0; i < 255 && end - p >= 16; i++, p += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)p);
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(block, newline));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(lanes, zero));
+    }
+    long long sums[2];
+    _mm_storeu_si128((__m128i *)sums, total);
+    return sums[0] + sums[1] + count_newlines_scalar(p, end);
+}
+
+static const kernel_set SSE2_KERNELS = {
+    "sse2",
+    find_literal_sse2,
+    find_literal_nocase_sse2,
+    find_multi_sse2,
+    count_newlines_sse2
+};
+
+// ---------------------------------------------------------------------------
+// AVX2
+// ---------------------------------------------------------------------------
+
+TARGET_AVX2
+static const char *find_literal_avx2(const char *p, const char *end, const char *needle, size_t len) {
+    if (len == 1) {
+        return find_literal_scalar(p, end, needle, len);
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[len - 1]);
+    while ((size_t)(end - p) >= len + 31) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + len - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(p + bit + 1, needle + 1, len - 2) == 0) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return find_literal_sse2(p, end, needle, len);
+}
+
+TARGET_AVX2
+static const char *find_literal_nocase_avx2(const char *p, const char *end, const char *needle,
+                                            size_t len) {
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    const __m256i first = _mm256_set1_epi8((char)(needle[0] | 0x20));
+    const __m256i last = _mm256_set1_epi8((char)(needle[len - 1] | 0x20));
+    while ((size_t)(end - p) >= len + 31) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p), fold);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + len - 1)), fold);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (nocase_verify(p + bit, needle, len)) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return find_literal_nocase_sse2(p, end, needle, len);
+}
+
+TARGET_AVX2
+static const char *find_multi_avx2(const multi_literal *m, const char *p, const char *end,
+                                   size_t *which) {
+    if (m->pair_count > MULTI_LITERAL_SIMD_MAX) {
+        return find_multi_scalar(m, p, end, which);
+    }
+    __m256i firsts[MULTI_LITERAL_SIMD_MAX], seconds[MULTI_LITERAL_SIMD_MAX];
+    for (int i = 0; i < m->pair_count; i++) {
+        firsts[i] = _mm256_set1_epi8((char)m->pair_first[i]);
+        seconds[i] = _mm256_set1_epi8((char)m->pair_second[i]);
+    }
+    const __m256i fold = _mm256_set1_epi8((char)(m->ignore_case ? 0x20 : 0));
+    while (end - p >= 33) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p), fold);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + 1)), fold);
+        __m256i hits = _mm256_setzero_si256();
+        for (int i = 0; i < m->pair_count; i++) {
+            __m256i hit = _mm256_cmpeq_epi8(a, firsts[i]);
+            if (!m->pair_any[i]) {
+                hit = _mm256_and_si256(hit, _mm256_cmpeq_epi8(b, seconds[i]));
+            }
+            hits = _mm256_or_si256(hits, hit);
+        }
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (multi_verify(m, p + bit, end, which)) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return find_multi_sse2(m, p, end, which);
+}
+
+TARGET_AVX2
+static long long count_newlines_avx2(const char *p, const char *end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    while (end - p >= 32) {
+        __m256i lanes = zero;
+        for (int i = 0; i < 255 && end - p >= 32; i++, p += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)p);
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(block, newline));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(lanes, zero));
+    }
+    long long sums[4];
+    _mm256_storeu_si256((__m256i *)sums, total);
+    return sums[0] + sums[1] + sums[2] + sums[3] + count_newlines_sse2(p, end);
+}
+
+static const kernel_set AVX2_KERNELS = {
+    "avx2",
+    find_literal_avx2,
+    find_literal_nocase_avx2,
+    find_multi_avx2,
+    count_newlines_avx2
+};
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Dispatch
+// ---------------------------------------------------------------------------
+
+const char *const KERNEL_VARIANTS[] = {"scalar", "sse2", "avx2", NULL};
+
+const kernel_set *kernels_variant(const char *name) {
+    init_fold();
+    if (strcmp(name, "scalar") == 0) {
+        return &SCALAR_KERNELS;
+    }
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        return &SSE2_KERNELS;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return &AVX2_KERNELS;
+    }
+#endif
+    return NULL;
+}
+
+const kernel_set *kernels_select(void) {
+    static const kernel_set *best;
+    if (best == NULL) {
+        for (int i = 0; KERNEL_VARIANTS[i] != NULL; i++) {
+            const kernel_set *k = kernels_variant(KERNEL_VARIANTS[i]);
+            if (k != NULL) {
+                best = k;
+            }
+        }
+    }
+    return best;
+}
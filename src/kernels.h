@@ -0,0 +1,59 @@
+/*
+ * kernels.h - Inner search loops
+ *
+ * Each kernel has a portable scalar version and, on x86, SSE2 and AVX2
+ * versions built with per-function target attributes, so one binary runs
+ * everywhere and kernels_select() picks the best set for the CPU at run
+ * time. Every variant returns exactly what the scalar version returns.
+ */
+
+#ifndef SS_KERNELS_H
+#define SS_KERNELS_H
+
+#include <stddef.h>
+
+// ASCII-only lower-casing, matching the automaton's case folding
+extern unsigned char kernel_fold[256];
+
+// A set of literals searched for at once. The SIMD versions filter
+// candidates on each literal's first two bytes and only apply up to
+// MULTI_LITERAL_SIMD_MAX distinct prefixes; past that every variant uses
+// the scalar loop.
+#define MULTI_LITERAL_SIMD_MAX 8
+
+typedef struct multi_literal multi_literal;
+
+multi_literal *multi_literal_new(const char *const *literals, const size_t *lens, size_t count,
+                                 int ignore_case);
+void multi_literal_free(multi_literal *m);
+
+typedef struct {
+    const char *name;
+
+    // First occurrence of needle in [p, end), or NULL. len >= 1.
+    const char *(*find_literal)(const char *p, const char *end, const char *needle, size_t len);
+
+    // As find_literal, ignoring ASCII case; `needle` is already folded
+    const char *(*find_literal_nocase)(const char *p, const char *end, const char *needle,
+                                       size_t len);
+
+    // Leftmost occurrence of any literal, or NULL. When two literals start
+    // at the same byte, the one given first wins; its index goes to *which
+    // if `which` is not NULL.
+    const char *(*find_multi)(const multi_literal *m, const char *p, const char *end,
+                              size_t *which);
+
+    long long (*count_newlines)(const char *p, const char *end);
+} kernel_set;
+
+// The fastest set this CPU supports
+const kernel_set *kernels_select(void);
+
+// A set by name ("scalar", "sse2", "avx2"), or NULL if it is unknown or
+// not supported here. Used by the microbenchmark.
+const kernel_set *kernels_variant(const char *name);
+
+// All variant names, NULL-terminated
+extern const char *const KERNEL_VARIANTS[];
+
+#endif
@@ -2,36 +2,100 @@
  * Select-String - PowerShell Select-String wrapper
  *
  * Calls PowerShell's Select-String command with all arguments passed through.
- * Handles both piped input and file arguments.
+ * Handles both piped input and file arguments. With --native the query runs
+ * in-process instead (see engine.c).
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <io.h>
-#include <fcntl.h>
+#include "compat.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "engine.h"
+#include "fanout.h"
+#include "numa.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
 
 #define BUFFER_SIZE 8192
 #define COMMAND_SIZE 32768
 #define PROGRAM_NAME "Select-String"
 #define VERSION "1.0.0"
+#define POWERSHELL_EXE "powershell.exe"
 
 static void print_usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s [PowerShell Select-String arguments]\n", program_name);
+    fprintf(stderr, "Usage: %s [options] [PowerShell Select-String arguments]\n", program_name);
     fprintf(stderr, "Wrapper for PowerShell's Select-String command.\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  --native       Search in-process instead of starting PowerShell\n");
+    fprintf(stderr, "  --interactive  Native search, smallest and newest files first, each match\n");
+    fprintf(stderr, "                 printed as soon as it is found\n");
+    fprintf(stderr, "  --threads N    Native search, N files at a time (output stays in order)\n");
+    fprintf(stderr, "  --unordered    Native search, each file's results written as soon as the\n");
+    fprintf(stderr, "                 file is done; one thread per CPU unless --threads is given\n");
+    fprintf(stderr, "  --affinity A   Native search, pin threads per NUMA node (numa, the default),\n");
+    fprintf(stderr, "                 not at all (none), or within a CPU list such as 0-7,16-23\n");
+    fprintf(stderr, "  --first N      Native search, stop after N matches in all\n");
+    fprintf(stderr, "  --max-count N  Native search, stop reading each file after N matches\n");
+    fprintf(stderr, "  --format F     Native search, output as text (default), ndjson or binary\n");
+    fprintf(stderr, "  --max-memory S Native search, keep buffers and caches under S bytes (K, M\n");
+    fprintf(stderr, "                 or G suffix), with fewer threads and smaller buffers\n");
+    fprintf(stderr, "  --read-buffer S\n");
+    fprintf(stderr, "                 Native search, read big files S bytes at a time (1M to 16M)\n");
+    fprintf(stderr, "  --cache-policy P\n");
+    fprintf(stderr, "                 Native search, leave files in the page cache (normal), drop\n");
+    fprintf(stderr, "                 them as they are read (noreuse), or bypass it (direct)\n");
+    fprintf(stderr, "  --workers N    Native search, files split across N worker processes\n");
+    fprintf(stderr, "  --compile-rules FILE\n");
+    fprintf(stderr, "                 Compile -Pattern (with -SimpleMatch, -CaseSensitive) into a\n");
+    fprintf(stderr, "                 rule file: the whole DFA, minimized, ready for --rules\n");
+    fprintf(stderr, "  --rules FILE   Native search with the patterns and DFA of a rule file\n");
+    fprintf(stderr, "  --jit          Native search, regex DFA compiled to x86-64 machine code\n");
+    fprintf(stderr, "  --generate-matchers SPEC FILE\n");
+    fprintf(stderr, "                 Write C matchers for the pattern sets in SPEC (one per line)\n");
+    fprintf(stderr, "                 to FILE, for a custom build (make custom)\n");
+    fprintf(stderr, "  --server PATH  Answer queries on the Unix socket PATH until killed\n");
+    fprintf(stderr, "  --connect PATH Native search, run by the server at PATH\n");
+    fprintf(stderr, "  --stats        Print per-phase timings and counters to stderr at exit\n");
+    fprintf(stderr, "  --trace FILE   Write a Chrome trace (chrome://tracing, Perfetto) to FILE\n");
+    fprintf(stderr, "  -h, --help     Show this help message\n");
+    fprintf(stderr, "  -v, --version  Show version information\n");
+    fprintf(stderr, "\nEnvironment:\n");
+    fprintf(stderr, "  SELECT_STRING_POWERSHELL  PowerShell executable (default: %s)\n", POWERSHELL_EXE);
+    fprintf(stderr, "  SELECT_STRING_SERVER      Server socket for native searches; searched\n");
+    fprintf(stderr, "                            in-process if no server answers\n");
     fprintf(stderr, "\nExamples:\n");
     fprintf(stderr, "  echo \"hello world\" | %s \"hello\"\n", program_name);
     fprintf(stderr, "  %s \"pattern\" -Path *.txt\n", program_name);
     fprintf(stderr, "  %s \"error\" file.log\n", program_name);
+    fprintf(stderr, "  %s --native \"error\" -Path *.log -Context 2\n", program_name);
+    fprintf(stderr, "  %s --compile-rules alerts.ssr -Pattern \"timeout\",\"fatal: .*\"\n", program_name);
+    fprintf(stderr, "  %s --rules alerts.ssr -Path *.log\n", program_name);
 }
 
 static void print_version(void) {
     printf("%s version %s (PowerShell wrapper)\n", PROGRAM_NAME, VERSION);
 }
 
+// The backend can be swapped out, e.g. for pwsh or a benchmark stub
+static const char *powershell_exe(void) {
+    const char *exe = getenv("SELECT_STRING_POWERSHELL");
+    return (exe != NULL && exe[0] != '\0') ? exe : POWERSHELL_EXE;
+}
+
 static int check_powershell_available(void) {
     // Try to execute a simple PowerShell command to verify it's available
-    FILE *test_pipe = _popen("powershell.exe -NoProfile -Command \"exit 0\" 2>nul", "r");
+    char command[COMMAND_SIZE];
+    int written = snprintf(command, COMMAND_SIZE, "%s -NoProfile -Command \"exit 0\" 2>" NULL_DEVICE,
+                           powershell_exe());
+    if (written < 0 || written >= COMMAND_SIZE) {
+        return 0;
+    }
+
+    stats.spawn_calls++;
+    FILE *test_pipe = _popen(command, "r");
     if (test_pipe == NULL) {
         return 0;  // Failed to execute
     }
@@ -40,6 +104,58 @@ static int check_powershell_available(void) {
     return (exit_code == 0);  // Return 1 if successful, 0 otherwise
 }
 
+// Piped input stays with the wrapper; the server cannot read our stdin
+static int stdin_piped(void) {
+    if (_isatty(_fileno(stdin))) {
+        return 0;
+    }
+#ifndef _WIN32
+    struct stat info;
+    return fstat(_fileno(stdin), &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISREG(info.st_mode));
+#else
+    return 1;
+#endif
+}
+
+// Reads the number that follows the wrapper option at argv[i]
+static int option_number(int argc, char *argv[], int i, long long max, long long *value) {
+    char *end = NULL;
+    long long n = i + 1 < argc ? strtoll(argv[i + 1], &end, 10) : 0;
+    if (end == NULL || end == argv[i + 1] || *end != '\0' || n < 1 || n > max) {
+        fprintf(stderr, "Error: %s requires a number from 1 to %lld\n", argv[i], max);
+        return 0;
+    }
+    *value = n;
+    return 1;
+}
+
+// Reads the size that follows the wrapper option at argv[i]: bytes, or
+// with a K, M or G suffix. `max` is 0 for no limit.
+static int option_size(int argc, char *argv[], int i, long long min, long long max, long long *value) {
+    char *end = NULL;
+    long long n = i + 1 < argc ? strtoll(argv[i + 1], &end, 10) : 0;
+    int shift = 0;
+    if (end != NULL && end != argv[i + 1] && end[0] != '\0' && end[1] == '\0') {
+        switch (*end | 0x20) {
+        case 'k': shift = 10; end++; break;
+        case 'm': shift = 20; end++; break;
+        case 'g': shift = 30; end++; break;
+        }
+    }
+    if (end == NULL || end == argv[i + 1] || *end != '\0' || n < 1 || n > (LLONG_MAX >> shift) ||
+        (n << shift) < min || (max > 0 && (n << shift) > max)) {
+        if (max > 0) {
+            fprintf(stderr, "Error: %s requires a size from %lldM to %lldM\n", argv[i], min >> 20, max >> 20);
+        } else {
+            fprintf(stderr, "Error: %s requires a size of at least %lldM, such as 512M or 2G\n", argv[i],
+                    min >> 20);
+        }
+        return 0;
+    }
+    *value = n << shift;
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
     // Parse arguments
     if (argc < 2) {
@@ -57,8 +173,249 @@ int main(int argc, char *argv[]) {
         return EXIT_SUCCESS;
     }
 
+#ifdef SIGPIPE
+    // A closed output pipe (`| head`) should end the search with a clean
+    // exit, which needs EPIPE from write() rather than a fatal signal
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    // Wrapper options come before the Select-String arguments. The first
+    // argument that is not one of ours starts those, even if it begins
+    // with "--", and goes to the backend unchanged as it always has
+    int native = 0;
+    const char *server = NULL;
+    const char *connect = NULL;
+    const char *compile_rules = NULL;
+    const char *rules = NULL;
+    const char *matcher_spec = NULL;
+    const char *matcher_file = NULL;
+    int jit = 0;
+    long long workers = 0;
+    engine_options options;
+    memset(&options, 0, sizeof(options));
+    int first_arg = 1;
+    while (first_arg < argc && strncmp(argv[first_arg], "--", 2) == 0) {
+        if (strcmp(argv[first_arg], "--native") == 0) {
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--interactive") == 0) {
+            // The probe, spool and PowerShell startup are exactly the
+            // latency this mode exists to avoid
+            native = 1;
+            options.interactive = 1;
+        } else if (strcmp(argv[first_arg], "--threads") == 0) {
+            long long threads;
+            if (!option_number(argc, argv, first_arg, 1024, &threads)) {
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+            options.threads = (int)threads;
+        } else if (strcmp(argv[first_arg], "--affinity") == 0) {
+            const char *affinity = first_arg + 1 < argc ? argv[first_arg + 1] : "";
+            numa_topology topology;
+            if (strcmp(affinity, "numa") != 0 && strcmp(affinity, "none") != 0 &&
+                !numa_detect(&topology, affinity)) {
+                fprintf(stderr, "Error: --affinity requires numa, none or a list of online CPUs\n");
+                return EXIT_FAILURE;
+            }
+            options.affinity = affinity;
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--workers") == 0) {
+            if (!option_number(argc, argv, first_arg, FANOUT_MAX_WORKERS, &workers)) {
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--first") == 0) {
+            if (!option_number(argc, argv, first_arg, LLONG_MAX, &options.first)) {
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--max-count") == 0) {
+            if (!option_number(argc, argv, first_arg, LLONG_MAX, &options.max_count)) {
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--max-memory") == 0) {
+            if (!option_size(argc, argv, first_arg, 1 << 20, 0, &options.max_memory)) {
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--read-buffer") == 0) {
+            if (!option_size(argc, argv, first_arg, 1 << 20, ENGINE_MAX_READ_BUFFER, &options.read_buffer)) {
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--cache-policy") == 0) {
+            const char *policy = first_arg + 1 < argc ? argv[first_arg + 1] : "";
+            if (strcmp(policy, "normal") == 0) {
+                options.cache_policy = SS_CACHE_NORMAL;
+            } else if (strcmp(policy, "noreuse") == 0) {
+                options.cache_policy = SS_CACHE_NOREUSE;
+            } else if (strcmp(policy, "direct") == 0) {
+                options.cache_policy = SS_CACHE_DIRECT;
+            } else {
+                fprintf(stderr, "Error: --cache-policy requires normal, noreuse or direct\n");
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--format") == 0) {
+            const char *format = first_arg + 1 < argc ? argv[first_arg + 1] : "";
+            if (strcmp(format, "text") == 0) {
+                options.format = ENGINE_FORMAT_TEXT;
+            } else if (strcmp(format, "ndjson") == 0) {
+                options.format = ENGINE_FORMAT_NDJSON;
+            } else if (strcmp(format, "binary") == 0) {
+                options.format = ENGINE_FORMAT_BINARY;
+            } else {
+                fprintf(stderr, "Error: --format requires text, ndjson or binary\n");
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            native = 1;
+        } else if (strcmp(argv[first_arg], "--server") == 0 || strcmp(argv[first_arg], "--connect") == 0) {
+            if (first_arg + 1 == argc) {
+                fprintf(stderr, "Error: %s requires a socket path\n", argv[first_arg]);
+                return EXIT_FAILURE;
+            }
+            if (argv[first_arg][2] == 's') {
+                server = argv[first_arg + 1];
+            } else {
+                connect = argv[first_arg + 1];
+                native = 1;
+            }
+            first_arg++;
+        } else if (strcmp(argv[first_arg], "--compile-rules") == 0 || strcmp(argv[first_arg], "--rules") == 0) {
+            if (first_arg + 1 == argc) {
+                fprintf(stderr, "Error: %s requires a file name\n", argv[first_arg]);
+                return EXIT_FAILURE;
+            }
+            if (argv[first_arg][2] == 'c') {
+                compile_rules = argv[first_arg + 1];
+            } else {
+                rules = argv[first_arg + 1];
+                native = 1;
+            }
+            first_arg++;
+        } else if (strcmp(argv[first_arg], "--generate-matchers") == 0) {
+            if (first_arg + 2 >= argc) {
+                fprintf(stderr, "Error: --generate-matchers requires a spec file and an output file\n");
+                return EXIT_FAILURE;
+            }
+            matcher_spec = argv[first_arg + 1];
+            matcher_file = argv[first_arg + 2];
+            first_arg += 2;
+        } else if (strcmp(argv[first_arg], "--jit") == 0) {
+            native = 1;
+            jit = 1;
+        } else if (strcmp(argv[first_arg], "--unordered") == 0) {
+            native = 1;
+            options.unordered = 1;
+        } else if (strcmp(argv[first_arg], "--stats") == 0) {
+            stats_enable();
+        } else if (strcmp(argv[first_arg], "--trace") == 0) {
+            if (first_arg + 1 == argc) {
+                fprintf(stderr, "Error: --trace requires a file name\n");
+                return EXIT_FAILURE;
+            }
+            first_arg++;
+            if (!trace_open(argv[first_arg])) {
+                fprintf(stderr, "Error: Cannot create trace file %s\n", argv[first_arg]);
+                return EXIT_FAILURE;
+            }
+        } else {
+            break;
+        }
+        first_arg++;
+    }
+    if (server != NULL) {
+        if (first_arg != argc) {
+            fprintf(stderr, "Error: --server takes no Select-String arguments\n");
+            return EXIT_FAILURE;
+        }
+        return server_run(server);
+    }
+    if (compile_rules != NULL) {
+        char error[512];
+        long size = ss_compile_rules(argc - first_arg, argv + first_arg, compile_rules, error, sizeof(error));
+        if (size < 0) {
+            fprintf(stderr, "Error: %s\n", error);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "Wrote %s (%ld bytes)\n", compile_rules, size);
+        return EXIT_SUCCESS;
+    }
+    if (matcher_spec != NULL) {
+        char error[512];
+        if (first_arg != argc) {
+            fprintf(stderr, "Error: --generate-matchers takes its patterns from the spec file\n");
+            return EXIT_FAILURE;
+        }
+        long count = ss_generate_matchers(matcher_spec, matcher_file, error, sizeof(error));
+        if (count < 0) {
+            fprintf(stderr, "Error: %s\n", error);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "Wrote %s (%ld matchers)\n", matcher_file, count);
+        return EXIT_SUCCESS;
+    }
+    // A rule file has the patterns, so piped input needs no arguments at all
+    if (first_arg == argc && rules == NULL) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (rules != NULL || jit) {
+        // Searched in-process: the server compiles its queries from
+        // arguments, and the workers of --workers inherit this one
+        char error[512];
+        options.query = rules != NULL ? ss_load_rules(rules, argc - first_arg, argv + first_arg, error, sizeof(error))
+                                      : ss_compile(argc - first_arg, argv + first_arg, error, sizeof(error));
+        if (options.query == NULL) {
+            fprintf(stderr, "Error: %s\n", error);
+            return EXIT_FAILURE;
+        }
+        if (jit) {
+            ss_query_jit(options.query);
+        }
+        int code = workers > 0 ? fanout_run(argc - first_arg, argv + first_arg, &options, (int)workers)
+                               : engine_run(argc - first_arg, argv + first_arg, &options);
+        ss_query_free(options.query);
+        return code;
+    }
+
+    if (native && workers > 0) {
+        return fanout_run(argc - first_arg, argv + first_arg, &options, (int)workers);
+    }
+    if (native) {
+        // A running server has the patterns compiled and the files mapped
+        // already; without one, search in-process as usual
+        const char *socket = connect != NULL ? connect : getenv("SELECT_STRING_SERVER");
+        if (socket != NULL && socket[0] != '\0' && !stdin_piped()) {
+            int code = server_query(socket, argc - first_arg, argv + first_arg, &options);
+            if (code >= 0) {
+                return code;
+            }
+            if (connect != NULL) {
+                fprintf(stderr, "Error: No server is listening on %s\n", connect);
+                return EXIT_FAILURE;
+            }
+        }
+        return engine_run(argc - first_arg, argv + first_arg, &options);
+    }
+
     // Check if PowerShell is available in PATH
-    if (!check_powershell_available()) {
+    stats_enter(PHASE_PROBE);
+    unsigned long long span = trace_begin();
+    int available = check_powershell_available();
+    trace_end("probe", span, NULL, -1);
+    stats_leave();
+    if (!available) {
         fprintf(stderr, "Error: PowerShell not found in PATH\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "This program requires PowerShell to be installed and available in your PATH.\n");
@@ -80,11 +437,13 @@ int main(int argc, char *argv[]) {
     if (is_piped) {
         // Use $input to receive piped data
         written = snprintf(command, COMMAND_SIZE,
-            "powershell.exe -NoProfile -Command \"$input | Microsoft.PowerShell.Utility\\Select-String");
+            "%s -NoProfile -Command \"$input | Microsoft.PowerShell.Utility\\Select-String",
+            powershell_exe());
     } else {
         // Direct command without piped input
         written = snprintf(command, COMMAND_SIZE,
-            "powershell.exe -NoProfile -Command \"Microsoft.PowerShell.Utility\\Select-String");
+            "%s -NoProfile -Command \"Microsoft.PowerShell.Utility\\Select-String",
+            powershell_exe());
     }
 
     // Check if snprintf failed or would overflow
@@ -100,7 +459,7 @@ int main(int argc, char *argv[]) {
     cmd_len = written;
 
     // Append all arguments
-    for (int i = 1; i < argc; i++) {
+    for (int i = first_arg; i < argc; i++) {
         // Escape quotes in arguments
         const char *arg = argv[i];
         int needs_quotes = 0;
@@ -142,11 +501,14 @@ int main(int argc, char *argv[]) {
     }
     cmd_len += written;
 
-    FILE *pipe = NULL;
+    ss_process backend;
     char *temp_file = NULL;
 
     // If stdin is piped, save it to a temporary file
     if (is_piped) {
+        stats_enter(PHASE_SPOOL);
+        span = trace_begin();
+
         // Create temporary file
         temp_file = _tempnam(NULL, "ss_");
         if (temp_file == NULL) {
@@ -166,7 +528,10 @@ int main(int argc, char *argv[]) {
         size_t bytes_read;
         size_t bytes_written;
         while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, stdin)) > 0) {
+            stats.read_calls++;
+            stats.bytes_read += (long long)bytes_read;
             bytes_written = fwrite(buffer, 1, bytes_read, temp);
+            stats.write_calls++;
             if (bytes_written != bytes_read) {
                 fprintf(stderr, "Error: Failed to write data to temporary file\n");
                 fprintf(stderr, "Attempted to write %zu bytes, only wrote %zu bytes\n",
@@ -188,11 +553,13 @@ int main(int argc, char *argv[]) {
         }
 
         fclose(temp);
+        trace_end("spool", span, temp_file, stats.bytes_read);
+        stats_leave();
 
         // Rebuild command to use Get-Content with the temp file
         written = snprintf(command, COMMAND_SIZE,
-            "powershell.exe -NoProfile -Command \"Get-Content -Raw '%s' | Microsoft.PowerShell.Utility\\Select-String",
-            temp_file);
+            "%s -NoProfile -Command \"Get-Content -Raw '%s' | Microsoft.PowerShell.Utility\\Select-String",
+            powershell_exe(), temp_file);
 
         // Check if snprintf failed or would overflow
         if (written < 0) {
@@ -212,7 +579,7 @@ int main(int argc, char *argv[]) {
         cmd_len = written;
 
         // Append all arguments again
-        for (int i = 1; i < argc; i++) {
+        for (int i = first_arg; i < argc; i++) {
             const char *arg = argv[i];
             int needs_quotes = (strchr(arg, ' ') != NULL);
 
@@ -257,9 +624,14 @@ int main(int argc, char *argv[]) {
         cmd_len += written;
     }
 
-    // Open pipe to PowerShell (read mode)
-    pipe = _popen(command, "r");
-    if (pipe == NULL) {
+    // Start PowerShell with its output on a pipe
+    stats_enter(PHASE_SPAWN);
+    stats.spawn_calls++;
+    span = trace_begin();
+    int spawned = ss_spawn(command, &backend);
+    trace_end("spawn", span, NULL, -1);
+    stats_leave();
+    if (!spawned) {
         fprintf(stderr, "Error: Failed to execute PowerShell\n");
         if (temp_file) {
             remove(temp_file);
@@ -268,34 +640,76 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    // Read and output results from PowerShell
+    // Copy PowerShell's results to stdout as they arrive. Time spent
+    // waiting on the pipe is PowerShell's search time, so it counts as the
+    // match phase. If whoever reads our output goes away, PowerShell is
+    // stopped rather than left to finish a search nobody will see.
     char buffer[BUFFER_SIZE];
-    while (fgets(buffer, BUFFER_SIZE, pipe) != NULL) {
-        if (printf("%s", buffer) < 0) {
-            fprintf(stderr, "Error: Failed to write output to stdout\n");
-            _pclose(pipe);
-            if (temp_file) {
-                remove(temp_file);
-                free(temp_file);
+    int read_failed = 0;
+    int closed = 0;
+    stats_enter(PHASE_MATCH);
+    span = trace_begin();
+    for (;;) {
+        if (!ss_wait_readable(backend.out, 1)) {
+            closed = 1;
+            break;
+        }
+        long n = (long)ss_read(backend.out, buffer, BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            read_failed = n < 0;
+            break;
+        }
+        stats.read_calls++;
+        trace_end("match", span, NULL, -1);
+        stats_leave();
+        stats_enter(PHASE_OUTPUT);
+        stats_first_output();
+        span = trace_begin();
+        stats.bytes_read += n;
+        long done = 0;
+        while (done < n) {
+            long w = (long)ss_write(1, buffer + done, (unsigned)(n - done));
+            stats.write_calls++;
+            if (w < 0 && errno == EINTR) {
+                continue;
             }
-            return EXIT_FAILURE;
+            if (w <= 0) {
+                break;
+            }
+            done += w;
         }
-        fflush(stdout);
-    }
-
-    // Check if loop ended due to error or EOF
-    if (ferror(pipe)) {
-        fprintf(stderr, "Error: Failed to read output from PowerShell\n");
-        _pclose(pipe);
-        if (temp_file) {
-            remove(temp_file);
-            free(temp_file);
+        stats.bytes_written += done;
+        trace_end("write", span, NULL, done);
+        stats_leave();
+        if (done < n) {
+            if (errno != EPIPE) {
+                fprintf(stderr, "Error: Failed to write output to stdout\n");
+                ss_kill(&backend);
+                ss_wait(&backend);
+                if (temp_file) {
+                    remove(temp_file);
+                    free(temp_file);
+                }
+                return EXIT_FAILURE;
+            }
+            closed = 1;
+            stats_enter(PHASE_MATCH);
+            span = trace_begin();
+            break;
         }
-        return EXIT_FAILURE;
+        stats_enter(PHASE_MATCH);
+        span = trace_begin();
     }
+    trace_end("match", span, NULL, -1);
+    stats_leave();
 
-    // Close pipe and get exit code
-    int exit_code = _pclose(pipe);
+    if (closed) {
+        ss_kill(&backend);
+    }
+    int exit_code = ss_wait(&backend);
 
     // Clean up temp file if it was created
     if (temp_file) {
@@ -303,5 +717,10 @@ int main(int argc, char *argv[]) {
         free(temp_file);
     }
 
-    return exit_code;
+    // Check if loop ended due to error or EOF
+    if (read_failed) {
+        fprintf(stderr, "Error: Failed to read output from PowerShell\n");
+        return EXIT_FAILURE;
+    }
+    return closed ? EXIT_SUCCESS : exit_code;
 }
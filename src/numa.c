@@ -0,0 +1,218 @@
+/*
+ * numa.c - NUMA topology, thread pinning and file placement
+ *
+ * The layout comes from sysfs rather than libnuma, so there is nothing
+ * to link. Memory placement relies on the kernel's first-touch policy: a
+ * thread pinned to a node gets that node's memory for whatever it
+ * allocates and touches first, which covers the read buffers, the DFA and
+ * the output blocks without binding them explicitly.
+ */
+
+#define _GNU_SOURCE
+
+#include "compat.h"
+
+#include "numa.h"
+
+#ifdef __linux__
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef NUMA_SYSFS_DIR
+#define NUMA_SYSFS_DIR "/sys/devices/system"
+#endif
+
+#define SAMPLE_PAGES 8
+
+static void set_cpu(unsigned char *set, int cpu) {
+    set[cpu / 8] |= (unsigned char)(1 << (cpu % 8));
+}
+
+static int has_cpu(const unsigned char *set, int cpu) {
+    return (set[cpu / 8] >> (cpu % 8)) & 1;
+}
+
+// Parses a CPU list such as "0-3,8,10-11" into `set`
+static int parse_cpus(const char *list, unsigned char *set) {
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        if (*p < '0' || *p > '9') {
+            return 0;
+        }
+        char *end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            if (*p < '0' || *p > '9') {
+                return 0;
+            }
+            hi = strtol(p, &end, 10);
+            p = end;
+        }
+        if (hi < lo || hi >= NUMA_MAX_CPUS) {
+            return 0;
+        }
+        for (long cpu = lo; cpu <= hi; cpu++) {
+            set_cpu(set, (int)cpu);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int read_line(const char *path, char *line, int size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    int ok = fgets(line, size, file) != NULL;
+    fclose(file);
+    return ok;
+}
+
+// Adds the CPUs of `set` that are also in `usable` as a node
+static void add_node(numa_topology *t, int id, const unsigned char *set, const unsigned char *usable) {
+    int count = 0;
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS; cpu++) {
+        if (has_cpu(set, cpu) && has_cpu(usable, cpu)) {
+            set_cpu(t->cpus[t->node_count], cpu);
+            count++;
+        }
+    }
+    if (count > 0) {
+        t->node_id[t->node_count] = id;
+        t->cpu_count[t->node_count++] = count;
+        t->cpu_total += count;
+    }
+}
+
+int numa_detect(numa_topology *t, const char *only) {
+    memset(t, 0, sizeof(*t));
+    unsigned char usable[NUMA_MAX_CPUS / 8];
+    memset(usable, 0, sizeof(usable));
+    char line[4096];
+    if (!read_line(NUMA_SYSFS_DIR "/cpu/online", line, sizeof(line)) || !parse_cpus(line, usable)) {
+        for (int cpu = 0; cpu < ss_cpu_count() && cpu < NUMA_MAX_CPUS; cpu++) {
+            set_cpu(usable, cpu);
+        }
+    }
+    if (only != NULL) {
+        unsigned char allowed[NUMA_MAX_CPUS / 8];
+        memset(allowed, 0, sizeof(allowed));
+        if (!parse_cpus(only, allowed)) {
+            return 0;
+        }
+        for (size_t i = 0; i < sizeof(usable); i++) {
+            usable[i] &= allowed[i];
+        }
+    }
+
+    for (int id = 0; id < NUMA_MAX_NODES; id++) {
+        char path[256];
+        unsigned char set[NUMA_MAX_CPUS / 8];
+        memset(set, 0, sizeof(set));
+        snprintf(path, sizeof(path), NUMA_SYSFS_DIR "/node/node%d/cpulist", id);
+        if (read_line(path, line, sizeof(line)) && parse_cpus(line, set)) {
+            add_node(t, id, set, usable);
+        }
+    }
+    if (t->node_count == 0) {
+        // No NUMA in this kernel: one node with every CPU
+        add_node(t, 0, usable, usable);
+    }
+    return t->node_count > 0;
+}
+
+int numa_bind(const numa_topology *t, int node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (has_cpu(t->cpus[node], cpu)) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    // pid 0 is the calling thread, not the whole process
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+int numa_file_node(const char *path) {
+    int fd = ss_open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        ss_close(fd);
+        return -1;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (size_t)info.st_size;
+    size_t pages = (size + page - 1) / page;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ss_close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    // Only pages already in the page cache are looked at: mapping one of
+    // them is a minor fault, where touching any other would read it
+    void *sampled[SAMPLE_PAGES];
+    int status[SAMPLE_PAGES];
+    unsigned long count = 0;
+    for (size_t i = 0; i < SAMPLE_PAGES && i < pages; i++) {
+        char *at = map + pages * i / (pages < SAMPLE_PAGES ? pages : SAMPLE_PAGES) * page;
+        unsigned char resident = 0;
+        if (mincore(at, page, &resident) == 0 && (resident & 1)) {
+            volatile char touch = *at;
+            (void)touch;
+            sampled[count++] = at;
+        }
+    }
+    int votes[NUMA_MAX_NODES];
+    memset(votes, 0, sizeof(votes));
+    // With no target nodes, move_pages() only reports where each page is
+    if (count > 0 && syscall(SYS_move_pages, 0, count, sampled, NULL, status, 0) == 0) {
+        for (unsigned long i = 0; i < count; i++) {
+            if (status[i] >= 0 && status[i] < NUMA_MAX_NODES) {
+                votes[status[i]]++;
+            }
+        }
+    }
+    munmap(map, size);
+    int best = -1;
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        if (votes[node] > 0 && (best < 0 || votes[node] > votes[best])) {
+            best = node;
+        }
+    }
+    return best;
+}
+
+#else
+
+int numa_detect(numa_topology *t, const char *only) {
+    memset(t, 0, sizeof(*t));
+    return only == NULL;
+}
+
+int numa_bind(const numa_topology *t, int node) {
+    (void)t;
+    (void)node;
+    return 0;
+}
+
+int numa_file_node(const char *path) {
+    (void)path;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * numa.h - NUMA topology, thread pinning and file placement
+ */
+
+#ifndef SS_NUMA_H
+#define SS_NUMA_H
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+
+typedef struct {
+    int node_count;                 // 0 when nothing can be pinned
+    int cpu_total;
+    int node_id[NUMA_MAX_NODES];    // the kernel's number for each node
+    int cpu_count[NUMA_MAX_NODES];
+    unsigned char cpus[NUMA_MAX_NODES][NUMA_MAX_CPUS / 8];
+} numa_topology;
+
+// Reads the node layout from sysfs. `only` is NULL for every CPU, or a
+// CPU list ("0-7,16-23") the layout is limited to. A machine without NUMA
+// is one node. Returns 0 if `only` is not a valid list or names no CPU
+// that is online.
+int numa_detect(numa_topology *t, const char *only);
+
+// Pins the calling thread to the CPUs of `node`, so what it allocates and
+// touches first lands in that node's memory. Returns 0 on failure.
+int numa_bind(const numa_topology *t, int node);
+
+// The node whose memory holds most of the file's cached pages (sampled),
+// or -1 if none of them are cached or it cannot be told
+int numa_file_node(const char *path);
+
+#endif
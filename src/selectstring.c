@@ -0,0 +1,1942 @@
+/*
+ * selectstring.c - libselectstring, the native Select-String engine
+ *
+ * Implements the common subset of Select-String without starting PowerShell:
+ * -Pattern, -Path, -LiteralPath, -SimpleMatch, -CaseSensitive, -NotMatch,
+ * -Context, -AllMatches, -Quiet, -List, -Raw, -Include and -Exclude.
+ * The library parses and compiles a query and finds the lines it selects;
+ * how they are printed, and which files are searched on which thread, is
+ * up to the caller (engine.c for the command line).
+ *
+ * Input is matched line by line, as `Get-Content | Select-String` would,
+ * rather than as one -Raw string.
+ *
+ * A rule file (ss_compile_rules()) holds a set of patterns with their DFA
+ * built, minimized and laid out ahead of time; ss_load_rules() maps it
+ * and searches with that table as it is.
+ */
+
+#define _GNU_SOURCE     // O_DIRECT
+
+#include "compat.h"
+#include <errno.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "selectstring.h"
+#include "arena.h"
+#include "automaton.h"
+#include "bufpool.h"
+#include "builtin.h"
+#include "kernels.h"
+#include "stats.h"
+#include "trace.h"
+
+#define READ_BUFFER_SIZE (256 * 1024)   // the most a file's read buffer grows to by default
+#define FIRST_READ_BUFFER_SIZE (64 * 1024)
+#define MIN_READ_BUFFER_SIZE 4096
+#define MAX_READ_CHUNK (1 << 30)
+#define DIRECT_ALIGN 4096               // O_DIRECT reads land on this boundary
+#define NOREUSE_BATCH (4 << 20)         // bytes read between drops from the page cache
+#define NOREUSE_ALIGN (2 << 20)         // ...cut where no large folio straddles
+
+// Formats into a caller's error buffer. Returns the length written.
+static size_t set_error(char *error, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(error, size, format, args);
+    va_end(args);
+    if (n < 0) {
+        return 0;
+    }
+    return (size_t)n < size ? (size_t)n : size;
+}
+
+// ---------------------------------------------------------------------------
+// Argument lists
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char **items;
+    size_t count;
+    size_t cap;
+} string_list;
+
+static int list_push(string_list *list, char *item) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 8;
+        char **items = realloc(list->items, cap * sizeof(*items));
+        if (items == NULL) {
+            return 0;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count++] = item;
+    return 1;
+}
+
+static void list_free(string_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+static char *copy_string(const char *s, size_t len) {
+    char *copy = malloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+// Splits a PowerShell array argument ("a,b,c") into its elements. Commas
+// inside (), [] or {} belong to the element, so "\d{1,3}" stays whole.
+static int split_array(const char *value, string_list *list) {
+    int depth = 0;
+    const char *start = value;
+    for (const char *p = value;; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+            continue;
+        }
+        if (*p == '(' || *p == '[' || *p == '{') {
+            depth++;
+        } else if ((*p == ')' || *p == ']' || *p == '}') && depth > 0) {
+            depth--;
+        } else if ((*p == ',' && depth == 0) || *p == '\0') {
+            size_t len = (size_t)(p - start);
+            if (len >= 2 && (start[0] == '\'' || start[0] == '"') && start[len - 1] == start[0]) {
+                start++;
+                len -= 2;
+            }
+            char *item = copy_string(start, len);
+            if (item == NULL || !list_push(list, item)) {
+                free(item);
+                return 0;
+            }
+            if (*p == '\0') {
+                return 1;
+            }
+            start = p + 1;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Query options
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    string_list patterns;
+    string_list paths;
+    string_list literal_paths;
+    string_list include;
+    string_list exclude;
+    int simple_match;
+    int case_sensitive;
+    int not_match;
+    int all_matches;
+    int quiet;
+    int list;
+    int raw;
+    int context_before;
+    int context_after;
+} query;
+
+enum {
+    PARAM_PATTERN,
+    PARAM_PATH,
+    PARAM_LITERAL_PATH,
+    PARAM_SIMPLE_MATCH,
+    PARAM_CASE_SENSITIVE,
+    PARAM_NOT_MATCH,
+    PARAM_ALL_MATCHES,
+    PARAM_QUIET,
+    PARAM_LIST,
+    PARAM_RAW,
+    PARAM_NO_EMPHASIS,
+    PARAM_CONTEXT,
+    PARAM_INCLUDE,
+    PARAM_EXCLUDE,
+    PARAM_ENCODING,
+    PARAM_CULTURE
+};
+
+typedef struct {
+    const char *name;
+    int id;
+    int is_switch;
+} param_spec;
+
+static const param_spec PARAMS[] = {
+    {"Pattern", PARAM_PATTERN, 0},
+    {"Path", PARAM_PATH, 0},
+    {"LiteralPath", PARAM_LITERAL_PATH, 0},
+    {"SimpleMatch", PARAM_SIMPLE_MATCH, 1},
+    {"CaseSensitive", PARAM_CASE_SENSITIVE, 1},
+    {"NotMatch", PARAM_NOT_MATCH, 1},
+    {"AllMatches", PARAM_ALL_MATCHES, 1},
+    {"Quiet", PARAM_QUIET, 1},
+    {"List", PARAM_LIST, 1},
+    {"Raw", PARAM_RAW, 1},
+    {"NoEmphasis", PARAM_NO_EMPHASIS, 1},
+    {"Context", PARAM_CONTEXT, 0},
+    {"Include", PARAM_INCLUDE, 0},
+    {"Exclude", PARAM_EXCLUDE, 0},
+    {"Encoding", PARAM_ENCODING, 0},
+    {"Culture", PARAM_CULTURE, 0},
+};
+
+#define PARAM_COUNT (sizeof(PARAMS) / sizeof(PARAMS[0]))
+
+static int name_has_prefix(const char *name, const char *prefix, size_t len) {
+    if (strlen(name) < len) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)name[i]) != tolower((unsigned char)prefix[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Resolves a parameter name the way PowerShell does: case-insensitive, and
+// any unambiguous prefix is accepted
+static const param_spec *find_param(const char *name, size_t len, char *error, size_t error_size) {
+    const param_spec *found = NULL;
+    int matches = 0;
+    for (size_t i = 0; i < PARAM_COUNT; i++) {
+        if (!name_has_prefix(PARAMS[i].name, name, len)) {
+            continue;
+        }
+        if (strlen(PARAMS[i].name) == len) {
+            return &PARAMS[i];
+        }
+        found = &PARAMS[i];
+        matches++;
+    }
+    if (matches > 1) {
+        size_t used = set_error(error, error_size,
+                                "Parameter name '%.*s' is ambiguous. Possible matches include:",
+                                (int)len, name);
+        for (size_t i = 0; i < PARAM_COUNT; i++) {
+            if (name_has_prefix(PARAMS[i].name, name, len) && used < error_size) {
+                used += set_error(error + used, error_size - used, " -%s", PARAMS[i].name);
+            }
+        }
+        return NULL;
+    }
+    if (matches == 0) {
+        set_error(error, error_size, "A parameter cannot be found that matches parameter name '%.*s'",
+                  (int)len, name);
+    }
+    return found;
+}
+
+static int parse_context(const char *value, query *q, char *error, size_t error_size) {
+    string_list parts;
+    memset(&parts, 0, sizeof(parts));
+    if (!split_array(value, &parts)) {
+        set_error(error, error_size, "Out of memory");
+        return 0;
+    }
+
+    int ok = parts.count == 1 || parts.count == 2;
+    int numbers[2] = {0, 0};
+    for (size_t i = 0; ok && i < parts.count; i++) {
+        char *end;
+        long n = strtol(parts.items[i], &end, 10);
+        if (parts.items[i][0] == '\0' || *end != '\0' || n < 0 || n > 1000000) {
+            ok = 0;
+        }
+        numbers[i] = (int)n;
+    }
+    if (ok) {
+        q->context_before = numbers[0];
+        q->context_after = parts.count == 2 ? numbers[1] : numbers[0];
+    } else {
+        set_error(error, error_size,
+                  "Cannot validate argument on parameter 'Context': '%s' is not one or two non-negative integers",
+                  value);
+    }
+    list_free(&parts);
+    return ok;
+}
+
+static int parse_query(int argc, char *argv[], query *q, char *error, size_t error_size) {
+    int positional = 0;
+
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = NULL;
+
+        if (arg[0] != '-' || arg[1] == '\0' || isdigit((unsigned char)arg[1])) {
+            // Positional: -Pattern first, then -Path
+            string_list *target = NULL;
+            while (target == NULL && positional < 2) {
+                if (positional == 0 && q->patterns.count == 0) {
+                    target = &q->patterns;
+                } else if (positional == 1 && q->paths.count == 0 && q->literal_paths.count == 0) {
+                    target = &q->paths;
+                }
+                positional++;
+            }
+            if (target == NULL) {
+                set_error(error, error_size, "A positional parameter cannot be found that accepts argument '%s'", arg);
+                return 0;
+            }
+            if (!split_array(arg, target)) {
+                set_error(error, error_size, "Out of memory");
+                return 0;
+            }
+            continue;
+        }
+
+        const char *name = arg + 1;
+        const char *colon = strchr(name, ':');
+        size_t name_len = colon ? (size_t)(colon - name) : strlen(name);
+        const param_spec *spec = find_param(name, name_len, error, error_size);
+        if (spec == NULL) {
+            return 0;
+        }
+
+        if (spec->is_switch) {
+            int on = 1;
+            if (colon != NULL) {
+                on = strcmp(colon + 1, "$false") != 0 && strcmp(colon + 1, "0") != 0;
+            }
+            switch (spec->id) {
+            case PARAM_SIMPLE_MATCH: q->simple_match = on; break;
+            case PARAM_CASE_SENSITIVE: q->case_sensitive = on; break;
+            case PARAM_NOT_MATCH: q->not_match = on; break;
+            case PARAM_ALL_MATCHES: q->all_matches = on; break;
+            case PARAM_QUIET: q->quiet = on; break;
+            case PARAM_LIST: q->list = on; break;
+            case PARAM_RAW: q->raw = on; break;
+            default: break;
+            }
+            continue;
+        }
+
+        if (colon != NULL) {
+            value = colon + 1;
+        } else if (i + 1 < argc) {
+            value = argv[++i];
+        } else {
+            set_error(error, error_size, "Missing an argument for parameter '%s'", spec->name);
+            return 0;
+        }
+
+        string_list *target = NULL;
+        switch (spec->id) {
+        case PARAM_PATTERN: target = &q->patterns; break;
+        case PARAM_PATH: target = &q->paths; break;
+        case PARAM_LITERAL_PATH: target = &q->literal_paths; break;
+        case PARAM_INCLUDE: target = &q->include; break;
+        case PARAM_EXCLUDE: target = &q->exclude; break;
+        case PARAM_CONTEXT:
+            if (!parse_context(value, q, error, error_size)) {
+                return 0;
+            }
+            break;
+        default:
+            // -Encoding and -Culture: input encoding comes from the byte
+            // order mark, and matching is culture-invariant
+            break;
+        }
+        if (target != NULL && !split_array(value, target)) {
+            set_error(error, error_size, "Out of memory");
+            return 0;
+        }
+    }
+
+    if (q->patterns.count == 0) {
+        set_error(error, error_size, "Missing an argument for parameter 'Pattern'");
+        return 0;
+    }
+    for (size_t i = 0; i < q->patterns.count; i++) {
+        if (q->patterns.items[i][0] == '\0') {
+            set_error(error, error_size, "Cannot bind argument to parameter 'Pattern' because it is an empty string");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void query_free(query *q) {
+    list_free(&q->patterns);
+    list_free(&q->paths);
+    list_free(&q->literal_paths);
+    list_free(&q->include);
+    list_free(&q->exclude);
+}
+
+// ---------------------------------------------------------------------------
+// Matching
+// ---------------------------------------------------------------------------
+
+enum {
+    MATCHER_LITERAL,
+    MATCHER_LITERAL_NOCASE,
+    MATCHER_MULTI_LITERAL,
+    MATCHER_AUTOMATON
+};
+
+typedef struct {
+    int kind;
+    char *literal;
+    size_t literal_len;
+    multi_literal *multi;
+    char **literals;            // MATCHER_MULTI_LITERAL, folded if case-insensitive
+    size_t *literal_lens;
+    size_t literal_count;
+    automaton *automaton;
+} matcher;
+
+static const kernel_set *kernels;
+
+// Several patterns that are all plain literals are searched for together.
+// Returns 0 only on allocation failure; m->multi stays NULL when the
+// patterns are not all literal.
+static int multi_literal_init(matcher *m, const query *q) {
+    size_t count = q->patterns.count;
+    char **literals = calloc(count, sizeof(*literals));
+    size_t *lens = calloc(count, sizeof(*lens));
+    int ok = literals != NULL && lens != NULL;
+    int all_literal = ok;
+    for (size_t i = 0; ok && all_literal && i < count; i++) {
+        const char *pattern = q->patterns.items[i];
+        size_t len = strlen(pattern);
+        literals[i] = malloc(len + 1);
+        if (literals[i] == NULL) {
+            ok = 0;
+            break;
+        }
+        if (q->simple_match) {
+            memcpy(literals[i], pattern, len);
+        } else if (!automaton_literal(pattern, literals[i], &len)) {
+            len = 0;
+        }
+        lens[i] = len;
+        all_literal = len > 0 && memchr(literals[i], '\n', len) == NULL;
+    }
+    if (ok && all_literal) {
+        m->multi = multi_literal_new((const char *const *)literals, lens, count, !q->case_sensitive);
+        ok = m->multi != NULL;
+    }
+    if (ok && m->multi != NULL) {
+        // Kept to tell which pattern matched, for ss_line_spans()
+        for (size_t i = 0; !q->case_sensitive && i < count; i++) {
+            for (size_t j = 0; j < lens[i]; j++) {
+                literals[i][j] = (char)kernel_fold[(unsigned char)literals[i][j]];
+            }
+        }
+        m->literals = literals;
+        m->literal_lens = lens;
+        m->literal_count = count;
+        return 1;
+    }
+    for (size_t i = 0; literals != NULL && i < count; i++) {
+        free(literals[i]);
+    }
+    free(literals);
+    free(lens);
+    return ok;
+}
+
+static int automaton_flags(const query *q) {
+    return (q->case_sensitive ? 0 : AUTOMATON_IGNORE_CASE) | (q->simple_match ? AUTOMATON_LITERAL : 0);
+}
+
+static int matcher_init(matcher *m, const query *q, char *error, size_t error_size) {
+    memset(m, 0, sizeof(*m));
+
+    if (q->patterns.count > 1) {
+        if (!multi_literal_init(m, q)) {
+            set_error(error, error_size, "Out of memory");
+            return 0;
+        }
+        if (m->multi != NULL) {
+            m->kind = MATCHER_MULTI_LITERAL;
+            return 1;
+        }
+    }
+
+    // A single pattern without metacharacters skips the automaton
+    if (q->patterns.count == 1) {
+        const char *pattern = q->patterns.items[0];
+        size_t len = strlen(pattern);
+        char *literal = malloc(len + 1);
+        if (literal == NULL) {
+            set_error(error, error_size, "Out of memory");
+            return 0;
+        }
+        if (q->simple_match) {
+            memcpy(literal, pattern, len);
+        } else if (!automaton_literal(pattern, literal, &len)) {
+            len = 0;
+        }
+        if (len > 0 && memchr(literal, '\n', len) == NULL) {
+            m->kind = q->case_sensitive ? MATCHER_LITERAL : MATCHER_LITERAL_NOCASE;
+            if (m->kind == MATCHER_LITERAL_NOCASE) {
+                for (size_t i = 0; i < len; i++) {
+                    literal[i] = (char)kernel_fold[(unsigned char)literal[i]];
+                }
+            }
+            m->literal = literal;
+            m->literal_len = len;
+            return 1;
+        }
+        free(literal);
+    }
+
+    char reason[256];
+    m->kind = MATCHER_AUTOMATON;
+    m->automaton = automaton_compile((const char *const *)q->patterns.items, q->patterns.count,
+                                     automaton_flags(q), reason, sizeof(reason));
+    if (m->automaton == NULL) {
+        set_error(error, error_size, "Invalid pattern: %s", reason);
+        return 0;
+    }
+    return 1;
+}
+
+static void matcher_free(matcher *m) {
+    free(m->literal);
+    multi_literal_free(m->multi);
+    for (size_t i = 0; i < m->literal_count; i++) {
+        free(m->literals[i]);
+    }
+    free(m->literals);
+    free(m->literal_lens);
+    automaton_free(m->automaton);
+}
+
+typedef struct scan_state scan_state;
+
+// Scans the complete lines in buf[start, end); one per matcher kind and
+// line selection mode (see scan_variants)
+typedef void (*scan_fn)(scan_state *st, const char *buf, size_t start, size_t end);
+
+struct ss_query {
+    query q;
+    matcher m;                  // the automaton here is only cloned, never run
+    scan_fn scan;               // picked for the matcher and switches
+    ss_query_info info;
+    void *rules;                // the rule file its DFA is in, if any (ss_load_rules())
+    size_t rules_len;
+};
+
+// Per-thread state. The lazy DFA fills itself in as it runs, so every
+// scratch context has its own copy of the automaton; literals are shared.
+struct ss_scratch {
+    const ss_query *query;
+    automaton *automaton;
+    char *buf;
+    size_t cap;
+    size_t read_size;           // the most a file's buffer grows to; cut back to after a long line
+    int cache_policy;           // SS_CACHE_*
+    ss_span *spans;             // in line_arena
+    size_t span_cap;
+    arena file_arena;           // reset per scan: held -Context lines, decoded UTF-16
+    arena line_arena;           // reset per ss_line_spans()
+    const char *line_text;      // the line being handed to the callback...
+    size_t line_len;            // ...and its length before the \r was cut
+    char error[512];
+};
+
+// Each finds the first matching line in [p, end) for one matcher kind;
+// `p` is at a line start. Returns a pointer somewhere inside that line, or
+// NULL. The scan loops are instantiated per kind, so none is switched on.
+static inline const char *find_literal(const ss_scratch *s, const char *p, const char *end) {
+    const matcher *m = &s->query->m;
+    return kernels->find_literal(p, end, m->literal, m->literal_len);
+}
+
+static inline const char *find_literal_nocase(const ss_scratch *s, const char *p, const char *end) {
+    const matcher *m = &s->query->m;
+    return kernels->find_literal_nocase(p, end, m->literal, m->literal_len);
+}
+
+static inline const char *find_multi(const ss_scratch *s, const char *p, const char *end) {
+    return kernels->find_multi(s->query->m.multi, p, end, NULL);
+}
+
+static inline const char *find_automaton(const ss_scratch *s, const char *p, const char *end) {
+    return automaton_find_line(s->automaton, p, end);
+}
+
+static int add_span(ss_scratch *s, size_t *count, size_t start, size_t end) {
+    if (*count == s->span_cap) {
+        size_t cap = s->span_cap == 0 ? 8 : s->span_cap * 2;
+        ss_span *spans = arena_alloc(&s->line_arena, cap * sizeof(*spans));
+        if (spans == NULL) {
+            return 0;
+        }
+        if (*count > 0) {
+            memcpy(spans, s->spans, *count * sizeof(*spans));
+        }
+        s->spans = spans;
+        s->span_cap = cap;
+    }
+    s->spans[*count].start = start;
+    s->spans[*count].end = end;
+    (*count)++;
+    return 1;
+}
+
+// The first pattern in order that matches, and its first match or, with
+// -AllMatches, every non-overlapping one. Spans go to s->spans.
+static size_t find_spans(ss_scratch *s, const char *line, size_t len, int *pattern) {
+    const query *q = &s->query->q;
+    const matcher *m = &s->query->m;
+    const char *end = line + len;
+    size_t count = 0;
+    *pattern = -1;
+
+    if (m->kind == MATCHER_AUTOMATON) {
+        for (int i = 0; i < (int)q->patterns.count && *pattern < 0; i++) {
+            automaton_span span;
+            size_t from = 0;
+            while (automaton_match(s->automaton, i, line, len, from, &span)) {
+                *pattern = i;
+                if (!add_span(s, &count, span.start, span.end) || !q->all_matches) {
+                    break;
+                }
+                // An empty match moves on a byte, as Regex.Matches does
+                from = span.end > span.start ? span.end : span.end + 1;
+            }
+        }
+        return count;
+    }
+
+    for (size_t i = 0; i < (m->kind == MATCHER_MULTI_LITERAL ? m->literal_count : 1) && *pattern < 0; i++) {
+        const char *needle = m->kind == MATCHER_MULTI_LITERAL ? m->literals[i] : m->literal;
+        size_t needle_len = m->kind == MATCHER_MULTI_LITERAL ? m->literal_lens[i] : m->literal_len;
+        int nocase = m->kind == MATCHER_LITERAL_NOCASE ||
+                     (m->kind == MATCHER_MULTI_LITERAL && !q->case_sensitive);
+        const char *p = line;
+        for (;;) {
+            const char *hit = nocase ? kernels->find_literal_nocase(p, end, needle, needle_len)
+                                     : kernels->find_literal(p, end, needle, needle_len);
+            if (hit == NULL) {
+                break;
+            }
+            *pattern = (int)i;
+            size_t start = (size_t)(hit - line);
+            if (!add_span(s, &count, start, start + needle_len) || !q->all_matches) {
+                break;
+            }
+            p = hit + needle_len;
+        }
+    }
+    return count;
+}
+
+// ---------------------------------------------------------------------------
+// Scanning
+// ---------------------------------------------------------------------------
+
+// Lines kept back for -Context's leading lines, as offsets into the buffer
+typedef struct {
+    size_t start;
+    size_t len;
+    long long number;
+} held_line;
+
+struct scan_state {
+    ss_scratch *s;
+    const query *q;
+    const ss_handler *handler;
+    const char *name;
+    const char *buf;            // buffer being scanned
+    long long base;             // input offset of buf[0]
+    long long line_number;      // lines consumed so far
+    long long last_printed;
+    int after_pending;
+    int done;                   // -List is satisfied, or a callback stopped the scan
+    int stopped;                // ...the latter
+    held_line *held;
+    int held_count;
+    int held_head;
+};
+
+static void emit_line(scan_state *st, const char *line, size_t len, long long number, int kind) {
+    ss_scratch *s = st->s;
+    ss_line out;
+    s->line_text = line;
+    s->line_len = len;
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    out.kind = kind;
+    out.path = st->name;
+    out.number = number;
+    out.offset = st->base + (long long)(line - st->buf);
+    out.text = line;
+    out.len = len;
+    if (st->handler->line(st->handler->user, &out)) {
+        st->done = 1;
+        st->stopped = 1;
+    }
+    s->line_text = NULL;
+}
+
+static void emit_match(scan_state *st, const char *line, size_t len, long long number) {
+    const query *q = st->q;
+
+    // Leading context, oldest first
+    int count = st->held_count;
+    for (int i = 0; i < count && !st->stopped; i++) {
+        int slot = (st->held_head - count + i + q->context_before) % q->context_before;
+        const held_line *h = &st->held[slot];
+        if (h->number > st->last_printed) {
+            emit_line(st, st->buf + h->start, h->len, h->number, SS_LINE_BEFORE);
+        }
+    }
+    st->held_count = 0;
+    if (st->stopped) {
+        return;
+    }
+
+    emit_line(st, line, len, number, SS_LINE_MATCH);
+    st->last_printed = number;
+    st->after_pending = q->context_after;
+    if (q->list) {
+        st->done = 1;
+    }
+}
+
+static void hold_line(scan_state *st, size_t start, size_t len, long long number) {
+    held_line *h = &st->held[st->held_head];
+    h->start = start;
+    h->len = len;
+    h->number = number;
+    st->held_head = (st->held_head + 1) % st->q->context_before;
+    if (st->held_count < st->q->context_before) {
+        st->held_count++;
+    }
+}
+
+// The start of the line before `q`, a line start or the end of the
+// region, looking no further back than `p`
+static const char *line_before(const char *p, const char *q) {
+    if (q > p) {
+        q--;
+    }
+    while (q > p && q[-1] != '\n') {
+        q--;
+    }
+    return q;
+}
+
+// The lines in [p, end), which -NotMatch selects. Returns where it
+// stopped, short of `end` if the scan is done.
+static const char *select_lines(scan_state *st, const char *p, const char *end) {
+    while (p < end && !st->done) {
+        const char *le = memchr(p, '\n', (size_t)(end - p));
+        const char *next = le != NULL ? le + 1 : end;
+        st->line_number++;
+        emit_match(st, p, (size_t)((le != NULL ? le : end) - p), st->line_number);
+        p = next;
+    }
+    return p;
+}
+
+// The lines in [p, end), which are not selected, under -Context: the
+// first few trail the last match, the last few are held in case the next
+// line is one, and the rest are only counted. Returns where it stopped.
+static const char *pass_lines(scan_state *st, const char *p, const char *end) {
+    while (p < end && st->after_pending > 0 && !st->done) {
+        const char *le = memchr(p, '\n', (size_t)(end - p));
+        const char *next = le != NULL ? le + 1 : end;
+        st->line_number++;
+        emit_line(st, p, (size_t)((le != NULL ? le : end) - p), st->line_number, SS_LINE_AFTER);
+        st->last_printed = st->line_number;
+        st->after_pending--;
+        p = next;
+    }
+    int before = st->q->context_before;
+    if (p >= end || st->done || before == 0) {
+        st->line_number += p < end && !st->done ? kernels->count_newlines(p, end) : 0;
+        return st->done ? p : end;
+    }
+    const char *held = end;
+    for (int i = 0; i < before && held > p; i++) {
+        held = line_before(p, held);
+    }
+    st->line_number += kernels->count_newlines(p, held);
+    for (p = held; p < end;) {
+        const char *le = memchr(p, '\n', (size_t)(end - p));
+        const char *next = le != NULL ? le + 1 : end;
+        st->line_number++;
+        hold_line(st, (size_t)(p - st->buf), (size_t)((le != NULL ? le : end) - p), st->line_number);
+        p = next;
+    }
+    return end;
+}
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// The scan loop. It jumps from match to match in every mode and walks the
+// lines in between only for what -NotMatch or -Context does with them.
+// Each instance below fixes `find`, `not_match` and `context`, so the
+// compiler calls the kernel directly and drops the branches a mode does
+// not take.
+static ALWAYS_INLINE void scan_loop(scan_state *st, const char *buf, size_t start, size_t end,
+                                    const char *(*find)(const ss_scratch *, const char *, const char *),
+                                    int not_match, int context) {
+    const char *p = buf + start;
+    const char *stop = buf + end;
+    st->buf = buf;
+
+    while (p < stop && !st->done) {
+        const char *hit = find(st->s, p, stop);
+        const char *ls = stop;
+        const char *le = stop;
+        if (hit != NULL) {
+            ls = hit;
+            while (ls > p && ls[-1] != '\n') {
+                ls--;
+            }
+            le = *hit == '\n' ? hit : memchr(hit, '\n', (size_t)(stop - hit));
+            if (le == NULL) {
+                le = stop;
+            }
+        }
+
+        // The lines before the match
+        if (not_match) {
+            p = select_lines(st, p, ls);
+        } else if (context) {
+            p = pass_lines(st, p, ls);
+        } else {
+            st->line_number += kernels->count_newlines(p, ls);
+            p = ls;
+        }
+        if (hit == NULL || st->done) {
+            break;
+        }
+
+        // The matching line itself
+        const char *next = le < stop ? le + 1 : stop;
+        if (!not_match) {
+            st->line_number++;
+            emit_match(st, ls, (size_t)(le - ls), st->line_number);
+        } else if (context) {
+            pass_lines(st, ls, next);
+        } else {
+            st->line_number++;
+        }
+        p = next;
+    }
+}
+
+#define SCAN_VARIANTS(kind, find) \
+    static void scan_##kind(scan_state *st, const char *buf, size_t start, size_t end) { \
+        scan_loop(st, buf, start, end, find, 0, 0); \
+    } \
+    static void scan_##kind##_not_match(scan_state *st, const char *buf, size_t start, size_t end) { \
+        scan_loop(st, buf, start, end, find, 1, 0); \
+    } \
+    static void scan_##kind##_context(scan_state *st, const char *buf, size_t start, size_t end) { \
+        scan_loop(st, buf, start, end, find, 0, 1); \
+    } \
+    static void scan_##kind##_not_match_context(scan_state *st, const char *buf, size_t start, size_t end) { \
+        scan_loop(st, buf, start, end, find, 1, 1); \
+    }
+
+SCAN_VARIANTS(literal, find_literal)
+SCAN_VARIANTS(literal_nocase, find_literal_nocase)
+SCAN_VARIANTS(multi, find_multi)
+SCAN_VARIANTS(automaton, find_automaton)
+
+// By matcher kind, then -NotMatch (1) and -Context (2)
+static const scan_fn scan_variants[][4] = {
+    [MATCHER_LITERAL] = {scan_literal, scan_literal_not_match, scan_literal_context,
+                         scan_literal_not_match_context},
+    [MATCHER_LITERAL_NOCASE] = {scan_literal_nocase, scan_literal_nocase_not_match, scan_literal_nocase_context,
+                                scan_literal_nocase_not_match_context},
+    [MATCHER_MULTI_LITERAL] = {scan_multi, scan_multi_not_match, scan_multi_context,
+                               scan_multi_not_match_context},
+    [MATCHER_AUTOMATON] = {scan_automaton, scan_automaton_not_match, scan_automaton_context,
+                           scan_automaton_not_match_context},
+};
+
+// Once per query, so the scan itself checks neither the kind nor the switches
+static void pick_scan(ss_query *sq) {
+    const query *q = &sq->q;
+    int context = q->context_before > 0 || q->context_after > 0;
+    sq->scan = scan_variants[sq->m.kind][(q->not_match ? 1 : 0) | (context ? 2 : 0)];
+
+    // For --stats in a make custom build: did this query get a generated matcher
+    if (builtin_matcher_count > 0) {
+        int used = sq->m.kind == MATCHER_AUTOMATON && automaton_builtin(sq->m.automaton);
+        stats_add(used ? &stats.generated_used : &stats.generated_missed, 1);
+    }
+}
+
+static void scan_text(scan_state *st, const char *text, size_t start, size_t end) {
+    unsigned long long span = trace_begin();
+    st->s->query->scan(st, text, start, end);
+    trace_end("match", span, NULL, (long long)(end - start));
+}
+
+// Called between blocks of input; returns nonzero to stop
+static int scan_progress(scan_state *st, long long bytes) {
+    const ss_handler *h = st->handler;
+    if (h->progress != NULL && h->progress(h->user, bytes)) {
+        st->done = 1;
+        st->stopped = 1;
+    }
+    return st->done;
+}
+
+static long read_some(int fd, char *buf, size_t size) {
+    if (size > MAX_READ_CHUNK) {
+        size = MAX_READ_CHUNK;
+    }
+    stats_enter(PHASE_READ);
+    unsigned long long span = trace_begin();
+    long n;
+    do {
+        n = (long)ss_read(fd, buf, (unsigned)size);
+        stats_add(&stats.read_calls, 1);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        stats_add(&stats.bytes_read, n);
+    }
+    trace_end("read", span, NULL, n > 0 ? n : 0);
+    stats_leave();
+    return n;
+}
+
+// Swaps the read buffer for a pooled one of `size`, keeping its first
+// `keep` bytes. The old one goes back to the pool.
+static int resize_buffer(ss_scratch *s, size_t size, size_t keep) {
+    char *buf = bufpool_get(size);
+    if (buf == NULL) {
+        return 0;
+    }
+    memcpy(buf, s->buf, keep);
+    bufpool_put(s->buf, s->cap);
+    s->buf = buf;
+    s->cap = bufpool_round(size);
+    return 1;
+}
+
+static int grow_buffer(ss_scratch *s) {
+    return resize_buffer(s, s->cap * 2, s->cap);
+}
+
+// Converts UTF-16 text to UTF-8 in the scan's arena
+static char *utf16_to_utf8(arena *a, const unsigned char *src, size_t len, int big_endian, size_t *out_len) {
+    char *dst = arena_alloc(a, len / 2 * 3 + 1);
+    if (dst == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        unsigned long cp = big_endian ? (unsigned long)(src[i] << 8 | src[i + 1])
+                                      : (unsigned long)(src[i + 1] << 8 | src[i]);
+        if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < len) {
+            unsigned long lo = big_endian ? (unsigned long)(src[i + 2] << 8 | src[i + 3])
+                                          : (unsigned long)(src[i + 3] << 8 | src[i + 2]);
+            if (lo >= 0xDC00 && lo < 0xE000) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                i += 2;
+            }
+        }
+        if (cp < 0x80) {
+            dst[n++] = (char)cp;
+        } else if (cp < 0x800) {
+            dst[n++] = (char)(0xC0 | (cp >> 6));
+            dst[n++] = (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            dst[n++] = (char)(0xE0 | (cp >> 12));
+            dst[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            dst[n++] = (char)(0x80 | (cp & 0x3F));
+        } else {
+            dst[n++] = (char)(0xF0 | (cp >> 18));
+            dst[n++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            dst[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            dst[n++] = (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    *out_len = n;
+    return dst;
+}
+
+// Searches UTF-16 input, BOM included, as UTF-8
+static int scan_utf16(scan_state *st, const char *data, size_t len, int big_endian) {
+    size_t text_len;
+    unsigned long long span = trace_begin();
+    char *text = utf16_to_utf8(&st->s->file_arena, (const unsigned char *)data + 2, len - 2, big_endian,
+                               &text_len);
+    trace_end("decode", span, st->name, (long long)len);
+    if (text == NULL) {
+        set_error(st->s->error, sizeof(st->s->error), "Out of memory");
+        return 0;
+    }
+    scan_text(st, text, 0, text_len);
+    return 1;
+}
+
+// Where the text starts after a byte order mark: 3 for UTF-8, 0 for none,
+// and -1 for UTF-16 (*big_endian tells which)
+static int check_bom(const char *data, size_t len, int *big_endian) {
+    const unsigned char *b = (const unsigned char *)data;
+    if (len >= 3 && b[0] == 0xEF && b[1] == 0xBB && b[2] == 0xBF) {
+        return 3;
+    }
+    if (len >= 2 && ((b[0] == 0xFF && b[1] == 0xFE) || (b[0] == 0xFE && b[1] == 0xFF))) {
+        *big_endian = b[0] == 0xFE;
+        return -1;
+    }
+    return 0;
+}
+
+static int scan_begin(scan_state *st, ss_scratch *s, const char *name, const ss_handler *handler) {
+    memset(st, 0, sizeof(*st));
+    st->s = s;
+    st->q = &s->query->q;
+    st->handler = handler;
+    st->name = name;
+    s->error[0] = '\0';
+    arena_reset(&s->file_arena);
+    if (st->q->context_before > 0) {
+        st->held = arena_alloc(&s->file_arena, (size_t)st->q->context_before * sizeof(*st->held));
+        if (st->held == NULL) {
+            set_error(s->error, sizeof(s->error), "Out of memory");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int scan_end(scan_state *st, int ok) {
+    stats_add(&stats.files_scanned, 1);
+    stats_add(&stats.lines_scanned, st->line_number);
+    return !ok ? SS_ERROR : st->stopped ? SS_STOPPED : SS_OK;
+}
+
+// SS_CACHE_NOREUSE: drops the file's pages from `from` up to `to` (the
+// end of the file when -1) from the page cache. The kernel keeps a page,
+// or a large folio of them, that the range only partly covers, so `to`
+// is rounded down to where one cannot straddle; returns where the next
+// drop starts.
+static long long drop_cached(int fd, long long from, long long to) {
+#ifdef POSIX_FADV_DONTNEED
+    if (to >= 0) {
+        to -= to % NOREUSE_ALIGN;
+    }
+    if (from >= 0 && (to < 0 || to > from)) {
+        posix_fadvise(fd, (off_t)from, to < 0 ? 0 : (off_t)(to - from), POSIX_FADV_DONTNEED);
+        return to;
+    }
+#else
+    (void)fd;
+    (void)to;
+#endif
+    return from;
+}
+
+// `size` is the file's, or -1 for a pipe
+static int scan_fd(ss_scratch *s, int fd, const char *name, const ss_handler *handler, long long size) {
+    scan_state st;
+    if (!scan_begin(&st, s, name, handler)) {
+        return SS_ERROR;
+    }
+    // The buffer grows to fit the file in one read, up to read_size. Big
+    // files and pipes get read_size; a failure keeps the buffer there is.
+    size_t want = size >= 0 && (unsigned long long)size < s->read_size ? (size_t)size + 1 : s->read_size;
+    if (want > s->cap) {
+        resize_buffer(s, want, 0);
+    }
+    // An O_DIRECT descriptor reads whole blocks into aligned memory
+#ifdef O_DIRECT
+    int direct = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+#else
+    int direct = 0;
+#endif
+    // SS_CACHE_NOREUSE: where the scan started in the file (-1 for a
+    // pipe or another policy), and where the cache is dropped up to
+    long long start = -1;
+#ifdef POSIX_FADV_DONTNEED
+    if (s->cache_policy == SS_CACHE_NOREUSE && !direct && size >= 0) {
+        start = (long long)lseek(fd, 0, SEEK_CUR);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+    long long dropped = start;
+    int before = st.q->context_before;
+    size_t len = 0;         // bytes in the buffer
+    size_t pos = 0;         // start of the first line not yet scanned
+    int checked_bom = 0;
+    int ok = 1;
+
+    for (;;) {
+        if (len == s->cap && !grow_buffer(s)) {
+            set_error(s->error, sizeof(s->error), "Out of memory");
+            ok = 0;
+            break;
+        }
+        long n = read_some(fd, s->buf + len, s->cap - len);
+#ifdef O_DIRECT
+        if (n < 0 && errno == EINVAL && direct) {
+            // The file system does not take O_DIRECT reads after all
+            direct = 0;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            n = read_some(fd, s->buf + len, s->cap - len);
+        }
+#endif
+        if (n < 0) {
+            ok = 0;
+            break;
+        }
+        int eof = (n == 0);
+        len += (size_t)n;
+        if (start >= 0 && start + st.base + (long long)len - dropped >= NOREUSE_BATCH) {
+            dropped = drop_cached(fd, dropped, start + st.base + (long long)len);
+        }
+
+        if (!checked_bom && (len >= 3 || eof)) {
+            int big_endian = 0;
+            int skip = check_bom(s->buf, len, &big_endian);
+            checked_bom = 1;
+            if (skip < 0) {
+                // UTF-16 input is rare enough that it is read whole and
+                // converted up front
+                while (ok && n > 0) {
+                    if (len == s->cap && !grow_buffer(s)) {
+                        set_error(s->error, sizeof(s->error), "Out of memory");
+                        ok = 0;
+                        break;
+                    }
+                    n = read_some(fd, s->buf + len, s->cap - len);
+                    ok = n >= 0;
+                    len += n > 0 ? (size_t)n : 0;
+                }
+                ok = ok && scan_utf16(&st, s->buf, len, big_endian);
+                break;
+            }
+            pos = (size_t)skip;
+        }
+        if (!checked_bom) {
+            continue;
+        }
+
+        // Scan every complete line; the final line may lack a newline
+        size_t region_end = len;
+        if (!eof) {
+            while (region_end > pos && s->buf[region_end - 1] != '\n') {
+                region_end--;
+            }
+        }
+        if (region_end > pos) {
+            scan_text(&st, s->buf, pos, region_end);
+            pos = region_end;
+        }
+        if (eof || st.done || scan_progress(&st, st.base + (long long)pos)) {
+            break;
+        }
+
+        // Keep the unscanned tail and any lines held for leading context,
+        // at the front or, for O_DIRECT, ending where a block starts
+        size_t keep = pos;
+        for (int i = 0; i < st.held_count; i++) {
+            int slot = (st.held_head - st.held_count + i + before) % before;
+            if (st.held[slot].start < keep) {
+                keep = st.held[slot].start;
+            }
+        }
+        size_t tail = len - keep;
+        size_t at = direct ? (DIRECT_ALIGN - tail % DIRECT_ALIGN) % DIRECT_ALIGN : 0;
+        if (keep != at) {
+            st.base += (long long)keep - (long long)at;
+            memmove(s->buf + at, s->buf + keep, tail);
+            len = at + tail;
+            pos = pos - keep + at;
+            for (int i = 0; i < st.held_count; i++) {
+                int slot = (st.held_head - st.held_count + i + before) % before;
+                st.held[slot].start = st.held[slot].start - keep + at;
+            }
+        }
+    }
+    // Everything read, once more, for any folio an earlier drop missed
+    if (start >= 0) {
+        drop_cached(fd, start - start % NOREUSE_ALIGN, -1);
+    }
+
+    if (!ok && s->error[0] == '\0') {
+        set_error(s->error, sizeof(s->error), "Failed to read %s",
+                  name != NULL ? name : fd == 0 ? "from stdin" : "input");
+    }
+    // A line longer than the buffer grew it; give that back
+    if (s->cap > s->read_size) {
+        resize_buffer(s, s->read_size, 0);
+    }
+    return scan_end(&st, ok);
+}
+
+// ---------------------------------------------------------------------------
+// Inputs
+// ---------------------------------------------------------------------------
+
+// Case-insensitive match with * and ?, as used by -Include and -Exclude
+static int wildcard_match(const char *pattern, const char *name) {
+    const char *star = NULL;
+    const char *resume = NULL;
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*name)) {
+            pattern++;
+            name++;
+        } else if (star != NULL) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+static int path_selected(const query *q, const char *path) {
+    const char *base = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            base = p + 1;
+        }
+    }
+    if (q->include.count > 0) {
+        int included = 0;
+        for (size_t i = 0; i < q->include.count && !included; i++) {
+            included = wildcard_match(q->include.items[i], base);
+        }
+        if (!included) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < q->exclude.count; i++) {
+        if (wildcard_match(q->exclude.items[i], base)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Rule files
+// ---------------------------------------------------------------------------
+
+// A rule file is this header, the patterns (each ending in a NUL), then
+// the frozen DFA (automaton_freeze()) at a 64-byte boundary. Both are in
+// the byte order of the machine that wrote them.
+#define RULES_MAGIC "SSRULES\1"
+#define RULES_BYTE_ORDER 0x01020304u
+#define RULES_ALIGN 64
+
+enum {
+    RULES_CASE_SENSITIVE = 0x1,
+    RULES_SIMPLE_MATCH = 0x2
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t flags;             // RULES_*
+    uint32_t pattern_count;
+    uint32_t patterns_len;
+    uint64_t dfa_offset;
+    uint64_t dfa_len;
+    uint32_t reserved[6];       // to 64 bytes
+} rules_header;
+
+static int write_all(FILE *out, const void *data, size_t len) {
+    return fwrite(data, 1, len, out) == len;
+}
+
+// Writes the file next to `path` and renames it over, so a search that
+// has the old one mapped keeps a consistent table. Returns its size, or -1.
+static long write_rules(const char *path, const query *q, const void *dfa, size_t dfa_len,
+                       char *error, size_t error_size) {
+    rules_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RULES_MAGIC, sizeof(h.magic));
+    h.byte_order = RULES_BYTE_ORDER;
+    h.flags = (q->case_sensitive ? RULES_CASE_SENSITIVE : 0) | (q->simple_match ? RULES_SIMPLE_MATCH : 0);
+    h.pattern_count = (uint32_t)q->patterns.count;
+    for (size_t i = 0; i < q->patterns.count; i++) {
+        h.patterns_len += (uint32_t)strlen(q->patterns.items[i]) + 1;
+    }
+    h.dfa_offset = (sizeof(h) + h.patterns_len + RULES_ALIGN - 1) / RULES_ALIGN * RULES_ALIGN;
+    h.dfa_len = dfa_len;
+
+    size_t len = strlen(path);
+    char *temp = malloc(len + 5);
+    if (temp == NULL) {
+        set_error(error, error_size, "Out of memory");
+        return -1;
+    }
+    memcpy(temp, path, len);
+    memcpy(temp + len, ".tmp", 5);
+    FILE *out = fopen(temp, "wb");
+    int ok = out != NULL && write_all(out, &h, sizeof(h));
+    for (size_t i = 0; ok && i < q->patterns.count; i++) {
+        ok = write_all(out, q->patterns.items[i], strlen(q->patterns.items[i]) + 1);
+    }
+    static const char zeros[RULES_ALIGN];
+    ok = ok && write_all(out, zeros, (size_t)h.dfa_offset - sizeof(h) - h.patterns_len) &&
+         write_all(out, dfa, dfa_len);
+    if (out != NULL && fclose(out) != 0) {
+        ok = 0;
+    }
+#ifdef _WIN32
+    if (ok) {
+        remove(path);
+    }
+#endif
+    if (!ok || rename(temp, path) != 0) {
+        set_error(error, error_size, "Cannot write '%s': %s", path, strerror(errno));
+        remove(temp);
+        free(temp);
+        return -1;
+    }
+    free(temp);
+    return (long)(h.dfa_offset + h.dfa_len);
+}
+
+// Maps a rule file read-only. Windows reads it into memory instead.
+static void *map_rules(const char *path, size_t *len, char *error, size_t error_size) {
+    int fd = ss_open(path, O_RDONLY | O_BINARY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        set_error(error, error_size, "Cannot read '%s': %s", path, strerror(errno));
+        if (fd >= 0) {
+            ss_close(fd);
+        }
+        return NULL;
+    }
+    *len = (size_t)info.st_size;
+    if (*len < sizeof(rules_header)) {
+        set_error(error, error_size, "'%s' is not a rule file", path);
+        ss_close(fd);
+        return NULL;
+    }
+#ifndef _WIN32
+    void *data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        data = NULL;
+    }
+#else
+    char *data = malloc(*len);
+    size_t got = 0;
+    while (data != NULL && got < *len) {
+        long n = read_some(fd, data + got, *len - got);
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+        } else {
+            got += (size_t)n;
+        }
+    }
+#endif
+    if (data == NULL) {
+        set_error(error, error_size, "Cannot read '%s': %s", path, strerror(errno));
+    }
+    ss_close(fd);
+    return data;
+}
+
+static void unmap_rules(void *data, size_t len) {
+#ifndef _WIN32
+    munmap(data, len);
+#else
+    (void)len;
+    free(data);
+#endif
+}
+
+// Fills the query's patterns and matching switches from a mapped rule file
+static int read_rules(const void *data, size_t len, query *q) {
+    const rules_header *h = data;
+    if (memcmp(h->magic, RULES_MAGIC, sizeof(h->magic)) != 0 || h->byte_order != RULES_BYTE_ORDER ||
+        h->patterns_len > len - sizeof(*h) || h->dfa_offset < sizeof(*h) + h->patterns_len ||
+        h->dfa_offset % RULES_ALIGN != 0 || h->dfa_offset > len || h->dfa_len > len - h->dfa_offset) {
+        return 0;
+    }
+    const char *p = (const char *)data + sizeof(*h);
+    const char *end = p + h->patterns_len;
+    while (p < end) {
+        const char *nul = memchr(p, '\0', (size_t)(end - p));
+        char *pattern = nul != NULL && nul > p ? copy_string(p, (size_t)(nul - p)) : NULL;
+        if (pattern == NULL || !list_push(&q->patterns, pattern)) {
+            free(pattern);
+            return 0;
+        }
+        p = nul + 1;
+    }
+    q->case_sensitive = (h->flags & RULES_CASE_SENSITIVE) != 0;
+    q->simple_match = (h->flags & RULES_SIMPLE_MATCH) != 0;
+    return q->patterns.count == h->pattern_count && q->patterns.count > 0;
+}
+
+// What a rule file or a generated matcher is compiled from
+static int patterns_only(const query *q) {
+    return q->paths.count == 0 && q->literal_paths.count == 0 && q->include.count == 0 && q->exclude.count == 0 &&
+           !q->not_match && !q->all_matches && !q->quiet && !q->list && !q->raw && q->context_before == 0 &&
+           q->context_after == 0;
+}
+
+// Whether matcher_init() would search for the patterns with the literal
+// kernels rather than the automaton
+static int literals_only(const query *q) {
+    int literal = 1;
+    for (size_t i = 0; literal && i < q->patterns.count; i++) {
+        const char *pattern = q->patterns.items[i];
+        size_t len = strlen(pattern);
+        char *bytes = malloc(len + 1);
+        if (bytes != NULL && !q->simple_match && !automaton_literal(pattern, bytes, &len)) {
+            len = 0;
+        }
+        literal = bytes != NULL && len > 0 && memchr(q->simple_match ? pattern : bytes, '\n', len) == NULL;
+        free(bytes);
+    }
+    return literal;
+}
+
+// Splits a line of a matcher spec into arguments the way a shell would,
+// without escapes: quotes group words and are dropped
+static int split_line(const char *line, string_list *args) {
+    const char *p = line;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        char *arg = malloc(strlen(p) + 1);
+        size_t len = 0;
+        char quote = 0;
+        while (arg != NULL && *p != '\0' && (quote != 0 || (*p != ' ' && *p != '\t'))) {
+            if (quote == 0 && (*p == '"' || *p == '\'')) {
+                quote = *p;
+            } else if (*p == quote) {
+                quote = 0;
+            } else {
+                arg[len++] = *p;
+            }
+            p++;
+        }
+        if (arg == NULL) {
+            return 0;
+        }
+        arg[len] = '\0';
+        if (!list_push(args, arg)) {
+            free(arg);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A C string literal; '?' is escaped against trigraphs
+static void write_c_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)s; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\' || *p == '?') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20 || *p >= 0x7f) {
+            fprintf(out, "\\%03o", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// One generated matcher from a spec line; `index` names it. Stores the
+// flags and the number of patterns, for the table at the end.
+static int generate_matcher(FILE *out, const char *line, size_t index, const char *spec, long line_number,
+                            int *flags, size_t *pattern_count, char *error, size_t error_size) {
+    string_list args;
+    query q;
+    memset(&args, 0, sizeof(args));
+    memset(&q, 0, sizeof(q));
+    char reason[256];
+    automaton *a = NULL;
+    int ok = split_line(line, &args);
+    if (!ok) {
+        set_error(error, error_size, "Out of memory");
+    } else if (!parse_query((int)args.count, args.items, &q, reason, sizeof(reason))) {
+        set_error(error, error_size, "%s:%ld: %s", spec, line_number, reason);
+        ok = 0;
+    } else if (!patterns_only(&q)) {
+        set_error(error, error_size, "%s:%ld: only -Pattern, -SimpleMatch and -CaseSensitive describe a matcher",
+                  spec, line_number);
+        ok = 0;
+    } else if (literals_only(&q)) {
+        set_error(error, error_size, "%s:%ld: plain literals are searched by the SIMD kernels; "
+                  "only regular expressions get a generated matcher", spec, line_number);
+        ok = 0;
+    } else if ((a = automaton_compile((const char *const *)q.patterns.items, q.patterns.count,
+                                      automaton_flags(&q), reason, sizeof(reason))) == NULL) {
+        set_error(error, error_size, "%s:%ld: Invalid pattern: %s", spec, line_number, reason);
+        ok = 0;
+    }
+    if (ok) {
+        char name[32];
+        snprintf(name, sizeof(name), "find_line_%zu", index);
+        fprintf(out, "// %s, line %ld\n", spec, line_number);
+        fprintf(out, "static const char *const patterns_%zu[] = {", index);
+        for (size_t i = 0; i < q.patterns.count; i++) {
+            fprintf(out, i > 0 ? ", " : "");
+            write_c_string(out, q.patterns.items[i]);
+        }
+        fprintf(out, "};\n\n");
+        *flags = automaton_flags(&q);
+        *pattern_count = q.patterns.count;
+        if (!automaton_codegen(a, out, name, reason, sizeof(reason))) {
+            set_error(error, error_size, "%s:%ld: Cannot generate a matcher: %s", spec, line_number, reason);
+            ok = 0;
+        }
+        fprintf(out, "\n");
+    }
+    automaton_free(a);
+    query_free(&q);
+    list_free(&args);
+    return ok;
+}
+
+static void describe(ss_query *sq) {
+    const query *q = &sq->q;
+    ss_query_info *info = &sq->info;
+    info->paths = (const char *const *)q->paths.items;
+    info->path_count = q->paths.count;
+    info->literal_paths = (const char *const *)q->literal_paths.items;
+    info->literal_path_count = q->literal_paths.count;
+    info->pattern_count = q->patterns.count;
+    info->context_before = q->context_before;
+    info->context_after = q->context_after;
+    info->not_match = q->not_match;
+    info->quiet = q->quiet;
+    info->raw = q->raw;
+}
+
+// ---------------------------------------------------------------------------
+// Public interface
+// ---------------------------------------------------------------------------
+
+ss_query *ss_compile(int argc, char *argv[], char *error, size_t error_size) {
+    ss_query *sq = calloc(1, sizeof(*sq));
+    if (sq == NULL) {
+        set_error(error, error_size, "Out of memory");
+        return NULL;
+    }
+    kernels = kernels_select();
+    if (!parse_query(argc, argv, &sq->q, error, error_size)) {
+        query_free(&sq->q);
+        free(sq);
+        return NULL;
+    }
+    if (!matcher_init(&sq->m, &sq->q, error, error_size)) {
+        query_free(&sq->q);
+        free(sq);
+        return NULL;
+    }
+
+    pick_scan(sq);
+    describe(sq);
+    return sq;
+}
+
+long ss_compile_rules(int argc, char *argv[], const char *path, char *error, size_t error_size) {
+    query q;
+    memset(&q, 0, sizeof(q));
+    if (!parse_query(argc, argv, &q, error, error_size)) {
+        query_free(&q);
+        return -1;
+    }
+    if (!patterns_only(&q)) {
+        set_error(error, error_size, "Only -Pattern, -SimpleMatch and -CaseSensitive go into a rule file; "
+                  "give the rest when searching with it");
+        query_free(&q);
+        return -1;
+    }
+
+    char reason[256];
+    size_t dfa_len = 0;
+    void *dfa = NULL;
+    automaton *a = automaton_compile((const char *const *)q.patterns.items, q.patterns.count,
+                                     automaton_flags(&q), reason, sizeof(reason));
+    if (a == NULL) {
+        set_error(error, error_size, "Invalid pattern: %s", reason);
+    } else if ((dfa = automaton_freeze(a, &dfa_len, reason, sizeof(reason))) == NULL) {
+        set_error(error, error_size, "Cannot compile the rules: %s", reason);
+    }
+    long written = dfa != NULL ? write_rules(path, &q, dfa, dfa_len, error, error_size) : -1;
+    free(dfa);
+    automaton_free(a);
+    query_free(&q);
+    return written;
+}
+
+long ss_generate_matchers(const char *spec, const char *path, char *error, size_t error_size) {
+    FILE *in = fopen(spec, "r");
+    if (in == NULL) {
+        set_error(error, error_size, "Cannot read '%s': %s", spec, strerror(errno));
+        return -1;
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        set_error(error, error_size, "Cannot write '%s': %s", path, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+    fprintf(out, "/*\n * Generated by Select-String --generate-matchers from %s; do not edit.\n */\n\n", spec);
+    automaton_codegen_header(out);
+    fprintf(out, "#include \"builtin.h\"\n\n");
+
+    size_t line_size = 64 * 1024;
+    char *line = malloc(line_size);
+    int *flags = NULL;
+    size_t *pattern_counts = NULL;
+    size_t count = 0;
+    long line_number = 0;
+    int ok = line != NULL;
+    if (!ok) {
+        set_error(error, error_size, "Out of memory");
+    }
+    while (ok && fgets(line, (int)line_size, in) != NULL) {
+        line_number++;
+        size_t len = strlen(line);
+        if (len == line_size - 1 && line[len - 1] != '\n') {
+            set_error(error, error_size, "%s:%ld: line too long", spec, line_number);
+            ok = 0;
+            break;
+        }
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        const char *first = line + strspn(line, " \t");
+        if (*first == '\0' || *first == '#') {
+            continue;
+        }
+        int *more_flags = realloc(flags, (count + 1) * sizeof(*flags));
+        flags = more_flags != NULL ? more_flags : flags;
+        size_t *more_counts = realloc(pattern_counts, (count + 1) * sizeof(*pattern_counts));
+        pattern_counts = more_counts != NULL ? more_counts : pattern_counts;
+        if (more_flags == NULL || more_counts == NULL) {
+            set_error(error, error_size, "Out of memory");
+            ok = 0;
+            break;
+        }
+        ok = generate_matcher(out, first, count, spec, line_number, &flags[count], &pattern_counts[count],
+                              error, error_size);
+        count++;
+    }
+    if (ok && count == 0) {
+        set_error(error, error_size, "'%s' has no pattern sets; write one per line, as -Pattern ...", spec);
+        ok = 0;
+    }
+    if (ok) {
+        fprintf(out, "static const builtin_matcher matchers[] = {\n");
+        for (size_t i = 0; i < count; i++) {
+            fprintf(out, "    {%d, %zu, patterns_%zu, find_line_%zu},\n", flags[i], pattern_counts[i], i, i);
+        }
+        fprintf(out, "};\n\n");
+        fprintf(out, "const builtin_matcher *const builtin_matchers = matchers;\n");
+        fprintf(out, "const size_t builtin_matcher_count = %zu;\n", count);
+    }
+    if (ok && (ferror(in) || ferror(out))) {
+        set_error(error, error_size, "Cannot write '%s': %s", path, strerror(errno));
+        ok = 0;
+    }
+    if (fclose(out) != 0 && ok) {
+        set_error(error, error_size, "Cannot write '%s': %s", path, strerror(errno));
+        ok = 0;
+    }
+    fclose(in);
+    free(line);
+    free(flags);
+    free(pattern_counts);
+    if (!ok) {
+        // Half a file would look up to date to make
+        remove(path);
+        return -1;
+    }
+    return (long)count;
+}
+
+ss_query *ss_load_rules(const char *path, int argc, char *argv[], char *error, size_t error_size) {
+    ss_query *sq = calloc(1, sizeof(*sq));
+    if (sq == NULL) {
+        set_error(error, error_size, "Out of memory");
+        return NULL;
+    }
+    kernels = kernels_select();
+    sq->rules = map_rules(path, &sq->rules_len, error, error_size);
+    if (sq->rules == NULL) {
+        free(sq);
+        return NULL;
+    }
+    if (!read_rules(sq->rules, sq->rules_len, &sq->q)) {
+        set_error(error, error_size, "'%s' is not a rule file from this version of Select-String", path);
+        ss_query_free(sq);
+        return NULL;
+    }
+
+    // The patterns are in already, so a positional argument is the -Path
+    size_t pattern_count = sq->q.patterns.count;
+    int case_sensitive = sq->q.case_sensitive;
+    int simple_match = sq->q.simple_match;
+    if (!parse_query(argc, argv, &sq->q, error, error_size)) {
+        ss_query_free(sq);
+        return NULL;
+    }
+    if (sq->q.patterns.count != pattern_count) {
+        set_error(error, error_size, "-Pattern cannot be used with a rule file; its patterns are compiled in");
+        ss_query_free(sq);
+        return NULL;
+    }
+    if (sq->q.case_sensitive != case_sensitive || sq->q.simple_match != simple_match) {
+        set_error(error, error_size, "-CaseSensitive and -SimpleMatch are fixed when the rule file is compiled");
+        ss_query_free(sq);
+        return NULL;
+    }
+
+    // The NFA is still needed for ss_line_spans(); the DFA comes from the file
+    const rules_header *h = sq->rules;
+    char reason[256];
+    sq->m.kind = MATCHER_AUTOMATON;
+    sq->m.automaton = automaton_compile((const char *const *)sq->q.patterns.items, sq->q.patterns.count,
+                                        automaton_flags(&sq->q), reason, sizeof(reason));
+    if (sq->m.automaton == NULL) {
+        set_error(error, error_size, "Invalid pattern: %s", reason);
+        ss_query_free(sq);
+        return NULL;
+    }
+    if (!automaton_attach(sq->m.automaton, (const char *)sq->rules + h->dfa_offset, (size_t)h->dfa_len)) {
+        set_error(error, error_size, "'%s' is damaged or from another version of Select-String; compile it again",
+                  path);
+        ss_query_free(sq);
+        return NULL;
+    }
+    pick_scan(sq);
+    describe(sq);
+    return sq;
+}
+
+void ss_query_free(ss_query *q) {
+    if (q == NULL) {
+        return;
+    }
+    matcher_free(&q->m);
+    query_free(&q->q);
+    if (q->rules != NULL) {
+        unmap_rules(q->rules, q->rules_len);
+    }
+    free(q);
+}
+
+int ss_query_jit(ss_query *q) {
+    // Literals already have SIMD kernels
+    if (q->m.kind != MATCHER_AUTOMATON) {
+        return 0;
+    }
+    size_t size = automaton_jit(q->m.automaton);
+    if (size == 0) {
+        stats_add(&stats.jit_declined, 1);
+        return 0;
+    }
+    stats_add(&stats.jit_bytes, (long long)size);
+    return 1;
+}
+
+const ss_query_info *ss_query_describe(const ss_query *q) {
+    return &q->info;
+}
+
+ss_scratch *ss_scratch_new(const ss_query *q) {
+    ss_scratch *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->query = q;
+    s->cap = bufpool_round(FIRST_READ_BUFFER_SIZE);
+    s->read_size = READ_BUFFER_SIZE;
+    s->cache_policy = SS_CACHE_NORMAL;
+    s->buf = bufpool_get(s->cap);
+    if (q->m.kind == MATCHER_AUTOMATON) {
+        s->automaton = automaton_clone(q->m.automaton);
+    }
+    if (s->buf == NULL || (q->m.kind == MATCHER_AUTOMATON && s->automaton == NULL)) {
+        ss_scratch_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void ss_scratch_free(ss_scratch *s) {
+    if (s == NULL) {
+        return;
+    }
+    automaton_free(s->automaton);
+    bufpool_put(s->buf, s->cap);
+    arena_free(&s->file_arena);
+    arena_free(&s->line_arena);
+    free(s);
+}
+
+void ss_scratch_limit(ss_scratch *s, size_t read_buffer, size_t dfa_cache) {
+    if (read_buffer > 0) {
+        // Buffers come in powers of two; this one stays within the budget
+        size_t size = bufpool_round(read_buffer);
+        if (size > read_buffer) {
+            size /= 2;
+        }
+        s->read_size = size > MIN_READ_BUFFER_SIZE ? size : MIN_READ_BUFFER_SIZE;
+        if (s->cap > s->read_size) {
+            resize_buffer(s, s->read_size, 0);
+        }
+    }
+    if (s->automaton != NULL) {
+        automaton_set_cache_limit(s->automaton, dfa_cache);
+    }
+}
+
+void ss_scratch_cache_policy(ss_scratch *s, int policy) {
+    s->cache_policy = policy;
+}
+
+int ss_scan_buffer(ss_scratch *s, const char *data, size_t len, const char *name,
+                   const ss_handler *handler) {
+    scan_state st;
+    if (!scan_begin(&st, s, name, handler)) {
+        return SS_ERROR;
+    }
+    int big_endian = 0;
+    int skip = check_bom(data, len, &big_endian);
+    if (skip < 0) {
+        return scan_end(&st, scan_utf16(&st, data, len, big_endian));
+    }
+    // Searched in read-sized pieces, cut at line ends, so the progress
+    // callback gets to stop a scan of a large buffer part way
+    size_t pos = (size_t)skip;
+    while (pos < len && !st.done) {
+        size_t end = len - pos > READ_BUFFER_SIZE ? pos + READ_BUFFER_SIZE : len;
+        if (end < len) {
+            const char *newline = memchr(data + end, '\n', len - end);
+            end = newline != NULL ? (size_t)(newline - data) + 1 : len;
+        }
+        scan_text(&st, data, pos, end);
+        pos = end;
+        scan_progress(&st, (long long)pos);
+    }
+    return scan_end(&st, 1);
+}
+
+int ss_scan_fd(ss_scratch *s, int fd, const char *name, const ss_handler *handler) {
+    struct stat info;
+    int regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    return scan_fd(s, fd, name, handler, regular ? (long long)info.st_size : -1);
+}
+
+int ss_scan_path(ss_scratch *s, const char *path, const ss_handler *handler) {
+    s->error[0] = '\0';
+    if (!path_selected(&s->query->q, path)) {
+        stats_add(&stats.files_skipped, 1);
+        return SS_SKIPPED;
+    }
+
+    unsigned long long span = trace_begin();
+    int fd = ss_open(path, O_RDONLY | O_BINARY);
+#ifdef O_DIRECT
+    if (s->cache_policy == SS_CACHE_DIRECT && fd >= 0) {
+        // Set once the file is open: a file system without O_DIRECT
+        // refuses the flag and the file is read the usual way
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+    }
+#endif
+    stats_add(&stats.open_calls, 1);
+    if (fd < 0) {
+        trace_end("open", span, path, -1);
+        stats_add(&stats.files_skipped, 1);
+        if (errno == ENOENT) {
+            set_error(s->error, sizeof(s->error), "Cannot find path '%s' because it does not exist", path);
+        } else {
+            set_error(s->error, sizeof(s->error), "Cannot read '%s': %s", path, strerror(errno));
+        }
+        return SS_ERROR;
+    }
+
+    struct stat info;
+    int have_info = fstat(fd, &info) == 0;
+    int is_dir = have_info && S_ISDIR(info.st_mode);
+    trace_end("open", span, path, -1);
+    if (is_dir) {
+        // Like Select-String, directories named by a wildcard are skipped
+        stats_add(&stats.files_skipped, 1);
+        ss_close(fd);
+        return SS_SKIPPED;
+    }
+    long long size = have_info && S_ISREG(info.st_mode) ? (long long)info.st_size : -1;
+    int result = scan_fd(s, fd, path, handler, size);
+    ss_close(fd);
+    return result;
+}
+
+int ss_path_selected(const ss_query *q, const char *path) {
+    return path_selected(&q->q, path);
+}
+
+size_t ss_line_spans(ss_scratch *s, const ss_line *line, int *pattern, const ss_span **spans) {
+    *pattern = -1;
+    arena_reset(&s->line_arena);
+    s->spans = NULL;
+    s->span_cap = 0;
+    *spans = s->spans;
+    if (line->kind != SS_LINE_MATCH || s->query->q.not_match) {
+        return 0;
+    }
+    // Matched against the line as read, \r included, then cut to the text
+    size_t len = line->text == s->line_text ? s->line_len : line->len;
+    size_t count = find_spans(s, line->text, len, pattern);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (s->spans[i].start <= line->len) {
+            s->spans[kept] = s->spans[i];
+            if (s->spans[kept].end > line->len) {
+                s->spans[kept].end = line->len;
+            }
+            kept++;
+        }
+    }
+    *spans = s->spans;
+    return kept;
+}
+
+const char *ss_error(const ss_scratch *s) {
+    return s->error;
+}
@@ -0,0 +1,187 @@
+/*
+ * selectstring.h - libselectstring, the native engine as a library
+ *
+ * A query is compiled once from Select-String arguments and can then be
+ * scanned over any number of buffers, file descriptors or paths. Every
+ * line the query outputs (matches, and -Context lines around them) is
+ * handed to a callback; nothing is printed.
+ *
+ *   char error[256];
+ *   ss_query *q = ss_compile(2, (char *[]){"error", "-CaseSensitive"}, error, sizeof(error));
+ *   ss_scratch *s = ss_scratch_new(q);
+ *   ss_handler h = {on_line, NULL, &state};
+ *   ss_scan_path(s, "app.log", &h);
+ *
+ * A compiled query is read-only and may be shared between threads. A
+ * scratch context holds the per-thread state (the lazily built DFA, the
+ * read buffer), so each thread needs its own; reuse it across scans.
+ */
+
+#ifndef SS_SELECTSTRING_H
+#define SS_SELECTSTRING_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(SS_BUILD_SHARED)
+#define SS_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define SS_API __attribute__((visibility("default")))
+#else
+#define SS_API
+#endif
+
+typedef struct ss_query ss_query;
+typedef struct ss_scratch ss_scratch;
+
+// How scans treat the page cache (ss_scratch_cache_policy())
+enum {
+    SS_CACHE_NORMAL,    // read through the cache and leave the pages there
+    SS_CACHE_NOREUSE,   // drop a file's pages from the cache behind the scan
+    SS_CACHE_DIRECT     // ss_scan_path() reads with O_DIRECT, around the cache
+};
+
+// Scan results
+enum {
+    SS_OK = 0,
+    SS_STOPPED = 1,     // a callback asked to stop
+    SS_SKIPPED = 2,     // ss_scan_path(): excluded by -Include/-Exclude, or a directory
+    SS_ERROR = -1       // see ss_error()
+};
+
+enum {
+    SS_LINE_MATCH,
+    SS_LINE_BEFORE,     // -Context line leading up to a match
+    SS_LINE_AFTER       // -Context line following a match
+};
+
+typedef struct {
+    int kind;           // SS_LINE_*
+    const char *path;   // name given to the scan, or NULL
+    long long number;   // 1-based line number
+    long long offset;   // byte offset of the line in the input (UTF-16 input: in the UTF-8 text)
+    const char *text;   // the line without its line ending; only valid during the callback
+    size_t len;
+} ss_line;
+
+typedef struct {
+    size_t start;       // byte offsets into ss_line.text, end exclusive
+    size_t end;
+} ss_span;
+
+typedef struct {
+    // Every line the query outputs, in input order. Return nonzero to stop
+    // the scan.
+    int (*line)(void *user, const ss_line *line);
+
+    // Optional; called after each block of input is searched, even when
+    // it had no matches. Return nonzero to stop the scan.
+    int (*progress)(void *user, long long bytes);
+
+    void *user;
+} ss_handler;
+
+// What the query asked for beyond matching, for callers that handle
+// paths, -Quiet or -Context themselves
+typedef struct {
+    const char *const *paths;           // -Path, wildcards unexpanded
+    size_t path_count;
+    const char *const *literal_paths;   // -LiteralPath
+    size_t literal_path_count;
+    size_t pattern_count;
+    int context_before;
+    int context_after;
+    int not_match;
+    int quiet;
+    int raw;
+} ss_query_info;
+
+// Parses Select-String arguments (without a program name) and compiles
+// the patterns. Returns NULL and fills `error` on failure.
+SS_API ss_query *ss_compile(int argc, char *argv[], char *error, size_t error_size);
+SS_API void ss_query_free(ss_query *q);
+SS_API const ss_query_info *ss_query_describe(const ss_query *q);
+
+// Compiles -Pattern, -SimpleMatch and -CaseSensitive from Select-String
+// arguments into a rule file at `path`: the patterns and their whole DFA,
+// minimized, as a table ss_load_rules() maps and searches with directly.
+// Returns the size of the file, or -1 and fills `error`.
+SS_API long ss_compile_rules(int argc, char *argv[], const char *path, char *error, size_t error_size);
+
+// Like ss_compile(), with the patterns and matching switches taken from a
+// rule file: `argv` gives the rest, and its first positional argument is
+// the -Path. No DFA state is built while scanning. The file stays mapped
+// until ss_query_free().
+SS_API ss_query *ss_load_rules(const char *path, int argc, char *argv[], char *error, size_t error_size);
+
+// Writes C source with a matcher specialized to each pattern set in the
+// file `spec`: one set per line, given as -Pattern with -SimpleMatch and
+// -CaseSensitive if wanted (blank lines and # comments are skipped).
+// Linked in place of builtin.c (make custom), each matcher runs its DFA
+// as straight-line code whenever a query has exactly those patterns and
+// switches. Returns the number of matchers, or -1 and fills `error`.
+SS_API long ss_generate_matchers(const char *spec, const char *path, char *error, size_t error_size);
+
+// Compiles a regex query's whole DFA to x86-64 machine code with SSE2
+// skip loops, for patterns searched through a lot of data. Call it before
+// ss_scratch_new(); scratch contexts made earlier keep the lazy DFA.
+// Returns 1 if machine code runs the query, 0 if it does not: a literal
+// query (its kernels are faster), a DFA too large to build up front, or a
+// system that forbids executable memory. A rule file's table, or a DFA
+// built small enough, is then stepped as a table instead.
+SS_API int ss_query_jit(ss_query *q);
+
+// The query must outlive the scratch context
+SS_API ss_scratch *ss_scratch_new(const ss_query *q);
+SS_API void ss_scratch_free(ss_scratch *s);
+
+// Sizes a scratch context for a memory budget or for large files: the
+// most its read buffer grows to for one file (by default 256KB; rounded
+// down to a power of two, at least 4KB; longer lines still grow it for
+// the scan that needs it) and the DFA cache, which starts over when full.
+// A read_buffer of 0 leaves the buffer as it is; a dfa_cache of 0 is the
+// default, 8MB.
+SS_API void ss_scratch_limit(ss_scratch *s, size_t read_buffer, size_t dfa_cache);
+
+// For scans of files that will not be read again soon, such as archived
+// logs on a host whose page cache serves a database: SS_CACHE_NOREUSE
+// drops each file's pages once they are read (POSIX_FADV_DONTNEED), and
+// SS_CACHE_DIRECT opens files with O_DIRECT so they never enter the
+// cache. Files on a file system without O_DIRECT, and systems without
+// either (Windows), are read as usual. SS_CACHE_NORMAL is the default.
+SS_API void ss_scratch_cache_policy(ss_scratch *s, int policy);
+
+// `name` is reported as ss_line.path; it may be NULL. A byte order mark
+// selects UTF-8 or UTF-16; without one the input is taken as UTF-8.
+SS_API int ss_scan_buffer(ss_scratch *s, const char *data, size_t len, const char *name,
+                          const ss_handler *handler);
+// A descriptor the caller opened with O_DIRECT is read in aligned blocks;
+// SS_CACHE_NOREUSE applies to a regular file from its current offset.
+SS_API int ss_scan_fd(ss_scratch *s, int fd, const char *name, const ss_handler *handler);
+
+// Applies -Include/-Exclude to the file name, then scans the file
+SS_API int ss_scan_path(ss_scratch *s, const char *path, const ss_handler *handler);
+
+// Whether -Include and -Exclude let the file through, for callers that
+// read files themselves and use ss_scan_buffer()
+SS_API int ss_path_selected(const ss_query *q, const char *path);
+
+// Where a match line matched, as MatchInfo reports it: the first pattern
+// in order that matches the line, and its first match or, with
+// -AllMatches, every one. Call it from the line callback. Returns the
+// span count; the spans stay valid until the next call. *pattern is -1
+// for context lines and -NotMatch.
+SS_API size_t ss_line_spans(ss_scratch *s, const ss_line *line, int *pattern,
+                            const ss_span **spans);
+
+// Why the last scan returned SS_ERROR
+SS_API const char *ss_error(const ss_scratch *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
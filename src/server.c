@@ -0,0 +1,1112 @@
+/*
+ * server.c - Search server on a Unix domain socket
+ *
+ * `--server PATH` keeps compiled queries (with the DFA states they have
+ * built so far) and memory mappings of recently searched files, as many
+ * as the memory budget allows (budget.c), so a client such as a log
+ * viewer can search on every keystroke without paying for process
+ * startup, pattern compilation or file reads each time.
+ *
+ * Each request is one line of JSON:
+ *
+ *   {"args":["error","-Path","*.log"],"cwd":"/var/log","format":"ndjson"}
+ *
+ * `args` are Select-String arguments; `cwd` is where relative paths are
+ * taken from (the server's own directory otherwise). The optional fields
+ * follow the wrapper options: "format", "first", "max_count", "threads",
+ * "unordered", "max_memory" (in bytes; the server's own caches are sized
+ * separately), "read_buffer" (in bytes), "cache_policy" and "interactive"
+ * (which flushes every match). The answer is a stream of frames (see
+ * engine.h) ending in an end or cancelled frame.
+ *
+ * A connection answers one query at a time. A request that arrives while
+ * a query is running cancels that query; {"cancel":true} cancels without
+ * starting another.
+ */
+
+#include "compat.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "budget.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAP_CACHE_SIZE 4096
+#define MAX_REQUEST_SIZE (1 << 20)
+#define BUFFER_SIZE 65536
+
+// ---------------------------------------------------------------------------
+// Requests
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char **args;
+    int arg_count;
+    char *cwd;
+    int cancel;
+    engine_options options;
+} request;
+
+typedef struct {
+    const char *p;
+    const char *end;
+} json_reader;
+
+static void json_space(json_reader *r) {
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\r' || *r->p == '\n')) {
+        r->p++;
+    }
+}
+
+static int json_take(json_reader *r, char c) {
+    json_space(r);
+    if (r->p < r->end && *r->p == c) {
+        r->p++;
+        return 1;
+    }
+    return 0;
+}
+
+static size_t put_utf8(char *out, unsigned long cp) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static int json_hex4(json_reader *r, unsigned long *value) {
+    if (r->end - r->p < 4) {
+        return 0;
+    }
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *r->p++;
+        int digit = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return 0;
+        }
+        *value = *value << 4 | (unsigned long)digit;
+    }
+    return 1;
+}
+
+// A string value, unescaped into a malloc'd buffer (never longer than
+// its escaped form)
+static char *json_string(json_reader *r) {
+    if (!json_take(r, '"')) {
+        return NULL;
+    }
+    char *out = malloc((size_t)(r->end - r->p) + 1);
+    size_t n = 0;
+    while (out != NULL && r->p < r->end && *r->p != '"') {
+        char c = *r->p++;
+        if (c != '\\') {
+            out[n++] = c;
+            continue;
+        }
+        if (r->p == r->end) {
+            break;
+        }
+        c = *r->p++;
+        unsigned long cp;
+        switch (c) {
+        case 'b': out[n++] = '\b'; break;
+        case 'f': out[n++] = '\f'; break;
+        case 'n': out[n++] = '\n'; break;
+        case 'r': out[n++] = '\r'; break;
+        case 't': out[n++] = '\t'; break;
+        case 'u':
+            if (!json_hex4(r, &cp)) {
+                free(out);
+                return NULL;
+            }
+            if (cp >= 0xD800 && cp < 0xDC00 && r->end - r->p >= 6 && r->p[0] == '\\' && r->p[1] == 'u') {
+                unsigned long lo;
+                r->p += 2;
+                if (!json_hex4(r, &lo) || lo < 0xDC00 || lo >= 0xE000) {
+                    free(out);
+                    return NULL;
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            }
+            n += put_utf8(out + n, cp);
+            break;
+        default: out[n++] = c; break;
+        }
+    }
+    if (out == NULL || r->p == r->end) {
+        free(out);
+        return NULL;
+    }
+    r->p++;
+    out[n] = '\0';
+    return out;
+}
+
+static int json_number(json_reader *r, long long max, long long *value) {
+    json_space(r);
+    char digits[24];
+    size_t n = 0;
+    while (r->p < r->end && n + 1 < sizeof(digits) && ((*r->p >= '0' && *r->p <= '9') || *r->p == '-')) {
+        digits[n++] = *r->p++;
+    }
+    digits[n] = '\0';
+    char *end = NULL;
+    long long v = strtoll(digits, &end, 10);
+    if (n == 0 || *end != '\0' || v < 0 || v > max) {
+        return 0;
+    }
+    *value = v;
+    return 1;
+}
+
+static int json_bool(json_reader *r, int *value) {
+    json_space(r);
+    if (r->end - r->p >= 4 && memcmp(r->p, "true", 4) == 0) {
+        r->p += 4;
+        *value = 1;
+        return 1;
+    }
+    if (r->end - r->p >= 5 && memcmp(r->p, "false", 5) == 0) {
+        r->p += 5;
+        *value = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Skips a value of a field this server does not know
+static int json_skip(json_reader *r, int depth) {
+    json_space(r);
+    if (r->p == r->end || depth > 64) {
+        return 0;
+    }
+    if (*r->p == '"') {
+        char *s = json_string(r);
+        free(s);
+        return s != NULL;
+    }
+    if (*r->p == '[' || *r->p == '{') {
+        char close = *r->p == '[' ? ']' : '}';
+        r->p++;
+        if (json_take(r, close)) {
+            return 1;
+        }
+        do {
+            if (close == '}' && (!json_skip(r, depth + 1) || !json_take(r, ':'))) {
+                return 0;
+            }
+            if (!json_skip(r, depth + 1)) {
+                return 0;
+            }
+        } while (json_take(r, ','));
+        return json_take(r, close);
+    }
+    const char *start = r->p;
+    while (r->p < r->end && *r->p != ',' && *r->p != '}' && *r->p != ']' && *r->p != ' ') {
+        r->p++;
+    }
+    return r->p > start;
+}
+
+static void request_free(request *req) {
+    for (int i = 0; i < req->arg_count; i++) {
+        free(req->args[i]);
+    }
+    free(req->args);
+    free(req->cwd);
+    memset(req, 0, sizeof(*req));
+}
+
+static int parse_args(json_reader *r, request *req) {
+    if (!json_take(r, '[')) {
+        return 0;
+    }
+    if (json_take(r, ']')) {
+        return 1;
+    }
+    do {
+        char *arg = json_string(r);
+        char **args = arg != NULL ? realloc(req->args, ((size_t)req->arg_count + 1) * sizeof(*args)) : NULL;
+        if (args == NULL) {
+            free(arg);
+            return 0;
+        }
+        req->args = args;
+        req->args[req->arg_count++] = arg;
+    } while (json_take(r, ','));
+    return json_take(r, ']');
+}
+
+// Fills `req` from one line of JSON; on failure says why in `error`
+static int parse_request(const char *line, size_t len, request *req, char *error, size_t error_size) {
+    json_reader r = {line, line + len};
+    memset(req, 0, sizeof(*req));
+    int ok = json_take(&r, '{');
+    int has_args = 0;
+    if (ok && !json_take(&r, '}')) {
+        do {
+            char *key = json_string(&r);
+            ok = key != NULL && json_take(&r, ':');
+            if (!ok) {
+                free(key);
+                break;
+            }
+            engine_options *o = &req->options;
+            long long number = 0;
+            if (strcmp(key, "args") == 0) {
+                ok = parse_args(&r, req);
+                has_args = 1;
+            } else if (strcmp(key, "cwd") == 0) {
+                free(req->cwd);
+                req->cwd = json_string(&r);
+                ok = req->cwd != NULL;
+            } else if (strcmp(key, "format") == 0) {
+                char *format = json_string(&r);
+                ok = format != NULL;
+                if (ok && strcmp(format, "text") == 0) {
+                    o->format = ENGINE_FORMAT_TEXT;
+                } else if (ok && strcmp(format, "ndjson") == 0) {
+                    o->format = ENGINE_FORMAT_NDJSON;
+                } else if (ok && strcmp(format, "binary") == 0) {
+                    o->format = ENGINE_FORMAT_BINARY;
+                } else {
+                    ok = 0;
+                }
+                free(format);
+            } else if (strcmp(key, "first") == 0) {
+                ok = json_number(&r, LLONG_MAX, &o->first);
+            } else if (strcmp(key, "max_count") == 0) {
+                ok = json_number(&r, LLONG_MAX, &o->max_count);
+            } else if (strcmp(key, "threads") == 0) {
+                ok = json_number(&r, 1024, &number);
+                o->threads = (int)number;
+            } else if (strcmp(key, "unordered") == 0) {
+                ok = json_bool(&r, &o->unordered);
+            } else if (strcmp(key, "max_memory") == 0) {
+                ok = json_number(&r, LLONG_MAX, &o->max_memory);
+            } else if (strcmp(key, "cache_policy") == 0) {
+                char *policy = json_string(&r);
+                ok = policy != NULL;
+                if (ok && strcmp(policy, "normal") == 0) {
+                    o->cache_policy = SS_CACHE_NORMAL;
+                } else if (ok && strcmp(policy, "noreuse") == 0) {
+                    o->cache_policy = SS_CACHE_NOREUSE;
+                } else if (ok && strcmp(policy, "direct") == 0) {
+                    o->cache_policy = SS_CACHE_DIRECT;
+                } else {
+                    ok = 0;
+                }
+                free(policy);
+            } else if (strcmp(key, "read_buffer") == 0) {
+                ok = json_number(&r, ENGINE_MAX_READ_BUFFER, &o->read_buffer);
+            } else if (strcmp(key, "interactive") == 0) {
+                ok = json_bool(&r, &o->interactive);
+            } else if (strcmp(key, "cancel") == 0) {
+                ok = json_bool(&r, &req->cancel);
+            } else {
+                ok = json_skip(&r, 0);
+            }
+            if (!ok) {
+                snprintf(error, error_size, "Invalid request: bad value for \"%s\"", key);
+            }
+            free(key);
+        } while (ok && json_take(&r, ','));
+        ok = ok && json_take(&r, '}');
+    }
+    json_space(&r);
+    if (ok && r.p != r.end) {
+        ok = 0;
+    }
+    if (ok && !has_args && !req->cancel) {
+        snprintf(error, error_size, "Invalid request: \"args\" is required");
+        ok = 0;
+    } else if (!ok && error[0] == '\0') {
+        snprintf(error, error_size, "Invalid request: expected one JSON object per line");
+    }
+    if (!ok) {
+        request_free(req);
+    }
+    return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Compiled queries
+// ---------------------------------------------------------------------------
+
+// Queries are looked up by their arguments. An entry keeps one scratch
+// context, so its DFA stays warm; a second client running the same query
+// at the same time gets a fresh one.
+typedef struct {
+    char *key;
+    size_t key_len;
+    ss_query *query;
+    ss_scratch *scratch;        // NULL while lent out
+    int refs;
+    unsigned long long used;
+} query_entry;
+
+static query_entry queries[BUDGET_QUERY_CACHE_MAX];
+static unsigned long long query_clock;
+static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *query_key(const request *req, size_t *len) {
+    size_t size = 1;
+    for (int i = 0; i < req->arg_count; i++) {
+        size += strlen(req->args[i]) + 1;
+    }
+    char *key = malloc(size);
+    if (key == NULL) {
+        return NULL;
+    }
+    *len = 0;
+    for (int i = 0; i < req->arg_count; i++) {
+        size_t n = strlen(req->args[i]) + 1;
+        memcpy(key + *len, req->args[i], n);
+        *len += n;
+    }
+    return key;
+}
+
+static void entry_free(query_entry *entry) {
+    ss_scratch_free(entry->scratch);
+    ss_query_free(entry->query);
+    free(entry->key);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Finds or compiles the request's query and takes a reference to it.
+// Returns NULL and fills `error` if it does not compile.
+static query_entry *query_acquire(const request *req, char *error, size_t error_size) {
+    size_t len;
+    char *key = query_key(req, &len);
+    if (key == NULL) {
+        snprintf(error, error_size, "Out of memory");
+        return NULL;
+    }
+    pthread_mutex_lock(&query_lock);
+    for (int i = 0; i < budget_get()->query_cache_size; i++) {
+        query_entry *entry = &queries[i];
+        if (entry->query != NULL && entry->key_len == len && memcmp(entry->key, key, len) == 0) {
+            entry->refs++;
+            entry->used = ++query_clock;
+            pthread_mutex_unlock(&query_lock);
+            free(key);
+            return entry;
+        }
+    }
+    pthread_mutex_unlock(&query_lock);
+
+    // Compiled outside the lock; if another client compiles the same
+    // query meanwhile, both are cached and the older ages out
+    ss_query *query = ss_compile(req->arg_count, req->args, error, error_size);
+    ss_scratch *scratch = query != NULL ? ss_scratch_new(query) : NULL;
+    if (query != NULL && scratch == NULL) {
+        snprintf(error, error_size, "Out of memory");
+        ss_query_free(query);
+        query = NULL;
+    }
+    if (query == NULL) {
+        free(key);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&query_lock);
+    query_entry *slot = NULL;
+    for (int i = 0; i < budget_get()->query_cache_size; i++) {
+        query_entry *entry = &queries[i];
+        if (entry->query == NULL) {
+            slot = entry;
+            break;
+        }
+        if (entry->refs == 0 && (slot == NULL || entry->used < slot->used)) {
+            slot = entry;
+        }
+    }
+    if (slot != NULL) {
+        if (slot->query != NULL) {
+            entry_free(slot);
+        }
+        slot->key = key;
+        slot->key_len = len;
+        slot->query = query;
+        slot->scratch = scratch;
+        slot->refs = 1;
+        slot->used = ++query_clock;
+    }
+    pthread_mutex_unlock(&query_lock);
+    if (slot == NULL) {
+        // Every entry is busy: this one is used once and dropped
+        slot = calloc(1, sizeof(*slot));
+        if (slot == NULL) {
+            snprintf(error, error_size, "Out of memory");
+            ss_scratch_free(scratch);
+            ss_query_free(query);
+            free(key);
+            return NULL;
+        }
+        slot->key = key;
+        slot->query = query;
+        slot->scratch = scratch;
+        slot->refs = -1;
+    }
+    return slot;
+}
+
+static ss_scratch *scratch_borrow(query_entry *entry) {
+    pthread_mutex_lock(&query_lock);
+    ss_scratch *scratch = entry->scratch;
+    entry->scratch = NULL;
+    pthread_mutex_unlock(&query_lock);
+    return scratch;
+}
+
+static void query_release(query_entry *entry, ss_scratch *scratch) {
+    if (entry->refs < 0) {
+        entry->scratch = scratch;
+        entry_free(entry);
+        free(entry);
+        return;
+    }
+    pthread_mutex_lock(&query_lock);
+    if (scratch != NULL) {
+        entry->scratch = scratch;
+    }
+    entry->refs--;
+    pthread_mutex_unlock(&query_lock);
+}
+
+// ---------------------------------------------------------------------------
+// Mapped files
+// ---------------------------------------------------------------------------
+
+// A mapping is reused while the file's identity, size and modification
+// time (to the nanosecond, so a file rewritten within the same second is
+// noticed) are unchanged. Replaced mappings are unmapped once no query is
+// still searching them. A file cut short while a query searches its old
+// mapping is caught by the engine's SIGBUS guard.
+typedef struct mapped_file {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    const char *data;
+    int refs;
+    int stale;
+    unsigned long long used;
+} mapped_file;
+
+static mapped_file *maps[MAP_CACHE_SIZE];
+static int map_count;
+static long long map_bytes;
+static unsigned long long map_clock;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void map_free(mapped_file *m) {
+    munmap((void *)m->data, (size_t)m->size);
+    free(m->path);
+    free(m);
+}
+
+// Drops entry `i` from the table; the caller holds map_lock
+static void map_drop(int i) {
+    mapped_file *m = maps[i];
+    maps[i] = maps[--map_count];
+    map_bytes -= (long long)m->size;
+    m->stale = 1;
+    if (m->refs == 0) {
+        map_free(m);
+    }
+}
+
+// Makes room for `size` more bytes by dropping the least recently used
+// mappings that are not in use
+static void map_evict(long long size) {
+    long long limit = budget_get()->map_cache_bytes;
+    while (map_count > 0 && (map_bytes + size > limit || map_count == MAP_CACHE_SIZE)) {
+        int oldest = -1;
+        for (int i = 0; i < map_count; i++) {
+            if (maps[i]->refs == 0 && (oldest < 0 || maps[i]->used < maps[oldest]->used)) {
+                oldest = i;
+            }
+        }
+        if (oldest < 0) {
+            break;
+        }
+        map_drop(oldest);
+    }
+}
+
+static const char *map_open(void *user, const char *path, size_t *len, void **handle) {
+    (void)user;
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0 ||
+        (long long)info.st_size > budget_get()->map_cache_bytes) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&map_lock);
+    for (int i = 0; i < map_count; i++) {
+        mapped_file *m = maps[i];
+        if (strcmp(m->path, path) != 0) {
+            continue;
+        }
+        if (m->dev == info.st_dev && m->ino == info.st_ino && m->size == info.st_size &&
+            m->mtime.tv_sec == info.st_mtim.tv_sec && m->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+            m->refs++;
+            m->used = ++map_clock;
+            pthread_mutex_unlock(&map_lock);
+            *len = (size_t)m->size;
+            *handle = m;
+            return m->data;
+        }
+        map_drop(i);
+        break;
+    }
+    pthread_mutex_unlock(&map_lock);
+
+    int fd = ss_open(path, O_RDONLY);
+    stats_add(&stats.open_calls, 1);
+    if (fd < 0) {
+        return NULL;
+    }
+    // Mapped from the open file, so what is cached is what was checked
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        ss_close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ss_close(fd);
+    mapped_file *m = calloc(1, sizeof(*m));
+    char *copy = malloc(strlen(path) + 1);
+    if (data == MAP_FAILED || m == NULL || copy == NULL) {
+        if (data != MAP_FAILED) {
+            munmap(data, (size_t)info.st_size);
+        }
+        free(m);
+        free(copy);
+        return NULL;
+    }
+    strcpy(copy, path);
+    m->path = copy;
+    m->dev = info.st_dev;
+    m->ino = info.st_ino;
+    m->size = info.st_size;
+    m->mtime = info.st_mtim;
+    m->data = data;
+    m->refs = 1;
+
+    pthread_mutex_lock(&map_lock);
+    map_evict((long long)m->size);
+    if (map_count < MAP_CACHE_SIZE && map_bytes + (long long)m->size <= budget_get()->map_cache_bytes) {
+        m->used = ++map_clock;
+        maps[map_count++] = m;
+        map_bytes += (long long)m->size;
+    } else {
+        // No room while other queries hold every mapping: use it once
+        m->stale = 1;
+    }
+    pthread_mutex_unlock(&map_lock);
+    *len = (size_t)m->size;
+    *handle = m;
+    return m->data;
+}
+
+static void map_close(void *user, void *handle) {
+    (void)user;
+    mapped_file *m = handle;
+    pthread_mutex_lock(&map_lock);
+    int unused = --m->refs == 0 && m->stale;
+    pthread_mutex_unlock(&map_lock);
+    if (unused) {
+        map_free(m);
+    }
+}
+
+static const engine_files MAPPED_FILES = {map_open, map_close, NULL};
+
+// ---------------------------------------------------------------------------
+// Connections
+// ---------------------------------------------------------------------------
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        long n = (long)ss_write(fd, data, (unsigned)len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int send_frame(int fd, int kind, const char *data, size_t len) {
+    unsigned char header[5];
+    unsigned long size = (unsigned long)len + 1;
+    for (int i = 0; i < 4; i++) {
+        header[i] = (unsigned char)(size >> (8 * i));
+    }
+    header[4] = (unsigned char)kind;
+    return send_all(fd, (const char *)header, sizeof(header)) && send_all(fd, data, len);
+}
+
+static int send_end(int fd, int code) {
+    if (code == ENGINE_CANCELLED) {
+        return send_frame(fd, ENGINE_FRAME_CANCELLED, NULL, 0);
+    }
+    char payload[4];
+    for (int i = 0; i < 4; i++) {
+        payload[i] = (char)((unsigned long)code >> (8 * i));
+    }
+    return send_frame(fd, ENGINE_FRAME_END, payload, sizeof(payload));
+}
+
+static int send_error(int fd, const char *message) {
+    char line[1024];
+    int n = snprintf(line, sizeof(line), "Error: %s\n", message);
+    if (n < 0) {
+        return 0;
+    }
+    return send_frame(fd, ENGINE_FRAME_ERROR, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1) &&
+           send_end(fd, EXIT_FAILURE);
+}
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;                 // bytes buffered
+    size_t cap;
+} line_reader;
+
+// Returns the next request line (without its newline, NUL-terminated and
+// valid until the next call), or NULL at end of input or if it is too long
+static char *read_line(line_reader *r, size_t *len) {
+    for (;;) {
+        char *newline = r->len > 0 ? memchr(r->data, '\n', r->len) : NULL;
+        if (newline != NULL) {
+            *len = (size_t)(newline - r->data);
+            *newline = '\0';
+            return r->data;
+        }
+        if (r->len == r->cap) {
+            size_t cap = r->cap == 0 ? 4096 : r->cap * 2;
+            char *data = cap <= MAX_REQUEST_SIZE ? realloc(r->data, cap) : NULL;
+            if (data == NULL) {
+                return NULL;
+            }
+            r->data = data;
+            r->cap = cap;
+        }
+        long n = (long)ss_read(r->fd, r->data + r->len, (unsigned)(r->cap - r->len));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return NULL;
+        }
+        r->len += (size_t)n;
+    }
+}
+
+// Drops the line read_line() returned last
+static void consume_line(line_reader *r, size_t len) {
+    memmove(r->data, r->data + len + 1, r->len - len - 1);
+    r->len -= len + 1;
+}
+
+static void run_request(int fd, request *req) {
+    char error[512] = "";
+    query_entry *entry = query_acquire(req, error, sizeof(error));
+    if (entry == NULL) {
+        send_error(fd, error);
+        return;
+    }
+    engine_options options = req->options;
+    options.dir = req->cwd;
+    options.client = 1;
+    options.client_fd = fd;
+    options.query = entry->query;
+    options.scratch = scratch_borrow(entry);
+    options.files = &MAPPED_FILES;
+    int code = engine_run(req->arg_count, req->args, &options);
+    query_release(entry, options.scratch);
+    send_end(fd, code);
+}
+
+static void *connection_thread(void *arg) {
+    line_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = (int)(long)arg;
+    trace_thread_name("connection");
+
+    char *line;
+    size_t len;
+    while ((line = read_line(&reader, &len)) != NULL) {
+        request req;
+        char error[256] = "";
+        int ok = parse_request(line, len, &req, error, sizeof(error));
+        consume_line(&reader, len);
+        if (!ok) {
+            if (!send_error(reader.fd, error)) {
+                break;
+            }
+            continue;
+        }
+        // A cancel on its own has nothing left to stop: the query it was
+        // meant for already ended when the line arrived
+        if (!req.cancel) {
+            run_request(reader.fd, &req);
+        }
+        request_free(&req);
+    }
+    ss_close(reader.fd);
+    free(reader.data);
+    return NULL;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long: %s\n", path);
+        return 0;
+    }
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un address;
+    if (!socket_address(path, &address)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        ss_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const char *path) {
+    struct sockaddr_un address;
+    if (!socket_address(path, &address)) {
+        return EXIT_FAILURE;
+    }
+    // A socket file nobody answers on is left over from a server that was
+    // killed; take it over
+    int existing = connect_to(path);
+    if (existing >= 0) {
+        ss_close(existing);
+        fprintf(stderr, "Error: A server is already listening on %s\n", path);
+        return EXIT_FAILURE;
+    }
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // Only the user who started the server may connect to it
+    mode_t mask = umask(077);
+    int bound = fd >= 0 && bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(fd, 64) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            ss_close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Listening on %s\n", path);
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                continue;
+            }
+            fprintf(stderr, "Error: Failed to accept a connection: %s\n", strerror(errno));
+            break;
+        }
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, connection_thread, (void *)(long)client) != 0) {
+            ss_close(client);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    ss_close(fd);
+    unlink(path);
+    return EXIT_FAILURE;
+}
+
+// ---------------------------------------------------------------------------
+// Client
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} text;
+
+static int text_add(text *t, const char *s, size_t len) {
+    if (t->len + len + 1 > t->cap) {
+        size_t cap = t->cap == 0 ? 1024 : t->cap;
+        while (t->len + len + 1 > cap) {
+            cap *= 2;
+        }
+        char *data = realloc(t->data, cap);
+        if (data == NULL) {
+            return 0;
+        }
+        t->data = data;
+        t->cap = cap;
+    }
+    memcpy(t->data + t->len, s, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+    return 1;
+}
+
+static int text_str(text *t, const char *s) {
+    return text_add(t, s, strlen(s));
+}
+
+static int text_json_string(text *t, const char *s) {
+    static const char HEX[] = "0123456789abcdef";
+    int ok = text_add(t, "\"", 1);
+    for (; *s && ok; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            char escape[2] = {'\\', (char)c};
+            ok = text_add(t, escape, 2);
+        } else if (c < 0x20) {
+            char escape[6] = {'\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 15]};
+            ok = text_add(t, escape, 6);
+        } else {
+            ok = text_add(t, s, 1);
+        }
+    }
+    return ok && text_add(t, "\"", 1);
+}
+
+static int build_request(text *t, int argc, char *argv[], const engine_options *options) {
+    static const char *const FORMATS[] = {"text", "ndjson", "binary"};
+    char cwd[4096];
+    char number[48];
+    int ok = text_str(t, "{\"args\":[");
+    for (int i = 0; i < argc && ok; i++) {
+        ok = (i == 0 || text_str(t, ",")) && text_json_string(t, argv[i]);
+    }
+    ok = ok && text_str(t, "],\"format\":") && text_json_string(t, FORMATS[options->format]);
+    if (ok && getcwd(cwd, sizeof(cwd)) != NULL) {
+        ok = text_str(t, ",\"cwd\":") && text_json_string(t, cwd);
+    }
+    if (ok && options->first > 0) {
+        snprintf(number, sizeof(number), ",\"first\":%lld", options->first);
+        ok = text_str(t, number);
+    }
+    if (ok && options->max_count > 0) {
+        snprintf(number, sizeof(number), ",\"max_count\":%lld", options->max_count);
+        ok = text_str(t, number);
+    }
+    if (ok && options->threads > 0) {
+        snprintf(number, sizeof(number), ",\"threads\":%d", options->threads);
+        ok = text_str(t, number);
+    }
+    if (ok && options->unordered) {
+        ok = text_str(t, ",\"unordered\":true");
+    }
+    if (ok && options->max_memory > 0) {
+        snprintf(number, sizeof(number), ",\"max_memory\":%lld", options->max_memory);
+        ok = text_str(t, number);
+    }
+    if (ok && options->cache_policy != SS_CACHE_NORMAL) {
+        ok = text_str(t, options->cache_policy == SS_CACHE_NOREUSE ? ",\"cache_policy\":\"noreuse\""
+                                                                   : ",\"cache_policy\":\"direct\"");
+    }
+    if (ok && options->read_buffer > 0) {
+        snprintf(number, sizeof(number), ",\"read_buffer\":%lld", options->read_buffer);
+        ok = text_str(t, number);
+    }
+    // Streaming each match only pays off when someone is watching
+    if (ok && options->interactive && _isatty(1)) {
+        ok = text_str(t, ",\"interactive\":true");
+    }
+    return ok && text_str(t, "}\n");
+}
+
+// Reads exactly `len` bytes, giving up if our own output goes away
+static int receive(int fd, char *data, size_t len, int *closed) {
+    while (len > 0) {
+        if (!ss_wait_readable(fd, 1)) {
+            *closed = 1;
+            return 0;
+        }
+        long n = (long)ss_read(fd, data, (unsigned)len);
+        stats_add(&stats.read_calls, 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        stats_add(&stats.bytes_read, n);
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+int server_query(const char *path, int argc, char *argv[], const engine_options *options) {
+    int fd = connect_to(path);
+    if (fd < 0) {
+        return -1;
+    }
+    text req;
+    memset(&req, 0, sizeof(req));
+    if (!build_request(&req, argc, argv, options) || !send_all(fd, req.data, req.len)) {
+        free(req.data);
+        ss_close(fd);
+        return -1;
+    }
+    free(req.data);
+
+    // Frames are copied through as they arrive. If our reader goes away,
+    // closing the connection stops the query on the server.
+    stats_enter(PHASE_MATCH);
+    char *buffer = malloc(BUFFER_SIZE);
+    int code = -2;
+    int closed = 0;
+    while (buffer != NULL && code == -2) {
+        unsigned char header[5];
+        if (!receive(fd, (char *)header, sizeof(header), &closed)) {
+            break;
+        }
+        size_t size = (size_t)header[0] | (size_t)header[1] << 8 | (size_t)header[2] << 16 |
+                      (size_t)header[3] << 24;
+        // The length counts the kind byte, so it is never 0
+        if (size == 0) {
+            fprintf(stderr, "Error: Malformed frame from the server at %s\n", path);
+            code = EXIT_FAILURE;
+            break;
+        }
+        size_t remaining = size - 1;
+        if (header[4] == ENGINE_FRAME_END || header[4] == ENGINE_FRAME_CANCELLED) {
+            char payload[4] = {0};
+            if (remaining > sizeof(payload) || !receive(fd, payload, remaining, &closed)) {
+                break;
+            }
+            code = header[4] == ENGINE_FRAME_END ? (unsigned char)payload[0] : EXIT_FAILURE;
+            break;
+        }
+        while (remaining > 0) {
+            size_t chunk = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
+            if (!receive(fd, buffer, chunk, &closed)) {
+                break;
+            }
+            remaining -= chunk;
+            if (header[4] == ENGINE_FRAME_ERROR) {
+                fwrite(buffer, 1, chunk, stderr);
+                continue;
+            }
+            stats_enter(PHASE_OUTPUT);
+            stats_first_output();
+            size_t done = 0;
+            while (done < chunk) {
+                long n = (long)ss_write(1, buffer + done, (unsigned)(chunk - done));
+                stats_add(&stats.write_calls, 1);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                done += (size_t)n;
+            }
+            stats_add(&stats.bytes_written, (long long)done);
+            stats_leave();
+            if (done < chunk) {
+                if (errno == EPIPE) {
+                    closed = 1;
+                } else {
+                    fprintf(stderr, "Error: Failed to write output to stdout\n");
+                    code = EXIT_FAILURE;
+                }
+                break;
+            }
+        }
+        if (remaining > 0 || closed || code != -2) {
+            break;
+        }
+    }
+    stats_leave();
+    free(buffer);
+    ss_close(fd);
+    if (closed) {
+        return EXIT_SUCCESS;
+    }
+    if (code == -2) {
+        fprintf(stderr, "Error: Lost the connection to the server at %s\n", path);
+        return EXIT_FAILURE;
+    }
+    return code;
+}
+
+#else
+
+int server_run(const char *path) {
+    (void)path;
+    fprintf(stderr, "Error: --server needs Unix domain sockets, which this build does not support\n");
+    return EXIT_FAILURE;
+}
+
+int server_query(const char *path, int argc, char *argv[], const engine_options *options) {
+    (void)path;
+    (void)argc;
+    (void)argv;
+    (void)options;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * server.h - Search server on a Unix domain socket
+ */
+
+#ifndef SS_SERVER_H
+#define SS_SERVER_H
+
+#include "engine.h"
+
+// Listens on `path` and answers queries until killed. Returns the process
+// exit code if it cannot start.
+int server_run(const char *path);
+
+// Runs a query on the server at `path`, copying its results to stdout and
+// its errors to stderr. Returns the query's exit code, or -1 without
+// having printed anything when no server answers at `path`.
+int server_query(const char *path, int argc, char *argv[], const engine_options *options);
+
+#endif
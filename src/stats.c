@@ -0,0 +1,228 @@
+/*
+ * stats.c - --stats instrumentation
+ *
+ * Wall and CPU time are charged to whichever phase is innermost, so the
+ * per-phase numbers add up to the total. The counters are globals bumped
+ * once per system call, file or match, never per byte.
+ */
+
+#include "compat.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+#include "budget.h"
+#include "stats.h"
+
+#define MAX_PHASE_DEPTH 16
+
+stats_counters stats;
+
+long long *const stats_search_counters[STATS_SEARCH_COUNTERS] = {
+    &stats.bytes_read, &stats.lines_scanned, &stats.matches, &stats.files_scanned,
+    &stats.files_skipped, &stats.read_calls, &stats.open_calls, &stats.scan_allocs
+};
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {
+    "startup", "probe", "spool", "spawn", "read", "match", "output"
+};
+
+static double phase_wall[PHASE_COUNT];
+static double phase_cpu[PHASE_COUNT];
+static stats_phase phase_stack[MAX_PHASE_DEPTH];
+static int phase_depth;
+static int phase_overflow;     // stats_enter() calls past MAX_PHASE_DEPTH, not pushed
+static double last_wall;
+static double last_cpu;
+static double start_wall;
+static double first_output_wall;
+static int first_output_seen;
+static THREAD_LOCAL int phase_owner;
+
+static double wall_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (double)now.QuadPart * 1e3 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+#endif
+}
+
+static double cpu_ms(void) {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        return 0;
+    }
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (double)(k.QuadPart + u.QuadPart) / 1e4;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+#endif
+}
+
+// Charges the time since the last switch to the current phase
+static void charge(void) {
+    double wall = wall_ms();
+    double cpu = cpu_ms();
+    stats_phase current = phase_stack[phase_depth - 1];
+    phase_wall[current] += wall - last_wall;
+    phase_cpu[current] += cpu - last_cpu;
+    last_wall = wall;
+    last_cpu = cpu;
+}
+
+static void print_report(void) {
+    if (phase_depth > 0) {
+        charge();
+    }
+    double total_wall = 0, total_cpu = 0;
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        total_wall += phase_wall[i];
+        total_cpu += phase_cpu[i];
+    }
+
+    long peak_rss_kb = 0;
+    double child_cpu = 0;
+    long child_rss_kb = 0;
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS memory;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+        peak_rss_kb = (long)(memory.PeakWorkingSetSize / 1024);
+    }
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        peak_rss_kb = usage.ru_maxrss;
+    }
+    if (getrusage(RUSAGE_CHILDREN, &usage) == 0) {
+        child_cpu = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+                    (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+        child_rss_kb = usage.ru_maxrss;
+    }
+#endif
+
+    fprintf(stderr, "\nSelect-String stats:\n");
+    fprintf(stderr, "  %-10s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        if (phase_wall[i] > 0 || phase_cpu[i] > 0) {
+            fprintf(stderr, "  %-10s %12.3f %12.3f\n", PHASE_NAMES[i], phase_wall[i], phase_cpu[i]);
+        }
+    }
+    fprintf(stderr, "  %-10s %12.3f %12.3f\n", "total", total_wall, total_cpu);
+    if (stats.spawn_calls > 0) {
+        fprintf(stderr, "  backend cpu ms:       %.3f\n", child_cpu);
+        fprintf(stderr, "  backend peak rss:     %ld KB\n", child_rss_kb);
+    }
+    if (first_output_wall > 0) {
+        fprintf(stderr, "  first output after:   %.3f ms\n", first_output_wall - start_wall);
+    }
+    fprintf(stderr, "  bytes read:           %lld\n", stats.bytes_read);
+    fprintf(stderr, "  bytes written:        %lld\n", stats.bytes_written);
+    fprintf(stderr, "  lines scanned:        %lld\n", stats.lines_scanned);
+    fprintf(stderr, "  matches:              %lld\n", stats.matches);
+    fprintf(stderr, "  files scanned:        %lld\n", stats.files_scanned);
+    fprintf(stderr, "  files skipped:        %lld\n", stats.files_skipped);
+    fprintf(stderr, "  syscalls:             read %lld, write %lld, open %lld, spawn %lld\n",
+            stats.read_calls, stats.write_calls, stats.open_calls, stats.spawn_calls);
+    fprintf(stderr, "  peak rss:             %ld KB\n", peak_rss_kb);
+    if (stats.files_scanned > 0) {
+        fprintf(stderr, "  scan allocations:     %lld\n", stats.scan_allocs);
+    }
+    if (stats.dfa_flushes > 0) {
+        fprintf(stderr, "  dfa cache:            %lld flushes, %lld fallbacks to NFA simulation\n",
+                stats.dfa_flushes, stats.dfa_fallbacks);
+    }
+    if (stats.reorder_waits > 0) {
+        fprintf(stderr, "  reorder waits:        %lld\n", stats.reorder_waits);
+    }
+    if (stats.jit_bytes > 0) {
+        fprintf(stderr, "  jit:                  %lld bytes of machine code\n", stats.jit_bytes);
+    } else if (stats.jit_declined > 0) {
+        fprintf(stderr, "  jit:                  not available; the DFA ran as a table or lazily\n");
+    }
+    if (stats.generated_used > 0) {
+        fprintf(stderr, "  generated matcher:    used (%lld %s)\n", stats.generated_used,
+                stats.generated_used == 1 ? "query" : "queries");
+    } else if (stats.generated_missed > 0) {
+        fprintf(stderr, "  generated matcher:    none for these patterns; searched as in a regular build\n");
+    }
+
+    // Only once the native engine has sized something from it
+    const budget *b = budget_peek();
+    if (b != NULL) {
+        fprintf(stderr, "  budget:               %d threads (%d CPUs online, %d allowed", b->cpus,
+                b->online_cpus, b->allowed_cpus);
+        if (b->cpu_quota > 0) {
+            fprintf(stderr, ", quota %.2f", b->cpu_quota);
+        }
+        fprintf(stderr, "), from %s\n", b->source);
+        if (b->memory_limit > 0) {
+            fprintf(stderr, "  memory limit:         %lld MB\n", b->memory_limit >> 20);
+        } else {
+            fprintf(stderr, "  memory limit:         none\n");
+        }
+        fprintf(stderr, "  server caches:        %lld MB of mapped files, %d queries\n",
+                b->map_cache_bytes >> 20, b->query_cache_size);
+    }
+}
+
+void stats_enable(void) {
+    if (stats.enabled) {
+        return;
+    }
+    stats.enabled = 1;
+    phase_owner = 1;
+    start_wall = last_wall = wall_ms();
+    last_cpu = cpu_ms();
+    phase_stack[0] = PHASE_STARTUP;
+    phase_depth = 1;
+    atexit(print_report);
+}
+
+void stats_enter(stats_phase phase) {
+    if (!stats.enabled || !phase_owner) {
+        return;
+    }
+    if (phase_depth == MAX_PHASE_DEPTH) {
+        // The time stays with the innermost phase; the matching
+        // stats_leave() must not end it
+        phase_overflow++;
+        return;
+    }
+    charge();
+    phase_stack[phase_depth++] = phase;
+}
+
+void stats_leave(void) {
+    if (!stats.enabled || !phase_owner || phase_depth <= 1) {
+        return;
+    }
+    if (phase_overflow > 0) {
+        phase_overflow--;
+        return;
+    }
+    charge();
+    phase_depth--;
+}
+
+void stats_first_output(void) {
+    if (stats.enabled && !__atomic_exchange_n(&first_output_seen, 1, __ATOMIC_RELAXED)) {
+        first_output_wall = wall_ms();
+    }
+}
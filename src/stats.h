@@ -0,0 +1,67 @@
+/*
+ * stats.h - --stats instrumentation
+ */
+
+#ifndef SS_STATS_H
+#define SS_STATS_H
+
+typedef enum {
+    PHASE_STARTUP,      // argument parsing and anything not covered below
+    PHASE_PROBE,        // check_powershell_available()
+    PHASE_SPOOL,        // copying piped stdin to the temporary file
+    PHASE_SPAWN,        // starting the backend
+    PHASE_READ,         // reading input files (native engine)
+    PHASE_MATCH,        // searching, or waiting on the backend's results
+    PHASE_OUTPUT,       // writing results to stdout
+    PHASE_COUNT
+} stats_phase;
+
+typedef struct {
+    int enabled;
+    long long bytes_read;
+    long long bytes_written;
+    long long lines_scanned;
+    long long matches;
+    long long files_scanned;
+    long long files_skipped;
+    long long read_calls;
+    long long write_calls;
+    long long open_calls;
+    long long spawn_calls;
+    long long dfa_flushes;      // DFA caches started over at their limit
+    long long dfa_fallbacks;    // ...so often that the NFA simulation took over
+    long long reorder_waits;    // threads held back by a full reorder buffer
+    long long jit_bytes;        // machine code made by --jit
+    long long jit_declined;     // --jit queries left to a DFA table
+    long long generated_used;   // queries run by a matcher from make custom
+    long long generated_missed; // ...and queries in such a build that had none
+    long long scan_allocs;      // heap allocations made while searching
+} stats_counters;
+
+extern stats_counters stats;
+
+// The counters a search adds to, in the order fan-out workers report them
+#define STATS_SEARCH_COUNTERS 8
+extern long long *const stats_search_counters[STATS_SEARCH_COUNTERS];
+
+// For counters bumped from the engine's worker threads
+static inline void stats_add(long long *counter, long long n) {
+    if (stats.enabled) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
+}
+
+// Starts collecting and registers the report to print at exit
+void stats_enable(void);
+
+// Phases nest: entering one pauses the current phase until it is left, so
+// each phase reports exclusive time. Only the thread that called
+// stats_enable() records phases; time spent waiting on worker threads is
+// charged to whatever phase it is in.
+void stats_enter(stats_phase phase);
+void stats_leave(void);
+
+// Records the first byte of output, for time-to-first-result
+void stats_first_output(void);
+
+#endif
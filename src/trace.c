@@ -0,0 +1,229 @@
+/*
+ * trace.c - --trace event recording
+ *
+ * Each thread appends to its own chunked event buffer, so recording a span
+ * takes no lock: the buffer is found through a thread-local pointer and is
+ * linked into the global list with a compare-and-swap the first time the
+ * thread records anything. An event's detail (a path) is copied into its
+ * chunk, so the only allocation is a new chunk now and then. Nothing is
+ * written until exit, when every
+ * worker has been joined and the buffers can be walked without locking.
+ */
+
+#include "compat.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "trace.h"
+
+#define EVENTS_PER_CHUNK 4096
+// Room for the chunk's event details; a detail that does not fit in what
+// is left starts a new chunk
+#define DETAIL_BYTES_PER_CHUNK (EVENTS_PER_CHUNK * 64)
+
+typedef struct {
+    const char *name;
+    const char *detail;
+    unsigned long long start;
+    unsigned long long end;
+    long long bytes;
+} trace_event;
+
+typedef struct event_chunk {
+    struct event_chunk *next;
+    int count;
+    size_t detail_used;
+    trace_event events[EVENTS_PER_CHUNK];
+    char details[DETAIL_BYTES_PER_CHUNK];
+} event_chunk;
+
+typedef struct thread_buffer {
+    struct thread_buffer *next;
+    int tid;
+    const char *name;
+    event_chunk *head;
+    event_chunk *tail;
+} thread_buffer;
+
+int trace_enabled;
+
+static char *trace_path;
+static unsigned long long trace_origin;
+static thread_buffer *buffers;
+static int next_tid;
+static long long dropped;
+static THREAD_LOCAL thread_buffer *local;
+
+static unsigned long long now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (unsigned long long)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static thread_buffer *local_buffer(void) {
+    if (local != NULL) {
+        return local;
+    }
+    thread_buffer *b = calloc(1, sizeof(*b));
+    if (b == NULL) {
+        return NULL;
+    }
+    b->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+    b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // b->next now holds the current head; try again
+    }
+    local = b;
+    return b;
+}
+
+static void write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void write_trace(void) {
+    FILE *f = fopen(trace_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error: Failed to write trace file %s\n", trace_path);
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Select-String\"}}");
+    for (thread_buffer *b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+        if (b->name != NULL) {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", b->tid);
+            write_string(f, b->name);
+            fprintf(f, "}}");
+        }
+        for (event_chunk *c = b->head; c != NULL; c = c->next) {
+            for (int i = 0; i < c->count; i++) {
+                const trace_event *ev = &c->events[i];
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                        ev->name, b->tid, (double)(ev->start - trace_origin) / 1e3,
+                        (double)(ev->end - ev->start) / 1e3);
+                if (ev->detail != NULL || ev->bytes >= 0) {
+                    fprintf(f, ",\"args\":{");
+                    if (ev->detail != NULL) {
+                        fprintf(f, "\"path\":");
+                        write_string(f, ev->detail);
+                    }
+                    if (ev->bytes >= 0) {
+                        fprintf(f, "%s\"bytes\":%lld", ev->detail != NULL ? "," : "", ev->bytes);
+                    }
+                    fprintf(f, "}");
+                }
+                fprintf(f, "}");
+            }
+        }
+    }
+    fprintf(f, "\n],\"otherData\":{\"dropped_events\":%lld}}\n", dropped);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error: Failed to write trace file %s\n", trace_path);
+    }
+}
+
+int trace_open(const char *path) {
+    // Create the file now so a bad path fails before the search runs
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return 0;
+    }
+    fclose(f);
+
+    trace_path = malloc(strlen(path) + 1);
+    if (trace_path == NULL) {
+        return 0;
+    }
+    strcpy(trace_path, path);
+    trace_origin = now_ns();
+    trace_enabled = 1;
+    trace_thread_name("main");
+    atexit(write_trace);
+    return 1;
+}
+
+void trace_thread_name(const char *name) {
+    thread_buffer *b = trace_enabled ? local_buffer() : NULL;
+    if (b != NULL) {
+        b->name = name;
+    }
+}
+
+unsigned long long trace_begin(void) {
+    return trace_enabled ? now_ns() : 0;
+}
+
+void trace_end(const char *name, unsigned long long start, const char *detail, long long bytes) {
+    if (start == 0) {
+        return;
+    }
+    unsigned long long end = now_ns();
+    thread_buffer *b = local_buffer();
+    if (b == NULL) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t detail_len = 0;
+    if (detail != NULL) {
+        detail_len = strlen(detail);
+        if (detail_len >= DETAIL_BYTES_PER_CHUNK) {
+            detail_len = DETAIL_BYTES_PER_CHUNK - 1;
+        }
+    }
+    if (b->tail == NULL || b->tail->count == EVENTS_PER_CHUNK ||
+        (detail != NULL && DETAIL_BYTES_PER_CHUNK - b->tail->detail_used <= detail_len)) {
+        event_chunk *c = malloc(sizeof(*c));
+        if (c == NULL) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        c->next = NULL;
+        c->count = 0;
+        c->detail_used = 0;
+        if (b->tail != NULL) {
+            b->tail->next = c;
+        } else {
+            b->head = c;
+        }
+        b->tail = c;
+    }
+
+    event_chunk *c = b->tail;
+    trace_event *ev = &c->events[c->count++];
+    ev->name = name;
+    ev->detail = NULL;
+    ev->start = start;
+    ev->end = end;
+    ev->bytes = bytes;
+    if (detail != NULL) {
+        char *copy = c->details + c->detail_used;
+        memcpy(copy, detail, detail_len);
+        copy[detail_len] = '\0';
+        c->detail_used += detail_len + 1;
+        ev->detail = copy;
+    }
+}
@@ -0,0 +1,28 @@
+/*
+ * trace.h - --trace event recording
+ *
+ * Spans are written as Chrome trace JSON ("X" complete events), which loads
+ * in chrome://tracing and ui.perfetto.dev.
+ */
+
+#ifndef SS_TRACE_H
+#define SS_TRACE_H
+
+extern int trace_enabled;
+
+// Starts recording; the file is written at exit. Returns 0 if the file
+// cannot be created.
+int trace_open(const char *path);
+
+// Names the calling thread in the trace viewer
+void trace_thread_name(const char *name);
+
+// Returns the span's start time, or 0 when tracing is off
+unsigned long long trace_begin(void);
+
+// Records a span from `start` to now. `name` must be a string literal;
+// `detail` (a path, may be NULL) is copied, and `bytes` is omitted when
+// negative.
+void trace_end(const char *name, unsigned long long start, const char *detail, long long bytes);
+
+#endif